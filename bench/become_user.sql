@@ -0,0 +1,20 @@
+-- become_user.sql
+--
+--     pgbench script: re-open this client's session for Alice, and
+--     become Bob.  Requires pgbench -D nonce=1.
+--
+--     Copyright (c) 2021 Marc Munro
+--     Author:  Marc Munro
+--     License: GPL V3
+
+\set nonce :nonce + 1
+select o.success
+  from bench.client_sessions cs
+ cross join veil2.open_connection(
+              cs.session_id, :nonce,
+              encode(digest(cs.session_token || to_hex(:nonce), 'sha1'),
+                     'base64')) o
+ where cs.username = 'Alice'
+   and cs.client_id = :client_id;
+select success
+  from veil2.become_user('Bob', 4, 1010);
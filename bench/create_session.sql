@@ -0,0 +1,10 @@
+-- create_session.sql
+--
+--     pgbench script: create a new session.
+--
+--     Copyright (c) 2021 Marc Munro
+--     Author:  Marc Munro
+--     License: GPL V3
+
+select session_id
+  from veil2.create_session('Sue', 'plaintext', 4, 1050);
@@ -0,0 +1,12 @@
+-- open_first.sql
+--
+--     pgbench script: create a new session and authenticate it, which
+--     requires the accessor's privileges to be loaded.
+--
+--     Copyright (c) 2021 Marc Munro
+--     Author:  Marc Munro
+--     License: GPL V3
+
+select o.success
+  from veil2.create_session('Sue', 'plaintext', 4, 1050) c
+ cross join veil2.open_connection(c.session_id, 1, 'passwd5') o;
@@ -0,0 +1,21 @@
+-- predicate.sql
+--
+--     pgbench script template: re-open this client's session and
+--     count the visible rows of a protected table.  bin/run_bench
+--     replaces @TABLE@ with each of the tables listed in
+--     bench.predicates.  Requires pgbench -D nonce=1.
+--
+--     Copyright (c) 2021 Marc Munro
+--     Author:  Marc Munro
+--     License: GPL V3
+
+\set nonce :nonce + 1
+select o.success
+  from bench.client_sessions cs
+ cross join veil2.open_connection(
+              cs.session_id, :nonce,
+              encode(digest(cs.session_token || to_hex(:nonce), 'sha1'),
+                     'base64')) o
+ where cs.username = 'Sue'
+   and cs.client_id = :client_id;
+select count(*) from bench.@TABLE@;
@@ -0,0 +1,24 @@
+-- refresh.sql
+--
+--     pgbench script: modify role privileges, causing the
+--     materialized views to be refreshed and the privileges caches to
+--     be cleared.  This is intended to be run in combination with
+--     open_continued.sql, to measure session performance while
+--     privileges are being updated.  It must be run by the database
+--     owner.
+--
+--     Copyright (c) 2021 Marc Munro
+--     Author:  Marc Munro
+--     License: GPL V3
+
+\set role_id random(20, 199)
+\set privilege_id random(30, 2000)
+insert
+  into veil2.role_privileges
+      (role_id, privilege_id)
+values (:role_id, :privilege_id)
+    on conflict do nothing;
+delete
+  from veil2.role_privileges
+ where role_id = :role_id
+   and privilege_id = :privilege_id;
@@ -0,0 +1,63 @@
+/* ----------
+ * sessions.sql
+ *
+ *      Create and authenticate a session, for each of Sue and Alice,
+ *      for each pgbench client.  The number of clients is given by
+ *      the psql variable clients.  Each session is authenticated with
+ *      nonce 1, so benchmark scripts that continue these sessions
+ *      must be run with pgbench -D nonce=1.
+ *
+ *      Copyright (c) 2021 Marc Munro
+ *      Author:  Marc Munro
+ *	License: GPL V3
+ *
+ * ----------
+ */
+\unset ECHO
+\set QUIET 1
+\pset format unaligned
+\pset tuples_only true
+\pset pager off
+
+truncate table bench.client_sessions;
+
+create or replace
+function pg_temp.open_client_session(
+    _username text, _password text,
+    _context_type_id integer, _context_id integer,
+    _client_id integer)
+  returns boolean as
+$$
+declare
+  _session_id bigint;
+  _session_token text;
+  _success boolean;
+begin
+  select cs.session_id, cs.session_token
+    into _session_id, _session_token
+    from veil2.create_session(_username, 'plaintext',
+                              _context_type_id, _context_id) cs;
+  select o.success
+    into _success
+    from veil2.open_connection(_session_id, 1, _password) o;
+  insert
+    into bench.client_sessions
+        (username, client_id, session_id, session_token)
+  values (_username, _client_id, _session_id, _session_token);
+  return _success;
+end;
+$$
+language plpgsql volatile;
+
+select 'Failed to open session for ' || username || ' ' || client_id
+  from (
+    select 'Sue' as username, c as client_id,
+           pg_temp.open_client_session('Sue', 'passwd5', 4, 1050, c) as ok
+      from generate_series(0, :clients - 1) c
+     union all
+    select 'Alice', c,
+           pg_temp.open_client_session('Alice', 'passwd1', 4, 1000, c)
+      from generate_series(0, :clients - 1) c) x
+ where not ok;
+
+select veil2.reset_session();
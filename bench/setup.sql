@@ -0,0 +1,120 @@
+/* ----------
+ * setup.sql
+ *
+ *      Prepare the demo database for the pgbench benchmarks run by
+ *      bin/run_bench.  This creates the bench schema, containing a
+ *      row level security protected table for each of the privilege
+ *      testing functions.
+ *
+ *	It is assumed that the demo, and the bulk data from
+ *	demo_bulk_data.sql, have been loaded.  The number of rows in
+ *	each table is given by the psql variable rows.
+ *
+ *      Copyright (c) 2021 Marc Munro
+ *      Author:  Marc Munro
+ *	License: GPL V3
+ *
+ * ----------
+ */
+\unset ECHO
+\set QUIET 1
+\pset format unaligned
+\pset tuples_only true
+\pset pager off
+
+\echo Setting up benchmark schema...
+drop schema if exists bench cascade;
+create schema bench;
+grant usage on schema bench to demouser;
+
+-- Allow plaintext authentication for Alice, as bcrypt would dominate
+-- the timings.
+insert
+  into veil2.authentication_details
+      (accessor_id, authentication_type, authent_token)
+select 1080, 'plaintext', 'passwd1'
+ where not exists (
+    select null
+      from veil2.authentication_details
+     where accessor_id = 1080
+       and authentication_type = 'plaintext');
+
+update veil2.authentication_types
+   set enabled = true
+ where shortname = 'plaintext';
+
+-- The base data for each protected table.  Each row references a
+-- party, and the org and corp to which it belongs, chosen evenly from
+-- the demo data.
+create table bench.base_rows as
+with parties as
+  (
+    select party_id, org_id, corp_id,
+           row_number() over (order by party_id) - 1 as idx,
+           count(*) over () as cnt
+      from demo.parties_tbl
+  )
+select n as id, p.party_id, p.org_id, p.corp_id
+  from generate_series(1, :rows) n
+ inner join parties p
+    on p.idx = (n * 7919) % p.cnt;
+
+-- One protected table for each privilege testing function, and one
+-- using the policy from demo.parties_tbl.
+create table bench.predicates (
+  table_name	text primary key,
+  predicate	text not null
+);
+
+insert
+  into bench.predicates
+      (table_name, predicate)
+values ('global', 'veil2.i_have_global_priv(21)'),
+       ('personal', 'veil2.i_have_personal_priv(21, party_id)'),
+       ('scope', 'veil2.i_have_priv_in_scope(21, 4, org_id)'),
+       ('scope_or_global',
+        'veil2.i_have_priv_in_scope_or_global(21, 3, corp_id)'),
+       ('superior', 'veil2.i_have_priv_in_superior_scope(21, 4, org_id)'),
+       ('scope_or_superior',
+        'veil2.i_have_priv_in_scope_or_superior(21, 4, org_id)'),
+       ('scope_or_superior_or_global',
+        'veil2.i_have_priv_in_scope_or_superior_or_global(21, 4, org_id)'),
+       ('demo_policy',
+        '   veil2.i_have_priv_in_scope_or_global(21, 3, corp_id)
+         or veil2.i_have_priv_in_scope(21, 4, org_id)
+         or veil2.i_have_priv_in_scope(21, 4, party_id)
+         or veil2.i_have_personal_priv(21, party_id)');
+
+do
+$$
+declare
+  rec record;
+begin
+  for rec in select * from bench.predicates loop
+    execute format('create table bench.%I as select * from bench.base_rows',
+                   rec.table_name);
+    execute format('alter table bench.%I enable row level security',
+                   rec.table_name);
+    execute format('create policy %I on bench.%I for select using (%s)',
+                   rec.table_name || '__select', rec.table_name,
+		   rec.predicate);
+    execute format('grant select on bench.%I to demouser',
+                   rec.table_name);
+  end loop;
+end;
+$$;
+
+analyze;
+
+-- Sessions used by each pgbench client.  These are recreated by
+-- bench/sessions.sql before each benchmark so that nonces start
+-- afresh.
+create table bench.client_sessions (
+  username	text not null,
+  client_id	integer not null,
+  session_id	bigint not null,
+  session_token	text not null,
+  primary key (username, client_id)
+);
+
+grant select on bench.client_sessions to demouser;
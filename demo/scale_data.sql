@@ -0,0 +1,371 @@
+/* ----------
+ * scale_data.sql
+ *
+ *      Generate a synthetic veil2 dataset of configurable size and
+ *      shape for scale testing, and report on the sizes of, and time
+ *      taken to query, the main veil2 views.
+ *
+ *      This must be run in a database in which veil2 has been
+ *      installed, but no VPD implementation (such as the demo) has
+ *      been created.  The dataset is controlled by the following psql
+ *      variables, each of which has a default:
+ *
+ *        seed               - seed for the pseudo-random choices (1)
+ *        accessors          - number of accessors (1000)
+ *        depth              - depth of the scope tree (3)
+ *        fanout             - children of each scope in the tree (10)
+ *        roles              - number of roles at each level of role
+ *                             nesting (100)
+ *        role_depth         - depth of role to role nesting (2)
+ *        role_fanout        - roles assigned to each nesting role (3)
+ *        privileges         - number of privileges (1000)
+ *        privs_per_role     - privileges for each innermost role (10)
+ *        roles_per_accessor - roles assigned to each accessor (5)
+ *        mapping_contexts   - number of mapping contexts, or 0 to
+ *                             map roles only in global context (0)
+ *
+ *      For example, to create 10^6 scopes and 10^5 accessors:
+ *
+ *        psql -v depth=6 -v fanout=10 -v accessors=100000 \
+ *             -f scale_data.sql
+ *
+ *      The same parameters always generate the same dataset.
+ *
+ *      Copyright (c) 2021 Marc Munro
+ *      Author:  Marc Munro
+ *	License: GPL V3
+ *
+ * ----------
+ */
+
+\set ON_ERROR_STOP 1
+\set QUIET 1
+\pset format unaligned
+\pset tuples_only true
+\pset pager off
+
+\if :{?seed} \else \set seed 1 \endif
+\if :{?accessors} \else \set accessors 1000 \endif
+\if :{?depth} \else \set depth 3 \endif
+\if :{?fanout} \else \set fanout 10 \endif
+\if :{?roles} \else \set roles 100 \endif
+\if :{?role_depth} \else \set role_depth 2 \endif
+\if :{?role_fanout} \else \set role_fanout 3 \endif
+\if :{?privileges} \else \set privileges 1000 \endif
+\if :{?privs_per_role} \else \set privs_per_role 10 \endif
+\if :{?roles_per_accessor} \else \set roles_per_accessor 5 \endif
+\if :{?mapping_contexts} \else \set mapping_contexts 0 \endif
+
+\echo Creating scale testing schema...
+create schema if not exists scale;
+
+-- Return a pseudo-random number in the range [0, 1), determined
+-- entirely by its parameters.  Each distinct stream provides an
+-- independent sequence, indexed by a and b.  We use this rather than
+-- random() so that the results do not depend on the order in which
+-- rows are generated.
+create or replace
+function scale.random(
+    _seed bigint, _stream integer, _a bigint, _b bigint default 0)
+  returns float8 as
+$$
+select (hashint8extended(_a * 1000003 + _b, _seed * 1000 + _stream)
+        & 9223372036854775807)::float8 / 9223372036854775808.0::float8;
+$$
+language sql immutable;
+
+-- Return a pseudo-random integer in the range [_lo, _hi].
+create or replace
+function scale.random_int(
+    _seed bigint, _stream integer, _lo bigint, _hi bigint,
+    _a bigint, _b bigint default 0)
+  returns bigint as
+$$
+select _lo + floor(scale.random(_seed, _stream, _a, _b)
+                   * (_hi - _lo + 1))::bigint;
+$$
+language sql immutable;
+
+create table if not exists scale.scope_tree (
+  scope_type_id			integer not null,
+  scope_id			integer not null,
+  superior_scope_type_id	integer not null,
+  superior_scope_id		integer not null,
+  primary key (scope_type_id, scope_id)
+);
+
+create table if not exists scale.accessor_contexts (
+  accessor_id			integer not null primary key,
+  context_type_id		integer not null,
+  context_id			integer not null
+);
+
+create or replace
+function scale.generate_dataset(
+    seed bigint default 1,
+    accessors integer default 1000,
+    depth integer default 3,
+    fanout integer default 10,
+    roles integer default 100,
+    role_depth integer default 2,
+    role_fanout integer default 3,
+    privileges integer default 1000,
+    privs_per_role integer default 10,
+    roles_per_accessor integer default 5,
+    mapping_contexts integer default 0)
+  returns void as
+$$
+declare
+  _level integer;
+begin
+  if exists (select null from veil2.accessors) then
+    raise exception 'Veil2 has already been implemented in this database'
+      using hint = 'Generate scale testing data in a newly created database.';
+  end if;
+  if mapping_contexts > fanout then
+    raise exception 'There can be no more than % mapping contexts', fanout;
+  end if;
+
+  -- Scopes.  Scope types 3 to depth + 2 are the levels of the tree.
+  -- Level n has fanout^n scopes, numbered from 1, with scope i
+  -- having as its superior scope (i - 1) / fanout + 1 of the level
+  -- above.  Level 1 scopes are superior only to global scope.
+  raise notice '...scopes...';
+  insert
+    into veil2.scope_types
+        (scope_type_id, scope_type_name, description)
+  select l + 2, 'level ' || l, 'Level ' || l || ' of the scope tree'
+    from generate_series(1, depth) l;
+
+  insert
+    into scale.scope_tree
+        (scope_type_id, scope_id,
+         superior_scope_type_id, superior_scope_id)
+  select l + 2, i, l + 1, (i - 1) / fanout + 1
+    from generate_series(2, depth) l
+   cross join lateral generate_series(1, power(fanout, l)::integer) i;
+
+  insert
+    into veil2.scopes
+        (scope_type_id, scope_id)
+  select l + 2, i
+    from generate_series(1, depth) l
+   cross join lateral generate_series(1, power(fanout, l)::integer) i;
+
+  -- Privileges.  About 10% are promoted, to a random level of the
+  -- scope tree or to global scope.
+  raise notice '...privileges...';
+  insert
+    into veil2.privileges
+        (privilege_id, privilege_name,
+         promotion_scope_type_id, description)
+  select p, 'priv ' || p,
+         case when scale.random(seed, 1, p) >= 0.1 then null
+         when scale.random_int(seed, 2, 2, depth + 2, p) = 2 then 1
+         else scale.random_int(seed, 2, 2, depth + 2, p) end,
+         'Generated privilege'
+    from generate_series(20, privileges + 19) p;
+
+  -- Roles.  Roles are created in levels, from 0 to role_depth.
+  -- Privileges are assigned only to level 0 roles, and each role in
+  -- level n is assigned role_fanout roles from level n - 1.
+  raise notice '...roles...';
+  insert
+    into veil2.roles
+        (role_id, role_type_id, role_name,
+         implicit, immutable, description)
+  select r, 1, 'role ' || r,
+         false, false, 'Generated role'
+    from generate_series(100, 100 + (role_depth + 1) * roles - 1) r;
+
+  insert
+    into veil2.role_privileges
+        (role_id, privilege_id)
+  select r, scale.random_int(seed, 3, 20, privileges + 19, r, n)
+    from generate_series(100, 99 + roles) r
+   cross join generate_series(1, privs_per_role) n
+      on conflict do nothing;
+
+  -- Role mappings are made separately in each mapping context.
+  raise notice '...role_roles...';
+  if mapping_contexts > 0 then
+    update veil2.system_parameters
+       set parameter_value = '3'
+     where parameter_name = 'mapping context target scope type';
+  end if;
+  for _level in 1 .. role_depth loop
+    insert
+      into veil2.role_roles
+          (primary_role_id, assigned_role_id,
+           context_type_id, context_id)
+    select r,
+           100 + (_level - 1) * roles +
+             scale.random_int(seed, 4, 0, roles - 1, r, m * 1000 + n),
+           case when mapping_contexts > 0 then 3 else 1 end, m
+      from generate_series(100 + _level * roles,
+                           99 + (_level + 1) * roles) r
+     cross join generate_series(case when mapping_contexts > 0 then 1
+                                else 0 end, mapping_contexts) m
+     cross join generate_series(1, role_fanout) n
+        on conflict do nothing;
+  end loop;
+
+  -- Accessors.  If we have mapping contexts, each accessor belongs to
+  -- one of them and connects in that context, otherwise accessors
+  -- connect in global context.
+  raise notice '...accessors...';
+  insert
+    into veil2.accessors
+        (accessor_id, username)
+  select a, 'user_' || a
+    from generate_series(1, accessors) a;
+
+  update veil2.authentication_types
+     set enabled = true
+   where shortname = 'plaintext';
+
+  insert
+    into veil2.authentication_details
+        (accessor_id, authentication_type, authent_token)
+  select a, 'plaintext', 'passwd_' || a
+    from generate_series(1, accessors) a;
+
+  insert
+    into scale.accessor_contexts
+        (accessor_id, context_type_id, context_id)
+  select a,
+         case when mapping_contexts > 0 then 3 else 1 end,
+         case when mapping_contexts > 0 then (a - 1) % mapping_contexts + 1
+         else 0 end
+    from generate_series(1, accessors) a;
+
+  -- Accessor roles.  Each accessor gets connect, and roles_per_accessor
+  -- roles from the outermost level, each in a scope chosen from a
+  -- random level of the tree.  If the accessor belongs to a mapping
+  -- context, the scope is from within that context's subtree.
+  -- Accessor 1 is also a superuser.
+  raise notice '...accessor_roles...';
+  alter table veil2.accessor_roles disable trigger accessor_roles__aiud;
+  insert
+    into veil2.accessor_roles
+        (accessor_id, role_id, context_type_id, context_id)
+  select a, 0, 1, 0
+    from generate_series(1, accessors) a
+   union all
+  select 1, 1, 1, 0;
+
+  insert
+    into veil2.accessor_roles
+        (accessor_id, role_id, context_type_id, context_id)
+  select x.accessor_id, x.role_id, x.level + 2,
+         (x.root - 1) * power(fanout, x.level - 1)::integer + 1 +
+           scale.random_int(seed, 7, 0,
+                            power(fanout, x.level - 1)::integer - 1,
+                            x.accessor_id, x.n)
+    from (
+      select ac.accessor_id, n,
+             100 + role_depth * roles +
+               scale.random_int(seed, 5, 0, roles - 1,
+                                ac.accessor_id, n) as role_id,
+             scale.random_int(seed, 6, 1, depth,
+                              ac.accessor_id, n) as level,
+             case when mapping_contexts > 0 then ac.context_id
+             else scale.random_int(seed, 8, 1, fanout, ac.accessor_id, n)
+             end as root
+        from scale.accessor_contexts ac
+       cross join generate_series(1, roles_per_accessor) n) x
+      on conflict do nothing;
+  alter table veil2.accessor_roles enable trigger accessor_roles__aiud;
+
+  truncate table veil2.accessor_privileges_cache;
+  perform veil2.clear_shared_privs();
+
+  -- Install our implementation views and functions, and refresh
+  -- everything.
+  raise notice '...initializing...';
+  execute
+    'create or replace
+     view veil2.my_superior_scopes (
+       scope_type_id, scope_id,
+       superior_scope_type_id, superior_scope_id
+     ) as
+     select scope_type_id, scope_id,
+            superior_scope_type_id, superior_scope_id
+       from scale.scope_tree';
+
+  execute
+    'create or replace
+     view veil2.my_accessor_contexts (
+       accessor_id, context_type_id, context_id
+     ) as
+     select accessor_id, context_type_id, context_id
+       from scale.accessor_contexts';
+
+  execute
+    'create or replace
+     function veil2.my_get_accessor(
+         username in text,
+         context_type_id in integer,
+         context_id in integer)
+       returns integer as
+     $fn$
+     select accessor_id
+       from veil2.accessors a
+      where a.username = my_get_accessor.username;
+     $fn$
+     language sql security definer stable';
+
+  perform veil2.init();
+end;
+$$
+language plpgsql volatile;
+
+comment on function scale.generate_dataset(
+    bigint, integer, integer, integer, integer, integer,
+    integer, integer, integer, integer, integer) is
+'Generate a synthetic veil2 dataset for scale testing.  See
+demo/scale_data.sql for a description of the parameters.  The dataset
+is entirely determined by the parameters: the same parameters will
+always generate the same data.';
+
+
+\echo Generating dataset...
+select scale.generate_dataset(
+    seed => :seed,
+    accessors => :accessors,
+    depth => :depth,
+    fanout => :fanout,
+    roles => :roles,
+    role_depth => :role_depth,
+    role_fanout => :role_fanout,
+    privileges => :privileges,
+    privs_per_role => :privs_per_role,
+    roles_per_accessor => :roles_per_accessor,
+    mapping_contexts => :mapping_contexts);
+analyze;
+
+\echo Row counts:
+select 'scopes: ' || count(*) from veil2.scopes;
+select 'accessors: ' || count(*) from veil2.accessors;
+select 'accessor_roles: ' || count(*) from veil2.accessor_roles;
+select 'role_roles: ' || count(*) from veil2.role_roles;
+select 'all_role_roles: ' || count(*) from veil2.all_role_roles;
+select 'all_superior_scopes: ' || count(*) from veil2.all_superior_scopes;
+
+\echo Timings:
+\timing on
+\echo ...refresh_superior_scopes()...
+select veil2.refresh_superior_scopes();
+\echo ...refresh_role_privileges()...
+select veil2.refresh_role_privileges();
+\echo ...open session for user_1...
+select o.success
+  from scale.accessor_contexts ac
+ cross join veil2.create_session('user_1', 'plaintext',
+                                 ac.context_type_id, ac.context_id) c
+ cross join veil2.open_connection(c.session_id, 1, 'passwd_1') o
+ where ac.accessor_id = 1;
+\echo ...session_privileges_v for user_1...
+select count(*) from veil2.session_privileges_v;
+\timing off
+select veil2.reset_session();
@@ -875,9 +875,12 @@ This is automatically populated by the Veil2 session management
 functions for any combination of accessor and session context for
 which it contains no data.
 
-It should be truncated whenever any underlying role, privilege or
-context data is updated, and records for individual accessors should
-be deleted whenever their role assignments are updated.';
+It should be emptied whenever any underlying context or scope data
+is updated.  Rows are deleted rather than truncated, as truncation
+would block all sessions reading the cache until the emptying
+transaction completes.  Records for individual accessors should be deleted
+whenever their role assignments are updated, or when any role that
+they hold, directly or indirectly, is updated.';
 
 create index accessor_privileges_cache__accessor_idx
   on veil2.accessor_privileges_cache(accessor_id);
@@ -888,10 +891,41 @@ used is:
   - retrieve the scopes, roles and privs for a given accessor and
     login context: extending the index to include login_context will
     have very little impact on performance;
-  - truncating the whole thing when roles, role_roles or privileges
-    are modified;
-  - removing entries for a single accessor when an accessor''s roles
-    have changed: an index solely on accessor_id is perfect for this.';
+  - clearing the whole thing when the scope hierarchy is modified;
+  - removing entries for individual accessors when an accessor''s
+    roles, or the definitions of those roles, have changed: an index
+    solely on accessor_id is perfect for this.';
+
+
+\echo ......deferred_refreshes...
+create unlogged table veil2.deferred_refreshes (
+  txid				bigint not null default txid_current(),
+  refresh_type			text not null,
+  role_id			integer
+);
+
+create unique index deferred_refreshes__uk
+  on veil2.deferred_refreshes(txid, refresh_type, coalesce(role_id, 0));
+
+comment on table veil2.deferred_refreshes is
+'Records the materialized view refreshes that are pending for each
+transaction when the ''deferred matview refresh'' system parameter is
+set.  Rows are added by the matview refresh triggers, and are
+processed and removed by veil2.apply_deferred_refreshes() when the
+transaction commits.  If the transaction aborts, its rows disappear
+with it.
+
+refresh_type is one of:
+  - ''commit'': a marker row, added once per transaction, whose
+    deferred trigger performs the refreshes;
+  - ''roles'': all_role_privileges must be updated for role_id, and
+    cached privileges cleared for the accessors holding it;
+  - ''all roles'': all_role_privileges must be fully refreshed;
+  - ''all accessors'': cached privileges must be cleared for all
+    accessors;
+  - ''scopes'': all_superior_scopes must be updated.';
+
+revoke all on veil2.deferred_refreshes from public;
 
 
 -- Create the VEIL2 schema views, including matviews
@@ -989,9 +1023,9 @@ comment on view veil2.all_role_privileges_v is
 in all mapping contexts.  If the mapping context is null, the mapping
 applies in all mapping contexts.
 
-For performance reasons a materialized view veil2.all_role_privileges,
-has been created.  This must be refreshed whenever data underlying
-this view is updated.';
+For performance reasons a table veil2.all_role_privileges, containing
+the results of this view, is maintained by triggers whenever data
+underlying this view is updated.';
 
 create or replace
 view veil2.all_role_privileges_info as
@@ -1004,15 +1038,40 @@ comment on view veil2.all_role_privileges_info is
 'Developer view on all_role_privileges showing roles and privileges as
 arrays of integers for easier comprehension.';
 
-create materialized view veil2.all_role_privileges as
+create table veil2.all_role_privileges (
+  role_id			integer not null,
+  mapping_context_type_id	integer,
+  mapping_context_id		integer,
+  roles				bitmap not null,
+  privileges			bitmap not null
+);
+
+create index all_role_privileges__role_idx
+  on veil2.all_role_privileges(role_id);
+
+create unique index all_role_privileges__uk
+  on veil2.all_role_privileges(role_id,
+                               coalesce(mapping_context_type_id, 0),
+                               coalesce(mapping_context_id, 0));
+
+comment on index veil2.all_role_privileges__uk is
+'There is exactly one row per role and mapping context, where the
+mapping context may be null.  This allows all_role_privileges to be
+refreshed in place, without truncation, as
+veil2.refresh_role_privileges() does.';
+
+insert
+  into veil2.all_role_privileges
 select * from veil2.all_role_privileges_v;
 
-comment on materialized view veil2.all_role_privileges is
-'Materialized view on veil2.all_role_privileges_v.  This exists to
+comment on table veil2.all_role_privileges is
+'Materialized copy of veil2.all_role_privileges_v.  This exists to
 improve the performance of veil2.session_privileges_v.
 
-Any time that the data underlying all_role_privileges_v is modified,
-this materialized view should be refreshed.';
+This is maintained incrementally, by triggers on the roles,
+role_roles, role_privileges and privileges tables, which recompute
+only the rows for roles affected by each change.  It may be fully
+rebuilt using veil2.refresh_role_privileges().';
 
 revoke all on veil2.all_role_privileges_v from public;
 grant select on veil2.all_role_privileges_v to veil_user;
@@ -1151,21 +1210,84 @@ You should not need to modify this view when creating your custom VPD
 implementation.
 
 Note that for performance reasons a materialized version of this view,
-veil2.all_superior_scopes, has been created.  Any change to the data
-underlying this view must result in the materialized view being
-refreshed.';
+veil2.all_superior_scopes, is maintained.  Any change to the data
+underlying this view must result in that table being updated.';
 
-create 
-materialized view veil2.all_superior_scopes
-as select * from veil2.all_superior_scopes_v;
 
-comment on materialized view veil2.all_superior_scopes is
-'This is a materialized view on veil2.all_superior_scopes_v.  It
+\echo ......direct_superior_scopes...
+create table veil2.direct_superior_scopes (
+  scope_type_id			integer not null,
+  scope_id			integer not null,
+  superior_scope_type_id	integer not null,
+  superior_scope_id		integer not null
+);
+
+alter table veil2.direct_superior_scopes
+  add constraint direct_superior_scope__pk
+  primary key(scope_type_id, scope_id,
+              superior_scope_type_id, superior_scope_id);
+
+insert
+  into veil2.direct_superior_scopes
+select distinct scope_type_id, scope_id,
+       superior_scope_type_id, superior_scope_id
+  from veil2.superior_scopes
+ where scope_type_id is not null
+   and scope_id is not null
+   and superior_scope_type_id is not null
+   and superior_scope_id is not null;
+
+comment on table veil2.direct_superior_scopes is
+'A copy of the content of veil2.superior_scopes, as it was when
+veil2.all_superior_scopes was last updated.  By comparing this with
+the current content of veil2.superior_scopes,
+veil2.update_superior_scopes() can identify which scopes have gained
+or lost superior scopes, and so update only the affected rows of
+veil2.all_superior_scopes.
+
+You should not modify this table.';
+
+revoke all on veil2.direct_superior_scopes from public;
+grant select on veil2.direct_superior_scopes to veil_user;
+
+
+\echo ......all_superior_scopes(table)...
+create table veil2.all_superior_scopes (
+  scope_type_id			integer not null,
+  scope_id			integer not null,
+  superior_scope_type_id	integer not null,
+  superior_scope_id		integer not null,
+  is_type_promotion		boolean not null
+);
+
+alter table veil2.all_superior_scopes
+  add constraint all_superior_scope__pk
+  primary key(scope_type_id, scope_id,
+              superior_scope_type_id, superior_scope_id,
+	      is_type_promotion);
+
+create index all_superior_scopes__superior_idx
+  on veil2.all_superior_scopes(superior_scope_type_id, superior_scope_id);
+
+insert
+  into veil2.all_superior_scopes
+select *
+  from veil2.all_superior_scopes_v
+ where scope_type_id is not null
+   and scope_id is not null
+   and superior_scope_type_id is not null
+   and superior_scope_id is not null;
+
+comment on table veil2.all_superior_scopes is
+'This is a materialized copy of veil2.all_superior_scopes_v.  It
 exists in order to improve the performance of
 veil2.session_privileges_v.
 
-It must be fully refreshed whenever the underlying data for
-veil2.superior_scopes is updated.'; 
+It must be updated, using veil2.update_superior_scopes(), whenever
+the underlying data for veil2.superior_scopes is updated.  This
+identifies the scopes whose superior scopes have changed and
+recomputes the rows only for them and their inferior scopes.  It may
+be fully rebuilt using veil2.refresh_superior_scopes().';
 
 revoke all on veil2.all_superior_scopes from public;
 grant select on veil2.all_superior_scopes to veil_user;
@@ -1510,9 +1632,8 @@ function veil2.add_session_privileges(
 comment on function veil2.add_session_privileges(
     integer, integer, bitmap, bitmap) is
 'Record in-memory copies of session privileges for a given scope for
-the session.  Note that it is imperative that this is called in
-scope_type_id, scope_id order so that the in-memory array can be
-bsearched.';
+the session.  Entries may be added in any order: they are indexed, by
+scope type, on the first privilege test following the load.';
 
 
 \echo ......update_session_privileges()...
@@ -1535,6 +1656,74 @@ comment on function veil2.update_session_privileges(
 'Update the in-memory roles and privileges bitmap for a given scope.';
 
 
+\echo ......load_shared_privs()...
+create or replace
+function veil2.load_shared_privs()
+  returns boolean
+     as '$libdir/veil2', 'veil2_load_shared_privs'
+     language C volatile;
+
+revoke all on function veil2.load_shared_privs() from public;
+
+comment on function veil2.load_shared_privs() is
+'Load the in-memory copy of session privileges from the shared
+accessor privileges cache.  Returns false if they could not be found
+there, or if the shared cache is unavailable.  The shared cache is only
+available if veil2 has been loaded using shared_preload_libraries.';
+
+
+\echo ......load_cached_session_privs()...
+create or replace
+function veil2.load_cached_session_privs()
+  returns integer
+     as '$libdir/veil2', 'veil2_load_cached_session_privs'
+     language C volatile;
+
+revoke all on function veil2.load_cached_session_privs() from public;
+
+comment on function veil2.load_cached_session_privs() is
+'Replace the in-memory copy of session privileges with those recorded
+for the session in veil2.accessor_privileges_cache.  All rows are
+fetched in a single query and loaded in one operation, with any
+duplicate rows being ignored.  Returns the number of scopes loaded.';
+
+
+\echo ......save_shared_privs()...
+create or replace
+function veil2.save_shared_privs()
+  returns void
+     as '$libdir/veil2', 'veil2_save_shared_privs'
+     language C volatile;
+
+revoke all on function veil2.save_shared_privs() from public;
+
+comment on function veil2.save_shared_privs() is
+'Save the in-memory copy of session privileges into the shared
+accessor privileges cache.  This does nothing unless it follows a call
+to load_shared_privs() that failed to find them.  If the cache has
+been invalidated since that call, the saved privileges will be
+ignored.';
+
+
+\echo ......clear_shared_privs()...
+create or replace
+function veil2.clear_shared_privs(accessor_id integer default null)
+  returns void
+     as '$libdir/veil2', 'veil2_clear_shared_privs'
+     language C volatile;
+
+revoke all on function veil2.clear_shared_privs(integer) from public;
+
+comment on function veil2.clear_shared_privs(integer) is
+'Invalidate the shared accessor privileges cache entries for the given
+accessor, or for all accessors if accessor_id is null.  The
+invalidation is repeated when the current transaction commits, so that
+other sessions cannot re-cache privileges that were loaded before our
+changes became visible.  Each backend''s cached ancestor privileges,
+for become user sessions, are also discarded when the transaction
+commits.';
+
+
 \echo ......session_assignment_contexts...
 create or replace
 view veil2.session_assignment_contexts as
@@ -1839,23 +2028,531 @@ the session''s accessor and session context.';
 revoke all on veil2.session_privileges_v from public;
 
 
+\echo ......compute_session_privileges()...
+create or replace
+function veil2.compute_session_privileges(load boolean default false)
+  returns setof veil2.session_privileges_t
+     as '$libdir/veil2', 'veil2_compute_session_privileges'
+     language C security definer volatile;
+
+revoke all on function veil2.compute_session_privileges(boolean)
+  from public;
+
+comment on function veil2.compute_session_privileges(boolean) is
+'Compute the roles and privileges in all contexts for the current
+session.  This gives the same results as veil2.session_privileges_v,
+but is computed natively, from veil2.base_accessor_roleprivs(),
+veil2.promotable_privileges and the in-memory copy of
+veil2.all_superior_scopes, and so is much faster.  If load is true,
+the results also replace the in-memory session privileges.';
+
+
 \echo ...creating materialized view refresh functions...
 
+\echo ......scope_hierarchy_changed()...
+create or replace
+function veil2.scope_hierarchy_changed()
+  returns void
+     as '$libdir/veil2', 'veil2_scope_hierarchy_changed'
+     language C volatile;
+
+revoke all on function veil2.scope_hierarchy_changed() from public;
+
+comment on function veil2.scope_hierarchy_changed() is
+'Notify all backends, on commit, that veil2.all_superior_scopes has
+been modified so that they will discard their in-memory copies of the
+scope hierarchy.';
+
+
+\echo ......refresh_superior_scopes()...
+create or replace
+function veil2.refresh_superior_scopes()
+  returns void as
+$$
+begin
+  -- Rather than truncating, which would block all readers until we
+  -- commit, we remove only those rows that no longer exist, and add
+  -- those that are new.
+  delete
+    from veil2.direct_superior_scopes d
+   using (select * from veil2.direct_superior_scopes
+          except
+          select scope_type_id, scope_id,
+                 superior_scope_type_id, superior_scope_id
+            from veil2.superior_scopes) x
+   where d.scope_type_id = x.scope_type_id
+     and d.scope_id = x.scope_id
+     and d.superior_scope_type_id = x.superior_scope_type_id
+     and d.superior_scope_id = x.superior_scope_id;
+  insert
+    into veil2.direct_superior_scopes
+  select scope_type_id, scope_id,
+         superior_scope_type_id, superior_scope_id
+    from veil2.superior_scopes
+   where scope_type_id is not null
+     and scope_id is not null
+     and superior_scope_type_id is not null
+     and superior_scope_id is not null
+  except
+  select *
+    from veil2.direct_superior_scopes;
+
+  delete
+    from veil2.all_superior_scopes a
+   using (select * from veil2.all_superior_scopes
+          except
+          select * from veil2.all_superior_scopes_v) x
+   where a.scope_type_id = x.scope_type_id
+     and a.scope_id = x.scope_id
+     and a.superior_scope_type_id = x.superior_scope_type_id
+     and a.superior_scope_id = x.superior_scope_id
+     and a.is_type_promotion = x.is_type_promotion;
+  insert
+    into veil2.all_superior_scopes
+  select *
+    from veil2.all_superior_scopes_v
+   where scope_type_id is not null
+     and scope_id is not null
+     and superior_scope_type_id is not null
+     and superior_scope_id is not null
+  except
+  select *
+    from veil2.all_superior_scopes;
+  perform veil2.scope_hierarchy_changed();
+end;
+$$
+language plpgsql security definer volatile;
+
+revoke all on function veil2.refresh_superior_scopes() from public;
+
+comment on function veil2.refresh_superior_scopes() is
+'Fully refresh veil2.all_superior_scopes (and
+veil2.direct_superior_scopes) from veil2.superior_scopes.  Like
+REFRESH MATERIALIZED VIEW CONCURRENTLY, this modifies only those rows
+that have changed, so does not block concurrent readers.';
+
+
+\echo ......update_superior_scopes()...
+create or replace
+function veil2.update_superior_scopes()
+  returns boolean as
+$$
+declare
+  _types integer[];
+  _ids integer[];
+begin
+  -- Identify scopes whose direct superior scopes have changed since
+  -- all_superior_scopes was last updated.
+  with current_scopes as
+    (
+      select distinct scope_type_id, scope_id,
+             superior_scope_type_id, superior_scope_id
+        from veil2.superior_scopes
+       where scope_type_id is not null
+         and scope_id is not null
+         and superior_scope_type_id is not null
+         and superior_scope_id is not null
+    ),
+  changed as
+    (
+      (select * from current_scopes
+       except
+       select * from veil2.direct_superior_scopes)
+      union
+      (select * from veil2.direct_superior_scopes
+       except
+       select * from current_scopes)
+    )
+  select array_agg(scope_type_id), array_agg(scope_id)
+    into _types, _ids
+    from (select distinct scope_type_id, scope_id
+            from changed) x;
+  if _types is null then
+    return false;
+  end if;
+
+  -- Update our copy of superior_scopes for the changed scopes.
+  delete
+    from veil2.direct_superior_scopes d
+   using unnest(_types, _ids) c(scope_type_id, scope_id)
+   where d.scope_type_id = c.scope_type_id
+     and d.scope_id = c.scope_id;
+  insert
+    into veil2.direct_superior_scopes
+  select distinct ss.scope_type_id, ss.scope_id,
+         ss.superior_scope_type_id, ss.superior_scope_id
+    from veil2.superior_scopes ss
+   inner join unnest(_types, _ids) c(scope_type_id, scope_id)
+      on ss.scope_type_id = c.scope_type_id
+     and ss.scope_id = c.scope_id
+   where ss.superior_scope_type_id is not null
+     and ss.superior_scope_id is not null;
+
+  -- All scopes that were inferior to the changed scopes are also
+  -- affected.
+  select array_agg(scope_type_id), array_agg(scope_id)
+    into _types, _ids
+    from (
+      select c.scope_type_id, c.scope_id
+        from unnest(_types, _ids) c(scope_type_id, scope_id)
+       union
+      select a.scope_type_id, a.scope_id
+        from veil2.all_superior_scopes a
+       inner join unnest(_types, _ids) c(scope_type_id, scope_id)
+          on a.superior_scope_type_id = c.scope_type_id
+         and a.superior_scope_id = c.scope_id) x;
+
+  -- Recompute the superior scopes for just the affected scopes.
+  delete
+    from veil2.all_superior_scopes a
+   using unnest(_types, _ids) c(scope_type_id, scope_id)
+   where a.scope_type_id = c.scope_type_id
+     and a.scope_id = c.scope_id;
+  insert
+    into veil2.all_superior_scopes
+  with recursive recursive_superior_scopes as
+    (
+      select d.scope_type_id, d.scope_id,
+             d.superior_scope_type_id, d.superior_scope_id,
+             d.scope_type_id != d.superior_scope_type_id
+        from veil2.direct_superior_scopes d
+       inner join unnest(_types, _ids) c(scope_type_id, scope_id)
+          on d.scope_type_id = c.scope_type_id
+         and d.scope_id = c.scope_id
+       union
+      select rsp.scope_type_id, rsp.scope_id,
+             d.superior_scope_type_id, d.superior_scope_id,
+             d.scope_type_id != d.superior_scope_type_id
+        from recursive_superior_scopes rsp
+       inner join veil2.direct_superior_scopes d
+          on d.scope_type_id = rsp.superior_scope_type_id
+         and d.scope_id = rsp.superior_scope_id
+       where not (    d.superior_scope_type_id = rsp.superior_scope_type_id
+                  and d.superior_scope_id = rsp.superior_scope_id)
+    )
+  select *
+    from recursive_superior_scopes;
+  perform veil2.scope_hierarchy_changed();
+  return true;
+end;
+$$
+language plpgsql security definer volatile;
+
+revoke all on function veil2.update_superior_scopes() from public;
+
+comment on function veil2.update_superior_scopes() is
+'Incrementally update veil2.all_superior_scopes.  This compares
+veil2.superior_scopes with veil2.direct_superior_scopes (our copy of
+it from the last update) to identify the scopes whose superior scopes
+have changed.  Only rows for those scopes and their inferior scopes
+are recomputed, so a change to one small part of a large scope
+hierarchy is cheap, and requires no exclusive lock.  Returns true if
+anything changed.';
+
+
+\echo ......refresh_role_privileges()...
+create or replace
+function veil2.refresh_role_privileges()
+  returns void as
+$$
+  -- Rather than truncating, which would block all readers until we
+  -- commit, we remove only those rows that have changed, and then add
+  -- those that are missing.  Bitmaps are compared as arrays.
+  delete
+    from veil2.all_role_privileges a
+   using (select role_id, mapping_context_type_id, mapping_context_id,
+                 to_array(roles), to_array(privileges)
+            from veil2.all_role_privileges
+          except
+          select *
+            from veil2.all_role_privileges_info) x
+   where a.role_id = x.role_id
+     and a.mapping_context_type_id is not distinct from
+             x.mapping_context_type_id
+     and a.mapping_context_id is not distinct from x.mapping_context_id;
+  insert
+    into veil2.all_role_privileges
+  select *
+    from veil2.all_role_privileges_v v
+   where not exists (
+       select null
+         from veil2.all_role_privileges a
+        where a.role_id = v.role_id
+          and a.mapping_context_type_id is not distinct from
+                  v.mapping_context_type_id
+          and a.mapping_context_id is not distinct from
+                  v.mapping_context_id);
+$$
+language sql security definer volatile;
+
+revoke all on function veil2.refresh_role_privileges() from public;
+
+comment on function veil2.refresh_role_privileges() is
+'Fully refresh veil2.all_role_privileges from
+veil2.all_role_privileges_v.  Like REFRESH MATERIALIZED VIEW
+CONCURRENTLY, this modifies only those rows that have changed, relying
+on the unique index all_role_privileges__uk, so does not block
+concurrent readers.';
+
+
+\echo ......update_role_privileges()...
+create or replace
+function veil2.update_role_privileges(role_ids integer[])
+  returns void as
+$$
+declare
+  _roles integer[];
+begin
+  -- Any role to which the given roles are assigned, directly or
+  -- indirectly, is also affected.
+  select array_agg(role_id)
+    into _roles
+    from (
+      select unnest(role_ids) as role_id
+       union
+      select primary_role_id
+        from veil2.all_role_roles
+       where assigned_role_id = any(role_ids)) x;
+
+  delete
+    from veil2.all_role_privileges
+   where role_id = any(_roles);
+  insert
+    into veil2.all_role_privileges
+  select *
+    from veil2.all_role_privileges_v
+   where role_id = any(_roles);
+end;
+$$
+language plpgsql security definer volatile;
+
+revoke all on function veil2.update_role_privileges(integer[]) from public;
+
+comment on function veil2.update_role_privileges(integer[]) is
+'Incrementally update veil2.all_role_privileges, recomputing only the
+rows for the given roles, and those roles to which they are assigned.';
+
+
+\echo ......clear_role_accessors_privs()...
+create or replace
+function veil2.clear_role_accessors_privs(role_ids integer[])
+  returns void as
+$$
+declare
+  _roles integer[];
+  _accessors integer[];
+begin
+  -- As in update_role_privileges(), any role to which the given roles
+  -- are assigned, directly or indirectly, is also affected.
+  select array_agg(role_id)
+    into _roles
+    from (
+      select unnest(role_ids) as role_id
+       union
+      select primary_role_id
+        from veil2.all_role_roles
+       where assigned_role_id = any(role_ids)) x;
+
+  if exists (
+      select null
+        from veil2.roles
+       where role_id = any(_roles)
+         and implicit)
+  then
+    -- Implicitly assigned roles are held by every accessor.
+    delete from veil2.accessor_privileges_cache;
+    perform veil2.clear_shared_privs();
+    return;
+  end if;
+
+  select array_agg(distinct accessor_id)
+    into _accessors
+    from veil2.all_accessor_roles
+   where role_id = any(_roles);
+  if _accessors is not null then
+    delete
+      from veil2.accessor_privileges_cache
+     where accessor_id = any(_accessors);
+    perform veil2.clear_shared_privs(accessor_id)
+       from unnest(_accessors) accessor_id;
+  end if;
+end;
+$$
+language plpgsql security definer volatile;
+
+revoke all on function veil2.clear_role_accessors_privs(integer[]) from public;
+
+comment on function veil2.clear_role_accessors_privs(integer[]) is
+'Clear cached privileges for only those accessors whose privileges
+may have changed as a result of changes to the given roles.  These are
+the accessors assigned, through veil2.all_accessor_roles, any of the
+given roles or any role to which they are assigned, directly or
+indirectly.  If any of those roles is implicitly assigned, all
+accessors are affected and all cached privileges are cleared.  This
+is called once the affected roles have been updated in
+veil2.all_role_privileges.';
+
+
+\echo ......deferred_refresh()...
+create or replace
+function veil2.deferred_refresh()
+  returns boolean as
+$$
+  select coalesce(
+           (select parameter_value::boolean
+              from veil2.system_parameters
+             where parameter_name = 'deferred matview refresh'),
+           false);
+$$
+language sql security definer stable;
+
+revoke all on function veil2.deferred_refresh() from public;
+
+comment on function veil2.deferred_refresh() is
+'Predicate identifying whether matview refreshes are to be deferred
+until commit.  This is controlled by the ''deferred matview refresh''
+system parameter.';
+
+
+\echo ......defer_refresh()...
+create or replace
+function veil2.defer_refresh(
+    refresh_type text,
+    role_ids integer[] default null)
+  returns void as
+$$
+  -- The commit marker ensures that apply_deferred_refreshes() is
+  -- called exactly once, at commit, for this transaction.
+  insert
+    into veil2.deferred_refreshes (refresh_type)
+  values ('commit')
+      on conflict do nothing;
+  insert
+    into veil2.deferred_refreshes (refresh_type, role_id)
+  select refresh_type, r.role_id
+    from (select unnest(role_ids)
+           where role_ids is not null
+           union all
+          select null
+           where role_ids is null) r(role_id)
+      on conflict do nothing;
+$$
+language sql security definer volatile;
+
+revoke all on function veil2.defer_refresh(text, integer[]) from public;
+
+comment on function veil2.defer_refresh(text, integer[]) is
+'Record a matview refresh to be performed when the current
+transaction commits.  Each refresh is recorded once, no matter how
+many statements ask for it.  See veil2.deferred_refreshes for the
+refresh types.';
+
+
+\echo ......apply_deferred_refreshes()...
+create or replace
+function veil2.apply_deferred_refreshes()
+  returns trigger
+as
+$$
+declare
+  _roles integer[];
+  _clear_all boolean := false;
+begin
+  if exists (
+      select null
+        from veil2.deferred_refreshes
+       where txid = txid_current()
+         and refresh_type = 'all roles')
+  then
+    perform veil2.refresh_role_privileges();
+    _clear_all := true;
+  else
+    select array_agg(role_id)
+      into _roles
+      from veil2.deferred_refreshes
+     where txid = txid_current()
+       and refresh_type = 'roles';
+    if _roles is not null then
+      perform veil2.update_role_privileges(_roles);
+    end if;
+  end if;
+
+  if exists (
+      select null
+        from veil2.deferred_refreshes
+       where txid = txid_current()
+         and refresh_type = 'all accessors')
+  then
+    _clear_all := true;
+  end if;
+
+  if exists (
+      select null
+        from veil2.deferred_refreshes
+       where txid = txid_current()
+         and refresh_type = 'scopes')
+  then
+    if veil2.update_superior_scopes() then
+      _clear_all := true;
+    end if;
+  end if;
+
+  delete
+    from veil2.deferred_refreshes
+   where txid = txid_current();
+
+  if _clear_all then
+    -- We delete rather than truncate so that sessions opening
+    -- concurrently are not blocked.
+    delete from veil2.accessor_privileges_cache;
+    perform veil2.clear_shared_privs();
+  elsif _roles is not null then
+    perform veil2.clear_role_accessors_privs(_roles);
+  end if;
+  return null;
+end;
+$$
+language plpgsql security definer volatile;
+
+revoke all on function veil2.apply_deferred_refreshes() from public;
+
+comment on function veil2.apply_deferred_refreshes() is
+'Deferred trigger function, called once at commit for each
+transaction that has recorded refreshes in veil2.deferred_refreshes.
+This performs all of the recorded refreshes in one go, and then clears
+the cached privileges of those accessors that may have been affected.';
+
+create constraint trigger deferred_refreshes__commit
+  after insert
+  on veil2.deferred_refreshes
+  deferrable initially deferred
+  for each row
+  when (new.refresh_type = 'commit')
+  execute procedure veil2.apply_deferred_refreshes();
+
+comment on trigger deferred_refreshes__commit on veil2.deferred_refreshes is
+'Perform all refreshes recorded by the current transaction, exactly
+once, at commit time.';
+
+
 \echo ......refresh_all_matviews()...
 create or replace
 function veil2.refresh_all_matviews()
     returns void as
 $$
-  refresh materialized view veil2.all_superior_scopes;
-  refresh materialized view veil2.all_role_privileges;
-  truncate table veil2.accessor_privileges_cache;
+  select veil2.refresh_superior_scopes();
+  select veil2.refresh_role_privileges();
+  delete from veil2.accessor_privileges_cache;
+  select veil2.clear_shared_privs();
 $$
 language sql security definer volatile;
 
 revoke all on function veil2.refresh_all_matviews() from public;
 
 comment on function veil2.refresh_all_matviews() is
-'Clear all matviews and caches unconditionally.';
+'Fully rebuild all matviews and clear all caches unconditionally.
+Rebuilding all_superior_scopes also causes each backend to discard its
+in-memory copy of the scope hierarchy.';
 
 
 \echo ......refresh_scopes_matviews()...
@@ -1865,7 +2562,12 @@ function veil2.refresh_scopes_matviews()
 as
 $$
 begin
-  perform veil2.refresh_all_matviews();
+  if veil2.deferred_refresh() then
+    perform veil2.defer_refresh('scopes');
+  elsif veil2.update_superior_scopes() then
+    delete from veil2.accessor_privileges_cache;
+    perform veil2.clear_shared_privs();
+  end if;
   return new;
 end;
 $$
@@ -1874,8 +2576,97 @@ language plpgsql security definer;
 revoke all on function veil2.refresh_scopes_matviews() from public;
 
 comment on function veil2.refresh_scopes_matviews() is
-'Trigger function to refresh all  materialized views and caches that 
-depend on the scopes hierarchy.';
+'Trigger function to update the materialized views and caches that
+depend on the scopes hierarchy.  Only the affected parts of
+all_superior_scopes are updated, and caches are cleared only if the
+scope hierarchy has actually changed.  If the ''deferred matview
+refresh'' system parameter is set, the update is performed once, at
+commit, instead.';
+
+
+\echo ......update_privs_matviews()...
+create or replace
+function veil2.update_privs_matviews()
+  returns trigger
+as
+$$
+declare
+  _roles integer[] := '{}';
+  _all_accessors boolean := false;
+begin
+  -- Identify the directly affected roles from the transition tables.
+  if tg_table_name = 'role_roles' then
+    if tg_op in ('INSERT', 'UPDATE') then
+      _roles := _roles || array(select primary_role_id from new_rows);
+    end if;
+    if tg_op in ('UPDATE', 'DELETE') then
+      _roles := _roles || array(select primary_role_id from old_rows);
+    end if;
+  elsif tg_table_name in ('roles', 'role_privileges') then
+    if tg_op in ('INSERT', 'UPDATE') then
+      _roles := _roles || array(select role_id from new_rows);
+    end if;
+    if tg_op in ('UPDATE', 'DELETE') then
+      _roles := _roles || array(select role_id from old_rows);
+    end if;
+  elsif tg_table_name = 'privileges' and tg_op = 'UPDATE' then
+    -- A modified privilege, eg one with a new promotion scope, affects
+    -- each role to which it has been given.  Until a privilege has
+    -- been given to a role it can be held only by the superuser role.
+    _roles := _roles || array(
+        select rp.role_id
+          from veil2.role_privileges rp
+         where rp.privilege_id in (
+             select privilege_id from old_rows
+              union
+             select privilege_id from new_rows));
+  end if;
+  if tg_table_name = 'roles' then
+    -- A role that is, or was, implicitly assigned affects all
+    -- accessors.
+    if tg_op in ('INSERT', 'UPDATE') then
+      _all_accessors := exists (select null from new_rows where implicit);
+    end if;
+    if tg_op in ('UPDATE', 'DELETE') then
+      _all_accessors := _all_accessors or
+                        exists (select null from old_rows where implicit);
+    end if;
+  end if;
+  if tg_table_name in ('roles', 'privileges') then
+    -- The superuser role is implicitly assigned all non-implicit roles
+    -- and all privileges.
+    _roles := _roles || 1;
+  end if;
+
+  if veil2.deferred_refresh() then
+    perform veil2.defer_refresh('roles', _roles);
+    if _all_accessors then
+      perform veil2.defer_refresh('all accessors');
+    end if;
+    return null;
+  end if;
+  perform veil2.update_role_privileges(_roles);
+  if _all_accessors then
+    delete from veil2.accessor_privileges_cache;
+    perform veil2.clear_shared_privs();
+  else
+    perform veil2.clear_role_accessors_privs(_roles);
+  end if;
+  return null;
+end;
+$$
+language plpgsql security definer volatile;
+
+revoke all on function veil2.update_privs_matviews() from public;
+
+comment on function veil2.update_privs_matviews() is
+'Trigger function to incrementally update all_role_privileges, using
+transition tables to identify the affected roles, and clear the
+cached privileges of just those accessors that hold, directly or
+indirectly, any of those roles.  Truncations are handled by
+refresh_privs_matviews() and refresh_roles_matviews() instead.  If the
+''deferred matview refresh'' system parameter is set, the affected
+roles are recorded and the update is performed once, at commit.';
 
 
 \echo ......refresh_privs_matviews()...
@@ -1885,8 +2676,13 @@ function veil2.refresh_privs_matviews()
 as
 $$
 begin
-  refresh materialized view veil2.all_role_privileges;
-  truncate table veil2.accessor_privileges_cache;
+  if veil2.deferred_refresh() then
+    perform veil2.defer_refresh('all roles');
+    return new;
+  end if;
+  perform veil2.refresh_role_privileges();
+  delete from veil2.accessor_privileges_cache;
+  perform veil2.clear_shared_privs();
   return new;
 end;
 $$
@@ -1895,8 +2691,8 @@ language plpgsql security definer volatile;
 revoke all on function veil2.refresh_privs_matviews() from public;
 
 comment on function veil2.refresh_privs_matviews() is
-'Trigger function to refresh all materialized views and caches that
-depend on privileges.';
+'Trigger function to fully refresh all materialized views and caches
+that depend on privileges.';
 
 
 \echo ......refresh_roles_matviews()...
@@ -1906,8 +2702,13 @@ function veil2.refresh_roles_matviews()
 as
 $$
 begin
-  refresh materialized view veil2.all_role_privileges;
-  truncate table veil2.accessor_privileges_cache;
+  if veil2.deferred_refresh() then
+    perform veil2.defer_refresh('all roles');
+    return new;
+  end if;
+  perform veil2.refresh_role_privileges();
+  delete from veil2.accessor_privileges_cache;
+  perform veil2.clear_shared_privs();
   return new;
 end;
 $$
@@ -1916,8 +2717,8 @@ language plpgsql security definer volatile;
 revoke all on function veil2.refresh_roles_matviews() from public;
 
 comment on function veil2.refresh_roles_matviews() is
-'Trigger function to refresh all materialized views and caches that
-depend on roles.';
+'Trigger function to fully refresh all materialized views and caches
+that depend on roles.';
 
 
 \echo ......clear_accessor_privs_cache()...
@@ -1926,7 +2727,8 @@ function veil2.clear_accessor_privs_cache()
   returns trigger as
 $$
 begin
-  truncate table veil2.accessor_privileges_cache;
+  delete from veil2.accessor_privileges_cache;
+  perform veil2.clear_shared_privs();
   return new;
 end;
 $$
@@ -1948,18 +2750,25 @@ begin
     delete
       from veil2.accessor_privileges_cache
      where accessor_id = new.accessor_id;
+    perform veil2.clear_shared_privs(new.accessor_id);
     if (tg_op = 'UPDATE') and
        (old.accessor_id != new.accessor_id) then
       delete
         from veil2.accessor_privileges_cache
        where accessor_id = old.accessor_id;
+      perform veil2.clear_shared_privs(old.accessor_id);
     end if;
     return new;
   elsif tg_op = 'DELETE' then
     delete
       from veil2.accessor_privileges_cache
      where accessor_id = old.accessor_id;
+    perform veil2.clear_shared_privs(old.accessor_id);
     return old;
+  elsif tg_op = 'TRUNCATE' then
+    delete from veil2.accessor_privileges_cache;
+    perform veil2.clear_shared_privs();
+    return null;
   end if;
 end;
 $$
@@ -1986,58 +2795,194 @@ the scopes table.
 
 VPD Implementation Notes:
 Although we expect that scopes will be modified relatively
-infrequently, this may not be the case in your application.  If the
-overhead of this trigger proves to be too significant it should be
-dropped, and other mechanisms used to refresh the affected materialized
-views.  Note that this will mean that the materialized views will not
-always be up to date, so this is a trade-off that must be evaluated.';
+infrequently, this may not be the case in your application.  This
+trigger updates only those parts of the materialized views that are
+affected by the change, but must still compare veil2.superior_scopes
+with its previous state.  If the overhead of this trigger proves to be
+too significant it should be dropped, and other mechanisms used to
+refresh the affected materialized views.  Note that this will mean
+that the materialized views will not always be up to date, so this is
+a trade-off that must be evaluated.';
 
 
 \echo ......on privileges...
-create trigger privileges__aiudt
-  after insert or update or delete or truncate
+create trigger privileges__ai
+  after insert
+  on veil2.privileges
+  referencing new table as new_rows
+  for each statement
+  execute procedure veil2.update_privs_matviews();
+
+create trigger privileges__au
+  after update
+  on veil2.privileges
+  referencing old table as old_rows new table as new_rows
+  for each statement
+  execute procedure veil2.update_privs_matviews();
+
+create trigger privileges__ad
+  after delete
+  on veil2.privileges
+  referencing old table as old_rows
+  for each statement
+  execute procedure veil2.update_privs_matviews();
+
+comment on trigger privileges__ai on veil2.privileges is
+'Update materialized views that are constructed from the
+privileges table.  Only the superuser role is affected.';
+
+comment on trigger privileges__au on veil2.privileges is
+'Update materialized views that are constructed from the privileges
+table, for the superuser role and any roles that have been given the
+modified privileges.';
+
+comment on trigger privileges__ad on veil2.privileges is
+'Update materialized views that are constructed from the
+privileges table.  Only the superuser role is affected.';
+
+create trigger privileges__at
+  after truncate
   on veil2.privileges
   for each statement
   execute procedure veil2.refresh_privs_matviews();
 
-comment on trigger privileges__aiudt on veil2.privileges is
-'Refresh materialized views that are constructed from the
+comment on trigger privileges__at on veil2.privileges is
+'Fully refresh materialized views that are constructed from the
 privileges table.';
 
 
 \echo ......on roles...
-create trigger roles__aiudt
-  after insert or update or delete or truncate
+create trigger roles__ai
+  after insert
+  on veil2.roles
+  referencing new table as new_rows
+  for each statement
+  execute procedure veil2.update_privs_matviews();
+
+create trigger roles__au
+  after update
+  on veil2.roles
+  referencing old table as old_rows new table as new_rows
+  for each statement
+  execute procedure veil2.update_privs_matviews();
+
+create trigger roles__ad
+  after delete
+  on veil2.roles
+  referencing old table as old_rows
+  for each statement
+  execute procedure veil2.update_privs_matviews();
+
+comment on trigger roles__ai on veil2.roles is
+'Incrementally update materialized views that are constructed from the
+roles table, for just the affected roles.';
+
+comment on trigger roles__au on veil2.roles is
+'Incrementally update materialized views that are constructed from the
+roles table, for just the affected roles.';
+
+comment on trigger roles__ad on veil2.roles is
+'Incrementally update materialized views that are constructed from the
+roles table, for just the affected roles.';
+
+create trigger roles__at
+  after truncate
   on veil2.roles
   for each statement
   execute procedure veil2.refresh_roles_matviews();
 
-comment on trigger roles__aiudt on veil2.roles is
-'Refresh materialized views that are constructed from the
+comment on trigger roles__at on veil2.roles is
+'Fully refresh materialized views that are constructed from the
 roles table.';
 
 
 \echo ......on role_roles...
-create trigger role_roles__aiudt
-  after insert or update or delete or truncate
+create trigger role_roles__ai
+  after insert
+  on veil2.role_roles
+  referencing new table as new_rows
+  for each statement
+  execute procedure veil2.update_privs_matviews();
+
+create trigger role_roles__au
+  after update
+  on veil2.role_roles
+  referencing old table as old_rows new table as new_rows
+  for each statement
+  execute procedure veil2.update_privs_matviews();
+
+create trigger role_roles__ad
+  after delete
+  on veil2.role_roles
+  referencing old table as old_rows
+  for each statement
+  execute procedure veil2.update_privs_matviews();
+
+comment on trigger role_roles__ai on veil2.role_roles is
+'Incrementally update materialized views that are constructed from the
+role_roles table, for just the affected roles.';
+
+comment on trigger role_roles__au on veil2.role_roles is
+'Incrementally update materialized views that are constructed from the
+role_roles table, for just the affected roles.';
+
+comment on trigger role_roles__ad on veil2.role_roles is
+'Incrementally update materialized views that are constructed from the
+role_roles table, for just the affected roles.';
+
+create trigger role_roles__at
+  after truncate
   on veil2.role_roles
   for each statement
   execute procedure veil2.refresh_roles_matviews();
 
-comment on trigger role_roles__aiudt on veil2.role_roles is
-'Refresh materialized views that are constructed from the
+comment on trigger role_roles__at on veil2.role_roles is
+'Fully refresh materialized views that are constructed from the
 role_roles table.';
 
 
 \echo ......on role_privileges...
-create trigger role_privileges__aiudt
-  after insert or update or delete or truncate
+create trigger role_privileges__ai
+  after insert
+  on veil2.role_privileges
+  referencing new table as new_rows
+  for each statement
+  execute procedure veil2.update_privs_matviews();
+
+create trigger role_privileges__au
+  after update
+  on veil2.role_privileges
+  referencing old table as old_rows new table as new_rows
+  for each statement
+  execute procedure veil2.update_privs_matviews();
+
+create trigger role_privileges__ad
+  after delete
+  on veil2.role_privileges
+  referencing old table as old_rows
+  for each statement
+  execute procedure veil2.update_privs_matviews();
+
+comment on trigger role_privileges__ai on veil2.role_privileges is
+'Incrementally update materialized views that are constructed from the
+role_privileges table, for just the affected roles.';
+
+comment on trigger role_privileges__au on veil2.role_privileges is
+'Incrementally update materialized views that are constructed from the
+role_privileges table, for just the affected roles.';
+
+comment on trigger role_privileges__ad on veil2.role_privileges is
+'Incrementally update materialized views that are constructed from the
+role_privileges table, for just the affected roles.';
+
+create trigger role_privileges__at
+  after truncate
   on veil2.role_privileges
   for each statement
   execute procedure veil2.refresh_roles_matviews();
 
-comment on trigger role_privileges__aiudt on veil2.role_privileges is
-'Refresh materialized views that are constructed from the
+comment on trigger role_privileges__at on veil2.role_privileges is
+'Fully refresh materialized views that are constructed from the
 role_privileges table.';
 
 \echo ......on accessor_roles...
@@ -2420,8 +3365,8 @@ $$
 begin
   perform veil2.install_user_functions();
   perform veil2.install_user_views();
-  refresh materialized view veil2.all_superior_scopes;
-  refresh materialized view veil2.all_role_privileges;
+  perform veil2.refresh_superior_scopes();
+  perform veil2.refresh_role_privileges();
 end;
 $$
 language plpgsql security definer volatile;
@@ -2610,7 +3555,7 @@ is an appropriate authentication.';
 create or replace
 function veil2.session_ready() returns boolean
      as '$libdir/veil2', 'veil2_session_ready'
-     language C stable strict;
+     language C stable strict parallel safe;
 
 revoke all on function veil2.session_ready() from public;
 
@@ -2632,9 +3577,9 @@ function veil2.reset_session() returns void
 revoke all on function veil2.reset_session() from public;
 
 comment on function veil2.reset_session() is
-'Ensure our temp tables exist, are of the expected type (temporary
-tables); that the session user has no unexpected access rights on
-them; and clear them.';
+'Clear our in-memory session context and privileges, and mark the
+session as ready for privileges to be loaded.  This performs no
+queries.';
 
 
 \echo ......close_connection()...
@@ -3012,221 +3957,28 @@ gets too large.';
 
 
 
-\echo ......filter_privs()...
-create or replace
-function veil2.filter_privs()
-  returns void as
-$$
-declare
-  _count integer;
-begin
-  -- We are going to update veil2_session_privileges to remove any
-  -- roles and privileges that do not exist in
-  -- veil2_ancestor_privileges.  This is part of the become user
-  -- process, to ensure that become user cannot lead to privilege
-  -- escalation.
-  with updatable_privs as
-    (
-      select sp.scope_type_id, sp.scope_id
-        from veil2.session_privileges() sp
-       where scope_type_id != 2
-    ),
-  superior_scopes as
-    (
-      -- For each scope, other than personal, in
-      -- veil2_session_privileges, identify all scopes that could give
-      -- us equivalent privileges.
-      select up.scope_type_id, up.scope_id,
-      	     asp.scope_type_id as test_scope_type_id,
-	       asp.scope_id as test_scope_id
-        from updatable_privs up
-       inner join veil2.all_superior_scopes asp
-          on asp.scope_type_id = up.scope_type_id
-         and asp.scope_id = up.scope_id
-       union all
-      select scope_type_id, scope_id, scope_type_id, scope_id
-        from updatable_privs
-       union all
-      select scope_type_id, scope_id, 1, 0  -- global scope is superior
-        from updatable_privs
-    ),
-  effective_ancestor_privs as
-    (
-      -- The set of privileges our ancestor effectively has at each
-      -- scope level.  These privileges may be from global or other
-      -- superior scopes.
-      select ss.scope_type_id, ss.scope_id,
-      	     union_of(coalesce(vap.roles, bitmap())) as roles,
-	       union_of(coalesce(vap.privs, bitmap())) as privs
-        from superior_scopes ss
-        left outer join veil2_ancestor_privileges vap
-          on vap.scope_type_id = ss.test_scope_type_id
-	 and vap.scope_id = ss.test_scope_id
-       group by ss.scope_type_id, ss.scope_id
-    ),
-  final_privs as
-    (
-      -- What the become-user session's roles and privs should be
-      -- after filtering any that the ancestor session did not
-      -- effectively have.
-      select sp.scope_type_id, sp.scope_id,
-             sp.roles * eap.roles as roles,
-             sp.privs * eap.privs as privs
-        from veil2.session_privileges() sp
-       inner join effective_ancestor_privs eap
-          on eap.scope_type_id = sp.scope_type_id
-         and eap.scope_id = sp.scope_id
-    ),
-  updates as
-    (
-      select veil2.update_session_privileges(scope_type_id, scope_id,
-					     roles, privs), 1
-        from final_privs
-    )
-  select count(*)::integer
-    into _count
-    from updates;
-end;
-$$
-language plpgsql security definer volatile;
-
-revoke all on function veil2.filter_privs() from public;
-
-comment on function veil2.filter_privs() is
-'Remove any privileges from veil2_session_privileges that would not be
-provided by veil2_ancestor_privileges.  This is part of the become user
-functionality.  We perform this filtering in order to ensure that a
-user cannot increase their privileges using become user.';
-
-
-\echo ......load_ancestor_privs(parent_session_id)...
-create or replace
-function veil2.load_ancestor_privs(parent_session_id bigint)
-  returns void as
-$$
-begin
-  delete
-    from veil2_ancestor_privileges;
-  with recursive ancestors as
-    (
-      select *
-        from veil2.sessions
-       where session_id = load_ancestor_privs.parent_session_id
-       union all
-      select s.*
-        from ancestors a
-       inner join veil2.sessions s
-          on s.session_id = a.parent_session_id
-    ),
-   base_accessor_privs as
-    (
-      select barp.accessor_id, barp.role_id,
-      	     barp.assignment_context_type_id,
-                 barp.assignment_context_id,
-             barp.mapping_context_type_id, barp.mapping_context_id,
-	     barp.roles, barp.privileges
-        from ancestors a
-       -- Making the following an inner join (rather than cross-join)
-       -- even though the condition is redundant improves performance
-       -- (Postgres 12.5).
-       inner join veil2.base_accessor_roleprivs(
-       	     	            a.accessor_id, a.session_context_type_id,
-			    a.session_context_id, a.mapping_context_type_id,
-			    a.mapping_context_id) barp
-          on barp.accessor_id = a.accessor_id
-       where assignment_context_type_id != 2 -- ignore personal context
-    ),
-  promoted_privs as
-    (
-      select bap.accessor_id, bap.role_id,
-      	     bap.mapping_context_type_id, bap.mapping_context_id,
-	     pp.scope_type_id, ss.superior_scope_id as scope_id,
-  	     bap.privileges * pp.privilege_ids as privileges
-        from base_accessor_privs bap
-       inner join veil2.promotable_privileges pp
-          on not is_empty(bap.privileges * pp.privilege_ids)
-         and pp.scope_type_id != 1
-       inner join veil2.all_superior_scopes ss
-          on ss.scope_type_id = bap.assignment_context_type_id
-         and ss.scope_id = bap.assignment_context_id
-         and ss.superior_scope_type_id = pp.scope_type_id
-	 and ss.is_type_promotion
-    ),
-  global_privs as
-    (
-      select bap.accessor_id, bap.role_id,
-      	     bap.mapping_context_type_id, bap.mapping_context_id,
-	     pp.scope_type_id, 0 as scope_id,
-  	     bap.privileges * pp.privilege_ids as privileges
-        from base_accessor_privs bap
-       inner join veil2.promotable_privileges pp
-          on not is_empty(bap.privileges * pp.privilege_ids)
-         and pp.scope_type_id = 1
-    ),  
-  all_role_privs as
-    (
-      select accessor_id, 
-      	     mapping_context_type_id, mapping_context_id,
-  	     assignment_context_type_id as scope_type_id,
-             assignment_context_id as scope_id,
-             roles + role_id as roles,  privileges
-        from base_accessor_privs
-       union all
-      select accessor_id, 
-             mapping_context_type_id, mapping_context_id,
-  	     scope_type_id, scope_id,
-             bitmap() as roles, privileges
-        from promoted_privs
-       union all
-      select accessor_id, 
-             mapping_context_type_id, mapping_context_id,
-  	     scope_type_id, scope_id,
-             bitmap() as roles, privileges
-        from global_privs
-    ),
-  grouped_role_privs as
-    (
-      select scope_type_id, scope_id,
-             union_of(roles) as roles, union_of(privileges) as privs
-        from all_role_privs
-       group by scope_type_id, scope_id
-    )
-  insert
-    into veil2_ancestor_privileges
-        (scope_type_id, scope_id, roles, privs)
-  select scope_type_id, scope_id, roles, privs
-    from grouped_role_privs;
-end;
-$$
-language plpgsql security definer volatile;
-
-revoke all on function veil2.load_ancestor_privs(bigint) from public;
-
-comment on function veil2.load_ancestor_privs(bigint) is
-'Load the privileges for all ancestor sessions into
-veil2_ancestor_privileges.  We will use this to ensure that a
-become_user() session does not gain privileges that the parent session
-did not have (ie we aim to stop it from being used as a mechanism for
-privilege escalation).';
-
-
 \echo ......filter_session_privs(parent_session_id)...
 create or replace
 function veil2.filter_session_privs(parent_session_id bigint)
-  returns void as
-$$
-begin
-  perform veil2.load_ancestor_privs(parent_session_id);
-  perform veil2.filter_privs();
-end;
-$$
-language plpgsql security definer volatile;
+  returns void
+     as '$libdir/veil2', 'veil2_filter_session_privs'
+     language C security definer volatile;
   
 revoke all on function veil2.filter_session_privs(bigint) from public;
 
 comment on function veil2.filter_session_privs(bigint) is
 'Remove from veil2_session_privileges any roles and privileges not
-held by the ancestor session(s).';
+held by the ancestor session(s).  This is part of the become user
+functionality.  We perform this filtering in order to ensure that a
+user cannot increase their privileges using become user.
+
+The privileges of the ancestor sessions are computed in memory, in
+the same way as for compute_session_privileges() except that role
+assignments in personal context are ignored.  They are cached, for
+each parent session, so that re-opening a become user session, or
+nesting become user sessions, need not recompute them.  The cache is
+discarded whenever clear_shared_privs() is called, or the scope
+hierarchy changes.';
 
 
 \echo ......session_privileges_info (view)...
@@ -3261,16 +4013,14 @@ begin
          sc.session_context_id, sc.mapping_context_type_id,
          sc.mapping_context_id, p.scope_type_id,
          p.scope_id, p.roles,
-         p.privileges
+         p.privs
     from veil2.session_context() sc
-   cross join (
-      select *
-        from veil2.session_privileges_v
-       order by scope_type_id, scope_id) p
-   cross join lateral (
-      select veil2.add_session_privileges(p.scope_type_id, p.scope_id,
-                                          p.roles, p.privileges)) asp;
-  return found;
+   cross join veil2.compute_session_privileges(true) p;
+  if found then
+    perform veil2.save_shared_privs();
+    return true;
+  end if;
+  return false;
 end;
 $$
 language plpgsql security definer volatile;
@@ -3278,9 +4028,10 @@ language plpgsql security definer volatile;
 revoke all on function veil2.load_and_cache_session_privs() from public;
 
 comment on function veil2.load_and_cache_session_privs() is
-'Load the in-memory copy of session privileges from
-veil2.session_privileges_v and also cache them in
-veil2.accessor_privileges_cache.';
+'Load the in-memory copy of session privileges using
+veil2.compute_session_privileges() and also cache them in
+veil2.accessor_privileges_cache and, if available, in the shared
+accessor privileges cache.';
 
 
 \echo ......check_continuation()...
@@ -3313,33 +4064,15 @@ create or replace
 function veil2.load_cached_privs()
   returns boolean as
 $$
-declare
-  _count integer;
 begin
-  with privs as
-    (
-      select apc.scope_type_id, apc.scope_id,
-      	 apc.roles, apc.privs
-        from veil2.session_context() sc
-       inner join veil2.accessor_privileges_cache apc
-          on apc.accessor_id = sc.accessor_id
-         and apc.login_context_type_id = sc.login_context_type_id
-         and apc.login_context_id = sc.login_context_id
-         and apc.session_context_type_id = sc.session_context_type_id
-         and apc.session_context_id = sc.session_context_id
-         and apc.mapping_context_type_id = sc.mapping_context_type_id
-         and apc.mapping_context_id = sc.mapping_context_id
-    ),
-  ins as
-    (
-      select veil2.add_session_privileges(scope_type_id, scope_id,
-    	 			          roles, privs)
-        from privs
-    )
-  select count(*)::integer
-    into _count
-    from ins;
-  return _count > 0;
+  if veil2.load_shared_privs() then
+    return true;
+  end if;
+  if veil2.load_cached_session_privs() > 0 then
+    perform veil2.save_shared_privs();
+    return true;
+  end if;
+  return false;
 end;
 $$
 language 'plpgsql' security definer volatile;
@@ -3348,7 +4081,9 @@ revoke all on function veil2.load_cached_privs() from public;
 
 comment on function veil2.load_cached_privs() is
 'Reload cached session privileges for the session''s accessor into our
-current session.';
+current session.  The shared accessor privileges cache is tried first,
+followed by veil2.accessor_privileges_cache.  Privileges found only in
+the latter are copied into the former.';
 
 
 \echo ......update_session()...
@@ -3415,6 +4150,51 @@ being able to do it in pure sql is cool and has the potential to be
 faster as it requires only a single statement.';
 
 
+\echo ......write_back_session()...
+create or replace
+function veil2.write_back_session(
+    _session_id bigint,
+    _expires timestamp with time zone,
+    _nonces integer[])
+  returns void as
+$$
+  with recursive sessions as
+    (
+      select parent_session_id
+        from upd_cur_session
+       union all
+      select s2.parent_session_id
+        from sessions s1
+       inner join veil2.sessions s2
+          on s1.parent_session_id is not null
+	 and s2.session_id = s1.parent_session_id
+	 and s2.parent_session_id is not null
+    ),
+  upd_cur_session as
+    (
+      update veil2.sessions s
+	 set expires = greatest(s.expires, _expires),
+	     nonces = coalesce((select bitmap_of(n)
+	                          from unnest(_nonces) n), s.nonces)
+       where s.session_id = _session_id
+      returning parent_session_id
+    )
+  update veil2.sessions s
+     set expires = greatest(s.expires, _expires)
+   where s.session_id in (select parent_session_id from sessions);
+$$
+language sql security definer volatile;
+
+revoke all on function veil2.write_back_session(
+    bigint, timestamp with time zone, integer[]) from public;
+   
+comment on function veil2.write_back_session(
+    bigint, timestamp with time zone, integer[]) is
+'Write back the expiry time and used nonces of a session from the
+shared session registry to veil2.sessions.  As with update_session(),
+any ancestor sessions have their expiry times extended.';
+
+
 \echo ......load_connection_privs()...
 create or replace
 function veil2.load_connection_privs(
@@ -3491,9 +4271,9 @@ comment on function veil2.reload_connection_privs() is
 cached privileges need to be reloaded.';
 
 
-\echo ......open_connection()...
+\echo ......open_new_connection()...
 create or replace
-function veil2.open_connection(
+function veil2.open_new_connection(
     session_id in bigint,
     nonce in integer,
     authent_token in text,
@@ -3528,7 +4308,7 @@ begin
       on ac.accessor_id = s.accessor_id
      and ac.context_type_id = s.login_context_type_id
      and ac.context_id = s.login_context_id
-   where s.session_id = open_connection.session_id;
+   where s.session_id = open_new_connection.session_id;
 
   if not found then
     raise warning 'SECURITY: Connection attempt with no session: %',
@@ -3593,6 +4373,30 @@ $$
 language plpgsql security definer volatile
 set client_min_messages = 'error';
 
+revoke all on function veil2.open_new_connection(bigint, integer, text) 
+  from public;
+
+comment on function veil2.open_new_connection(bigint, integer, text) is
+'Attempt to open a session.  This is called by
+veil2.open_connection() to handle all cases other than the
+re-opening of an already authenticated session, which
+veil2.open_connection() handles natively.  The parameters, results
+and error messages are the same as for veil2.open_connection().';
+
+
+\echo ......open_connection()...
+create or replace
+function veil2.open_connection(
+    session_id in bigint,
+    nonce in integer,
+    authent_token in text,
+    success out boolean,
+    errmsg out text)
+  returns record
+     as '$libdir/veil2', 'veil2_open_connection'
+     language C security definer volatile
+     set client_min_messages = 'error';
+
 revoke all on function veil2.open_connection(bigint, integer, text) 
   from public;
 
@@ -3631,6 +4435,10 @@ chosen.  See the authentication function for your session''s
 authentication method (identified in table veil2.authentication_types)
 for details.
 
+The re-opening of already authenticated sessions, which happens on
+every request from an application server, is handled natively for
+speed.  All other cases are handled by veil2.open_new_connection().
+
 Note that warning messages will be sent to the log but not to the
 client, even if client_min_messages is modified for the session.  This
 is deliberate, for security reasons.';
@@ -3922,8 +4730,6 @@ username rather than accessor_id.';
 
 
 \echo ...creating veil2 privilege testing functions...
--- Ensure the veil2_session_context and session _privileges temp tables
--- exist as they are needed in order to compile the following functions.
 select veil2.reset_session();
 
 \echo ......true()...
@@ -3931,18 +4737,31 @@ select veil2.reset_session();
 create or replace
 function veil2.always_true(integer) returns boolean
      as '$libdir/veil2', 'veil2_true'
-     language C security definer stable leakproof;
+     language C security definer stable leakproof parallel safe;
 
 comment on function veil2.always_true(integer) is
 'Performance testing function - always returns true.  Used to
 establish the minimum overhead of security policies for tables.';
 
 
+\echo ......privilege_support()...
+create or replace
+function veil2.privilege_support(internal) returns internal
+     as '$libdir/veil2', 'veil2_privilege_support'
+     language C stable;
+
+comment on function veil2.privilege_support(internal) is
+'Planner support function for the privilege testing functions.  This
+provides selectivity estimates, based on the privileges of the
+connected user, and cost estimates.  It is attached to the privilege
+testing functions only for PostgreSQL 12 and above.';
+
+
 \echo ......i_have_global_priv()...
 create or replace
 function veil2.i_have_global_priv(integer) returns boolean
      as '$libdir/veil2', 'veil2_i_have_global_priv'
-     language C security definer stable leakproof;
+     language C security definer stable leakproof parallel safe;
 
 comment on function veil2.i_have_global_priv(integer) is
 'Predicate to determine whether the connected user has the given
@@ -3953,7 +4772,7 @@ privilege in the global scope.';
 create or replace
 function veil2.i_have_personal_priv(integer, integer) returns boolean
      as '$libdir/veil2', 'veil2_i_have_personal_priv'
-     language C security definer stable leakproof;
+     language C security definer stable leakproof parallel safe;
 
 comment on function veil2.i_have_personal_priv(integer, integer) is
 'Predicate to determine whether the connected user has the given
@@ -3964,7 +4783,7 @@ privilege in the personal scope.';
 create or replace
 function veil2.i_have_priv_in_scope(integer, integer, integer) returns boolean
      as '$libdir/veil2', 'veil2_i_have_priv_in_scope'
-     language C security definer stable leakproof;
+     language C security definer stable leakproof parallel safe;
 
 comment on function veil2.i_have_priv_in_scope(integer, integer, integer) is
 'Predicate to determine whether the connected user has the given
@@ -3976,7 +4795,7 @@ create or replace
 function veil2.i_have_priv_in_scope_or_global(
 	     integer, integer, integer) returns boolean
      as '$libdir/veil2', 'veil2_i_have_priv_in_scope_or_global'
-     language C security definer stable leakproof;
+     language C security definer stable leakproof parallel safe;
 
 comment on function veil2.i_have_priv_in_scope(integer, integer, integer) is
 'Predicate to determine whether the connected user has the given
@@ -3988,32 +4807,32 @@ create or replace
 function veil2.i_have_priv_in_superior_scope(integer, integer, integer) 
      returns boolean
      as '$libdir/veil2', 'veil2_i_have_priv_in_superior_scope'
-     language C security definer stable leakproof;
+     language C security definer stable leakproof parallel safe;
 
 comment on function veil2.i_have_priv_in_superior_scope(
 	   	         integer, integer, integer) is
 'Predicate to determine whether the connected user has the given
 privilege in a scope that is superior to the given scope.  This does not
 check for the privilege in a global scope as it is assumed that such a
-test will have already been performed.  Note that due to the join on
-all_superior_scopes this function may incur some small measurable
-overhead.';
+test will have already been performed.  Superior scopes are found
+from an in-memory copy of all_superior_scopes which is reloaded only
+when that table is updated.';
 
 \echo ......i_have_priv_in_scope_or_superior()...
 create or replace
 function veil2.i_have_priv_in_scope_or_superior(integer, integer, integer) 
      returns boolean
      as '$libdir/veil2', 'veil2_i_have_priv_in_scope_or_superior'
-     language C security definer stable leakproof;
+     language C security definer stable leakproof parallel safe;
 
 comment on function veil2.i_have_priv_in_scope_or_superior(
 	   	         integer, integer, integer) is
 'Predicate to determine whether the connected user has the given
 privilege in a scope that is, or is superior to the given scope.  This
 does not check for the privilege in a global scope as it is assumed
-that such a test will have already been performed.  Note that due to
-the join on all_superior_scopes this function may incur some small
-measurable overhead.';
+that such a test will have already been performed.  Superior scopes
+are found from an in-memory copy of all_superior_scopes which is
+reloaded only when that table is updated.';
 
 
 \echo ......i_have_priv_in_scope_or_superior_or_global()...
@@ -4022,7 +4841,7 @@ function veil2.i_have_priv_in_scope_or_superior_or_global(
 	     integer, integer, integer) 
      returns boolean
      as '$libdir/veil2', 'veil2_i_have_priv_in_scope_or_superior_or_global'
-     language C security definer stable leakproof;
+     language C security definer stable leakproof parallel safe;
 
 comment on function veil2.i_have_priv_in_scope_or_superior_or_global(
 	   	         integer, integer, integer) is
@@ -4030,8 +4849,135 @@ comment on function veil2.i_have_priv_in_scope_or_superior_or_global(
 privilege in a scope that is, or is superior to the given scope, or in
 the global scope.  This does not check for the privilege in a global
 scope as it is assumed that such a test will have already been
-performed.  Note that due to the join on all_superior_scopes this
-function may incur some small measurable overhead.';
+performed.  Superior scopes are found from an in-memory copy of
+all_superior_scopes which is reloaded only when that table is
+updated.';
+
+
+\echo ......attaching planner support...
+do
+$$
+declare
+  _fn text;
+begin
+  if current_setting('server_version_num')::integer >= 120000 then
+    foreach _fn in array array[
+        'veil2.i_have_global_priv(integer)',
+        'veil2.i_have_personal_priv(integer, integer)',
+        'veil2.i_have_priv_in_scope(integer, integer, integer)',
+        'veil2.i_have_priv_in_scope_or_global(integer, integer, integer)',
+        'veil2.i_have_priv_in_superior_scope(integer, integer, integer)',
+        'veil2.i_have_priv_in_scope_or_superior(integer, integer, integer)',
+        'veil2.i_have_priv_in_scope_or_superior_or_global(' ||
+            'integer, integer, integer)']
+    loop
+      execute 'alter function ' || _fn ||
+              ' support veil2.privilege_support';
+    end loop;
+  end if;
+end;
+$$;
+
+
+\echo ......i_have_priv_in_scopes()...
+create or replace
+function veil2.i_have_priv_in_scopes(integer, integer, integer[])
+     returns boolean[]
+     as '$libdir/veil2', 'veil2_i_have_priv_in_scopes'
+     language C security definer stable leakproof parallel safe;
+
+comment on function veil2.i_have_priv_in_scopes(
+	   	         integer, integer, integer[]) is
+'Determine whether the connected user has the given privilege in each
+of an array of scopes of the given scope type.  Returns an array of
+booleans corresponding to the supplied array of scope ids.  This is
+much faster than calling i_have_priv_in_scope() for each scope.';
+
+
+\echo ......filter_scopes_with_priv()...
+create or replace
+function veil2.filter_scopes_with_priv(integer, integer, integer[])
+     returns integer[]
+     as '$libdir/veil2', 'veil2_filter_scopes_with_priv'
+     language C security definer stable leakproof parallel safe;
+
+comment on function veil2.filter_scopes_with_priv(
+	   	         integer, integer, integer[]) is
+'Return the subset of the supplied array of scope ids, of the given
+scope type, in which the connected user has the given privilege.';
+
+
+\echo ......my_scopes()...
+create or replace
+function veil2.my_scopes(integer, integer)
+     returns integer[]
+     as '$libdir/veil2', 'veil2_my_scopes'
+     language C security definer stable leakproof parallel safe;
+
+comment on function veil2.my_scopes(integer, integer) is
+'Return the array of scope ids, of the given scope type, in which the
+connected user has the given privilege, either directly, through
+promotion, or through a superior scope.  Global privileges are not
+considered.  This allows security policies to be written in a form
+that can use indexes, eg:
+
+  using (veil2.i_have_global_priv(25) or
+         project_id = any(veil2.my_scopes(25, 5)))
+
+The result is built only once for each call site in a query, and is
+rebuilt only when session privileges or the scope hierarchy change.';
+
+
+\echo ......i_have_any_priv()...
+create or replace
+function veil2.i_have_any_priv(text, variadic integer[])
+     returns boolean
+     as '$libdir/veil2', 'veil2_i_have_any_priv'
+     language C security definer stable parallel safe;
+
+comment on function veil2.i_have_any_priv(text, integer[]) is
+'Predicate to determine whether the connected user satisfies any of
+the terms of a policy.  This allows a security policy that ORs
+together several privilege tests to be evaluated in a single call,
+eg:
+
+  using (veil2.i_have_any_priv(
+             ''scope_or_global(21, 3), scope(21, 4), personal(21)'',
+             corp_id, org_id, party_id))
+
+is equivalent to:
+
+  using (   veil2.i_have_priv_in_scope_or_global(21, 3, corp_id)
+         or veil2.i_have_priv_in_scope(21, 4, org_id)
+         or veil2.i_have_personal_priv(21, party_id))
+
+Each term names a privilege testing function, without its i_have_ and
+priv_in_ prefixes, giving the privilege and, except for global() and
+personal(), the scope type.  The available terms are global(),
+personal(), scope(), scope_or_global(), superior(),
+scope_or_superior() and scope_or_superior_or_global().  Each term,
+other than global(), takes the next of the scope ids, or for
+personal() the accessor id.  A term whose scope id is null is
+satisfied only by its global test, if it has one, as is the
+equivalent function.  Each distinct scope is looked up only once, and
+superior scopes are searched only if no other term is satisfied.  The
+policy is parsed only once for each call site.
+
+Unlike the other privilege testing functions, this is not leakproof:
+an invalid policy, or the wrong number of scope ids, raises an error
+that reveals its arguments.';
+
+create or replace
+function veil2.i_have_any_priv(text)
+     returns boolean
+     as '$libdir/veil2', 'veil2_i_have_any_priv'
+     language C security definer stable parallel safe;
+
+comment on function veil2.i_have_any_priv(text) is
+'As i_have_any_priv(text, variadic integer[]), for a policy consisting
+only of global() terms, which take no scope ids, eg:
+
+  using (veil2.i_have_any_priv(''global(21), global(22)''))';
 
 
 \echo ......result_counts()...
@@ -4048,11 +4994,209 @@ returned by the i_have_privi_xxx() functions in this session';
 revoke all on function veil2.result_counts() from public;
 
 
+\echo ......function_stats()...
+create or replace
+function veil2.function_stats(
+    function_name out text, calls out bigint,
+    true_count out bigint, false_count out bigint,
+    memo_hits out bigint, context_lookups out bigint,
+    context_cache_hits out bigint, index_probes out bigint,
+    superior_lookups out bigint, bsearch_probes out bigint,
+    hierarchy_loads out bigint, total_time out float8)
+     returns setof record
+     as '$libdir/veil2', 'veil2_function_stats'
+     language C security definer volatile;
+
+comment on function veil2.function_stats() is
+'Return statistics for each of the privilege testing functions,
+accumulated across all backends (if veil2 is in
+shared_preload_libraries, otherwise for this backend only), since they
+were last reset.  Statistics from other backends are included only
+once their transactions have completed.  The counts are:
+
+  calls              - number of calls;
+  true_count         - number of true results (for each element of the
+                       array for i_have_priv_in_scopes() and
+                       filter_scopes_with_priv());
+  false_count        - number of false results;
+  memo_hits          - results found in the per-call-site memo;
+  context_lookups    - searches for a security context in the session
+                       privileges;
+  context_cache_hits - searches satisfied from the cached last context;
+  index_probes       - slots examined in the session privileges index;
+  superior_lookups   - searches for superior scopes;
+  bsearch_probes     - probes of the binary search of the scope
+                       hierarchy;
+  hierarchy_loads    - (re)loads of the scope hierarchy using SPI;
+  total_time         - total time in milliseconds, recorded only if
+                       veil2.track_timing is on.
+
+The row for function_name ''internal'' gives counts from calls made
+outside of the privilege testing functions, eg when loading session
+privileges.';
+
+revoke all on function veil2.function_stats() from public;
+
+
+\echo ......session_stats()...
+create or replace
+function veil2.session_stats(
+    opens out bigint, registry_hits out bigint,
+    shared_cache_hits out bigint, shared_cache_misses out bigint,
+    computes out bigint, computed_contexts out bigint,
+    contexts_loaded out bigint, compute_time out float8,
+    open_time out float8, stats_reset out timestamptz)
+     returns record
+     as '$libdir/veil2', 'veil2_session_stats'
+     language C security definer volatile;
+
+comment on function veil2.session_stats() is
+'Return statistics for session handling, accumulated in the same way
+as for veil2.function_stats().  The counts are:
+
+  opens               - calls to open_connection();
+  registry_hits       - sessions re-opened from the shared session
+                        registry;
+  shared_cache_hits   - session privileges found in the shared
+                        privileges cache;
+  shared_cache_misses - session privileges not found in the shared
+                        privileges cache;
+  computes            - computations of session privileges (the
+                        equivalent of querying
+                        veil2.session_privileges_v);
+  computed_contexts   - security contexts returned by those
+                        computations;
+  contexts_loaded     - security contexts loaded into session
+                        privileges;
+  compute_time        - time in milliseconds spent computing session
+                        privileges (if veil2.track_timing is on);
+  open_time           - time in milliseconds spent in open_connection()
+                        (if veil2.track_timing is on);
+  stats_reset         - when the statistics were last reset.';
+
+revoke all on function veil2.session_stats() from public;
+
+
+\echo ......reset_stats()...
+create or replace
+function veil2.reset_stats() returns void
+     as '$libdir/veil2', 'veil2_reset_stats'
+     language C security definer volatile;
+
+comment on function veil2.reset_stats() is
+'Reset the statistics returned by veil2.function_stats() and
+veil2.session_stats().';
+
+revoke all on function veil2.reset_stats() from public;
+
+
+\echo ......stat_functions...
+create or replace
+view veil2.stat_functions as
+select * from veil2.function_stats();
+
+comment on view veil2.stat_functions is
+'Statistics for each of the privilege testing functions.  See
+veil2.function_stats() for details.';
+
+revoke all on veil2.stat_functions from public;
+
+
+\echo ......stat_sessions...
+create or replace
+view veil2.stat_sessions as
+select * from veil2.session_stats();
+
+comment on view veil2.stat_sessions is
+'Statistics for session handling.  See veil2.session_stats() for
+details.';
+
+revoke all on veil2.stat_sessions from public;
+
+
 \echo ...creating veil2 admin and helper functions...
+\echo ......flush_sessions()...
+create or replace
+function veil2.flush_sessions(expired_only boolean default false)
+  returns integer
+     as '$libdir/veil2', 'veil2_flush_sessions'
+     language C security definer volatile;
+
+revoke all on function veil2.flush_sessions(boolean) from public;
+
+comment on function veil2.flush_sessions(boolean) is
+'Write back the expiry times and used nonces of sessions in the shared
+session registry to veil2.sessions.  This is done lazily by
+open_connection(), so veil2.sessions may not be up to date.  You
+should call this before a planned server shutdown, as the registry is
+held only in memory.  If expired_only is true, only sessions whose
+expiry time as recorded in veil2.sessions has passed are written back.
+This is all that is needed before deleting expired sessions.  Returns
+the number of sessions written.';
+
+
+\echo ......forget_sessions()...
+create or replace
+function veil2.forget_sessions(session_ids bigint[] default null)
+  returns void
+     as '$libdir/veil2', 'veil2_forget_sessions'
+     language C security definer volatile;
+
+revoke all on function veil2.forget_sessions(bigint[]) from public;
+
+comment on function veil2.forget_sessions(bigint[]) is
+'Remove the given sessions, or if session_ids is null, all sessions,
+from the shared session registry.';
+
+
+\echo ......sessions_deleted()...
+create or replace
+function veil2.sessions_deleted()
+  returns trigger as
+$$
+begin
+  if tg_op = 'TRUNCATE' then
+    perform veil2.forget_sessions();
+  else
+    perform veil2.forget_sessions(array_agg(session_id))
+       from old_sessions;
+  end if;
+  return null;
+end;
+$$
+language plpgsql security definer volatile;
+
+revoke all on function veil2.sessions_deleted() from public;
+
+comment on function veil2.sessions_deleted() is
+'Trigger function to remove deleted sessions from the shared session
+registry.';
+
+create trigger sessions__ad
+  after delete
+  on veil2.sessions
+  referencing old table as old_sessions
+  for each statement
+  execute procedure veil2.sessions_deleted();
+
+comment on trigger sessions__ad on veil2.sessions is
+'Remove deleted sessions from the shared session registry.';
+
+create trigger sessions__at
+  after truncate
+  on veil2.sessions
+  for each statement
+  execute procedure veil2.sessions_deleted();
+
+comment on trigger sessions__at on veil2.sessions is
+'Remove all sessions from the shared session registry.';
+
+
 \echo ......delete_expired_sessions()...
 create or replace
 function veil2.delete_expired_sessions() returns void as
 $$
+select veil2.flush_sessions(true);
 delete
   from veil2.sessions s
      where expires <= now();
@@ -4061,7 +5205,109 @@ language 'sql' security definer volatile;
 
 comment on function veil2.delete_expired_sessions() is
 'Utility function to clean-up  session data.  This should be
-run periodically from a batch job.';
+run periodically from a batch job.  Sessions in the shared session
+registry whose recorded expiry times have passed are first written
+back to veil2.sessions so that sessions that are still active are not
+deleted.';
+
+
+\echo ......sweep_expired_sessions()...
+create or replace
+function veil2.sweep_expired_sessions(batch_size integer)
+  returns integer as
+$$
+declare
+  _count integer;
+begin
+  perform veil2.flush_sessions(true);
+  with expired as
+    (
+      select session_id
+        from veil2.sessions
+       where expires <= now()
+       limit batch_size
+         for update skip locked
+    )
+  delete
+    from veil2.sessions s
+   where s.session_id in (select session_id from expired);
+  get diagnostics _count = row_count;
+  return _count;
+end;
+$$
+language plpgsql security definer volatile;
+
+revoke all on function veil2.sweep_expired_sessions(integer) from public;
+
+comment on function veil2.sweep_expired_sessions(integer) is
+'Delete up to batch_size expired sessions, returning the number
+deleted.  This is used by the veil2 background worker which, by
+deleting sessions in small batches, keeps its transactions short.
+Sessions locked by other transactions are skipped.  Only those
+registered sessions whose recorded expiry times have passed are
+written back first, so that other sessions remain lazily written.';
+
+
+\echo ......prewarm_privs_cache()...
+create or replace
+function veil2.prewarm_privs_cache(max_entries integer)
+  returns integer as
+$$
+declare
+  _count integer := 0;
+  rec record;
+begin
+  for rec in
+    select s.accessor_id, max(s.session_id) as session_id,
+           s.login_context_type_id, s.login_context_id,
+           s.session_context_type_id, s.session_context_id,
+           s.mapping_context_type_id, s.mapping_context_id
+      from veil2.sessions s
+     where s.has_authenticated
+       and s.expires > now()
+       and not exists (
+             select null
+               from veil2.accessor_privileges_cache apc
+              where apc.accessor_id = s.accessor_id
+                and apc.login_context_type_id = s.login_context_type_id
+                and apc.login_context_id = s.login_context_id
+                and apc.session_context_type_id = s.session_context_type_id
+                and apc.session_context_id = s.session_context_id
+                and apc.mapping_context_type_id = s.mapping_context_type_id
+                and apc.mapping_context_id = s.mapping_context_id)
+     group by s.accessor_id,
+              s.login_context_type_id, s.login_context_id,
+              s.session_context_type_id, s.session_context_id,
+              s.mapping_context_type_id, s.mapping_context_id
+     order by max(s.expires) desc
+     limit max_entries
+  loop
+    perform veil2.session_context(
+                rec.accessor_id, rec.session_id,
+                rec.login_context_type_id, rec.login_context_id,
+                rec.session_context_type_id, rec.session_context_id,
+                rec.mapping_context_type_id, rec.mapping_context_id);
+    perform veil2.load_shared_privs();
+    if veil2.load_and_cache_session_privs() then
+      _count := _count + 1;
+    end if;
+  end loop;
+  perform veil2.reset_session();
+  return _count;
+end;
+$$
+language plpgsql security definer volatile;
+
+revoke all on function veil2.prewarm_privs_cache(integer) from public;
+
+comment on function veil2.prewarm_privs_cache(integer) is
+'Load, into veil2.accessor_privileges_cache and the shared accessor
+privileges cache, the privileges for up to max_entries of the most
+recently active combinations of accessor and session contexts that are
+not already cached.  This is used by the veil2 background worker so
+that, following the clearing of the caches, accessors re-opening
+sessions do not have to wait for their privileges to be recomputed.
+Returns the number of entries loaded.';
 
 
 \echo ......bcrypt()...
@@ -4209,7 +5455,8 @@ insert into veil2.system_parameters
        (parameter_name, parameter_value)
 values ('shared session timeout', '20 mins'),
        ('mapping context target scope type', '1'),
-       ('error on uninitialized session', true);
+       ('error on uninitialized session', true),
+       ('deferred matview refresh', false);
 
 
 -- Create security for vpd tables.
@@ -4781,7 +6028,7 @@ begin
     ok := false;
     return next 'You need to redefine the superior_scopes view (step 6)';
   else
-    execute('refresh materialized view veil2.all_superior_scopes');
+    perform veil2.refresh_superior_scopes();
   end if;
   if not veil2.have_user_privileges() then
     ok := false;
@@ -0,0 +1,227 @@
+/**
+ * @file   parallel.c
+ * \code
+ *     Author:       Marc Munro
+ *     Copyright (c) 2021 Marc Munro
+ *     License:      GPL V3
+ *
+ * \endcode
+ * @brief
+ * Provides our session state to parallel query workers, so that the
+ * privilege testing functions may be declared parallel safe.
+ *
+ * Session context and privileges are held in backend-local memory,
+ * which parallel workers do not share.  Before starting the execution
+ * of any plan that may use parallel workers, we copy our session
+ * state into a dynamic shared memory segment, and record that
+ * segment's handle in the veil2.parallel_state GUC.  As with all
+ * GUCs, this is copied into each worker when it starts.  The first
+ * time that a worker needs its session state, it attaches to the
+ * segment and restores it.
+ *
+ * The segment is re-used for as long as the session state does not
+ * change, so that parallel queries do not each create a new one.
+ *
+ * The veil2.parallel_state GUC may only be set by us, or by the
+ * parallel worker startup code, so a user cannot provide workers with
+ * some other session's state.
+ */
+
+#include "postgres.h"
+#include "access/parallel.h"
+#include "executor/executor.h"
+#include "storage/dsm.h"
+#include "utils/guc.h"
+
+#include "veil2.h"
+
+
+/**
+ * The value of the veil2.parallel_state GUC.  This is empty, or has
+ * the form "handle:generation".
+ */
+static char *parallel_state = NULL;
+
+/**
+ * Set while we are setting veil2.parallel_state, so that our check
+ * hook can distinguish our own changes from those of a user.
+ */
+static bool setting_parallel_state = false;
+
+/**
+ * The segment containing the most recently shipped session state.
+ * This is pinned so that it survives until we replace it, or the
+ * backend exits.
+ */
+static dsm_segment *state_segment = NULL;
+
+/**
+ * The session state generation, from veil2_session_state_generation(),
+ * of the contents of ::state_segment.
+ */
+static uint64 state_generation = 0;
+
+/**
+ * Whether a parallel worker has restored its session state from the
+ * leader.
+ */
+static bool state_restored = false;
+
+static ExecutorStart_hook_type prev_ExecutorStart = NULL;
+
+
+/**
+ * GUC check hook for veil2.parallel_state.  This allows the value to
+ * be set only by shipSessionState() or when a parallel worker is
+ * restoring its leader's GUCs.
+ *
+ * @param newval Unused
+ * @param extra Unused
+ * @param source The source of the new value.
+ *
+ * @return true if the new value may be accepted.
+ */
+static bool
+check_parallel_state(char **newval, void **extra, GucSource source)
+{
+	if (setting_parallel_state || InitializingParallelWorker ||
+		(source == PGC_S_DEFAULT))
+	{
+		return true;
+	}
+	GUC_check_errdetail("veil2.parallel_state may not be set directly.");
+	return false;
+}
+
+/**
+ * Copy our session state into a dynamic shared memory segment, unless
+ * the current segment is still up to date, and record the segment in
+ * veil2.parallel_state.
+ */
+static void
+shipSessionState()
+{
+	uint64 generation = veil2_session_state_generation();
+	dsm_segment *segment;
+	Size size;
+	char value[64];
+
+	if (!state_segment || (state_generation != generation)) {
+		if (state_segment) {
+			dsm_detach(state_segment);
+			state_segment = NULL;
+		}
+		size = veil2_session_state_size();
+		segment = dsm_create(size, 0);
+		dsm_pin_mapping(segment);
+		veil2_session_state_pack(dsm_segment_address(segment), size);
+		state_segment = segment;
+		state_generation = generation;
+	}
+
+	snprintf(value, sizeof(value), "%u:" UINT64_FORMAT,
+			 (uint32) dsm_segment_handle(state_segment), state_generation);
+	if (parallel_state && (strcmp(parallel_state, value) == 0)) {
+		/* The value may differ if a previous setting was undone by
+		 * a transaction abort. */
+		return;
+	}
+
+	setting_parallel_state = true;
+	PG_TRY();
+	{
+		(void) set_config_option("veil2.parallel_state", value,
+								 PGC_SUSET, PGC_S_SESSION,
+								 GUC_ACTION_SET, true, 0, false);
+	}
+	PG_CATCH();
+	{
+		setting_parallel_state = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	setting_parallel_state = false;
+}
+
+/**
+ * ExecutorStart hook.  If the plan may use parallel workers, we ship
+ * our session state before execution begins, as GUCs may not be
+ * changed once we have entered parallel mode.
+ *
+ * @param queryDesc The query to be executed.
+ * @param eflags Executor flags.
+ */
+static void
+veil2_ExecutorStart(QueryDesc *queryDesc, int eflags)
+{
+	if (queryDesc->plannedstmt->parallelModeNeeded &&
+		!(eflags & EXEC_FLAG_EXPLAIN_ONLY) &&
+		!IsInParallelMode())
+	{
+		shipSessionState();
+	}
+	if (prev_ExecutorStart) {
+		prev_ExecutorStart(queryDesc, eflags);
+	}
+	else {
+		standard_ExecutorStart(queryDesc, eflags);
+	}
+}
+
+/**
+ * In a parallel worker, restore the session state shipped by our
+ * leader.  This does nothing except on the first call, or if there
+ * is no shipped state, in which case the worker's session is, like
+ * the leader's, not ready.
+ */
+void
+veil2_parallel_restore(void)
+{
+	uint32 handle;
+	dsm_segment *segment;
+
+	if (state_restored || !IsParallelWorker()) {
+		return;
+	}
+	state_restored = true;
+	if (!(parallel_state && *parallel_state)) {
+		return;
+	}
+	if (sscanf(parallel_state, "%u:", &handle) != 1) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("Invalid veil2.parallel_state: \"%s\"",
+						parallel_state)));
+	}
+	segment = dsm_attach((dsm_handle) handle);
+	if (!segment) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("Unable to attach to veil2 session state for "
+						"parallel worker")));
+	}
+	veil2_session_state_unpack(dsm_segment_address(segment));
+	dsm_detach(segment);
+}
+
+/**
+ * Define the veil2.parallel_state GUC and install our ExecutorStart
+ * hook.  This must be called from _PG_init(), before
+ * veil2_shmem_init() reserves the veil2 GUC prefix.
+ */
+void
+veil2_parallel_init(void)
+{
+	DefineCustomStringVariable("veil2.parallel_state",
+							   "Session state for parallel query workers.",
+							   "This is set internally and may not be "
+							   "set directly.",
+							   &parallel_state,
+							   "",
+							   PGC_SUSET,
+							   GUC_NO_SHOW_ALL | GUC_NO_RESET_ALL |
+							   GUC_NOT_IN_SAMPLE | GUC_DISALLOW_IN_FILE,
+							   check_parallel_state, NULL, NULL);
+	prev_ExecutorStart = ExecutorStart_hook;
+	ExecutorStart_hook = veil2_ExecutorStart;
+}
@@ -0,0 +1,1042 @@
+/**
+ * @file   privs.c
+ * \code
+ *     Author:       Marc Munro
+ *     Copyright (c) 2021 Marc Munro
+ *     License:      GPL V3
+ *
+ * \endcode
+ * @brief
+ * Native computation of session privileges.
+ *
+ * This performs the same computation as veil2.session_privileges_v,
+ * but rather than having Postgres evaluate a large query with
+ * multiple CTEs, grouping and connect-privilege subqueries, we fetch
+ * the accessor's base role assignments and privileges, and the
+ * promotable privileges, in two simple queries and do the rest in
+ * memory, using the in-memory scope hierarchy from scopes.c for
+ * privilege promotion.
+ *
+ * The results must be identical to those from
+ * veil2.session_privileges_v.  The unit tests compare the two.
+ *
+ * Bitmap operations are performed using the pgbitmap operator
+ * functions, so that we do not depend on pgbitmap's internal
+ * representation.  These are looked up once per backend, in the
+ * pgbitmap extension's own schema rather than through search_path,
+ * and are looked up again only if pg_proc changes.
+ *
+ * We also provide for the bulk loading of previously computed
+ * session privileges from veil2.accessor_privileges_cache, in a
+ * single query, rather than row by row through
+ * veil2.add_session_privileges().
+ *
+ * Finally, for become_user() sessions, we compute the combined
+ * privileges of the ancestor sessions, and filter the new session's
+ * privileges so that it has none that its ancestors did not.  This
+ * is the equivalent of what was once done by
+ * veil2.load_ancestor_privs() and veil2.filter_privs() using a
+ * temporary table.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "access/genam.h"
+#include "access/htup_details.h"
+#if PG_VERSION_NUM >= 120000
+#include "access/table.h"
+#else
+#include "access/heapam.h"
+#define table_open(r, l) heap_open(r, l)
+#define table_close(r, l) heap_close(r, l)
+#endif
+#include "catalog/indexing.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_extension.h"
+#include "catalog/pg_type.h"
+#include "executor/spi.h"
+#include "nodes/makefuncs.h"
+#include "parser/parse_func.h"
+#include "parser/parse_type.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/fmgroids.h"
+#include "utils/memutils.h"
+#include "utils/rel.h"
+#include "utils/syscache.h"
+
+#include "veil2.h"
+
+
+/**
+ * The pgbitmap functions that we need in order to manipulate bitmaps.
+ */
+typedef struct {
+	/** bitmap + bitmap: union */
+	FmgrInfo union_fn;
+	/** bitmap * bitmap: intersection */
+	FmgrInfo intersect_fn;
+	/** bitmap + integer: set a bit */
+	FmgrInfo setbit_fn;
+	/** is_empty(bitmap) */
+	FmgrInfo is_empty_fn;
+	/** An empty bitmap */
+	Bitmap *empty;
+	/** Whether the above have been looked up */
+	bool valid;
+} BitmapOps;
+
+/**
+ * Our pgbitmap functions, looked up by getBitmapOps().  These are
+ * allocated in TopMemoryContext and invalidated by bitmap_ops_inval().
+ */
+static BitmapOps bitmap_ops;
+
+/**
+ * A single role assignment for the accessor, with the roles and
+ * privileges that it provides, as returned by
+ * veil2.base_accessor_roleprivs().
+ */
+typedef struct {
+	int assignment_context_type;
+	int assignment_context;
+	int role_id;
+	Bitmap *roles;
+	Bitmap *privileges;
+} BaseRolePrivs;
+
+/**
+ * A set of privileges that may be promoted to a given scope type, as
+ * returned by veil2.promotable_privileges.
+ */
+typedef struct {
+	int scope_type;
+	Bitmap *privileges;
+} PromotablePrivs;
+
+/**
+ * Our working state, used by the Fetch_fn()s below to record query
+ * results.
+ */
+typedef struct {
+	/** The memory context into which query results are copied, so
+	 * that they survive veil2_spi_finish() */
+	MemoryContext context;
+	BitmapOps *ops;
+	/** Whether role assignments in personal context are to be
+	 * ignored, as they are for ancestor privileges */
+	bool exclude_personal;
+	int nbase;
+	int maxbase;
+	BaseRolePrivs *base;
+	int npromotable;
+	PromotablePrivs *promotable;
+	/** Our results, ungrouped and then grouped */
+	int nresults;
+	int maxresults;
+	ContextRolePrivs *results;
+} SessionPrivsState;
+
+
+/**
+ * Return a copy of a bitmap from an SPI result, in our state's memory
+ * context.
+ *
+ * @param state Our ::SessionPrivsState
+ * @param tuple  The ::HeapTuple returned from a Postgres SPI query.
+ * @param tupdesc The ::TupleDesc returned from the same query
+ * @param col The column containing the bitmap.
+ *
+ * @return The copied bitmap, or NULL if the column was null.
+ */
+static Bitmap *
+copyBitmapCol(SessionPrivsState *state, HeapTuple tuple,
+			  TupleDesc tupdesc, int col)
+{
+	bool isnull;
+	Datum datum = SPI_getbinval(tuple, tupdesc, col, &isnull);
+	MemoryContext old_context;
+	Bitmap *result;
+
+	if (isnull) {
+		return NULL;
+	}
+	old_context = MemoryContextSwitchTo(state->context);
+	result = (Bitmap *) PG_DETOAST_DATUM_COPY(datum);
+	MemoryContextSwitchTo(old_context);
+	return result;
+}
+
+/**
+ * Fetch_fn() for recording rows from veil2.base_accessor_roleprivs().
+ *
+ * @param tuple  The ::HeapTuple returned from a Postgres SPI query.
+ * This contains 3 integers and 2 bitmaps.
+ * @param tupdesc The ::TupleDesc returned from the same Postgres SPI query
+ * @param p_result Pointer to our ::SessionPrivsState.
+ *
+ * @return <code>bool</code> true, indicating to veil2_query() that
+ * more rows are expected.
+ */
+static bool
+fetch_base_roleprivs(HeapTuple tuple, TupleDesc tupdesc, void *p_result)
+{
+	SessionPrivsState *state = (SessionPrivsState *) p_result;
+	BaseRolePrivs *this;
+	bool isnull1;
+	bool isnull2;
+	bool isnull3;
+
+	if (state->nbase >= state->maxbase) {
+		/* The query has already been executed, so SPI_processed
+		 * tells us how many more rows we need.  We may be called for
+		 * several queries, so must allow for rows from previous
+		 * ones. */
+		state->maxbase = state->nbase + (int) SPI_processed;
+		if (state->base) {
+			state->base = (BaseRolePrivs *) repalloc(
+				state->base, sizeof(BaseRolePrivs) * state->maxbase);
+		}
+		else {
+			state->base = (BaseRolePrivs *) MemoryContextAlloc(
+				state->context, sizeof(BaseRolePrivs) * state->maxbase);
+		}
+	}
+	this = &(state->base[state->nbase]);
+	this->assignment_context_type = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 1, &isnull1));
+	this->assignment_context = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 2, &isnull2));
+	this->role_id = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 3, &isnull3));
+	if (isnull1 || isnull2 || isnull3) {
+		/* As with the view, such rows can never be grouped into a
+		 * useful scope. */
+		return true;
+	}
+	if (state->exclude_personal && (this->assignment_context_type == 2)) {
+		return true;
+	}
+	this->roles = copyBitmapCol(state, tuple, tupdesc, 4);
+	this->privileges = copyBitmapCol(state, tuple, tupdesc, 5);
+	state->nbase++;
+	return true;
+}
+
+/**
+ * Fetch_fn() for recording rows from veil2.promotable_privileges.
+ *
+ * @param tuple  The ::HeapTuple returned from a Postgres SPI query.
+ * This contains an integer and a bitmap.
+ * @param tupdesc The ::TupleDesc returned from the same Postgres SPI query
+ * @param p_result Pointer to our ::SessionPrivsState.
+ *
+ * @return <code>bool</code> true, indicating to veil2_query() that
+ * more rows are expected.
+ */
+static bool
+fetch_promotable_privs(HeapTuple tuple, TupleDesc tupdesc, void *p_result)
+{
+	SessionPrivsState *state = (SessionPrivsState *) p_result;
+	PromotablePrivs *this;
+	bool isnull;
+
+	if (!state->promotable) {
+		state->promotable = (PromotablePrivs *) MemoryContextAlloc(
+			state->context, sizeof(PromotablePrivs) * SPI_processed);
+	}
+	this = &(state->promotable[state->npromotable]);
+	this->scope_type = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 1, &isnull));
+	this->privileges = copyBitmapCol(state, tuple, tupdesc, 2);
+	if (!isnull && this->privileges) {
+		state->npromotable++;
+	}
+	return true;
+}
+
+/**
+ * Syscache callback for pg_proc.  If pgbitmap is re-installed, its
+ * function oids will change, so we must look them up again.
+ *
+ * @param arg Unused.
+ * @param cacheid Unused.
+ * @param hashvalue Unused.
+ */
+static void
+bitmap_ops_inval(Datum arg, int cacheid, uint32 hashvalue)
+{
+	bitmap_ops.valid = false;
+}
+
+/**
+ * Return the name of the schema into which the pgbitmap extension
+ * has been installed.
+ *
+ * @return The schema name, palloc'd.
+ */
+static char *
+pgbitmapSchema()
+{
+	Relation rel;
+	ScanKeyData key;
+	SysScanDesc scan;
+	HeapTuple tuple;
+	Oid nsp = InvalidOid;
+
+	rel = table_open(ExtensionRelationId, AccessShareLock);
+	ScanKeyInit(&key, Anum_pg_extension_extname, BTEqualStrategyNumber,
+				F_NAMEEQ, CStringGetDatum("pgbitmap"));
+	scan = systable_beginscan(rel, ExtensionNameIndexId, true,
+							  NULL, 1, &key);
+	if (HeapTupleIsValid(tuple = systable_getnext(scan))) {
+		nsp = ((Form_pg_extension) GETSTRUCT(tuple))->extnamespace;
+	}
+	systable_endscan(scan);
+	table_close(rel, AccessShareLock);
+
+	if (!OidIsValid(nsp)) {
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_OBJECT),
+				 errmsg("Unable to find the pgbitmap extension")));
+	}
+	return get_namespace_name(nsp);
+}
+
+/**
+ * Return the qualified name of an object in the pgbitmap schema.
+ *
+ * @param schema The name of the pgbitmap extension's schema.
+ * @param name The unqualified name.
+ *
+ * @return The qualified name, as a List of String nodes.
+ */
+static List *
+bitmapName(char *schema, char *name)
+{
+	return list_make2(makeString(schema), makeString(name));
+}
+
+/**
+ * Return the oid of the function implementing a pgbitmap operator.
+ *
+ * @param schema The name of the pgbitmap extension's schema.
+ * @param opname The operator name.
+ * @param left The operator's left argument type.
+ * @param right The operator's right argument type.
+ *
+ * @return The function oid.
+ */
+static Oid
+bitmapOperatorFn(char *schema, char *opname, Oid left, Oid right)
+{
+	Oid opr = OpernameGetOprid(bitmapName(schema, opname), left, right);
+
+	if (!OidIsValid(opr)) {
+		ereport(ERROR,
+				(errcode(ERRCODE_UNDEFINED_FUNCTION),
+				 errmsg("Unable to find pgbitmap functions in "
+						"veil2_compute_session_privs()")));
+	}
+	return get_opcode(opr);
+}
+
+/**
+ * Return the pgbitmap functions that we need, looking them up if
+ * necessary.  The lookups are made in the schema of the pgbitmap
+ * extension, so that they cannot be affected by search_path, and
+ * require no SPI queries.
+ *
+ * @return Our ::BitmapOps.
+ */
+static BitmapOps *
+getBitmapOps()
+{
+	static bool callback_registered = false;
+	char *schema;
+	Oid bitmap_oid;
+	Oid argtypes[2];
+	Oid empty_fn;
+	MemoryContext old_context;
+
+	if (bitmap_ops.valid) {
+		return &bitmap_ops;
+	}
+	if (!callback_registered) {
+		CacheRegisterSyscacheCallback(PROCOID, bitmap_ops_inval, (Datum) 0);
+		callback_registered = true;
+	}
+
+	schema = pgbitmapSchema();
+	bitmap_oid = LookupTypeNameOid(
+		NULL, makeTypeNameFromNameList(bitmapName(schema, "bitmap")),
+		false);
+	argtypes[0] = bitmap_oid;
+	empty_fn = LookupFuncName(bitmapName(schema, "bitmap"),
+							  0, argtypes, false);
+
+	fmgr_info_cxt(bitmapOperatorFn(schema, "+", bitmap_oid, bitmap_oid),
+				  &bitmap_ops.union_fn, TopMemoryContext);
+	fmgr_info_cxt(bitmapOperatorFn(schema, "*", bitmap_oid, bitmap_oid),
+				  &bitmap_ops.intersect_fn, TopMemoryContext);
+	fmgr_info_cxt(bitmapOperatorFn(schema, "+", bitmap_oid, INT4OID),
+				  &bitmap_ops.setbit_fn, TopMemoryContext);
+	fmgr_info_cxt(LookupFuncName(bitmapName(schema, "is_empty"),
+								 1, argtypes, false),
+				  &bitmap_ops.is_empty_fn, TopMemoryContext);
+
+	old_context = MemoryContextSwitchTo(TopMemoryContext);
+	if (bitmap_ops.empty) {
+		pfree(bitmap_ops.empty);
+	}
+	bitmap_ops.empty = (Bitmap *) PG_DETOAST_DATUM_COPY(
+		OidFunctionCall0Coll(empty_fn, InvalidOid));
+	MemoryContextSwitchTo(old_context);
+	bitmap_ops.valid = true;
+	return &bitmap_ops;
+}
+
+/**
+ * Fetch the base role assignments, with their roles and privileges,
+ * for an accessor's session, adding them to those already in our
+ * state.  We must already be connected to SPI.
+ *
+ * @param state Our ::SessionPrivsState.
+ * @param key Identifies the accessor and the contexts for their
+ * session.
+ */
+static void
+fetchBaseRolePrivs(SessionPrivsState *state, PrivsCacheKey *key)
+{
+	static void *base_plan = NULL;
+	Oid argtypes[] = {INT4OID, INT4OID, INT4OID, INT4OID, INT4OID};
+	Datum args[5];
+
+	args[0] = Int32GetDatum(key->accessor_id);
+	args[1] = Int32GetDatum(key->session_context_type_id);
+	args[2] = Int32GetDatum(key->session_context_id);
+	args[3] = Int32GetDatum(key->mapping_context_type_id);
+	args[4] = Int32GetDatum(key->mapping_context_id);
+
+	(void) veil2_query(
+		"select assignment_context_type_id, assignment_context_id,"
+		"       role_id, roles, privileges"
+		"  from veil2.base_accessor_roleprivs($1, $2, $3, $4, $5)",
+		5, argtypes, args,
+		true, &base_plan,
+		fetch_base_roleprivs, (void *) state);
+}
+
+/**
+ * Fetch the promotable privileges for each scope type.  We must
+ * already be connected to SPI.
+ *
+ * @param state Our ::SessionPrivsState.
+ */
+static void
+fetchPromotablePrivs(SessionPrivsState *state)
+{
+	static void *promotable_plan = NULL;
+
+	(void) veil2_query(
+		"select scope_type_id, privilege_ids"
+		"  from veil2.promotable_privileges",
+		0, NULL, NULL,
+		true, &promotable_plan,
+		fetch_promotable_privs, (void *) state);
+}
+
+/**
+ * Fetch, using SPI, everything that we need from the database in
+ * order to compute session privileges.
+ *
+ * @param state Our ::SessionPrivsState.
+ * @param key Identifies the accessor and the contexts for their
+ * session.
+ */
+static void
+fetchSessionPrivsData(SessionPrivsState *state, PrivsCacheKey *key)
+{
+	bool pushed;
+
+	state->ops = getBitmapOps();
+	veil2_spi_connect(&pushed, "failed to compute session privileges (1)");
+	fetchBaseRolePrivs(state, key);
+	fetchPromotablePrivs(state);
+	veil2_spi_finish(pushed, "failed to compute session privileges (2)");
+}
+
+/**
+ * Return the union of 2 bitmaps.
+ */
+static Bitmap *
+bitmapUnionOf(BitmapOps *ops, Bitmap *bitmap1, Bitmap *bitmap2)
+{
+	return (Bitmap *) DatumGetPointer(
+		FunctionCall2(&ops->union_fn, PointerGetDatum(bitmap1),
+					  PointerGetDatum(bitmap2)));
+}
+
+/**
+ * Return the intersection of 2 bitmaps.
+ */
+static Bitmap *
+bitmapIntersectionOf(BitmapOps *ops, Bitmap *bitmap1, Bitmap *bitmap2)
+{
+	return (Bitmap *) DatumGetPointer(
+		FunctionCall2(&ops->intersect_fn, PointerGetDatum(bitmap1),
+					  PointerGetDatum(bitmap2)));
+}
+
+/**
+ * Return a copy of a bitmap with an additional bit set.
+ */
+static Bitmap *
+bitmapWithBit(BitmapOps *ops, Bitmap *bitmap, int bit)
+{
+	return (Bitmap *) DatumGetPointer(
+		FunctionCall2(&ops->setbit_fn, PointerGetDatum(bitmap),
+					  Int32GetDatum(bit)));
+}
+
+/**
+ * Predicate identifying whether a bitmap has no bits set.
+ */
+static bool
+bitmapIsEmpty(BitmapOps *ops, Bitmap *bitmap)
+{
+	return DatumGetBool(
+		FunctionCall1(&ops->is_empty_fn, PointerGetDatum(bitmap)));
+}
+
+/**
+ * Add an ungrouped (scope, roles, privileges) result to our state.
+ *
+ * @param state Our ::SessionPrivsState.
+ * @param scope_type The scope_type_id for the result.
+ * @param scope The scope_id for the result.
+ * @param roles The roles for the result.
+ * @param privs The privileges for the result.
+ */
+static void
+addResult(SessionPrivsState *state, int scope_type, int scope,
+		  Bitmap *roles, Bitmap *privs)
+{
+	ContextRolePrivs *this;
+
+	if (state->nresults >= state->maxresults) {
+		state->maxresults = state->maxresults ? state->maxresults * 2 : 64;
+		if (state->results) {
+			state->results = (ContextRolePrivs *) repalloc(
+				state->results, sizeof(ContextRolePrivs) * state->maxresults);
+		}
+		else {
+			state->results = (ContextRolePrivs *) MemoryContextAlloc(
+				state->context, sizeof(ContextRolePrivs) * state->maxresults);
+		}
+	}
+	this = &(state->results[state->nresults]);
+	this->scope_type = scope_type;
+	this->scope = scope;
+	this->roles = roles;
+	this->privileges = privs;
+	state->nresults++;
+}
+
+/**
+ * Compare 2 ::ContextRolePrivs entries by scope_type and scope, for
+ * qsort() and bsearch().
+ */
+static int
+cmp_roleprivs(const void *a, const void *b)
+{
+	const ContextRolePrivs *rp1 = (const ContextRolePrivs *) a;
+	const ContextRolePrivs *rp2 = (const ContextRolePrivs *) b;
+
+	if (rp1->scope_type != rp2->scope_type) {
+		return (rp1->scope_type < rp2->scope_type) ? -1 : 1;
+	}
+	if (rp1->scope != rp2->scope) {
+		return (rp1->scope < rp2->scope) ? -1 : 1;
+	}
+	return 0;
+}
+
+/**
+ * Build the ungrouped set of session privileges.  This is the
+ * equivalent of the all_role_privs CTE in
+ * veil2.session_privileges_v, with its promoted_privs and global_privs
+ * parts.
+ *
+ * @param state Our ::SessionPrivsState.
+ */
+static void
+buildResults(SessionPrivsState *state)
+{
+	BitmapOps *ops = state->ops;
+	BaseRolePrivs *base;
+	PromotablePrivs *pp;
+	Bitmap *promoted;
+	ScopeKey *superiors;
+	bool *promotions;
+	int count;
+	int i;
+	int j;
+	int k;
+
+	for (i = 0; i < state->nbase; i++) {
+		base = &(state->base[i]);
+		addResult(state, base->assignment_context_type,
+				  base->assignment_context,
+				  bitmapWithBit(ops, base->roles ? base->roles : ops->empty,
+								base->role_id),
+				  base->privileges ? base->privileges : ops->empty);
+		if (!base->privileges) {
+			continue;
+		}
+
+		count = -1;
+		for (j = 0; j < state->npromotable; j++) {
+			pp = &(state->promotable[j]);
+			promoted = bitmapIntersectionOf(ops, base->privileges,
+											pp->privileges);
+			if (bitmapIsEmpty(ops, promoted)) {
+				continue;
+			}
+			if (pp->scope_type == 1) {
+				/* Global privileges are promoted regardless of the
+				 * scope hierarchy. */
+				addResult(state, 1, 0, ops->empty, promoted);
+				continue;
+			}
+			if (count < 0) {
+				count = veil2_superior_scopes(
+					base->assignment_context_type,
+					base->assignment_context,
+					&superiors, &promotions);
+			}
+			for (k = 0; k < count; k++) {
+				if (promotions[k] &&
+					(superiors[k].scope_type == pp->scope_type))
+				{
+					addResult(state, superiors[k].scope_type,
+							  superiors[k].scope, ops->empty, promoted);
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Group our results by scope, forming the union of roles and
+ * privileges for each scope.  This is the equivalent of the
+ * grouped_role_privs CTE in veil2.session_privileges_v.  On return,
+ * results are sorted by scope_type and scope.
+ *
+ * @param state Our ::SessionPrivsState.
+ */
+static void
+groupResults(SessionPrivsState *state)
+{
+	BitmapOps *ops = state->ops;
+	ContextRolePrivs *this;
+	ContextRolePrivs *last = NULL;
+	int ngroups = 0;
+	int i;
+
+	if (state->nresults == 0) {
+		return;
+	}
+	qsort((void *) state->results, state->nresults,
+		  sizeof(ContextRolePrivs), cmp_roleprivs);
+	for (i = 0; i < state->nresults; i++) {
+		this = &(state->results[i]);
+		if (last && (cmp_roleprivs(last, this) == 0)) {
+			last->roles = bitmapUnionOf(ops, last->roles, this->roles);
+			last->privileges = bitmapUnionOf(ops, last->privileges,
+											 this->privileges);
+		}
+		else {
+			last = &(state->results[ngroups]);
+			if (last != this) {
+				*last = *this;
+			}
+			ngroups++;
+		}
+	}
+	state->nresults = ngroups;
+}
+
+/**
+ * Predicate identifying whether the session's grouped privileges
+ * include connect privilege in the given scope.
+ *
+ * @param state Our ::SessionPrivsState, with grouped results.
+ * @param scope_type The scope_type_id of the scope to check.
+ * @param scope The scope_id of the scope to check.
+ *
+ * @return true if we have connect privilege in the scope.
+ */
+static bool
+haveConnectInScope(SessionPrivsState *state, int scope_type, int scope)
+{
+	ContextRolePrivs key;
+	ContextRolePrivs *found;
+
+	key.scope_type = scope_type;
+	key.scope = scope;
+	found = (ContextRolePrivs *) bsearch(
+		(void *) &key, (void *) state->results, state->nresults,
+		sizeof(ContextRolePrivs), cmp_roleprivs);
+	return found && bitmapTestbit(found->privileges, 0);
+}
+
+/**
+ * Predicate identifying whether the session's grouped privileges
+ * include connect privilege in the given scope, or in any scope
+ * superior to it.  This is the equivalent of the have_login_connect
+ * and have_session_connect CTEs in veil2.session_privileges_v.
+ *
+ * @param state Our ::SessionPrivsState, with grouped results.
+ * @param scope_type The scope_type_id of the scope to check.
+ * @param scope The scope_id of the scope to check.
+ *
+ * @return true if we have connect privilege.
+ */
+static bool
+haveConnectIn(SessionPrivsState *state, int scope_type, int scope)
+{
+	ScopeKey *superiors;
+	int count;
+	int i;
+
+	if (haveConnectInScope(state, scope_type, scope)) {
+		return true;
+	}
+	count = veil2_superior_scopes(scope_type, scope, &superiors, NULL);
+	for (i = 0; i < count; i++) {
+		if (haveConnectInScope(state, superiors[i].scope_type,
+							   superiors[i].scope)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Compute the roles and privileges, in each scope, for a session.
+ * This gives the same results as veil2.session_privileges_v, which
+ * relies on the session context having been set, as it must also be
+ * here.  If the accessor does not have connect privilege in both the
+ * login and session contexts (or globally), no results are returned.
+ *
+ * @param key Identifies the accessor and the contexts for their
+ * session.
+ * @param p_result Pointer into which the address of a palloc'd array
+ * of results, sorted by scope_type and scope, will be returned.  The
+ * bitmaps in the results are also palloc'd in the current memory
+ * context.
+ *
+ * @return The number of results.
+ */
+int
+veil2_compute_session_privs(PrivsCacheKey *key, ContextRolePrivs **p_result)
+{
+	SessionPrivsState state;
+	instr_time start;
+
+	if (veil2_track_timing) {
+		INSTR_TIME_SET_CURRENT(start);
+	}
+	memset((void *) &state, 0, sizeof(state));
+	state.context = CurrentMemoryContext;
+	fetchSessionPrivsData(&state, key);
+	buildResults(&state);
+	groupResults(&state);
+
+	if (!(haveConnectInScope(&state, 1, 0) ||
+		  (haveConnectIn(&state, key->login_context_type_id,
+						 key->login_context_id) &&
+		   haveConnectIn(&state, key->session_context_type_id,
+						 key->session_context_id))))
+	{
+		state.nresults = 0;
+	}
+	SESSION_STAT(SESSTAT_COMPUTES)++;
+	SESSION_STAT(SESSTAT_COMPUTED_CONTEXTS) += state.nresults;
+	if (veil2_track_timing) {
+		SESSION_STAT(SESSTAT_COMPUTE_TIME) += veil2_stat_elapsed(&start);
+	}
+	*p_result = state.results;
+	return state.nresults;
+}
+
+/**
+ * Fetch_fn() for recording rows from veil2.accessor_privileges_cache.
+ *
+ * @param tuple  The ::HeapTuple returned from a Postgres SPI query.
+ * This contains 2 integers and 2 bitmaps.
+ * @param tupdesc The ::TupleDesc returned from the same Postgres SPI query
+ * @param p_result Pointer to our ::SessionPrivsState.
+ *
+ * @return <code>bool</code> true, indicating to veil2_query() that
+ * more rows are expected.
+ */
+static bool
+fetch_cached_roleprivs(HeapTuple tuple, TupleDesc tupdesc, void *p_result)
+{
+	SessionPrivsState *state = (SessionPrivsState *) p_result;
+	bool isnull;
+	int scope_type;
+	int scope;
+
+	if (!state->results) {
+		/* Size our results array for the whole query result, so
+		 * that addResult() need never extend it. */
+		state->maxresults = (int) SPI_processed;
+		state->results = (ContextRolePrivs *) MemoryContextAlloc(
+			state->context, sizeof(ContextRolePrivs) * state->maxresults);
+	}
+	scope_type = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+	scope = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+	addResult(state, scope_type, scope,
+			  copyBitmapCol(state, tuple, tupdesc, 3),
+			  copyBitmapCol(state, tuple, tupdesc, 4));
+	return true;
+}
+
+/**
+ * Sort our results by scope and remove any duplicates.  As
+ * veil2.accessor_privileges_cache has no primary key, concurrent
+ * sessions for the same accessor may each have cached the same
+ * privileges.  Such duplicates are identical, so we simply keep the
+ * first.
+ *
+ * @param state Our ::SessionPrivsState.
+ */
+static void
+dedupResults(SessionPrivsState *state)
+{
+	int nkept = 0;
+	int i;
+
+	if (state->nresults == 0) {
+		return;
+	}
+	qsort((void *) state->results, state->nresults,
+		  sizeof(ContextRolePrivs), cmp_roleprivs);
+	for (i = 0; i < state->nresults; i++) {
+		if ((nkept == 0) ||
+			(cmp_roleprivs(&(state->results[nkept - 1]),
+						   &(state->results[i])) != 0))
+		{
+			if (nkept != i) {
+				state->results[nkept] = state->results[i];
+			}
+			nkept++;
+		}
+	}
+	state->nresults = nkept;
+}
+
+/**
+ * Fetch the previously computed roles and privileges for a session
+ * from veil2.accessor_privileges_cache, in a single query.
+ *
+ * @param key Identifies the accessor and the contexts for their
+ * session.
+ * @param p_result Pointer into which the address of a palloc'd array
+ * of results, sorted by scope_type and scope, and without
+ * duplicates, will be returned.  The bitmaps in the results are also
+ * palloc'd in the current memory context.
+ *
+ * @return The number of results.
+ */
+int
+veil2_fetch_cached_session_privs(PrivsCacheKey *key,
+								 ContextRolePrivs **p_result)
+{
+	static void *saved_plan = NULL;
+	Oid argtypes[] = {INT4OID, INT4OID, INT4OID, INT4OID,
+					  INT4OID, INT4OID, INT4OID};
+	Datum args[7];
+	SessionPrivsState state;
+	bool pushed;
+
+	memset((void *) &state, 0, sizeof(state));
+	state.context = CurrentMemoryContext;
+	args[0] = Int32GetDatum(key->accessor_id);
+	args[1] = Int32GetDatum(key->login_context_type_id);
+	args[2] = Int32GetDatum(key->login_context_id);
+	args[3] = Int32GetDatum(key->session_context_type_id);
+	args[4] = Int32GetDatum(key->session_context_id);
+	args[5] = Int32GetDatum(key->mapping_context_type_id);
+	args[6] = Int32GetDatum(key->mapping_context_id);
+
+	veil2_spi_connect(&pushed, "failed to fetch cached privileges (1)");
+	(void) veil2_query(
+		"select scope_type_id, scope_id, roles, privs"
+		"  from veil2.accessor_privileges_cache"
+		" where accessor_id = $1"
+		"   and login_context_type_id = $2"
+		"   and login_context_id = $3"
+		"   and session_context_type_id = $4"
+		"   and session_context_id = $5"
+		"   and mapping_context_type_id = $6"
+		"   and mapping_context_id = $7",
+		7, argtypes, args,
+		true, &saved_plan,
+		fetch_cached_roleprivs, (void *) &state);
+	veil2_spi_finish(pushed, "failed to fetch cached privileges (2)");
+
+	dedupResults(&state);
+	*p_result = state.results;
+	return state.nresults;
+}
+
+/**
+ * Compute the combined roles and privileges, in each scope, of a
+ * chain of ancestor sessions, for become_user().  This is computed in
+ * the same way as session privileges, except that role assignments
+ * in personal context are ignored and there is no connect privilege
+ * check.  The results may be combined with those already computed
+ * for the rest of the chain, so that nested become_user() sessions
+ * need not recompute them.
+ *
+ * @param keys Array identifying the accessor and the contexts for
+ * each ancestor session.
+ * @param nkeys The number of entries in keys.
+ * @param inherited Previously computed ancestor privileges, for the
+ * ancestors of the sessions in keys, sorted by scope_type and scope.
+ * These will be included in the results.
+ * @param ninherited The number of entries in inherited.
+ * @param p_result Pointer into which the address of a palloc'd array
+ * of results, sorted by scope_type and scope, will be returned.  The
+ * bitmaps in the results are also palloc'd in the current memory
+ * context.
+ *
+ * @return The number of results.
+ */
+int
+veil2_compute_ancestor_privs(PrivsCacheKey *keys, int nkeys,
+							 ContextRolePrivs *inherited, int ninherited,
+							 ContextRolePrivs **p_result)
+{
+	SessionPrivsState state;
+	bool pushed;
+	int i;
+
+	memset((void *) &state, 0, sizeof(state));
+	state.context = CurrentMemoryContext;
+	state.exclude_personal = true;
+
+	state.ops = getBitmapOps();
+	veil2_spi_connect(&pushed, "failed to compute ancestor privileges (1)");
+	for (i = 0; i < nkeys; i++) {
+		fetchBaseRolePrivs(&state, &(keys[i]));
+	}
+	fetchPromotablePrivs(&state);
+	veil2_spi_finish(pushed, "failed to compute ancestor privileges (2)");
+
+	buildResults(&state);
+	for (i = 0; i < ninherited; i++) {
+		addResult(&state, inherited[i].scope_type, inherited[i].scope,
+				  inherited[i].roles, inherited[i].privileges);
+	}
+	groupResults(&state);
+	*p_result = state.results;
+	return state.nresults;
+}
+
+/**
+ * Add the roles and privileges that our ancestors have in a given
+ * scope to an accumulating set.
+ *
+ * @param state Our ::SessionPrivsState, whose results are the
+ * ancestor privileges.
+ * @param scope_type The scope_type_id of the scope.
+ * @param scope The scope_id of the scope.
+ * @param p_roles Pointer to the accumulating roles bitmap.
+ * @param p_privs Pointer to the accumulating privileges bitmap.
+ */
+static void
+addAncestorScope(SessionPrivsState *state, int scope_type, int scope,
+				 Bitmap **p_roles, Bitmap **p_privs)
+{
+	ContextRolePrivs key;
+	ContextRolePrivs *found;
+
+	key.scope_type = scope_type;
+	key.scope = scope;
+	found = (ContextRolePrivs *) bsearch(
+		(void *) &key, (void *) state->results, state->nresults,
+		sizeof(ContextRolePrivs), cmp_roleprivs);
+	if (found) {
+		*p_roles = bitmapUnionOf(state->ops, *p_roles, found->roles);
+		*p_privs = bitmapUnionOf(state->ops, *p_privs, found->privileges);
+	}
+}
+
+/**
+ * Filter a become_user() session's privileges, removing any roles
+ * and privileges that its ancestor sessions did not effectively have.
+ * For each scope, other than personal scope, the effective ancestor
+ * privileges are those that the ancestors have in that scope, in any
+ * superior scope, or globally.  This ensures that become_user()
+ * cannot be used for privilege escalation.
+ *
+ * @param session The session's privileges.
+ * @param nsession The number of entries in session.
+ * @param ancestors The ancestor privileges from
+ * veil2_compute_ancestor_privs().
+ * @param nancestors The number of entries in ancestors.
+ * @param p_result Pointer into which the address of a palloc'd array
+ * of filtered privileges, in the same order as session, will be
+ * returned.  New bitmaps are palloc'd in the current memory context,
+ * but those for personal scope are the originals from session.
+ */
+void
+veil2_filter_privs(ContextRolePrivs *session, int nsession,
+				   ContextRolePrivs *ancestors, int nancestors,
+				   ContextRolePrivs **p_result)
+{
+	SessionPrivsState state;
+	ContextRolePrivs *result;
+	ScopeKey *superiors;
+	Bitmap *roles;
+	Bitmap *privs;
+	int count;
+	int i;
+	int j;
+
+	memset((void *) &state, 0, sizeof(state));
+	state.context = CurrentMemoryContext;
+	state.ops = getBitmapOps();
+	state.results = ancestors;
+	state.nresults = nancestors;
+
+	result = (ContextRolePrivs *) palloc(
+		sizeof(ContextRolePrivs) * (nsession + 1));
+	for (i = 0; i < nsession; i++) {
+		result[i] = session[i];
+		if (session[i].scope_type == 2) {
+			continue;
+		}
+		roles = state.ops->empty;
+		privs = state.ops->empty;
+		addAncestorScope(&state, session[i].scope_type, session[i].scope,
+						 &roles, &privs);
+		count = veil2_superior_scopes(session[i].scope_type,
+									  session[i].scope, &superiors, NULL);
+		for (j = 0; j < count; j++) {
+			addAncestorScope(&state, superiors[j].scope_type,
+							 superiors[j].scope, &roles, &privs);
+		}
+		addAncestorScope(&state, 1, 0, &roles, &privs);
+		result[i].roles = bitmapIntersectionOf(state.ops,
+											   session[i].roles, roles);
+		result[i].privileges = bitmapIntersectionOf(
+			state.ops, session[i].privileges, privs);
+	}
+	*p_result = result;
+}
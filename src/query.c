@@ -238,7 +238,7 @@ veil2_query(const char *qry,
  * \return false.  This causes ::veil2_query to terminate after processing a
  * single row.
  */
-static bool
+bool
 fetch_one_bool(HeapTuple tuple, TupleDesc tupdesc, void *p_result)
 {
 	bool is_null = false;
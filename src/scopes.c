@@ -0,0 +1,410 @@
+/**
+ * @file   scopes.c
+ * \code
+ *     Author:       Marc Munro
+ *     Copyright (c) 2021 Marc Munro
+ *     License:      GPL V3
+ *
+ * \endcode
+ * @brief
+ * Provides an in-memory copy of the scope hierarchy, as recorded in
+ * veil2.all_superior_scopes.  This allows the superior scope
+ * privilege testing functions to do their work without SPI queries.
+ *
+ * The hierarchy is loaded, in a single query, the first time it is
+ * needed.  It is discarded whenever we receive a relcache
+ * invalidation for veil2.all_superior_scopes, and will be lazily
+ * reloaded the next time it is needed.  As ordinary DML does not
+ * cause relcache invalidations, veil2.update_superior_scopes() and
+ * veil2.refresh_superior_scopes() explicitly request one by calling
+ * veil2_scope_hierarchy_changed().
+ *
+ */
+
+#include "postgres.h"
+#include "catalog/namespace.h"
+#include "executor/spi.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+#include "veil2.h"
+
+
+PG_FUNCTION_INFO_V1(veil2_scope_hierarchy_changed);
+
+
+/**
+ * Records the superior scopes for a single scope.  The superior
+ * scopes themselves are stored contiguously in
+ * ScopeHierarchy->superiors.
+ */
+typedef struct {
+	/** The scope_type_id of the scope */
+	int scope_type;
+	/** The scope_id of the scope */
+	int scope;
+	/** Index of the first superior scope in ScopeHierarchy->superiors */
+	int first;
+	/** How many superior scopes this scope has */
+	int count;
+} ScopeSuperiors;
+
+/**
+ * The in-memory copy of veil2.all_superior_scopes.  Scopes are sorted
+ * by scope_type_id and scope_id so that they may be bsearched.
+ */
+typedef struct {
+	/** Memory context for all hierarchy data.  This is reset on each
+	 * reload.  */
+	MemoryContext context;
+	/** Whether the hierarchy may be used, or must first be
+	 * (re)loaded. */
+	bool valid;
+	/** Oid of the veil2.all_superior_scopes matview, used to identify
+	 * relevant relcache invalidations. */
+	Oid relid;
+	/** The number of entries in scopes */
+	int nscopes;
+	/** Array of scopes that have superiors */
+	ScopeSuperiors *scopes;
+	/** The number of entries in superiors */
+	int nsuperiors;
+	/** Array of all superior scopes, grouped by inferior scope */
+	ScopeKey *superiors;
+	/** Whether each entry in superiors is a type promotion, as
+	 * recorded in all_superior_scopes.is_type_promotion */
+	bool *promotions;
+} ScopeHierarchy;
+
+/**
+ * Our backend's copy of the scope hierarchy.
+ */
+static ScopeHierarchy hierarchy = {NULL, false, InvalidOid,
+								   0, NULL, 0, NULL, NULL};
+
+/**
+ * Incremented each time the hierarchy is invalidated.  This allows
+ * callers to identify whether results derived from the hierarchy may
+ * be stale.
+ */
+static uint64 hierarchy_generation = 1;
+
+
+/**
+ * Relcache invalidation callback.  If the invalidation is for
+ * veil2.all_superior_scopes, or for all relations, we mark our
+ * in-memory hierarchy as invalid.  We do not free anything here: the
+ * memory will be re-used when the hierarchy is next loaded.
+ *
+ * @param arg Unused
+ * @param relid The Oid of the invalidated relation, or InvalidOid if
+ * all relations are being invalidated.
+ */
+static void
+scope_hierarchy_inval(Datum arg, Oid relid)
+{
+	if ((relid == InvalidOid) || (relid == hierarchy.relid)) {
+		hierarchy.valid = false;
+		hierarchy_generation++;
+	}
+}
+
+/**
+ * Ensure that we will be notified of invalidations of
+ * veil2.all_superior_scopes.  This must be done before any result
+ * that depends on the hierarchy is derived, whether or not the
+ * hierarchy itself has yet been loaded.
+ */
+static void
+registerHierarchyCallback()
+{
+	static bool callback_registered = false;
+
+	if (!callback_registered) {
+		CacheRegisterRelcacheCallback(scope_hierarchy_inval, (Datum) 0);
+		callback_registered = true;
+	}
+	if (!OidIsValid(hierarchy.relid)) {
+		hierarchy.relid = get_relname_relid(
+			"all_superior_scopes", get_namespace_oid("veil2", false));
+		/* We may have missed invalidations until now. */
+		hierarchy.valid = false;
+		hierarchy_generation++;
+	}
+}
+
+/**
+ * Fetch_fn() for loading superior scopes rows from
+ * veil2.all_superior_scopes into ::hierarchy.  Rows must be provided
+ * in scope_type_id, scope_id order.
+ *
+ * @param tuple  The ::HeapTuple returned from a Postgres SPI query.
+ * This will contain a tuple of 4 integers and a boolean.
+ * @param tupdesc The ::TupleDesc returned from the same Postgres SPI query
+ * @param p_result Unused.
+ *
+ * @return <code>bool</code> true, indicating to veil2_query() that
+ * more rows are expected.
+ */
+static bool
+fetch_superior_scope(HeapTuple tuple, TupleDesc tupdesc, void *p_result)
+{
+	bool isnull1;
+	bool isnull2;
+	bool isnull3;
+	bool isnull4;
+	bool isnull5;
+	int scope_type;
+	int scope;
+	ScopeSuperiors *this;
+	ScopeKey *superior;
+
+	if (!hierarchy.superiors) {
+		/* The query has already been executed, so SPI_processed gives
+		 * us an upper bound for the size of both of our arrays. */
+		hierarchy.scopes = (ScopeSuperiors *) MemoryContextAlloc(
+			hierarchy.context, sizeof(ScopeSuperiors) * SPI_processed);
+		hierarchy.superiors = (ScopeKey *) MemoryContextAlloc(
+			hierarchy.context, sizeof(ScopeKey) * SPI_processed);
+		hierarchy.promotions = (bool *) MemoryContextAlloc(
+			hierarchy.context, sizeof(bool) * SPI_processed);
+	}
+
+	scope_type = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 1, &isnull1));
+	scope = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 2, &isnull2));
+	superior = &(hierarchy.superiors[hierarchy.nsuperiors]);
+	superior->scope_type = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 3, &isnull3));
+	superior->scope = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 4, &isnull4));
+	hierarchy.promotions[hierarchy.nsuperiors] = DatumGetBool(
+		SPI_getbinval(tuple, tupdesc, 5, &isnull5));
+	if (isnull1 || isnull2 || isnull3 || isnull4 || isnull5) {
+		/* Incomplete rows can never match anything. */
+		return true;
+	}
+
+	/* Rows are ordered by scope, so we only need to check whether
+	 * this row is for the same scope as the last. */
+	this = NULL;
+	if (hierarchy.nscopes) {
+		this = &(hierarchy.scopes[hierarchy.nscopes - 1]);
+	}
+	if (!(this && (this->scope_type == scope_type) &&
+		  (this->scope == scope)))
+	{
+		this = &(hierarchy.scopes[hierarchy.nscopes]);
+		hierarchy.nscopes++;
+		this->scope_type = scope_type;
+		this->scope = scope;
+		this->first = hierarchy.nsuperiors;
+		this->count = 0;
+	}
+	this->count++;
+	hierarchy.nsuperiors++;
+	return true;
+}
+
+/**
+ * (Re)load the scope hierarchy from veil2.all_superior_scopes.
+ */
+static void
+load_scope_hierarchy()
+{
+	static void *saved_plan = NULL;
+	bool pushed;
+
+	registerHierarchyCallback();
+	FN_STAT(FNSTAT_HIERARCHY_LOADS)++;
+	if (hierarchy.context) {
+		MemoryContextReset(hierarchy.context);
+	}
+	else {
+		hierarchy.context = AllocSetContextCreate(TopMemoryContext,
+												  "veil2 scope hierarchy",
+												  ALLOCSET_DEFAULT_SIZES);
+	}
+	hierarchy.nscopes = 0;
+	hierarchy.scopes = NULL;
+	hierarchy.nsuperiors = 0;
+	hierarchy.superiors = NULL;
+	hierarchy.promotions = NULL;
+
+	/* Mark the hierarchy as valid before we run the query.  If an
+	 * invalidation is received while we are loading, we want to
+	 * reload again next time. */
+	hierarchy.valid = true;
+	veil2_spi_connect(&pushed, "failed to load scope hierarchy (1)");
+	hierarchy.relid = get_relname_relid("all_superior_scopes",
+										get_namespace_oid("veil2", false));
+	PG_TRY();
+	{
+		(void) veil2_query(
+			"select scope_type_id, scope_id,"
+			"       superior_scope_type_id, superior_scope_id,"
+			"       is_type_promotion"
+			"  from veil2.all_superior_scopes"
+			" order by 1, 2, 3, 4, 5",
+			0, NULL, NULL,
+			true, &saved_plan,
+			fetch_superior_scope, NULL);
+	}
+	PG_CATCH();
+	{
+		hierarchy.valid = false;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	veil2_spi_finish(pushed, "failed to load scope hierarchy (2)");
+}
+
+/**
+ * Identify the set of scopes that are superior to the given scope.
+ * If the in-memory scope hierarchy has not been loaded or has been
+ * invalidated, it will be (re)loaded first.
+ *
+ * @param scope_type The scope_type_id of the scope whose superiors we
+ * want.
+ * @param scope The scope_id of the scope whose superiors we want.
+ * @param p_superiors Pointer into which the address of the first
+ * superior scope will be returned.  This remains valid only until the
+ * next relcache invalidation is processed.
+ * @param p_promotions If not NULL, pointer into which the address of
+ * an array of flags, matching the superior scopes and identifying
+ * which are type promotions, will be returned.  This has the same
+ * lifetime as the superior scopes themselves.
+ *
+ * @return The number of superior scopes.
+ */
+int
+veil2_superior_scopes(int scope_type, int scope, ScopeKey **p_superiors,
+					  bool **p_promotions)
+{
+	int lower = 0;
+	int upper;
+	int this;
+	int cmp;
+	ScopeSuperiors *this_ss;
+
+	FN_STAT(FNSTAT_SUPERIOR_LOOKUPS)++;
+	if (!hierarchy.valid) {
+		load_scope_hierarchy();
+	}
+	upper = hierarchy.nscopes - 1;
+	while (lower <= upper) {
+		FN_STAT(FNSTAT_BSEARCH_PROBES)++;
+		this = (upper + lower) >> 1;
+		this_ss = &(hierarchy.scopes[this]);
+		cmp = this_ss->scope_type - scope_type;
+		if (!cmp) {
+			cmp = this_ss->scope - scope;
+		}
+		if (!cmp) {
+			*p_superiors = &(hierarchy.superiors[this_ss->first]);
+			if (p_promotions) {
+				*p_promotions = &(hierarchy.promotions[this_ss->first]);
+			}
+			return this_ss->count;
+		}
+		if (cmp > 0) {
+			upper = this - 1;
+		}
+		else {
+			lower = this + 1;
+		}
+	}
+	*p_superiors = NULL;
+	if (p_promotions) {
+		*p_promotions = NULL;
+	}
+	return 0;
+}
+
+/**
+ * Identify all scopes of a given scope type that have superior
+ * scopes.  If the in-memory scope hierarchy has not been loaded or
+ * has been invalidated, it will be (re)loaded first.
+ *
+ * @param scope_type The scope_type_id of the scopes we want.
+ * @param p_scopes Pointer into which the address of a palloc'd array
+ * of scope_ids will be returned.  This will be in scope_id order.
+ *
+ * @return The number of scopes.
+ */
+int
+veil2_scopes_with_superiors(int scope_type, int **p_scopes)
+{
+	int lower = 0;
+	int upper;
+	int this;
+	int first;
+	int count;
+	int i;
+
+	if (!hierarchy.valid) {
+		load_scope_hierarchy();
+	}
+
+	/* Find the first scope of our scope type. */
+	upper = hierarchy.nscopes;
+	while (lower < upper) {
+		this = (upper + lower) >> 1;
+		if (hierarchy.scopes[this].scope_type < scope_type) {
+			lower = this + 1;
+		}
+		else {
+			upper = this;
+		}
+	}
+	first = lower;
+	for (count = 0; (first + count) < hierarchy.nscopes; count++) {
+		if (hierarchy.scopes[first + count].scope_type != scope_type) {
+			break;
+		}
+	}
+
+	*p_scopes = (int *) palloc(sizeof(int) * (count + 1));
+	for (i = 0; i < count; i++) {
+		(*p_scopes)[i] = hierarchy.scopes[first + i].scope;
+	}
+	return count;
+}
+
+/** 
+ * <code>veil2.scope_hierarchy_changed() returns void</code>
+ *
+ * Register a relcache invalidation for veil2.all_superior_scopes.
+ * This will be sent to all backends when our transaction commits, and
+ * processed by our own backend at the end of the current command,
+ * causing the in-memory scope hierarchy to be discarded.
+ *
+ * @return void
+ */
+Datum
+veil2_scope_hierarchy_changed(PG_FUNCTION_ARGS)
+{
+	Oid relid = get_relname_relid("all_superior_scopes",
+								  get_namespace_oid("veil2", false));
+
+	if (OidIsValid(relid)) {
+		CacheInvalidateRelcacheByRelid(relid);
+	}
+	PG_RETURN_VOID();
+}
+
+/**
+ * Return the current scope hierarchy generation, first ensuring that
+ * we will be notified of invalidations.  This changes each time the
+ * hierarchy is invalidated, so any result that depends on the
+ * hierarchy, and was derived under a different generation, must be
+ * discarded.
+ *
+ * @return The generation number.
+ */
+uint64
+veil2_scope_hierarchy_generation()
+{
+	registerHierarchyCallback();
+	return hierarchy_generation;
+}
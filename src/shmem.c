@@ -0,0 +1,1410 @@
+/**
+ * @file   shmem.c
+ * \code
+ *     Author:       Marc Munro
+ *     Copyright (c) 2021 Marc Munro
+ *     License:      GPL V3
+ *
+ * \endcode
+ * @brief
+ * Shared memory handling for veil2.
+ *
+ * Shared memory is only available if veil2 has been loaded using
+ * shared_preload_libraries, and requires Postgres 15 or later.  If
+ * it is not available, each of the functions here quietly does
+ * nothing, and veil2 falls back to its table-based caches.
+ *
+ * The shared accessor privileges cache is a dshash table, keyed by
+ * accessor and session contexts (::PrivsCacheKey), which records a
+ * packed copy of the session privileges (::PackedSessionPrivs) for
+ * that key.  Cache entries are never updated in place.
+ *
+ * Cache invalidation is managed using generation numbers.  A single
+ * counter is incremented each time anything is loaded or
+ * invalidated.  Each cache entry records the value of the counter at
+ * the time its privileges began to be loaded, and each invalidation
+ * records the value of the counter either globally (when the whole
+ * cache is invalidated) or for a specific accessor.  An entry is
+ * valid only if it was loaded after any relevant invalidation.  This
+ * means that invalidating the cache for an accessor requires no scan
+ * of the cache, and that privileges loaded concurrently with an
+ * invalidation will not be used.  Invalid entries are removed when
+ * they are next looked up, or by reclaim_privs_cache() when space is
+ * needed.  So that the per-accessor generations do not accumulate
+ * without limit, once there are more than ::ACCESSOR_GENS_LIMIT of
+ * them, those for accessors with no cached entries are retired: they
+ * are folded into a single retired generation which then applies to
+ * every accessor with no generation of its own.  This may cause some
+ * privileges to be needlessly reloaded, but never allows invalid
+ * ones to be used.  Each invalidation is repeated once
+ * the invalidating transaction's commit has become visible to other
+ * backends, so that privileges loaded from data that did not yet
+ * reflect that commit are never used.  Backends whose snapshots may
+ * predate such a commit, ie those in repeatable read or serializable
+ * transactions, do not store entries at all.
+ *
+ * The same generation numbers allow each backend to discover whether
+ * the privileges for its own session have been invalidated since
+ * they were loaded.  So that this can be done on every privilege
+ * test, a separate counter of invalidations is kept: only when this
+ * has changed does a backend need to examine the generations.
+ *
+ * The shared session registry is a dshash table, keyed by
+ * session_id, which records the state of recently opened,
+ * authenticated sessions (::RegisteredSession).  This allows
+ * sessions to be re-opened without reading or updating their
+ * veil2.sessions records, which would otherwise be updated on every
+ * open_connection() call.  The logic for using and updating entries
+ * lives in veil2.c; here we simply manage the table.
+ *
+ * Statistics counters, from stats.c, are accumulated across backends
+ * in an array of atomic counters in the control structure itself.
+ */
+
+#include "postgres.h"
+#include "access/xact.h"
+#include "lib/dshash.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/dsa.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+
+#include "veil2.h"
+
+
+/**
+ * The maximum amount of memory, in kilobytes, that may be used for
+ * the shared accessor privileges cache.  Once this limit is reached,
+ * invalid entries are removed to make space and, if that is not
+ * enough, new entries are not added.  This is set from the
+ * veil2.shared_cache_size GUC.
+ */
+static int shared_cache_size = 65536;
+
+/**
+ * The maximum number of sessions that may be recorded in the shared
+ * session registry.  Once this limit is reached, new sessions are
+ * not registered until others have been removed.  A value of 0
+ * disables the registry.  This is set from the
+ * veil2.session_registry_size GUC.
+ */
+static int session_registry_size = 10000;
+
+/**
+ * The maximum time, in seconds, for which the used nonces and expiry
+ * time of an active session may be held only in the shared session
+ * registry.  Nonces that have not been written back to
+ * veil2.sessions are lost if the server is restarted, so this bounds
+ * the window in which a continuation token might be replayed.  A
+ * value of 0 disables these periodic write-backs.  This is set from
+ * the veil2.session_write_back_interval GUC.
+ */
+int veil2_session_write_back_interval = 60;
+
+
+#if PG_VERSION_NUM >= 150000
+
+/**
+ * The number of per-accessor invalidation generations above which
+ * those for accessors with no cached privileges are retired.
+ */
+#define ACCESSOR_GENS_LIMIT 1024
+
+/**
+ * The veil2 shared memory control structure.
+ */
+typedef struct {
+	/** Lock used to serialize creation of, and attachment to, our
+	 * dsa area and dshash tables. */
+	LWLock *lock;
+	/** Tranche id for our dsa area and dshash tables. */
+	int tranche_id;
+	/** Whether our dsa area and dshash tables have been created. */
+	bool dsa_created;
+	/** Handle for our dsa area. */
+	dsa_handle dsa;
+	/** Handle for the accessor privileges cache dshash table. */
+	dshash_table_handle privs_cache;
+	/** Handle for the per-accessor invalidation generations dshash
+	 * table. */
+	dshash_table_handle accessor_gens;
+	/** Handle for the session registry dshash table. */
+	dshash_table_handle sessions;
+	/** The generation counter.  This is incremented each time
+	 * privileges are loaded or invalidated. */
+	pg_atomic_uint64 generation;
+	/** The generation at which the entire cache was last
+	 * invalidated. */
+	pg_atomic_uint64 clear_generation;
+	/** The latest generation of any retired per-accessor
+	 * generation.  This applies to each accessor with no entry in
+	 * the accessor generations table. */
+	pg_atomic_uint64 retired_generation;
+	/** The number of entries in the accessor generations table. */
+	pg_atomic_uint32 accessor_gen_count;
+	/** The number of invalidations, global or per-accessor, that
+	 * have been made. */
+	pg_atomic_uint64 invalidations;
+	/** The number of bytes currently allocated to cache entries. */
+	pg_atomic_uint64 cache_bytes;
+	/** The number of entries in the session registry. */
+	pg_atomic_uint32 session_count;
+	/** The time at which statistics were last reset. */
+	pg_atomic_uint64 stats_reset;
+	/** Statistics counters accumulated from all backends. */
+	pg_atomic_uint64 stats[STAT_COUNTERS];
+} Veil2SharedState;
+
+/**
+ * An entry in the shared accessor privileges cache.
+ */
+typedef struct {
+	/** The key for this entry.  This must be the first field. */
+	PrivsCacheKey key;
+	/** The generation at which privileges began to be loaded. */
+	uint64 generation;
+	/** The size of the packed privileges. */
+	Size size;
+	/** The packed privileges, as a ::PackedSessionPrivs. */
+	dsa_pointer privs;
+} PrivsCacheEntry;
+
+/**
+ * An entry recording the last invalidation for a specific accessor.
+ */
+typedef struct {
+	/** The accessor_id.  This must be the first field. */
+	int accessor_id;
+	/** The generation at which this accessor was last
+	 * invalidated.  This is atomic so that it may be advanced at
+	 * commit while holding only a shared lock on the entry. */
+	pg_atomic_uint64 generation;
+} AccessorGenEntry;
+
+/**
+ * Pointer to our shared memory control structure.  This will be
+ * NULL if shared memory is unavailable.
+ */
+static Veil2SharedState *shared_state = NULL;
+
+/** Our backend's attachment to the veil2 dsa area. */
+static dsa_area *shared_area = NULL;
+
+/** Our backend's attachment to the shared privileges cache. */
+static dshash_table *privs_cache = NULL;
+
+/** Our backend's attachment to the accessor generations table. */
+static dshash_table *accessor_gens = NULL;
+
+/** Our backend's attachment to the session registry. */
+static dshash_table *session_registry = NULL;
+
+/**
+ * Accessor_ids for which invalidations must be repeated when the
+ * current transaction commits.
+ */
+static List *pending_invalidations = NIL;
+
+/**
+ * Whether the entire cache must be invalidated when the current
+ * transaction commits.
+ */
+static bool pending_clear = false;
+
+/**
+ * Copies of the session registry entries that the current
+ * transaction is writing back to veil2.sessions, as returned by
+ * veil2_session_registry_dirty().  They are allocated in
+ * TopTransactionContext.
+ */
+static RegisteredSession *flushed_sessions = NULL;
+
+/** The number of entries in ::flushed_sessions. */
+static int nflushed_sessions = 0;
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+
+/**
+ * Request our shared memory and lwlock.  This is called from the
+ * postmaster via shmem_request_hook.
+ */
+static void
+veil2_shmem_request(void)
+{
+	if (prev_shmem_request_hook) {
+		prev_shmem_request_hook();
+	}
+	RequestAddinShmemSpace(MAXALIGN(sizeof(Veil2SharedState)));
+	RequestNamedLWLockTranche("veil2", 1);
+}
+
+/**
+ * Create or attach to our shared memory control structure.  This is
+ * called via shmem_startup_hook.
+ */
+static void
+veil2_shmem_startup(void)
+{
+	bool found;
+	int i;
+
+	if (prev_shmem_startup_hook) {
+		prev_shmem_startup_hook();
+	}
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	shared_state = ShmemInitStruct("veil2", sizeof(Veil2SharedState),
+								   &found);
+	if (!found) {
+		shared_state->lock = &(GetNamedLWLockTranche("veil2")->lock);
+		shared_state->tranche_id = LWLockNewTrancheId();
+		shared_state->dsa_created = false;
+		pg_atomic_init_u64(&shared_state->generation, 1);
+		pg_atomic_init_u64(&shared_state->clear_generation, 0);
+		pg_atomic_init_u64(&shared_state->retired_generation, 0);
+		pg_atomic_init_u32(&shared_state->accessor_gen_count, 0);
+		pg_atomic_init_u64(&shared_state->invalidations, 0);
+		pg_atomic_init_u64(&shared_state->cache_bytes, 0);
+		pg_atomic_init_u32(&shared_state->session_count, 0);
+		pg_atomic_init_u64(&shared_state->stats_reset,
+						   (uint64) GetCurrentTimestamp());
+		for (i = 0; i < STAT_COUNTERS; i++) {
+			pg_atomic_init_u64(&shared_state->stats[i], 0);
+		}
+	}
+	LWLockRelease(AddinShmemInitLock);
+}
+
+/**
+ * Provide dshash parameters for the shared privileges cache.
+ *
+ * @param params The dshash_parameters struct to be filled in.
+ */
+static void
+privs_cache_params(dshash_parameters *params)
+{
+	params->key_size = sizeof(PrivsCacheKey);
+	params->entry_size = sizeof(PrivsCacheEntry);
+	params->compare_function = dshash_memcmp;
+	params->hash_function = dshash_memhash;
+#if PG_VERSION_NUM >= 170000
+	params->copy_function = dshash_memcpy;
+#endif
+	params->tranche_id = shared_state->tranche_id;
+}
+
+/**
+ * Provide dshash parameters for the accessor generations table.
+ *
+ * @param params The dshash_parameters struct to be filled in.
+ */
+static void
+accessor_gens_params(dshash_parameters *params)
+{
+	params->key_size = sizeof(int);
+	params->entry_size = sizeof(AccessorGenEntry);
+	params->compare_function = dshash_memcmp;
+	params->hash_function = dshash_memhash;
+#if PG_VERSION_NUM >= 170000
+	params->copy_function = dshash_memcpy;
+#endif
+	params->tranche_id = shared_state->tranche_id;
+}
+
+/**
+ * Provide dshash parameters for the session registry.
+ *
+ * @param params The dshash_parameters struct to be filled in.
+ */
+static void
+session_registry_params(dshash_parameters *params)
+{
+	params->key_size = sizeof(int64);
+	params->entry_size = sizeof(RegisteredSession);
+	params->compare_function = dshash_memcmp;
+	params->hash_function = dshash_memhash;
+#if PG_VERSION_NUM >= 170000
+	params->copy_function = dshash_memcpy;
+#endif
+	params->tranche_id = shared_state->tranche_id;
+}
+
+/**
+ * Advance a shared generation number to at least the given value.
+ * Concurrent invalidations may obtain their generations in one order
+ * and record them in another, so a generation must never be moved
+ * backwards.
+ *
+ * @param target The generation number to be advanced.
+ * @param generation Its new minimum value.
+ */
+static void
+advance_generation(pg_atomic_uint64 *target, uint64 generation)
+{
+	uint64 current = pg_atomic_read_u64(target);
+
+	while ((current < generation) &&
+		   !pg_atomic_compare_exchange_u64(target, &current, generation))
+	{
+		/* current has been updated, so just try again. */
+	}
+}
+
+/**
+ * Ensure that an accessor generations entry exists for each accessor
+ * whose invalidation is to be repeated at commit, so that
+ * apply_pending_invalidations() need allocate nothing.  This is
+ * called at pre-commit, where errors may still be raised.
+ */
+static void
+prepare_pending_invalidations(void)
+{
+	ListCell *lc;
+	AccessorGenEntry *gen_entry;
+	int accessor_id;
+	bool found;
+
+	if (pending_clear) {
+		return;
+	}
+	foreach (lc, pending_invalidations) {
+		accessor_id = lfirst_int(lc);
+		gen_entry = (AccessorGenEntry *)
+			dshash_find_or_insert(accessor_gens, &accessor_id, &found);
+		if (!found) {
+			pg_atomic_init_u64(&gen_entry->generation, 0);
+			pg_atomic_add_fetch_u32(&shared_state->accessor_gen_count, 1);
+		}
+		dshash_release_lock(accessor_gens, gen_entry);
+	}
+}
+
+/**
+ * Repeat the invalidations made by our transaction, now that its
+ * commit is visible to other backends.  This may not raise errors,
+ * so does no more than look up the entries created by
+ * prepare_pending_invalidations() and advance generation numbers.
+ * If an entry has since been removed, by a concurrent invalidation of
+ * the whole cache or by retirement, we advance the retired generation,
+ * which applies to the accessor now that it has no entry, rather
+ * than re-create it.
+ */
+static void
+apply_pending_invalidations(void)
+{
+	ListCell *lc;
+	AccessorGenEntry *gen_entry;
+	int accessor_id;
+	uint64 generation;
+	bool all = pending_clear;
+
+	if (!(all || pending_invalidations)) {
+		return;
+	}
+	generation = pg_atomic_add_fetch_u64(&shared_state->generation, 1);
+	if (!all) {
+		foreach (lc, pending_invalidations) {
+			accessor_id = lfirst_int(lc);
+			gen_entry = (AccessorGenEntry *)
+				dshash_find(accessor_gens, &accessor_id, false);
+			if (!gen_entry) {
+				advance_generation(&shared_state->retired_generation,
+								   generation);
+				continue;
+			}
+			advance_generation(&gen_entry->generation, generation);
+			dshash_release_lock(accessor_gens, gen_entry);
+		}
+	}
+	if (all) {
+		/* Entries stored before this generation will be treated as
+		 * invalid, and will be replaced as they are next loaded. */
+		advance_generation(&shared_state->clear_generation, generation);
+	}
+	pg_atomic_add_fetch_u64(&shared_state->invalidations, 1);
+}
+
+/**
+ * Mark the session registry entries that our transaction has written
+ * back to veil2.sessions as clean, now that the write-back has
+ * committed.  Entries that have changed again since they were copied
+ * remain dirty, though their recorded expiry time is updated.  As
+ * for apply_pending_invalidations(), this must not raise errors.
+ */
+static void
+mark_flushed_sessions(void)
+{
+	RegisteredSession *flushed;
+	RegisteredSession *entry;
+	int i;
+
+	for (i = 0; i < nflushed_sessions; i++) {
+		flushed = &flushed_sessions[i];
+		entry = (RegisteredSession *) dshash_find(
+			session_registry, &flushed->session_id, true);
+		if (!entry) {
+			continue;
+		}
+		if (flushed->expires > entry->stored_expires) {
+			entry->stored_expires = flushed->expires;
+		}
+		if (flushed->written_at > entry->written_at) {
+			entry->written_at = flushed->written_at;
+		}
+		if ((entry->expires == flushed->expires) &&
+			(entry->nonce_base == flushed->nonce_base) &&
+			(memcmp(entry->nonces, flushed->nonces,
+					sizeof(entry->nonces)) == 0))
+		{
+			entry->dirty = false;
+		}
+		dshash_release_lock(session_registry, entry);
+	}
+}
+
+/**
+ * Transaction callback.  This repeats, once our commit is visible to
+ * other backends, any invalidations made during the transaction.
+ * Privileges loaded by other backends between our invalidation and
+ * that point would have been loaded from data that our transaction
+ * had not yet made visible, so must themselves be invalidated.
+ * XACT_EVENT_COMMIT is called only after our transaction has been
+ * removed from the proc array, whereas at XACT_EVENT_PRE_COMMIT it
+ * is still in progress.
+ *
+ * @param event The transaction event.
+ * @param arg Unused.
+ */
+static void
+veil2_xact_callback(XactEvent event, void *arg)
+{
+	switch (event) {
+	case XACT_EVENT_PRE_COMMIT:
+		prepare_pending_invalidations();
+		break;
+	case XACT_EVENT_COMMIT:
+		apply_pending_invalidations();
+		mark_flushed_sessions();
+		/* FALLTHROUGH */
+	case XACT_EVENT_ABORT:
+	case XACT_EVENT_PREPARE:
+		/* These are allocated in TopTransactionContext, so will be
+		 * freed for us.  On abort, flushed sessions simply remain
+		 * dirty. */
+		pending_invalidations = NIL;
+		pending_clear = false;
+		flushed_sessions = NULL;
+		nflushed_sessions = 0;
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Attach to our dsa area and dshash tables, creating them if this
+ * is the first backend to need them.
+ *
+ * @return true if the shared cache is available.
+ */
+static bool
+attach_shared_cache()
+{
+	dshash_parameters params;
+	MemoryContext old_context;
+
+	if (privs_cache) {
+		return true;
+	}
+	if (!shared_state) {
+		return false;
+	}
+
+	LWLockRegisterTranche(shared_state->tranche_id, "veil2");
+	old_context = MemoryContextSwitchTo(TopMemoryContext);
+	LWLockAcquire(shared_state->lock, LW_EXCLUSIVE);
+	if (!shared_state->dsa_created) {
+		shared_area = dsa_create(shared_state->tranche_id);
+		dsa_pin(shared_area);
+		dsa_pin_mapping(shared_area);
+		privs_cache_params(&params);
+		privs_cache = dshash_create(shared_area, &params, NULL);
+		accessor_gens_params(&params);
+		accessor_gens = dshash_create(shared_area, &params, NULL);
+		session_registry_params(&params);
+		session_registry = dshash_create(shared_area, &params, NULL);
+		shared_state->dsa = dsa_get_handle(shared_area);
+		shared_state->privs_cache =
+			dshash_get_hash_table_handle(privs_cache);
+		shared_state->accessor_gens =
+			dshash_get_hash_table_handle(accessor_gens);
+		shared_state->sessions =
+			dshash_get_hash_table_handle(session_registry);
+		shared_state->dsa_created = true;
+	}
+	else {
+		shared_area = dsa_attach(shared_state->dsa);
+		dsa_pin_mapping(shared_area);
+		privs_cache_params(&params);
+		privs_cache = dshash_attach(shared_area, &params,
+									shared_state->privs_cache, NULL);
+		accessor_gens_params(&params);
+		accessor_gens = dshash_attach(shared_area, &params,
+									  shared_state->accessor_gens, NULL);
+		session_registry_params(&params);
+		session_registry = dshash_attach(shared_area, &params,
+										 shared_state->sessions, NULL);
+	}
+	LWLockRelease(shared_state->lock);
+	MemoryContextSwitchTo(old_context);
+	RegisterXactCallback(veil2_xact_callback, NULL);
+	return true;
+}
+
+/**
+ * Return the generation at which the given accessor's cached
+ * privileges were last invalidated.  If the accessor has no
+ * generation of its own, this is the retired generation, which must
+ * be read only after the lookup has failed: retirement advances it
+ * before removing the accessor's entry.
+ *
+ * @param accessor_id The accessor whose generation we want.
+ *
+ * @return The generation, which will be 0 if the accessor has never
+ * been invalidated.
+ */
+static uint64
+accessor_generation(int accessor_id)
+{
+	AccessorGenEntry *entry;
+	uint64 result;
+
+	entry = (AccessorGenEntry *) dshash_find(accessor_gens,
+											 &accessor_id, false);
+	if (entry) {
+		result = pg_atomic_read_u64(&entry->generation);
+		dshash_release_lock(accessor_gens, entry);
+	}
+	else {
+		result = pg_atomic_read_u64(&shared_state->retired_generation);
+	}
+	return result;
+}
+
+/**
+ * Return the generation of the most recent invalidation affecting
+ * the given accessor, whether global or specific to that accessor.
+ * Privileges loaded at an earlier generation are invalid.
+ *
+ * @param accessor_id The accessor whose generation we want.
+ *
+ * @return The generation, which will be 0 if there have been no
+ * relevant invalidations.
+ */
+static uint64
+invalidation_generation(int accessor_id)
+{
+	uint64 min_generation;
+	uint64 accessor_gen;
+
+	min_generation = pg_atomic_read_u64(&shared_state->clear_generation);
+	accessor_gen = accessor_generation(accessor_id);
+	if (accessor_gen > min_generation) {
+		min_generation = accessor_gen;
+	}
+	return min_generation;
+}
+
+
+/**
+ * Predicate identifying whether veil2 shared memory is available.
+ *
+ * @return true if shared memory is available.
+ */
+bool
+veil2_shmem_available(void)
+{
+	return shared_state != NULL;
+}
+
+/**
+ * Return a new generation number.  This should be called before
+ * privileges begin to be loaded, and the result passed to
+ * veil2_privs_cache_store() once they have been.
+ *
+ * @return The new generation number, or 0 if there is no shared
+ * cache.
+ */
+uint64
+veil2_privs_cache_generation(void)
+{
+	if (!attach_shared_cache()) {
+		return 0;
+	}
+	return pg_atomic_add_fetch_u64(&shared_state->generation, 1);
+}
+
+/**
+ * Return the number of invalidations made so far.  A backend that
+ * records this when it loads its session privileges need not check
+ * them again for as long as the number remains unchanged.  This
+ * reads a single atomic counter so may be called on every privilege
+ * test.
+ *
+ * @return The number of invalidations, or 0 if there is no shared
+ * memory.
+ */
+uint64
+veil2_privs_cache_invalidations(void)
+{
+	if (!shared_state) {
+		return 0;
+	}
+	return pg_atomic_read_u64(&shared_state->invalidations);
+}
+
+/**
+ * Predicate identifying whether privileges for an accessor, loaded
+ * at a given generation, have since been invalidated.
+ *
+ * @param accessor_id The accessor whose privileges were loaded.
+ * @param generation The generation number, as returned by
+ * veil2_privs_cache_generation(), from before the privileges began
+ * to be loaded.
+ *
+ * @return true if the privileges have been invalidated.
+ */
+bool
+veil2_privs_cache_stale(int accessor_id, uint64 generation)
+{
+	if ((generation == 0) || !attach_shared_cache()) {
+		return false;
+	}
+	return invalidation_generation(accessor_id) > generation;
+}
+
+/**
+ * Free the packed privileges of an entry in the shared accessor
+ * privileges cache, which is about to be deleted.
+ *
+ * @param entry The entry, which must be exclusively locked.
+ */
+static void
+free_privs_entry(PrivsCacheEntry *entry)
+{
+	dsa_free(shared_area, entry->privs);
+	pg_atomic_sub_fetch_u64(&shared_state->cache_bytes, entry->size);
+}
+
+/**
+ * qsort and bsearch comparator for accessor_ids.
+ */
+static int
+cmp_accessor_ids(const void *a, const void *b)
+{
+	int x = *((const int *) a);
+	int y = *((const int *) b);
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Remove invalid entries from the shared accessor privileges cache,
+ * freeing their memory.  Then, if there are more than
+ * ::ACCESSOR_GENS_LIMIT per-accessor generations, retire those for
+ * accessors that no longer have any cached entries.  The retired
+ * generation is advanced before each entry is removed so that, to
+ * anyone who then fails to find the entry, the accessor's privileges
+ * remain invalid.
+ */
+static void
+reclaim_privs_cache(void)
+{
+	dshash_seq_status status;
+	PrivsCacheEntry *entry;
+	AccessorGenEntry *gen_entry;
+	int *cached;
+	int ncached = 0;
+	int maxcached = 64;
+
+	cached = (int *) palloc(sizeof(int) * maxcached);
+	dshash_seq_init(&status, privs_cache, true);
+	while ((entry = (PrivsCacheEntry *) dshash_seq_next(&status))) {
+		if (entry->generation <=
+			invalidation_generation(entry->key.accessor_id))
+		{
+			free_privs_entry(entry);
+			dshash_delete_current(&status);
+			continue;
+		}
+		if (ncached >= maxcached) {
+			maxcached *= 2;
+			cached = (int *) repalloc(cached, sizeof(int) * maxcached);
+		}
+		cached[ncached++] = entry->key.accessor_id;
+	}
+	dshash_seq_term(&status);
+
+	if (pg_atomic_read_u32(&shared_state->accessor_gen_count) >
+		ACCESSOR_GENS_LIMIT)
+	{
+		qsort(cached, ncached, sizeof(int), cmp_accessor_ids);
+		dshash_seq_init(&status, accessor_gens, true);
+		while ((gen_entry = (AccessorGenEntry *) dshash_seq_next(&status))) {
+			if (!bsearch(&gen_entry->accessor_id, cached, ncached,
+						 sizeof(int), cmp_accessor_ids))
+			{
+				advance_generation(
+					&shared_state->retired_generation,
+					pg_atomic_read_u64(&gen_entry->generation));
+				dshash_delete_current(&status);
+				pg_atomic_sub_fetch_u32(&shared_state->accessor_gen_count,
+										1);
+			}
+		}
+		dshash_seq_term(&status);
+	}
+	pfree(cached);
+}
+
+/**
+ * Look for a valid entry in the shared accessor privileges cache,
+ * and if found, pass its packed privileges to a reader function.
+ *
+ * @param key The cache key to look for
+ * @param reader Function to be called with the packed privileges
+ * from the cache entry.  This is called while a shared lock is held
+ * on the entry, so must not attempt to access the cache itself.
+ * @param arg Argument to be passed to reader.
+ *
+ * @return true if a valid entry was found.  An invalid entry that is
+ * found is removed.
+ */
+bool
+veil2_privs_cache_lookup(PrivsCacheKey *key,
+						 PrivsCacheReader reader, void *arg)
+{
+	PrivsCacheEntry *entry;
+	uint64 min_generation;
+	bool found = false;
+	bool stale = false;
+
+	if (!attach_shared_cache()) {
+		return false;
+	}
+	min_generation = invalidation_generation(key->accessor_id);
+
+	entry = (PrivsCacheEntry *) dshash_find(privs_cache, key, false);
+	if (entry) {
+		if (entry->generation > min_generation) {
+			reader((PackedSessionPrivs *)
+				   dsa_get_address(shared_area, entry->privs), arg);
+			found = true;
+		}
+		else {
+			stale = true;
+		}
+		dshash_release_lock(privs_cache, entry);
+	}
+	if (stale) {
+		/* Re-find the entry exclusively, in order to remove it.  It
+		 * may have been replaced, with a valid entry, meanwhile. */
+		entry = (PrivsCacheEntry *) dshash_find(privs_cache, key, true);
+		if (entry) {
+			if (entry->generation <= min_generation) {
+				free_privs_entry(entry);
+				dshash_delete_entry(privs_cache, entry);
+			}
+			else {
+				dshash_release_lock(privs_cache, entry);
+			}
+		}
+	}
+	SESSION_STAT(found? SESSTAT_SHARED_HITS: SESSTAT_SHARED_MISSES)++;
+	return found;
+}
+
+/**
+ * Store an entry in the shared accessor privileges cache.  If there
+ * is insufficient space, invalid entries are first removed.  If
+ * there is still insufficient space, or a newer entry has already
+ * been stored, we quietly do nothing.  We also do nothing if the current
+ * transaction uses a single snapshot for all of its statements:
+ * privileges read using that snapshot may predate invalidations that
+ * have been repeated since, so could be stored with a generation
+ * that makes them appear valid.
+ *
+ * @param key The cache key for the entry
+ * @param generation The generation number, as returned by
+ * veil2_privs_cache_generation(), from before the privileges being
+ * stored began to be loaded.
+ * @param size The size of the packed privileges to be stored.
+ * @param writer Function to write the packed privileges into the
+ * space allocated for them.
+ * @param arg Argument to be passed to writer.
+ */
+void
+veil2_privs_cache_store(PrivsCacheKey *key, uint64 generation,
+						Size size, PrivsCacheWriter writer, void *arg)
+{
+	PrivsCacheEntry *entry;
+	dsa_pointer privs;
+	bool found;
+
+	if ((generation == 0) || IsolationUsesXactSnapshot() ||
+		!attach_shared_cache())
+	{
+		return;
+	}
+	if ((pg_atomic_read_u64(&shared_state->cache_bytes) + size) >
+		((uint64) shared_cache_size * 1024))
+	{
+		reclaim_privs_cache();
+		if ((pg_atomic_read_u64(&shared_state->cache_bytes) + size) >
+			((uint64) shared_cache_size * 1024))
+		{
+			return;
+		}
+	}
+	privs = dsa_allocate_extended(shared_area, size, DSA_ALLOC_NO_OOM);
+	if (!DsaPointerIsValid(privs)) {
+		return;
+	}
+	writer((PackedSessionPrivs *) dsa_get_address(shared_area, privs),
+		   size, arg);
+
+	entry = (PrivsCacheEntry *) dshash_find_or_insert(privs_cache,
+													  key, &found);
+	if (found) {
+		if (entry->generation >= generation) {
+			/* Someone else has beaten us to it. */
+			dshash_release_lock(privs_cache, entry);
+			dsa_free(shared_area, privs);
+			return;
+		}
+		free_privs_entry(entry);
+	}
+	entry->generation = generation;
+	entry->size = size;
+	entry->privs = privs;
+	pg_atomic_add_fetch_u64(&shared_state->cache_bytes, size);
+	dshash_release_lock(privs_cache, entry);
+}
+
+/**
+ * Does the work of veil2_privs_cache_invalidate(), without recording
+ * the invalidation for repetition at commit.
+ *
+ * @param accessor_id The accessor whose entries are to be
+ * invalidated.  Ignored if all is true.
+ * @param all Whether all entries are to be invalidated.
+ */
+static void
+invalidate_privs_cache(int accessor_id, bool all)
+{
+	dshash_seq_status status;
+	PrivsCacheEntry *entry;
+	AccessorGenEntry *gen_entry;
+	uint64 generation;
+	bool found;
+
+	generation = pg_atomic_add_fetch_u64(&shared_state->generation, 1);
+	if (all) {
+		advance_generation(&shared_state->clear_generation, generation);
+		dshash_seq_init(&status, privs_cache, true);
+		while ((entry = (PrivsCacheEntry *) dshash_seq_next(&status))) {
+			free_privs_entry(entry);
+			dshash_delete_current(&status);
+		}
+		dshash_seq_term(&status);
+
+		/* Accessor generations are now superseded by the clear
+		 * generation. */
+		dshash_seq_init(&status, accessor_gens, true);
+		while (dshash_seq_next(&status)) {
+			dshash_delete_current(&status);
+			pg_atomic_sub_fetch_u32(&shared_state->accessor_gen_count, 1);
+		}
+		dshash_seq_term(&status);
+	}
+	else {
+		gen_entry = (AccessorGenEntry *)
+			dshash_find_or_insert(accessor_gens, &accessor_id, &found);
+		if (!found) {
+			pg_atomic_init_u64(&gen_entry->generation, 0);
+			pg_atomic_add_fetch_u32(&shared_state->accessor_gen_count, 1);
+		}
+		advance_generation(&gen_entry->generation, generation);
+		dshash_release_lock(accessor_gens, gen_entry);
+		if (pg_atomic_read_u32(&shared_state->accessor_gen_count) >
+			ACCESSOR_GENS_LIMIT)
+		{
+			reclaim_privs_cache();
+		}
+	}
+	pg_atomic_add_fetch_u64(&shared_state->invalidations, 1);
+}
+
+/**
+ * Invalidate entries in the shared accessor privileges cache, either
+ * for a single accessor, or for all accessors.  When all entries are
+ * invalidated, they are also removed, freeing their memory.
+ * Invalidations are repeated once the current transaction's commit
+ * has become visible to other backends.
+ *
+ * @param accessor_id The accessor whose entries are to be
+ * invalidated.  Ignored if all is true.
+ * @param all Whether all entries are to be invalidated.
+ */
+void
+veil2_privs_cache_invalidate(int accessor_id, bool all)
+{
+	MemoryContext old_context;
+
+	if (!attach_shared_cache()) {
+		return;
+	}
+	invalidate_privs_cache(accessor_id, all);
+
+	old_context = MemoryContextSwitchTo(TopTransactionContext);
+	if (all) {
+		pending_clear = true;
+	}
+	else if (!pending_clear) {
+		/* Repeating an invalidation is harmless, whereas checking
+		 * for duplicates would make invalidating many accessors in
+		 * one transaction quadratic. */
+		pending_invalidations =
+			lappend_int(pending_invalidations, accessor_id);
+	}
+	MemoryContextSwitchTo(old_context);
+}
+
+/**
+ * Look for an entry in the shared session registry and, if found,
+ * return a copy of it.  This allows the caller to examine the entry
+ * at leisure, without holding its lock.
+ *
+ * @param session_id The session to look for.
+ * @param session The ::RegisteredSession into which the entry is
+ * copied.
+ *
+ * @return true if an entry was found.
+ */
+bool
+veil2_session_registry_fetch(int64 session_id, RegisteredSession *session)
+{
+	RegisteredSession *entry;
+
+	if ((session_registry_size == 0) || !attach_shared_cache()) {
+		return false;
+	}
+	entry = (RegisteredSession *) dshash_find(session_registry,
+											  &session_id, false);
+	if (!entry) {
+		return false;
+	}
+	memcpy(session, entry, sizeof(RegisteredSession));
+	dshash_release_lock(session_registry, entry);
+	return true;
+}
+
+/**
+ * Look for an entry in the shared session registry and, if found,
+ * pass it to fn, which may update it.  The entry is exclusively
+ * locked while fn is called, so fn must be quick and must not
+ * attempt to access the registry itself.
+ *
+ * @param session_id The session to look for.
+ * @param fn Function to be called with the registry entry.  If this
+ * returns false, the entry is removed from the registry.
+ * @param arg Argument to be passed to fn.
+ *
+ * @return true if an entry was found.
+ */
+bool
+veil2_session_registry_lookup(int64 session_id,
+							  SessionRegistryFn fn, void *arg)
+{
+	RegisteredSession *entry;
+
+	if ((session_registry_size == 0) || !attach_shared_cache()) {
+		return false;
+	}
+	entry = (RegisteredSession *) dshash_find(session_registry,
+											  &session_id, true);
+	if (!entry) {
+		return false;
+	}
+	if (fn(entry, arg)) {
+		dshash_release_lock(session_registry, entry);
+	}
+	else {
+		dshash_delete_entry(session_registry, entry);
+		pg_atomic_sub_fetch_u32(&shared_state->session_count, 1);
+	}
+	return true;
+}
+
+/**
+ * Add an entry to the shared session registry.  If the registry is
+ * full, or there is already an entry for the session, we quietly do
+ * nothing.  The existing entry is at least as up to date as the
+ * veil2.sessions record from which this one was built.
+ *
+ * @param session The session to be registered.
+ */
+void
+veil2_session_registry_store(RegisteredSession *session)
+{
+	RegisteredSession *entry;
+	bool found;
+
+	if ((session_registry_size == 0) || !attach_shared_cache()) {
+		return;
+	}
+	if (pg_atomic_read_u32(&shared_state->session_count) >=
+		(uint32) session_registry_size)
+	{
+		return;
+	}
+	entry = (RegisteredSession *) dshash_find_or_insert(
+		session_registry, &session->session_id, &found);
+	if (!found) {
+		memcpy(entry, session, sizeof(RegisteredSession));
+		pg_atomic_add_fetch_u32(&shared_state->session_count, 1);
+	}
+	dshash_release_lock(session_registry, entry);
+}
+
+/**
+ * Remove an entry, or all entries, from the shared session
+ * registry.  This is used when veil2.sessions records are deleted.
+ *
+ * @param session_id The session to be removed.  Ignored if all is
+ * true.
+ * @param all Whether all entries are to be removed.
+ */
+void
+veil2_session_registry_remove(int64 session_id, bool all)
+{
+	dshash_seq_status status;
+
+	if (!attach_shared_cache()) {
+		return;
+	}
+	if (all) {
+		dshash_seq_init(&status, session_registry, true);
+		while (dshash_seq_next(&status)) {
+			dshash_delete_current(&status);
+			pg_atomic_sub_fetch_u32(&shared_state->session_count, 1);
+		}
+		dshash_seq_term(&status);
+	}
+	else if (dshash_delete_key(session_registry, &session_id)) {
+		pg_atomic_sub_fetch_u32(&shared_state->session_count, 1);
+	}
+}
+
+/**
+ * Return copies of all session registry entries whose state has not
+ * been written back to veil2.sessions.  The caller is responsible
+ * for writing them back.  The entries are marked as clean only when
+ * the current transaction commits, so that if it aborts they will be
+ * written back by a later call.
+ *
+ * @param p_sessions Pointer to a palloc'd array of
+ * ::RegisteredSession copies, returned to the caller.
+ * @param expired_only If true, only entries whose expiry time, as
+ * last written to veil2.sessions, has passed are returned.  These are
+ * the entries whose veil2.sessions records may be deleted as expired.
+ *
+ * @return The number of entries in the array.
+ */
+int
+veil2_session_registry_dirty(RegisteredSession **p_sessions,
+							 bool expired_only)
+{
+	dshash_seq_status status;
+	RegisteredSession *entry;
+	RegisteredSession *sessions = NULL;
+	MemoryContext old_context;
+	TimestampTz now = GetCurrentTimestamp();
+	int count = 0;
+	int size = 0;
+	int i;
+
+	*p_sessions = NULL;
+	if (!attach_shared_cache()) {
+		return 0;
+	}
+	dshash_seq_init(&status, session_registry, true);
+	while ((entry = (RegisteredSession *) dshash_seq_next(&status))) {
+		if (entry->dirty &&
+			!(expired_only && (entry->stored_expires > now)))
+		{
+			if (count >= size) {
+				size = size ? size * 2: 64;
+				sessions = sessions ?
+					repalloc(sessions, sizeof(RegisteredSession) * size):
+					palloc(sizeof(RegisteredSession) * size);
+			}
+			memcpy(&sessions[count++], entry, sizeof(RegisteredSession));
+		}
+	}
+	dshash_seq_term(&status);
+
+	if (count) {
+		old_context = MemoryContextSwitchTo(TopTransactionContext);
+		flushed_sessions = flushed_sessions ?
+			repalloc(flushed_sessions, sizeof(RegisteredSession) *
+					 (nflushed_sessions + count)):
+			palloc(sizeof(RegisteredSession) * count);
+		MemoryContextSwitchTo(old_context);
+		memcpy(&flushed_sessions[nflushed_sessions], sessions,
+			   sizeof(RegisteredSession) * count);
+		for (i = 0; i < count; i++) {
+			flushed_sessions[nflushed_sessions + i].written_at = now;
+		}
+		nflushed_sessions += count;
+	}
+	*p_sessions = sessions;
+	return count;
+}
+
+/**
+ * Add a backend's statistics counters to the shared counters.
+ *
+ * @param counters Array of ::STAT_COUNTERS counters to be added.
+ *
+ * @return true if shared memory is available, and the counters have
+ * been added.
+ */
+bool
+veil2_shared_stats_add(uint64 *counters)
+{
+	int i;
+
+	if (!shared_state) {
+		return false;
+	}
+	for (i = 0; i < STAT_COUNTERS; i++) {
+		if (counters[i]) {
+			pg_atomic_fetch_add_u64(&shared_state->stats[i], counters[i]);
+		}
+	}
+	return true;
+}
+
+/**
+ * Read the shared statistics counters.
+ *
+ * @param counters Array of ::STAT_COUNTERS counters into which the
+ * shared counters are to be copied.
+ * @param p_reset The time that the counters were last reset is
+ * returned through this.
+ *
+ * @return true if shared memory is available.
+ */
+bool
+veil2_shared_stats_read(uint64 *counters, TimestampTz *p_reset)
+{
+	int i;
+
+	if (!shared_state) {
+		return false;
+	}
+	for (i = 0; i < STAT_COUNTERS; i++) {
+		counters[i] = pg_atomic_read_u64(&shared_state->stats[i]);
+	}
+	*p_reset = (TimestampTz) pg_atomic_read_u64(&shared_state->stats_reset);
+	return true;
+}
+
+/**
+ * Reset the shared statistics counters.  Counts being added
+ * concurrently by other backends may be lost.
+ *
+ * @param reset The time of the reset.
+ */
+void
+veil2_shared_stats_reset(TimestampTz reset)
+{
+	int i;
+
+	if (!shared_state) {
+		return;
+	}
+	for (i = 0; i < STAT_COUNTERS; i++) {
+		pg_atomic_write_u64(&shared_state->stats[i], 0);
+	}
+	pg_atomic_write_u64(&shared_state->stats_reset, (uint64) reset);
+}
+
+/**
+ * Install our shared memory hooks.
+ */
+static void
+install_shmem_hooks()
+{
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = veil2_shmem_request;
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = veil2_shmem_startup;
+}
+
+#else  /* PG_VERSION_NUM < 150000 */
+
+/*
+ * Shared memory is not supported for this version of Postgres.  The
+ * following stubs ensure that veil2 uses its table-based caches.
+ */
+
+bool
+veil2_shmem_available(void)
+{
+	return false;
+}
+
+uint64
+veil2_privs_cache_generation(void)
+{
+	return 0;
+}
+
+uint64
+veil2_privs_cache_invalidations(void)
+{
+	return 0;
+}
+
+bool
+veil2_privs_cache_stale(int accessor_id, uint64 generation)
+{
+	return false;
+}
+
+bool
+veil2_privs_cache_lookup(PrivsCacheKey *key,
+						 PrivsCacheReader reader, void *arg)
+{
+	return false;
+}
+
+void
+veil2_privs_cache_store(PrivsCacheKey *key, uint64 generation,
+						Size size, PrivsCacheWriter writer, void *arg)
+{
+}
+
+void
+veil2_privs_cache_invalidate(int accessor_id, bool all)
+{
+}
+
+bool
+veil2_session_registry_fetch(int64 session_id, RegisteredSession *session)
+{
+	return false;
+}
+
+bool
+veil2_session_registry_lookup(int64 session_id,
+							  SessionRegistryFn fn, void *arg)
+{
+	return false;
+}
+
+void
+veil2_session_registry_store(RegisteredSession *session)
+{
+}
+
+void
+veil2_session_registry_remove(int64 session_id, bool all)
+{
+}
+
+int
+veil2_session_registry_dirty(RegisteredSession **p_sessions,
+							 bool expired_only)
+{
+	*p_sessions = NULL;
+	return 0;
+}
+
+bool
+veil2_shared_stats_add(uint64 *counters)
+{
+	return false;
+}
+
+bool
+veil2_shared_stats_read(uint64 *counters, TimestampTz *p_reset)
+{
+	return false;
+}
+
+void
+veil2_shared_stats_reset(TimestampTz reset)
+{
+}
+
+#endif
+
+
+/**
+ * Initialize veil2 shared memory.  This must be called from
+ * _PG_init().  If we are not being loaded by
+ * shared_preload_libraries we do nothing, and no shared memory will
+ * be available.
+ */
+void
+veil2_shmem_init(void)
+{
+	DefineCustomIntVariable("veil2.shared_cache_size",
+							"Maximum memory for the shared accessor "
+							"privileges cache.",
+							NULL,
+							&shared_cache_size,
+							65536, 0, INT_MAX / 1024,
+							PGC_SIGHUP,
+							GUC_UNIT_KB,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("veil2.session_registry_size",
+							"Maximum number of sessions in the shared "
+							"session registry.",
+							NULL,
+							&session_registry_size,
+							10000, 0, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("veil2.session_write_back_interval",
+							"Maximum time for which an active session's "
+							"used nonces are held only in the shared "
+							"session registry.",
+							"0 disables periodic write-backs.",
+							&veil2_session_write_back_interval,
+							60, 0, INT_MAX,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL, NULL, NULL);
+#if PG_VERSION_NUM >= 150000
+	MarkGUCPrefixReserved("veil2");
+#endif
+
+	if (!process_shared_preload_libraries_in_progress) {
+		return;
+	}
+#if PG_VERSION_NUM >= 150000
+	install_shmem_hooks();
+#endif
+}
@@ -0,0 +1,343 @@
+/**
+ * @file   stats.c
+ * \code
+ *     Author:       Marc Munro
+ *     Copyright (c) 2021 Marc Munro
+ *     License:      GPL V3
+ *
+ * \endcode
+ * @brief
+ * Statistics for the veil2 privilege testing and session handling
+ * functions.
+ *
+ * Counters are incremented, using the FN_STAT() and SESSION_STAT()
+ * macros, in the backend-local ::veil2_stats array.  This costs no
+ * more than a memory increment so may be done on every privilege
+ * test.  At the end of each transaction, the local counters are
+ * added to shared counters, if shared memory is available, and then
+ * zeroed.  If shared memory is not available, statistics are
+ * accumulated for the current backend only.
+ *
+ * Function statistics are recorded against ::veil2_stat_fn, which
+ * each privilege testing function sets on entry and resets to
+ * STATFN_INTERNAL on exit.  This allows the lower level functions,
+ * such as the context lookups and the scope hierarchy searches, to
+ * attribute their counts to the function that called them.
+ *
+ * Timings require two clock reads per call, which is significant in
+ * relation to the cost of a privilege test, so are only recorded if
+ * the veil2.track_timing GUC is on.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
+
+#include "veil2.h"
+
+
+PG_FUNCTION_INFO_V1(veil2_function_stats);
+PG_FUNCTION_INFO_V1(veil2_session_stats);
+PG_FUNCTION_INFO_V1(veil2_reset_stats);
+
+
+/**
+ * Statistics counters recorded by this backend since the end of its
+ * last transaction.
+ */
+uint64 veil2_stats[STAT_COUNTERS];
+
+/**
+ * The function against which function statistics are currently
+ * being recorded.
+ */
+StatFunction veil2_stat_fn = STATFN_INTERNAL;
+
+/**
+ * Whether timings are to be recorded.  This is set from the
+ * veil2.track_timing GUC.
+ */
+bool veil2_track_timing = false;
+
+/**
+ * Statistics accumulated by this backend, used only if shared memory
+ * is not available.
+ */
+static uint64 backend_stats[STAT_COUNTERS];
+
+/**
+ * The time at which ::backend_stats were last reset.
+ */
+static TimestampTz backend_stats_reset = 0;
+
+/**
+ * The SQL names of each ::StatFunction.
+ */
+static const char *stat_function_names[STATFN_COUNT] = {
+	"internal",
+	"i_have_global_priv",
+	"i_have_personal_priv",
+	"i_have_priv_in_scope",
+	"i_have_priv_in_scope_or_global",
+	"i_have_priv_in_superior_scope",
+	"i_have_priv_in_scope_or_superior",
+	"i_have_priv_in_scope_or_superior_or_global",
+	"i_have_priv_in_scopes",
+	"filter_scopes_with_priv",
+	"my_scopes",
+	"i_have_any_priv"
+};
+
+
+/**
+ * Return the elapsed time since a given start time.
+ *
+ * @param start The start time, as recorded by INSTR_TIME_SET_CURRENT().
+ *
+ * @return The elapsed time in nanoseconds.
+ */
+uint64
+veil2_stat_elapsed(instr_time *start)
+{
+	instr_time now;
+
+	INSTR_TIME_SET_CURRENT(now);
+	INSTR_TIME_SUBTRACT(now, *start);
+	return (uint64) (INSTR_TIME_GET_DOUBLE(now) * 1000000000.0);
+}
+
+/**
+ * Add this backend's statistics counters to the shared counters, or
+ * to ::backend_stats if there is no shared memory, and zero them.
+ */
+void
+veil2_stats_flush(void)
+{
+	int i;
+
+	if (!veil2_shared_stats_add(veil2_stats)) {
+		for (i = 0; i < STAT_COUNTERS; i++) {
+			backend_stats[i] += veil2_stats[i];
+		}
+	}
+	memset(veil2_stats, 0, sizeof(veil2_stats));
+}
+
+/**
+ * Transaction callback.  This flushes our statistics counters at the
+ * end of each transaction.
+ *
+ * @param event The transaction event.
+ * @param arg Unused.
+ */
+static void
+stats_xact_callback(XactEvent event, void *arg)
+{
+	switch (event) {
+	case XACT_EVENT_ABORT:
+	case XACT_EVENT_PARALLEL_ABORT:
+		/* A privilege testing function may have been interrupted
+		 * by an error. */
+		veil2_stat_fn = STATFN_INTERNAL;
+		/* FALLTHROUGH */
+	case XACT_EVENT_COMMIT:
+	case XACT_EVENT_PARALLEL_COMMIT:
+	case XACT_EVENT_PREPARE:
+		veil2_stats_flush();
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Read the current statistics: the shared counters, or those for
+ * this backend if shared memory is unavailable.  Our own counters are
+ * flushed first so that they are included.
+ *
+ * @param counters Array of ::STAT_COUNTERS counters into which the
+ * statistics are returned.
+ *
+ * @return The time at which the statistics were last reset.
+ */
+static TimestampTz
+readStats(uint64 *counters)
+{
+	TimestampTz reset;
+
+	veil2_stats_flush();
+	if (!veil2_shared_stats_read(counters, &reset)) {
+		memcpy(counters, backend_stats, sizeof(backend_stats));
+		reset = backend_stats_reset;
+	}
+	return reset;
+}
+
+/**
+ * Convert a nanoseconds counter into a float8 Datum of milliseconds.
+ *
+ * @param nanosecs The counter.
+ *
+ * @return The Datum.
+ */
+static Datum
+millisecsDatum(uint64 nanosecs)
+{
+	return Float8GetDatum((double) nanosecs / 1000000.0);
+}
+
+
+/**
+ * <code>veil2.function_stats() returns setof record</code>
+ *
+ * Return statistics for each of the privilege testing functions, as
+ * accumulated across all backends since they were last reset.
+ *
+ * @return setof record (function_name, calls, true_count,
+ * false_count, memo_hits, context_lookups, context_cache_hits,
+ * index_probes, superior_lookups, bsearch_probes, hierarchy_loads,
+ * total_time)
+ */
+Datum
+veil2_function_stats(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	MemoryContext oldcontext;
+	TupleDesc tupdesc;
+	uint64 *counters;
+	int fn;
+
+	if (SRF_IS_FIRSTCALL()) {
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+		if (get_call_result_type(fcinfo, NULL,
+								 &tupdesc) != TYPEFUNC_COMPOSITE) {
+			ereport(ERROR,
+					(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+					 errmsg("function returning record called in context "
+							"that cannot accept type record")));
+		}
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+		counters = (uint64 *) palloc(sizeof(uint64) * STAT_COUNTERS);
+		(void) readStats(counters);
+		funcctx->user_fctx = (void *) counters;
+		funcctx->max_calls = STATFN_COUNT;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	fn = funcctx->call_cntr;
+	if (fn < funcctx->max_calls) {
+		Datum results[FNSTAT_COUNT + 1];
+		bool nulls[FNSTAT_COUNT + 1];
+		int i;
+
+		counters = ((uint64 *) funcctx->user_fctx) + (fn * FNSTAT_COUNT);
+		memset(nulls, 0, sizeof(nulls));
+		results[0] = CStringGetTextDatum(stat_function_names[fn]);
+		for (i = 0; i < FNSTAT_TIME; i++) {
+			results[i + 1] = Int64GetDatum((int64) counters[i]);
+		}
+		results[FNSTAT_TIME + 1] = millisecsDatum(counters[FNSTAT_TIME]);
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(
+							heap_form_tuple(funcctx->tuple_desc,
+											results, nulls)));
+	}
+	SRF_RETURN_DONE(funcctx);
+}
+
+
+/**
+ * <code>veil2.session_stats() returns record</code>
+ *
+ * Return session handling statistics, as accumulated across all
+ * backends since they were last reset.
+ *
+ * @return record (opens, registry_hits, shared_cache_hits,
+ * shared_cache_misses, computes, computed_contexts, contexts_loaded,
+ * compute_time, open_time, stats_reset)
+ */
+Datum
+veil2_session_stats(PG_FUNCTION_ARGS)
+{
+	Datum results[SESSTAT_COUNT + 1];
+	bool nulls[SESSTAT_COUNT + 1];
+	uint64 counters[STAT_COUNTERS];
+	uint64 *session_counters = counters + (STATFN_COUNT * FNSTAT_COUNT);
+	TimestampTz reset;
+	TupleDesc tuple_desc;
+	int i;
+
+	if (get_call_result_type(fcinfo, NULL,
+							 &tuple_desc) != TYPEFUNC_COMPOSITE) {
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("function returning record called in context "
+						"that cannot accept type record")));
+	}
+	tuple_desc = BlessTupleDesc(tuple_desc);
+
+	reset = readStats(counters);
+	memset(nulls, 0, sizeof(nulls));
+	for (i = 0; i < SESSTAT_COMPUTE_TIME; i++) {
+		results[i] = Int64GetDatum((int64) session_counters[i]);
+	}
+	results[SESSTAT_COMPUTE_TIME] =
+		millisecsDatum(session_counters[SESSTAT_COMPUTE_TIME]);
+	results[SESSTAT_OPEN_TIME] =
+		millisecsDatum(session_counters[SESSTAT_OPEN_TIME]);
+	if (reset) {
+		results[SESSTAT_COUNT] = TimestampTzGetDatum(reset);
+	}
+	else {
+		nulls[SESSTAT_COUNT] = true;
+	}
+	return HeapTupleGetDatum(heap_form_tuple(tuple_desc, results, nulls));
+}
+
+
+/**
+ * <code>veil2.reset_stats() returns void</code>
+ *
+ * Reset all veil2 statistics counters to zero.
+ *
+ * @return void
+ */
+Datum
+veil2_reset_stats(PG_FUNCTION_ARGS)
+{
+	TimestampTz now = GetCurrentTimestamp();
+
+	memset(veil2_stats, 0, sizeof(veil2_stats));
+	memset(backend_stats, 0, sizeof(backend_stats));
+	backend_stats_reset = now;
+	veil2_shared_stats_reset(now);
+	PG_RETURN_VOID();
+}
+
+
+/**
+ * Define the veil2.track_timing GUC and register our transaction
+ * callback.  This must be called from _PG_init(), before
+ * veil2_shmem_init() reserves the veil2 GUC prefix.
+ */
+void
+veil2_stats_init(void)
+{
+	DefineCustomBoolVariable("veil2.track_timing",
+							 "Record timings for veil2 functions.",
+							 "Timings are reported by veil2.stat_functions "
+							 "and veil2.stat_sessions.",
+							 &veil2_track_timing,
+							 false,
+							 PGC_SUSET,
+							 0,
+							 NULL, NULL, NULL);
+	backend_stats_reset = GetCurrentTimestamp();
+	RegisterXactCallback(stats_xact_callback, NULL);
+}
@@ -0,0 +1,271 @@
+/**
+ * @file   support.c
+ * \code
+ *     Author:       Marc Munro
+ *     Copyright (c) 2021 Marc Munro
+ *     License:      GPL V3
+ *
+ * \endcode
+ * @brief
+ * Planner support for the veil2 privilege testing functions.
+ *
+ * Without this, the planner assumes a default selectivity for each
+ * privilege test in a security policy, which can lead to very poor
+ * row count estimates, and so to poor join orders, for large tables.
+ * Here we estimate selectivity from the session's loaded privileges:
+ * the fraction of the distinct values of the scope column for which
+ * the session holds the privilege.  We also provide relative costs so
+ * that the cheaper tests are evaluated first.
+ *
+ * We deliberately do not implement SupportRequestSimplify to fold
+ * tests to constants.  Plans may be cached, and re-used after the
+ * session's privileges have changed (eg by prepared statements or
+ * pl/pgsql), and a plan in which a privilege test had been folded to
+ * true would then leak data.  Selectivity and cost estimates carry no
+ * such risk.
+ *
+ * Planner support functions require Postgres 12 or later.  For
+ * earlier versions, veil2_privilege_support() does nothing.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "catalog/pg_type.h"
+#include "nodes/nodeFuncs.h"
+#if PG_VERSION_NUM >= 120000
+#include "nodes/supportnodes.h"
+#include "optimizer/cost.h"
+#include "utils/lsyscache.h"
+#include "utils/selfuncs.h"
+#endif
+
+#include "veil2.h"
+
+
+PG_FUNCTION_INFO_V1(veil2_privilege_support);
+
+
+#if PG_VERSION_NUM >= 120000
+
+/**
+ * How many times more expensive than a simple privilege test is a
+ * test that must check superior scopes.
+ */
+#define SUPERIOR_COST_FACTOR 4.0
+
+/**
+ * The smallest selectivity that we will estimate.  Plans may be
+ * cached and re-used by sessions with different privileges, so we
+ * never tell the planner that a privilege test cannot succeed.
+ */
+#define MIN_PRIV_SELECTIVITY 0.001
+
+/**
+ * Describes one of the privilege testing functions.
+ */
+typedef struct {
+	/** The SQL name of the function */
+	const char *name;
+	/** Whether the function checks global scope */
+	bool global;
+	/** The scope_type_id for the function if it is implied by the
+	 * function itself, or 0 if it is given by the second argument. */
+	int scope_type;
+	/** The (zero-based) position of the scope_id argument, or -1 if
+	 * there is none. */
+	int scope_arg;
+	/** Whether the function checks superior scopes */
+	bool superior;
+} PrivTestFunction;
+
+/**
+ * The privilege testing functions that we provide support for.
+ */
+static PrivTestFunction priv_test_functions[] = {
+	{"i_have_global_priv", true, 1, -1, false},
+	{"i_have_personal_priv", false, 2, 1, false},
+	{"i_have_priv_in_scope", false, 0, 2, false},
+	{"i_have_priv_in_scope_or_global", true, 0, 2, false},
+	{"i_have_priv_in_superior_scope", false, 0, 2, true},
+	{"i_have_priv_in_scope_or_superior", false, 0, 2, true},
+	{"i_have_priv_in_scope_or_superior_or_global", true, 0, 2, true},
+	{NULL, false, 0, -1, false}
+};
+
+/**
+ * Identify which privilege testing function we are providing support
+ * for.
+ *
+ * @param funcid The Oid of the function.
+ *
+ * @return The matching ::PrivTestFunction entry or NULL.
+ */
+static PrivTestFunction *
+identifyFunction(Oid funcid)
+{
+	char *name = get_func_name(funcid);
+	PrivTestFunction *fn;
+
+	if (name) {
+		for (fn = priv_test_functions; fn->name; fn++) {
+			if (strcmp(fn->name, name) == 0) {
+				return fn;
+			}
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Get the value of an integer function argument if it is a non-null
+ * constant.
+ *
+ * @param args The function argument list.
+ * @param argno The (zero-based) position of the argument.
+ * @param p_value The value is returned through this.
+ *
+ * @return true if the argument is a non-null integer constant.
+ */
+static bool
+constIntArg(List *args, int argno, int *p_value)
+{
+	Node *arg;
+
+	if (list_length(args) <= argno) {
+		return false;
+	}
+	arg = (Node *) list_nth(args, argno);
+	if (IsA(arg, Const) && !((Const *) arg)->constisnull &&
+		(((Const *) arg)->consttype == INT4OID))
+	{
+		*p_value = DatumGetInt32(((Const *) arg)->constvalue);
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Estimate the selectivity of a privilege test.
+ *
+ * @param req The selectivity request from the planner.
+ * @param fn The privilege testing function.
+ *
+ * @return true if an estimate was made.
+ */
+static bool
+estimateSelectivity(SupportRequestSelectivity *req, PrivTestFunction *fn)
+{
+	int priv;
+	int scope_type = fn->scope_type;
+	int count;
+	bool isdefault;
+	double ndistinct;
+	VariableStatData vardata;
+
+	if (!constIntArg(req->args, 0, &priv)) {
+		return false;
+	}
+	if (fn->global) {
+		if (veil2_session_has_global_priv(priv)) {
+			req->selectivity = 1.0;
+			return true;
+		}
+		if (fn->scope_arg < 0) {
+			/* i_have_global_priv(): we know the answer, for this
+			 * session at least. */
+			req->selectivity = MIN_PRIV_SELECTIVITY;
+			return true;
+		}
+	}
+	if ((fn->scope_arg < 0) ||
+		(!scope_type && !constIntArg(req->args, 1, &scope_type)))
+	{
+		return false;
+	}
+	count = veil2_count_scopes_with_priv(priv, scope_type, fn->superior);
+	if (count < 0) {
+		return false;
+	}
+
+	/* Our estimate is the fraction of distinct values of the scope
+	 * column for which we have the privilege.  If the planner has no
+	 * statistics for it, we leave the estimate to the planner. */
+	examine_variable(req->root,
+					 (Node *) list_nth(req->args, fn->scope_arg),
+					 req->varRelid, &vardata);
+	ndistinct = get_variable_numdistinct(&vardata, &isdefault);
+	ReleaseVariableStats(vardata);
+	if (isdefault || (ndistinct <= 0.0)) {
+		return false;
+	}
+	req->selectivity = count / ndistinct;
+	CLAMP_PROBABILITY(req->selectivity);
+	if (req->selectivity < MIN_PRIV_SELECTIVITY) {
+		req->selectivity = MIN_PRIV_SELECTIVITY;
+	}
+	return true;
+}
+
+/**
+ * Estimate the cost of a privilege test.  Simple tests cost a single
+ * operator, tests that must check superior scopes cost more.
+ *
+ * @param req The cost request from the planner.
+ * @param fn The privilege testing function.
+ *
+ * @return true, indicating that an estimate was made.
+ */
+static bool
+estimateCost(SupportRequestCost *req, PrivTestFunction *fn)
+{
+	req->startup = 0.0;
+	req->per_tuple = cpu_operator_cost;
+	if (fn->superior) {
+		req->per_tuple *= SUPERIOR_COST_FACTOR;
+	}
+	return true;
+}
+
+#endif
+
+
+/**
+ * <code>veil2.privilege_support(internal) returns internal</code>
+ *
+ * Planner support function for the veil2 privilege testing
+ * functions.  This handles SupportRequestSelectivity and
+ * SupportRequestCost requests.
+ *
+ * @param internal The planner's support request node.
+ *
+ * @return The support request node if we handled it, or null.
+ */
+Datum
+veil2_privilege_support(PG_FUNCTION_ARGS)
+{
+#if PG_VERSION_NUM >= 120000
+	Node *rawreq = (Node *) PG_GETARG_POINTER(0);
+	PrivTestFunction *fn;
+
+	if (IsA(rawreq, SupportRequestSelectivity)) {
+		SupportRequestSelectivity *req =
+			(SupportRequestSelectivity *) rawreq;
+
+		if ((fn = identifyFunction(req->funcid)) &&
+			estimateSelectivity(req, fn))
+		{
+			PG_RETURN_POINTER(req);
+		}
+	}
+	else if (IsA(rawreq, SupportRequestCost)) {
+		SupportRequestCost *req = (SupportRequestCost *) rawreq;
+
+		if ((fn = identifyFunction(req->funcid)) &&
+			estimateCost(req, fn))
+		{
+			PG_RETURN_POINTER(req);
+		}
+	}
+#endif
+	PG_RETURN_POINTER(NULL);
+}
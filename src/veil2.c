@@ -13,12 +13,23 @@
  */
 
 #include "postgres.h"
+#include <ctype.h>
 #include "funcapi.h"
+#include "catalog/namespace.h"
 #include "catalog/pg_type.h"
 #include "access/xact.h"
 #include "executor/spi.h"
 #include "access/htup_details.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/inval.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#if PG_VERSION_NUM >= 140000
+#include "common/cryptohash.h"
+#include "common/sha1.h"
+#endif
 
 #include "veil2.h"
 
@@ -36,6 +47,15 @@ PG_FUNCTION_INFO_V1(veil2_session_context);
 PG_FUNCTION_INFO_V1(veil2_session_privileges); 
 PG_FUNCTION_INFO_V1(veil2_add_session_privileges); 
 PG_FUNCTION_INFO_V1(veil2_update_session_privileges); 
+PG_FUNCTION_INFO_V1(veil2_compute_session_privileges);
+PG_FUNCTION_INFO_V1(veil2_load_shared_privs);
+PG_FUNCTION_INFO_V1(veil2_load_cached_session_privs);
+PG_FUNCTION_INFO_V1(veil2_save_shared_privs);
+PG_FUNCTION_INFO_V1(veil2_clear_shared_privs);
+PG_FUNCTION_INFO_V1(veil2_filter_session_privs);
+PG_FUNCTION_INFO_V1(veil2_open_connection);
+PG_FUNCTION_INFO_V1(veil2_forget_sessions);
+PG_FUNCTION_INFO_V1(veil2_flush_sessions);
 PG_FUNCTION_INFO_V1(veil2_true);
 PG_FUNCTION_INFO_V1(veil2_i_have_global_priv);
 PG_FUNCTION_INFO_V1(veil2_i_have_personal_priv);
@@ -44,6 +64,10 @@ PG_FUNCTION_INFO_V1(veil2_i_have_priv_in_scope_or_global);
 PG_FUNCTION_INFO_V1(veil2_i_have_priv_in_superior_scope);
 PG_FUNCTION_INFO_V1(veil2_i_have_priv_in_scope_or_superior);
 PG_FUNCTION_INFO_V1(veil2_i_have_priv_in_scope_or_superior_or_global);
+PG_FUNCTION_INFO_V1(veil2_i_have_priv_in_scopes);
+PG_FUNCTION_INFO_V1(veil2_filter_scopes_with_priv);
+PG_FUNCTION_INFO_V1(veil2_my_scopes);
+PG_FUNCTION_INFO_V1(veil2_i_have_any_priv);
 PG_FUNCTION_INFO_V1(veil2_result_counts);
 PG_FUNCTION_INFO_V1(veil2_docpath);
 PG_FUNCTION_INFO_V1(veil2_datapath);
@@ -51,7 +75,7 @@ PG_FUNCTION_INFO_V1(veil2_version);
 
 
 /**
- * Used to record whether the current session's temporary tables have
+ * Used to record whether the current session's privileges have
  * been properly initialised using veil2_reset_session().  If not the
  * privilege testing functions veil2_i_have_global_priv(),
  * veil2_i_have_personal_priv(), veil2_i_have_priv_in_scope() and
@@ -75,28 +99,81 @@ static int result_counts[] = {0, 0};
 
 
 /**
- * Used to record an in-memory set of privileges associated with a
- * specfic scope (security context).
- */
-typedef struct {
-	int scope_type;
-	int scope;
-	Bitmap *roles;
-	Bitmap *privileges;
-} ContextRolePrivs;
-
-/**
- * Used to record the set of ContextPrivs for the current user's session.
+ * Used to record the set of ContextPrivs for the current user's
+ * session.  This is a structure of arrays: the scope keys are packed
+ * together, so that scans of them touch as few cache lines as
+ * possible, and the roles and privileges bitmaps are copied, one
+ * after the other, into a single data buffer, and identified by
+ * their offsets into it.  Everything is allocated in a dedicated
+ * memory context, which is visible in pg_backend_memory_contexts as
+ * "veil2 session privileges", so that clearing session privileges is
+ * a single reset of that context.
  */
 typedef struct {
+	/** Memory context for everything below */
+	MemoryContext context;
 	/** How many ContextPrivs we can currently store.  If we need
-	 * more, we have to rebuild this structure. */
+	 * more, the arrays must be extended. */
 	int array_len;
 	/** How many ContextPrivs we have for the current session. */
 	int active_contexts;
-	ContextRolePrivs context_roleprivs[0];
+	/** The scope of each ContextPrivs entry */
+	ScopeKey *keys;
+	/** The offset, in data, of each entry's roles bitmap */
+	uint32 *roles_offsets;
+	/** The offset, in data, of each entry's privileges bitmap */
+	uint32 *privs_offsets;
+	/** Buffer containing the bitmaps */
+	char *data;
+	/** The allocated size of data */
+	Size data_len;
+	/** The number of bytes of data in use */
+	Size data_used;
+	/** Whether this is retained in ::recent_sessions, in which case
+	 * it must not be modified. */
+	bool retained;
 } SessionRolePrivs;
 
+/**
+ * The number of recently opened sessions whose privileges each
+ * backend retains.  When a connection pooler switches a backend back
+ * to one of these sessions, open_connection() can re-use them rather
+ * than reloading them.
+ */
+#define RECENT_SESSIONS 8
+
+/**
+ * The generations that were current when a set of session privileges
+ * began to be loaded.  These allow us to tell whether the privileges
+ * have since become stale.
+ */
+typedef struct {
+	/** The shared generation, from veil2_privs_cache_generation(), or
+	 * 0 if there is no shared memory */
+	uint64 shared_generation;
+	/** The number of shared invalidations, from
+	 * veil2_privs_cache_invalidations(), that we have checked
+	 * against */
+	uint64 invalidations;
+	/** The backend-local accessor privileges generation, used if
+	 * there is no shared memory */
+	uint64 local_generation;
+	/** The scope hierarchy generation */
+	uint64 hierarchy_generation;
+} PrivsValidity;
+
+/**
+ * A recently opened session, whose privileges we retain.
+ */
+typedef struct {
+	int64 session_id;
+	/** The generations under which the privileges were loaded */
+	PrivsValidity validity;
+	/** When this entry was last used, for LRU replacement */
+	uint64 last_used;
+	SessionRolePrivs *roleprivs;
+} RecentSession;
+
 
 /**
  * Used to record our current session context.  This replaces a
@@ -119,10 +196,33 @@ typedef struct {
 } SessionContext;
 
 /** 
- * The SessionPrivs object for this session. 
+ * The SessionPrivs object for this session.  This is NULL until
+ * session privileges are first loaded.
  */
 static SessionRolePrivs *session_roleprivs = NULL;
 
+/**
+ * An empty SessionRolePrivs object, kept for re-use when
+ * ::session_roleprivs is replaced by, or must be detached from, a
+ * retained one.  This saves creating a new memory context each time.
+ */
+static SessionRolePrivs *spare_roleprivs = NULL;
+
+/**
+ * Our recently opened sessions, with their retained privileges.
+ */
+static RecentSession recent_sessions[RECENT_SESSIONS];
+
+/**
+ * The number of entries in use in ::recent_sessions.
+ */
+static int nrecent_sessions = 0;
+
+/**
+ * Incremented on each use of ::recent_sessions, to record last_used.
+ */
+static uint64 recent_sessions_clock = 0;
+
 /** 
  * Whether we have loaded our session's ContextPrivs into session memory.
  */
@@ -131,15 +231,446 @@ static bool session_roleprivs_loaded = false;
 static SessionContext session_context = {false, 0, 0, 0, 0,
 										 0, 0, 0, 0};
 
+/**
+ * The generations under which our session privileges were loaded.
+ */
+static PrivsValidity session_validity = {0, 0, 0, 0};
+
+/**
+ * Set while our session privileges are being reloaded by
+ * reloadSessionPrivs(), so that we do not attempt to reload them
+ * recursively.
+ */
+static bool reloading_privs = false;
+
+/**
+ * The statement start time of the command in which checkSessionPrivs()
+ * last checked our session privileges.
+ */
+static TimestampTz checked_statement_start = 0;
+
+/**
+ * The command id of the command in which checkSessionPrivs() last
+ * checked our session privileges.
+ */
+static CommandId checked_command_id = InvalidCommandId;
+
+
+/**
+ * If the range of scope_ids for a scope type is no more than this
+ * many times the number of its scopes, we index it using a
+ * direct-indexed array rather than a hash.
+ */
+#define DENSE_INDEX_FACTOR 4
+
+/**
+ * Scope types with no more than this range of scope_ids are always
+ * indexed using a direct-indexed array.
+ */
+#define DENSE_INDEX_MIN_RANGE 64
+
+/**
+ * Index of the ::session_roleprivs entries for a single scope type.
+ * Each slot contains an index into
+ * the ::session_roleprivs arrays, or -1 for an empty slot.
+ * If the scope_ids for the scope type are dense, slots is a
+ * direct-indexed array, indexed by scope_id - min_scope.  Otherwise
+ * it is an open-addressing hash table, using linear probing, with a
+ * power of 2 number of slots.
+ */
+typedef struct {
+	/** The scope_type_id being indexed */
+	int scope_type;
+	/** The number of entries for this scope type */
+	int count;
+	/** The lowest scope_id for this scope type */
+	int min_scope;
+	/** The highest scope_id for this scope type */
+	int max_scope;
+	/** Whether slots is a direct-indexed array or a hash table */
+	bool dense;
+	/** The number of slots */
+	int nslots;
+	/** The slots array */
+	int *slots;
+} ScopeTypeIndex;
+
+/**
+ * Per-scope-type index for ::session_roleprivs.  This is built
+ * lazily, on the first lookup following any change to the set of
+ * ContextRolePrivs entries, so that it is built only once for each
+ * load of session privileges.
+ */
+typedef struct {
+	/** Memory context for the index.  This is reset on each
+	 * rebuild. */
+	MemoryContext context;
+	/** Whether the index matches ::session_roleprivs */
+	bool valid;
+	/** The number of entries in types */
+	int ntypes;
+	/** Array of indexes, one per scope type */
+	ScopeTypeIndex *types;
+} SessionRolePrivsIndex;
+
+/**
+ * The index for ::session_roleprivs.
+ */
+static SessionRolePrivsIndex session_index = {NULL, false, 0, NULL};
+
+/**
+ * Incremented each time ::session_roleprivs is modified.  Any
+ * privilege test result recorded under a different generation is
+ * stale.
+ */
+static uint64 session_privs_generation = 1;
+
+
+/**
+ * The number of bits used to identify a slot in a ::PrivsMemo.
+ */
+#define PRIVS_MEMO_BITS 7
+
+/**
+ * The number of slots in a ::PrivsMemo.
+ */
+#define PRIVS_MEMO_SLOTS (1 << PRIVS_MEMO_BITS)
+
+/**
+ * A single memoized privilege test result.
+ */
+typedef struct {
+	/** Whether this slot contains a result */
+	bool valid;
+	/** The result of the privilege test */
+	bool result;
+	/** The privilege tested */
+	int priv;
+	/** The scope_type_id tested */
+	int scope_type;
+	/** The scope_id tested */
+	int scope;
+} PrivsMemoEntry;
+
+/**
+ * A per-call-site memo of privilege test results, hung off
+ * fcinfo->flinfo->fn_extra.  This is a direct-mapped table: a new
+ * result simply replaces whatever occupied its slot.  Policies
+ * typically test the same few scopes over and over, for many rows,
+ * so most tests become a single probe.
+ */
+typedef struct {
+	/** The session privileges generation for which our results are
+	 * valid */
+	uint64 session_generation;
+	/** The scope hierarchy generation for which our results are
+	 * valid */
+	uint64 hierarchy_generation;
+	/** The memoized results */
+	PrivsMemoEntry entries[PRIVS_MEMO_SLOTS];
+} PrivsMemo;
+
+/**
+ * A per-call-site memo of the result of veil2_my_scopes(), hung off
+ * fcinfo->flinfo->fn_extra.
+ */
+typedef struct {
+	/** The session privileges generation for which result is valid */
+	uint64 session_generation;
+	/** The scope hierarchy generation for which result is valid */
+	uint64 hierarchy_generation;
+	/** The privilege for which result was built */
+	int priv;
+	/** The scope_type_id for which result was built */
+	int scope_type;
+	/** The result array, allocated in fn_mcxt, or NULL */
+	ArrayType *result;
+} MyScopesMemo;
+
+/**
+ * The kinds of privilege test that may be combined in a policy for
+ * veil2_i_have_any_priv().  Each is the equivalent of one of the
+ * i_have_xxx() functions.
+ */
+typedef enum {
+	POLICY_GLOBAL = 0,
+	POLICY_PERSONAL,
+	POLICY_SCOPE,
+	POLICY_SCOPE_OR_GLOBAL,
+	POLICY_SUPERIOR,
+	POLICY_SCOPE_OR_SUPERIOR,
+	POLICY_SCOPE_OR_SUPERIOR_OR_GLOBAL
+} PolicyMode;
+
+/**
+ * A single term in a policy for veil2_i_have_any_priv().
+ */
+typedef struct {
+	PolicyMode mode;
+	/** The privilege to test for */
+	int priv;
+	/** The scope_type_id to test in, if any */
+	int scope_type;
+	/** The index, in the scope_ids argument, of the scope_id to test
+	 * in, or -1 for a global test */
+	int arg;
+	/** Cached context index, as for checkContext() */
+	int context_idx;
+} PolicyTerm;
+
+/**
+ * A parsed policy for veil2_i_have_any_priv(), hung off
+ * fcinfo->flinfo->fn_extra so that the policy is parsed only once
+ * for each call site.
+ */
+typedef struct {
+	/** The policy text from which this was parsed */
+	char *text;
+	/** The number of terms */
+	int nterms;
+	/** The number of terms that take a scope_id argument */
+	int nscopes;
+	/** Cached index of the global context */
+	int global_idx;
+	/** The terms themselves */
+	PolicyTerm *terms;
+	/** The scope_id arguments for the current call */
+	int *scopes;
+	/** Null flags for the scope_id arguments */
+	bool *nulls;
+	/** The memory context holding this parsed policy */
+	MemoryContext context;
+} PolicySpec;
+
+/**
+ * The generation number, from veil2_privs_cache_generation(), that
+ * was current when we failed to find our session's privileges in the
+ * shared cache.  This is used by veil2_save_shared_privs() and is
+ * zero if there is nothing to be saved.
+ */
+static uint64 shared_privs_generation = 0;
+
+
+/**
+ * Module initialisation.  This is called when the veil2 library is
+ * loaded.
+ */
+void
+_PG_init(void)
+{
+	/* The worker's, statistics and parallel GUCs must be defined before
+	 * veil2_shmem_init() reserves the veil2 prefix. */
+	veil2_worker_init();
+	veil2_stats_init();
+	veil2_parallel_init();
+	veil2_shmem_init();
+}
+
+
+
+/**
+ * Hash a scope_id for use in a ScopeTypeIndex hash table.
+ *
+ * @param scope The scope_id to be hashed.
+ * @param mask The number of slots in the hash table, minus 1.
+ *
+ * @return The slot at which probing should start.
+ */
+static inline int
+scopeHashSlot(int scope, int mask)
+{
+	/* Fibonacci hashing: scope_ids are often sequential, so we must
+	 * ensure that they are well-distributed. */
+	return (int) (((uint32) scope * 0x9E3779B1U) >> 7) & mask;
+}
+
+/**
+ * Return the roles bitmap for an entry in ::session_roleprivs.
+ *
+ * @param idx The index of the entry.
+ *
+ * @return The roles Bitmap.  This remains valid only until
+ * ::session_roleprivs is next modified.
+ */
+static inline Bitmap *
+contextRoles(int idx)
+{
+	return (Bitmap *) (session_roleprivs->data +
+					   session_roleprivs->roles_offsets[idx]);
+}
+
+/**
+ * Return the privileges bitmap for an entry in ::session_roleprivs.
+ *
+ * @param idx The index of the entry.
+ *
+ * @return The privileges Bitmap.  This remains valid only until
+ * ::session_roleprivs is next modified.
+ */
+static inline Bitmap *
+contextPrivileges(int idx)
+{
+	return (Bitmap *) (session_roleprivs->data +
+					   session_roleprivs->privs_offsets[idx]);
+}
+
+/**
+ * Find the ScopeTypeIndex for a given scope type, optionally
+ * creating it.  As there are usually only a handful of scope types,
+ * a linear search is used.
+ *
+ * @param scope_type The scope_type_id to look for.
+ * @param create Whether to create an entry if none is found.  There
+ * must be space for it in ::session_index.types.
+ *
+ * @return The ScopeTypeIndex, or NULL if it does not exist and
+ * create is false.
+ */
+static ScopeTypeIndex *
+findScopeTypeIndex(int scope_type, bool create)
+{
+	int i;
+	ScopeTypeIndex *type_index;
+
+	for (i = 0; i < session_index.ntypes; i++) {
+		if (session_index.types[i].scope_type == scope_type) {
+			return &(session_index.types[i]);
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	type_index = &(session_index.types[session_index.ntypes]);
+	session_index.ntypes++;
+	type_index->scope_type = scope_type;
+	type_index->count = 0;
+	type_index->slots = NULL;
+	return type_index;
+}
+
+/**
+ * Build the index for ::session_roleprivs.  This requires 2 passes
+ * through the entries: the first identifies the scope types, and
+ * the number and range of scopes for each; the second populates the
+ * slots.  Entries need not be in any particular order.
+ */
+static void
+buildSessionIndex()
+{
+	int i;
+	int64 range;
+	ScopeKey *key;
+	ScopeTypeIndex *type_index;
+	int slot;
+	int mask;
+
+	if (session_index.context) {
+		MemoryContextReset(session_index.context);
+	}
+	else {
+		session_index.context = AllocSetContextCreate(
+			TopMemoryContext, "veil2 session privileges index",
+			ALLOCSET_SMALL_SIZES);
+	}
+	session_index.ntypes = 0;
+	session_index.types = NULL;
+	if (!session_roleprivs || !session_roleprivs->active_contexts) {
+		session_index.valid = true;
+		return;
+	}
+
+	/* We cannot have more scope types than entries. */
+	session_index.types = (ScopeTypeIndex *) MemoryContextAlloc(
+		session_index.context,
+		sizeof(ScopeTypeIndex) * session_roleprivs->active_contexts);
+	for (i = 0; i < session_roleprivs->active_contexts; i++) {
+		key = &(session_roleprivs->keys[i]);
+		type_index = findScopeTypeIndex(key->scope_type, true);
+		if (type_index->count == 0) {
+			type_index->min_scope = key->scope;
+			type_index->max_scope = key->scope;
+		}
+		else if (key->scope < type_index->min_scope) {
+			type_index->min_scope = key->scope;
+		}
+		else if (key->scope > type_index->max_scope) {
+			type_index->max_scope = key->scope;
+		}
+		type_index->count++;
+	}
+
+	for (i = 0; i < session_index.ntypes; i++) {
+		type_index = &(session_index.types[i]);
+		range = (int64) type_index->max_scope -
+			(int64) type_index->min_scope + 1;
+		if ((range <= DENSE_INDEX_MIN_RANGE) ||
+			(range <= ((int64) type_index->count * DENSE_INDEX_FACTOR)))
+		{
+			type_index->dense = true;
+			type_index->nslots = (int) range;
+		}
+		else {
+			/* Keep the load factor at or below 50%. */
+			type_index->dense = false;
+			type_index->nslots = 2;
+			while (type_index->nslots < (type_index->count * 2)) {
+				type_index->nslots <<= 1;
+			}
+		}
+		type_index->slots = (int *) MemoryContextAlloc(
+			session_index.context, sizeof(int) * type_index->nslots);
+		memset(type_index->slots, -1, sizeof(int) * type_index->nslots);
+	}
+
+	for (i = 0; i < session_roleprivs->active_contexts; i++) {
+		key = &(session_roleprivs->keys[i]);
+		type_index = findScopeTypeIndex(key->scope_type, false);
+		if (type_index->dense) {
+			slot = key->scope - type_index->min_scope;
+			if (type_index->slots[slot] == -1) {
+				type_index->slots[slot] = i;
+			}
+		}
+		else {
+			mask = type_index->nslots - 1;
+			slot = scopeHashSlot(key->scope, mask);
+			while (type_index->slots[slot] != -1) {
+				if (session_roleprivs->keys[
+						type_index->slots[slot]].scope == key->scope) {
+					/* Duplicate entry: the first one wins. */
+					break;
+				}
+				slot = (slot + 1) & mask;
+			}
+			if (type_index->slots[slot] == -1) {
+				type_index->slots[slot] = i;
+			}
+		}
+	}
+	session_index.valid = true;
+}
+
+/**
+ * Mark the index for ::session_roleprivs as needing to be rebuilt.
+ * This must be called whenever ContextRolePrivs entries are added or
+ * removed.
+ */
+static void
+invalidateSessionIndex()
+{
+	session_index.valid = false;
+}
 
 /**
  * Locate a particular ContextPriv entry in ::session_roleprivs.
+ * This uses the per-scope-type index, rebuilding it first if
+ * necessary, so is O(1) regardless of the number of scopes.
  *
- * @param p_idx Pointer to a cached index value for the entry in the
- * ::session_roleprivs->active_contexts that the search should start from.
- * This allows the caller to cache the last returned index in the hope
- * that they will be looking for the same entry next time.  If no
- * cached value exists, the caller should provide -1.  The index of
+ * @param p_idx Pointer to a cached index value for the entry in
+ * the ::session_roleprivs arrays.  This allows the caller to
+ * cache the last returned index in the hope that they will be
+ * looking for the same entry next time, saving the index lookup.  If
+ * no cached value exists, the caller should provide -1.  The index of
  * the found ContextPrivs entry will be returned through this, or -1
  * if no context can be found.
  * @param scope_type The scope_type_id of the ContextPrivs entry we
@@ -151,47 +682,54 @@ static void
 findContext(int *p_idx, int scope_type, int scope)
 {
 	int this = *p_idx;
-	int cmp;
-	int lower = 0;
-	int upper;
-	ContextRolePrivs *this_cp;
+	ScopeKey *this_key;
+	ScopeTypeIndex *type_index;
+	int slot;
+	int mask;
 
+	FN_STAT(FNSTAT_CONTEXT_LOOKUPS)++;
 	if (!session_roleprivs) {
 		*p_idx = -1;
 		return;
 	}
-	upper = session_roleprivs->active_contexts - 1;
-	if (upper == 0) {
-		*p_idx = -1;
-		return;
+	if (session_index.valid &&
+		(this >= 0) && (this < session_roleprivs->active_contexts))
+	{
+		this_key = &(session_roleprivs->keys[this]);
+		if ((this_key->scope_type == scope_type) &&
+			(this_key->scope == scope))
+		{
+			FN_STAT(FNSTAT_CONTEXT_CACHE_HITS)++;
+			return;
+		}
 	}
-	else if ((this < 0) || (this >= upper)) {
-		/* Create a new start, in the middle of the contexts. */
-		this = upper >> 1;
+	if (!session_index.valid) {
+		buildSessionIndex();
 	}
-	/* Bsearch until we find a match or realise there is none. */	  
-	while (true) {
-		this_cp = &(session_roleprivs->context_roleprivs[this]);
-		cmp = this_cp->scope_type - scope_type;
-		if (!cmp) {
-			cmp = this_cp->scope - scope;
+
+	*p_idx = -1;
+	type_index = findScopeTypeIndex(scope_type, false);
+	if (!type_index) {
+		return;
+	}
+	FN_STAT(FNSTAT_INDEX_PROBES)++;
+	if (type_index->dense) {
+		if ((scope >= type_index->min_scope) &&
+			(scope <= type_index->max_scope))
+		{
+			*p_idx = type_index->slots[scope - type_index->min_scope];
 		}
-		if (!cmp) {
+		return;
+	}
+	mask = type_index->nslots - 1;
+	slot = scopeHashSlot(scope, mask);
+	while ((this = type_index->slots[slot]) != -1) {
+		if (session_roleprivs->keys[this].scope == scope) {
 			*p_idx = this;
 			return;
 		}
-		if (cmp > 0) {
-			/* We are looking for a lower value. */
-			upper = this - 1;
-		}
-		else {
-			lower = this + 1;
-		}
-		if (upper < lower) {
-			*p_idx = -1;
-			return;
-		}
-		this = (upper + lower) >> 1;
+		slot = (slot + 1) & mask;
+		FN_STAT(FNSTAT_INDEX_PROBES)++;
 	}
 }
 
@@ -222,139 +760,297 @@ checkContext(int *p_idx, int scope_type, int scope, int priv)
 	if (*p_idx == -1) {
 		return false;
 	}
-	return bitmapTestbit(
-		session_roleprivs->context_roleprivs[*p_idx].privileges, priv);
-}
-
-
-/**
- * Free a ContextRolePrivs entry.  This just means freeing the privileges
- * Bitmap and zeroing the pointer for it.
- * 
- * @param cp The ContextRolePrivs entry to be cleared out.
- */
-static void
-freeContextRolePrivs(ContextRolePrivs *cp)
-{
-	pfree((void *) cp->roles);
-	pfree((void *) cp->privileges);
-	cp->roles = NULL;
-	cp->privileges = NULL;
+	return bitmapTestbit(contextPrivileges(*p_idx), priv);
 }
 
-
 /**
- * Clear all ContextRolePrivs entries in session_roleprivs.
+ * Check whether priv has been assigned in any scope that is superior
+ * to the given scope.  This uses the in-memory scope hierarchy from
+ * veil2_superior_scopes() so requires no SPI queries, except possibly
+ * to (re)load that hierarchy.
+ *
+ * @param scope_type The scope_type_id of the scope whose superior
+ * scopes are to be checked.
+ * @param scope The scope_id of the scope whose superior scopes are to
+ * be checked.
+ * @param priv The privilege to test for.
+ *
+ * @return true if the user has priv in any superior scope.
  */
-static void
-clear_session_roleprivs()
+static bool
+checkSuperiorContexts(int scope_type, int scope, int priv)
 {
+	ScopeKey *superiors;
+	int count;
+	int idx;
 	int i;
-	MemoryContext old_context;
-	old_context = MemoryContextSwitchTo(TopMemoryContext);
 
-	if (session_roleprivs) {
-		for (i = session_roleprivs->active_contexts - 1; i >= 0; i--) {
-			freeContextRolePrivs(&session_roleprivs->context_roleprivs[i]);
+	count = veil2_superior_scopes(scope_type, scope, &superiors, NULL);
+	for (i = 0; i < count; i++) {
+		idx = -1;
+		if (checkContext(&idx, superiors[i].scope_type,
+						 superiors[i].scope, priv)) {
+			return true;
 		}
-		session_roleprivs->active_contexts = 0;
-		session_roleprivs_loaded = false;
 	}
-	MemoryContextSwitchTo(old_context);
+	return false;
 }
 
-/**
- * How many ContextPrivs entries a SessionPrivs structure will be
- * created with or extended by.
- */
-#define CONTEXT_ROLEPRIVS_INCREMENT 16
 
-/** Provide the size that we want our SessionRolePrivs structure to be.
+/**
+ * Empty a SessionRolePrivs object.  As everything is allocated in a
+ * single memory context, this is just a reset of that context.
  *
- * @param elems the number of ContextRolePrivs entries already in
- * place.  This will be increased by CONTEXT_ROLEPRIVS_INCREMENT.
+ * @param roleprivs The object to be emptied.
  */
-#define CONTEXT_ROLEPRIVS_SIZE(elems) (					\
-	sizeof(SessionRolePrivs) +							\
-	(sizeof(ContextRolePrivs) *							\
-	 (elems + CONTEXT_ROLEPRIVS_INCREMENT)))
+static void
+resetSessionRolePrivs(SessionRolePrivs *roleprivs)
+{
+	MemoryContextReset(roleprivs->context);
+	roleprivs->array_len = 0;
+	roleprivs->active_contexts = 0;
+	roleprivs->keys = NULL;
+	roleprivs->roles_offsets = NULL;
+	roleprivs->privs_offsets = NULL;
+	roleprivs->data = NULL;
+	roleprivs->data_len = 0;
+	roleprivs->data_used = 0;
+	roleprivs->retained = false;
+}
 
-/*
- * Create or extend our SessionRolePrivs structure.
+/**
+ * Dispose of a SessionRolePrivs object that is no longer needed.  It
+ * becomes our ::spare_roleprivs if we do not already have one.
  *
- * @param session_roleprivs, the current version of the struct, or
- * NULL, if it has not yet been created.
- * @result The newly allocated or extended SessionRolePrivs struct.
+ * @param roleprivs The object to be disposed of.
  */
-static SessionRolePrivs *
-extendSessionRolePrivs(SessionRolePrivs *session_roleprivs)
+static void
+discardSessionRolePrivs(SessionRolePrivs *roleprivs)
 {
-	size_t size;
-	int i;
-	if (session_roleprivs) {
-		size = CONTEXT_ROLEPRIVS_SIZE(session_roleprivs->array_len);
-		session_roleprivs = (SessionRolePrivs *)
-			realloc((void *) session_roleprivs, size);
-		session_roleprivs->array_len += CONTEXT_ROLEPRIVS_INCREMENT;
-		for (i = session_roleprivs->array_len - CONTEXT_ROLEPRIVS_INCREMENT;
-			 i < session_roleprivs->array_len; i++)
-		{
-			session_roleprivs->context_roleprivs[i].privileges = NULL;
-		}
+	if (spare_roleprivs) {
+		MemoryContextDelete(roleprivs->context);
+		pfree(roleprivs);
 	}
 	else {
-		session_roleprivs = (SessionRolePrivs *)
-			calloc(1, CONTEXT_ROLEPRIVS_SIZE(0));
-		session_roleprivs->array_len = CONTEXT_ROLEPRIVS_INCREMENT;
-	}
-	if (!session_roleprivs) {
-		ereport(ERROR,
-				(errcode(ERRCODE_INTERNAL_ERROR),
-				 errmsg("Unable to create session memory in "
-						"extendSessionPrivs()")));
+		resetSessionRolePrivs(roleprivs);
+		spare_roleprivs = roleprivs;
 	}
-	return session_roleprivs;
 }
 
-
 /**
- * Add a ContextPrivs entry to ::session_roleprivs, from the parameters.
+ * Remove an entry from ::recent_sessions.  Its privileges are
+ * discarded unless they are our current session privileges, which
+ * simply cease to be retained.
  *
- * @param scope_type The scope_type for the new entry
- * @param scope The scope scope for the new entry
- * @param roles The roles Bitmap for the new entry
- * @param privs The privileges Bitmap for the new entry
+ * @param recent The entry to be removed.
  */
 static void
-add_scope_roleprivs(int scope_type, int scope, Bitmap *roles, Bitmap *privs)
+forgetRecentSession(RecentSession *recent)
 {
-	MemoryContext old_context;
-	int idx;
-	
-	if (!session_roleprivs) {
-		session_roleprivs = extendSessionRolePrivs(NULL);
-	}
-	else if (session_roleprivs->active_contexts >=
-			 session_roleprivs->array_len) {
-		session_roleprivs = extendSessionRolePrivs(session_roleprivs);
+	SessionRolePrivs *roleprivs = recent->roleprivs;
+
+	roleprivs->retained = false;
+	if (roleprivs != session_roleprivs) {
+		discardSessionRolePrivs(roleprivs);
 	}
+	nrecent_sessions--;
+	*recent = recent_sessions[nrecent_sessions];
+}
+
+/**
+ * Ensure that ::session_roleprivs may be modified in place.  If it is
+ * retained in ::recent_sessions, it is first removed from there.
+ */
+static void
+releaseSessionRolePrivs()
+{
+	int i;
+
+	if (!(session_roleprivs && session_roleprivs->retained)) {
+		return;
+	}
+	for (i = 0; i < nrecent_sessions; i++) {
+		if (recent_sessions[i].roleprivs == session_roleprivs) {
+			forgetRecentSession(&(recent_sessions[i]));
+			return;
+		}
+	}
+}
+
+/**
+ * Clear all ContextRolePrivs entries in session_roleprivs.  If our
+ * session privileges are retained in ::recent_sessions, we leave
+ * them there, and continue with an empty set.
+ */
+static void
+clear_session_roleprivs()
+{
+	if (session_roleprivs) {
+		if (session_roleprivs->retained) {
+			/* If there is no spare, reserveSessionRolePrivs() will
+			 * create a new one when needed. */
+			session_roleprivs = spare_roleprivs;
+			spare_roleprivs = NULL;
+		}
+		else {
+			resetSessionRolePrivs(session_roleprivs);
+		}
+		session_roleprivs_loaded = false;
+	}
+	invalidateSessionIndex();
+	session_privs_generation++;
+}
+
+/**
+ * The minimum number of ContextPrivs entries that a SessionPrivs
+ * structure will be created with.  Beyond this, its arrays are
+ * doubled in size as needed.
+ */
+#define CONTEXT_ROLEPRIVS_INCREMENT 16
+
+/**
+ * The minimum size of the data buffer for a SessionPrivs structure.
+ */
+#define CONTEXT_ROLEPRIVS_DATA_SIZE 1024
+
+/**
+ * Ensure that ::session_roleprivs has space for some number of
+ * additional ContextPrivs entries, and bitmaps.  If we know how much
+ * will be loaded, as we do when loading from the shared privileges
+ * cache, reserving the space up front means that the arrays and data
+ * buffer are allocated only once.
+ *
+ * @param ncontexts The number of additional entries.
+ * @param nbytes The number of additional bytes of bitmap data,
+ * including alignment padding.
+ */
+static void
+reserveSessionRolePrivs(int ncontexts, Size nbytes)
+{
+	int needed_len;
+	int new_len;
+	Size needed_size;
+	Size new_size;
+
+	if (!session_roleprivs) {
+		session_roleprivs = (SessionRolePrivs *) MemoryContextAllocZero(
+			TopMemoryContext, sizeof(SessionRolePrivs));
+		session_roleprivs->context = AllocSetContextCreate(
+			TopMemoryContext, "veil2 session privileges",
+			ALLOCSET_DEFAULT_SIZES);
+	}
+
+	needed_len = session_roleprivs->active_contexts + ncontexts;
+	if (needed_len > session_roleprivs->array_len) {
+		new_len = Max(session_roleprivs->array_len * 2,
+					  CONTEXT_ROLEPRIVS_INCREMENT);
+		new_len = Max(new_len, needed_len);
+		if (session_roleprivs->keys) {
+			session_roleprivs->keys = (ScopeKey *) repalloc(
+				session_roleprivs->keys, sizeof(ScopeKey) * new_len);
+			session_roleprivs->roles_offsets = (uint32 *) repalloc(
+				session_roleprivs->roles_offsets, sizeof(uint32) * new_len);
+			session_roleprivs->privs_offsets = (uint32 *) repalloc(
+				session_roleprivs->privs_offsets, sizeof(uint32) * new_len);
+		}
+		else {
+			session_roleprivs->keys = (ScopeKey *) MemoryContextAlloc(
+				session_roleprivs->context, sizeof(ScopeKey) * new_len);
+			session_roleprivs->roles_offsets = (uint32 *) MemoryContextAlloc(
+				session_roleprivs->context, sizeof(uint32) * new_len);
+			session_roleprivs->privs_offsets = (uint32 *) MemoryContextAlloc(
+				session_roleprivs->context, sizeof(uint32) * new_len);
+		}
+		session_roleprivs->array_len = new_len;
+	}
+
+	needed_size = session_roleprivs->data_used + nbytes;
+	if (needed_size > session_roleprivs->data_len) {
+		new_size = Max(session_roleprivs->data_len * 2,
+					   CONTEXT_ROLEPRIVS_DATA_SIZE);
+		new_size = Max(new_size, needed_size);
+		if (new_size > PG_UINT32_MAX) {
+			ereport(ERROR,
+					(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+					 errmsg("Session privileges are too large")));
+		}
+		if (session_roleprivs->data) {
+			session_roleprivs->data = (char *) repalloc(
+				session_roleprivs->data, new_size);
+		}
+		else {
+			session_roleprivs->data = (char *) MemoryContextAlloc(
+				session_roleprivs->context, new_size);
+		}
+		session_roleprivs->data_len = new_size;
+	}
+}
+
+/**
+ * Return the space needed in the data buffer of ::session_roleprivs
+ * to record a ContextPrivs entry's bitmaps.
+ *
+ * @param roles The roles Bitmap for the entry
+ * @param privs The privileges Bitmap for the entry
+ *
+ * @return The number of bytes needed.
+ */
+static inline Size
+roleprivsDataSize(Bitmap *roles, Bitmap *privs)
+{
+	return MAXALIGN(VARSIZE(roles)) + MAXALIGN(VARSIZE(privs));
+}
+
+/**
+ * Copy a bitmap into the data buffer of ::session_roleprivs.  Space
+ * for it must already have been reserved.
+ *
+ * @param bitmap The Bitmap to be copied.
+ *
+ * @return The offset of the copy in the data buffer.
+ */
+static uint32
+storeBitmap(Bitmap *bitmap)
+{
+	uint32 offset = (uint32) session_roleprivs->data_used;
+
+	memcpy(session_roleprivs->data + offset, bitmap, VARSIZE(bitmap));
+	session_roleprivs->data_used += MAXALIGN(VARSIZE(bitmap));
+	return offset;
+}
+
+
+/**
+ * Add a ContextPrivs entry to ::session_roleprivs, from the parameters.
+ *
+ * @param scope_type The scope_type for the new entry
+ * @param scope The scope scope for the new entry
+ * @param roles The roles Bitmap for the new entry
+ * @param privs The privileges Bitmap for the new entry
+ */
+static void
+add_scope_roleprivs(int scope_type, int scope, Bitmap *roles, Bitmap *privs)
+{
+	int idx;
+
+	releaseSessionRolePrivs();
+	reserveSessionRolePrivs(1, roleprivsDataSize(roles, privs));
 	idx = session_roleprivs->active_contexts;
 	session_roleprivs->active_contexts++;
-	session_roleprivs->context_roleprivs[idx].scope_type = scope_type;
-	session_roleprivs->context_roleprivs[idx].scope = scope;
-
-	/* We copy the bitmaps in TopMemoryContext so they won't be
-	 * cleaned-up as transactions come and go. */
-	
-	old_context = MemoryContextSwitchTo(TopMemoryContext);
-	session_roleprivs->context_roleprivs[idx].roles = bitmapCopy(roles);
-	session_roleprivs->context_roleprivs[idx].privileges = bitmapCopy(privs);
-	MemoryContextSwitchTo(old_context);
+	session_roleprivs->keys[idx].scope_type = scope_type;
+	session_roleprivs->keys[idx].scope = scope;
+	session_roleprivs->roles_offsets[idx] = storeBitmap(roles);
+	session_roleprivs->privs_offsets[idx] = storeBitmap(privs);
+	invalidateSessionIndex();
+	session_privs_generation++;
+	SESSION_STAT(SESSTAT_CONTEXTS_LOADED)++;
 }
 
 /**
  * Update a ContextPrivs entry in ::session_roleprivs with new roles and
- * privs.  If there is no matching entry, we do nothing.
+ * privs.  If there is no matching entry, we do nothing.  The new
+ * bitmaps are appended to the data buffer; the space used by the old
+ * ones is not reclaimed until session privileges are next cleared.
  *
  * @param scope_type The scope_type for the entry to be updated.
  * @param scope The scope scope for the entry to be updated.
@@ -364,8 +1060,7 @@ add_scope_roleprivs(int scope_type, int scope, Bitmap *roles, Bitmap *privs)
 static void
 update_scope_roleprivs(int scope_type, int scope, Bitmap *roles, Bitmap *privs)
 {
-	int idx;
-	MemoryContext old_context;
+	int idx = -1;
 
 	findContext(&idx, scope_type, scope);
 	if (idx == -1) {
@@ -373,11 +1068,248 @@ update_scope_roleprivs(int scope_type, int scope, Bitmap *roles, Bitmap *privs)
 		 * does nothing. */
 		return;
 	}
-	old_context = MemoryContextSwitchTo(TopMemoryContext);
-	freeContextRolePrivs(&session_roleprivs->context_roleprivs[idx]);
-	session_roleprivs->context_roleprivs[idx].roles = bitmapCopy(roles);
-	session_roleprivs->context_roleprivs[idx].privileges = bitmapCopy(privs);
-	MemoryContextSwitchTo(old_context);
+	session_privs_generation++;
+	releaseSessionRolePrivs();
+	reserveSessionRolePrivs(0, roleprivsDataSize(roles, privs));
+	session_roleprivs->roles_offsets[idx] = storeBitmap(roles);
+	session_roleprivs->privs_offsets[idx] = storeBitmap(privs);
+}
+
+/**
+ * Replace ::session_roleprivs with a set of ContextRolePrivs entries,
+ * in a single operation.  Space is reserved once for all entries,
+ * and the index is built immediately, rather than on the next
+ * privilege test.  Entries need not be in any particular order but
+ * should not contain duplicates.
+ *
+ * @param roleprivs Array of entries to be loaded.
+ * @param count The number of entries.
+ */
+static void
+loadSessionRolePrivs(ContextRolePrivs *roleprivs, int count)
+{
+	Size nbytes = 0;
+	int i;
+
+	clear_session_roleprivs();
+	for (i = 0; i < count; i++) {
+		nbytes += roleprivsDataSize(roleprivs[i].roles,
+									roleprivs[i].privileges);
+	}
+	reserveSessionRolePrivs(count, nbytes);
+	for (i = 0; i < count; i++) {
+		session_roleprivs->keys[i].scope_type = roleprivs[i].scope_type;
+		session_roleprivs->keys[i].scope = roleprivs[i].scope;
+		session_roleprivs->roles_offsets[i] =
+			storeBitmap(roleprivs[i].roles);
+		session_roleprivs->privs_offsets[i] =
+			storeBitmap(roleprivs[i].privileges);
+	}
+	session_roleprivs->active_contexts = count;
+	SESSION_STAT(SESSTAT_CONTEXTS_LOADED) += count;
+	buildSessionIndex();
+}
+
+
+/**
+ * Calculate the size of the ::PackedSessionPrivs needed to record
+ * ::session_roleprivs.
+ *
+ * @return The size in bytes.
+ */
+static Size
+packedSessionPrivsSize()
+{
+	Size size;
+	int i;
+
+	size = MAXALIGN(offsetof(PackedSessionPrivs, entries) +
+					(sizeof(PackedRolePrivs) *
+					 session_roleprivs->active_contexts));
+	for (i = 0; i < session_roleprivs->active_contexts; i++) {
+		size += roleprivsDataSize(contextRoles(i), contextPrivileges(i));
+	}
+	return size;
+}
+
+/**
+ * A PrivsCacheWriter() function to pack ::session_roleprivs into a
+ * ::PackedSessionPrivs.
+ *
+ * @param packed The space into which we will write.
+ * @param size The size of that space, as given by
+ * packedSessionPrivsSize().
+ * @param arg Unused.
+ */
+static void
+packSessionPrivs(PackedSessionPrivs *packed, Size size, void *arg)
+{
+	Size offset;
+	int i;
+	Bitmap *roles;
+	Bitmap *privs;
+	PackedRolePrivs *entry;
+
+	packed->size = (uint32) size;
+	packed->nentries = session_roleprivs->active_contexts;
+	offset = MAXALIGN(offsetof(PackedSessionPrivs, entries) +
+					  (sizeof(PackedRolePrivs) * packed->nentries));
+	for (i = 0; i < packed->nentries; i++) {
+		roles = contextRoles(i);
+		privs = contextPrivileges(i);
+		entry = &(packed->entries[i]);
+		entry->scope_type = session_roleprivs->keys[i].scope_type;
+		entry->scope = session_roleprivs->keys[i].scope;
+		entry->roles_offset = (uint32) offset;
+		memcpy(((char *) packed) + offset, roles, VARSIZE(roles));
+		offset += MAXALIGN(VARSIZE(roles));
+		entry->privs_offset = (uint32) offset;
+		memcpy(((char *) packed) + offset, privs, VARSIZE(privs));
+		offset += MAXALIGN(VARSIZE(privs));
+	}
+	Assert(offset == size);
+}
+
+/**
+ * A PrivsCacheReader() function to load ::session_roleprivs from a
+ * ::PackedSessionPrivs.  The packed entries are loaded in a single
+ * operation by loadSessionRolePrivs(), with the bitmaps copied
+ * directly from the packed privileges.
+ *
+ * @param packed The packed privileges to be loaded.
+ * @param arg Unused.
+ */
+static void
+unpackSessionPrivs(PackedSessionPrivs *packed, void *arg)
+{
+	ContextRolePrivs *roleprivs;
+	PackedRolePrivs *entry;
+	int i;
+
+	roleprivs = (ContextRolePrivs *) palloc(
+		sizeof(ContextRolePrivs) * (packed->nentries + 1));
+	for (i = 0; i < packed->nentries; i++) {
+		entry = &(packed->entries[i]);
+		roleprivs[i].scope_type = entry->scope_type;
+		roleprivs[i].scope = entry->scope;
+		roleprivs[i].roles =
+			(Bitmap *) (((char *) packed) + entry->roles_offset);
+		roleprivs[i].privileges =
+			(Bitmap *) (((char *) packed) + entry->privs_offset);
+	}
+	loadSessionRolePrivs(roleprivs, packed->nentries);
+	pfree(roleprivs);
+}
+
+/**
+ * The header of our session state, as shipped to parallel workers.
+ * It is followed, at offset ::SESSION_STATE_PRIVS_OFFSET, by a
+ * ::PackedSessionPrivs.
+ */
+typedef struct {
+	bool ready;
+	SessionContext context;
+} SessionStateHeader;
+
+/**
+ * The offset of the ::PackedSessionPrivs within our shipped session
+ * state.
+ */
+#define SESSION_STATE_PRIVS_OFFSET MAXALIGN(sizeof(SessionStateHeader))
+
+/**
+ * Return the generation of our session state, for parallel.c.  This
+ * changes whenever our session privileges or context change.
+ *
+ * @return The generation number.
+ */
+uint64
+veil2_session_state_generation(void)
+{
+	return session_privs_generation;
+}
+
+/**
+ * Return the space needed to record our session state, for
+ * parallel.c.
+ *
+ * @return The size in bytes.
+ */
+Size
+veil2_session_state_size(void)
+{
+	if (session_roleprivs && session_roleprivs->active_contexts) {
+		return SESSION_STATE_PRIVS_OFFSET + packedSessionPrivsSize();
+	}
+	return SESSION_STATE_PRIVS_OFFSET +
+		MAXALIGN(offsetof(PackedSessionPrivs, entries));
+}
+
+/**
+ * Record our session state, for parallel.c to ship to parallel
+ * workers.
+ *
+ * @param dest The space into which we will write.
+ * @param size The size of that space, as given by
+ * veil2_session_state_size().
+ */
+void
+veil2_session_state_pack(void *dest, Size size)
+{
+	SessionStateHeader *header = (SessionStateHeader *) dest;
+	PackedSessionPrivs *packed = (PackedSessionPrivs *)
+		(((char *) dest) + SESSION_STATE_PRIVS_OFFSET);
+
+	header->ready = session_ready;
+	header->context = session_context;
+	if (session_roleprivs && session_roleprivs->active_contexts) {
+		packSessionPrivs(packed, size - SESSION_STATE_PRIVS_OFFSET, NULL);
+	}
+	else {
+		packed->size = (uint32) (size - SESSION_STATE_PRIVS_OFFSET);
+		packed->nentries = 0;
+	}
+}
+
+/**
+ * Restore our session state, in a parallel worker, from that recorded
+ * by veil2_session_state_pack() in the leader.
+ *
+ * @param src The recorded session state.
+ */
+void
+veil2_session_state_unpack(void *src)
+{
+	SessionStateHeader *header = (SessionStateHeader *) src;
+	PackedSessionPrivs *packed = (PackedSessionPrivs *)
+		(((char *) src) + SESSION_STATE_PRIVS_OFFSET);
+
+	session_context = header->context;
+	if (packed->nentries) {
+		unpackSessionPrivs(packed, NULL);
+	}
+	else {
+		clear_session_roleprivs();
+	}
+	session_ready = header->ready;
+}
+
+/**
+ * Build a key for the shared privileges cache from our session
+ * context.
+ *
+ * @param key The ::PrivsCacheKey to be populated.
+ */
+static void
+sessionPrivsCacheKey(PrivsCacheKey *key)
+{
+	key->accessor_id = session_context.accessor_id;
+	key->login_context_type_id = session_context.login_context_type_id;
+	key->login_context_id = session_context.login_context_id;
+	key->session_context_type_id = session_context.session_context_type_id;
+	key->session_context_id = session_context.session_context_id;
+	key->mapping_context_type_id = session_context.mapping_context_type_id;
+	key->mapping_context_id = session_context.mapping_context_id;
 }
 
 
@@ -398,132 +1330,151 @@ error_if_no_session()
 	static bool error = true;
 	bool pushed;
 	if (!init_done) {
+		/* This must be read-only as we may be in a parallel
+		 * worker. */
 		veil2_spi_connect(&pushed, "error_if_no_session() (1)");
-		(void) veil2_bool_from_query(
+		(void) veil2_query(
 			"select parameter_value::boolean"
 			"  from veil2.system_parameters"
 			" where parameter_name = 'error on uninitialized session'",
-			0, NULL, NULL, NULL, &error);
+			0, NULL, NULL,
+			true, NULL,
+			fetch_one_bool, (void *) &error);
 		veil2_spi_finish(pushed, "error_if_no_session (2)");
 		init_done = true;
 	}
 	return error;
 }
 
-/** 
- * This is a Fetch_fn() for dealing with tuples containing 2 integers.
- * Its job is to populate the p_result parameter with 2 integers
- * from a Postgres SPI query.
- * 
- * @param tuple  The ::HeapTuple returned from a Postgres SPI query.
- * This will contain a tuple of 2 integers.
- * @param tupdesc The ::TupleDesc returned from the same Postgres SPI query
- * @param p_result Pointer to a ::tuple_2ints struct into which the 2
- * integers from the SPI query will be placed.
+/**
+ * Oid of veil2.accessor_privileges_cache, used to identify relevant
+ * relcache invalidations.
+ */
+static Oid accessor_privs_relid = InvalidOid;
+
+/**
+ * Incremented whenever we receive a relcache invalidation for
+ * veil2.accessor_privileges_cache, which veil2_clear_shared_privs()
+ * requests whenever any accessor's roles or privileges may have
+ * changed.  Any privileges that we retain in backend memory, and
+ * which were computed under a different generation, are stale.
+ */
+static uint64 accessor_privs_generation = 1;
+
+/**
+ * Relcache invalidation callback.  If the invalidation is for
+ * veil2.accessor_privileges_cache, or for all relations, we
+ * increment ::accessor_privs_generation.
  *
- * @return <code>bool</code> false, indicating to veil2_query() that
- * no more rows are expected.
+ * @param arg Unused
+ * @param relid The Oid of the invalidated relation, or InvalidOid if
+ * all relations are being invalidated.
  */
-static bool
-fetch_2ints(HeapTuple tuple, TupleDesc tupdesc, void *p_result)
+static void
+accessor_privs_inval(Datum arg, Oid relid)
 {
-	bool isnull;
-	tuple_2ints *my_tup = (tuple_2ints *) p_result;
-    my_tup->f1 = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 1, &isnull));
-    my_tup->f2 = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 2, &isnull));
-
-	return false;  // No need to continue processing after this
+	if ((relid == InvalidOid) || (relid == accessor_privs_relid)) {
+		accessor_privs_generation++;
+	}
 }
 
+/**
+ * Return the current accessor privileges generation, first ensuring
+ * that we will be notified of relevant invalidations.
+ *
+ * @return The generation number.
+ */
+static uint64
+accessorPrivsGeneration()
+{
+	static bool callback_registered = false;
 
-/** 
- * Create a temporary table used for handling privileges in become_user.
- * Originally, more temp tables were used but these have been replaced
- * by in memory structures for performance and security.
+	if (!callback_registered) {
+		CacheRegisterRelcacheCallback(accessor_privs_inval, (Datum) 0);
+		callback_registered = true;
+	}
+	if (!OidIsValid(accessor_privs_relid)) {
+		accessor_privs_relid = get_relname_relid(
+			"accessor_privileges_cache", get_namespace_oid("veil2", false));
+		/* We may have missed invalidations until now. */
+		accessor_privs_generation++;
+	}
+	return accessor_privs_generation;
+}
+
+/**
+ * Record, in ::session_validity, the generations that are current
+ * before our session privileges begin to be loaded.  Any
+ * invalidation made after this will cause them to be reloaded.
  */
 static void
-create_temp_tables()
+stampPrivsValidity()
 {
-	(void) veil2_query(
-		"create temporary table veil2_ancestor_privileges"
-		"    of veil2.session_privileges_t",
-		0, NULL, NULL,
-		false, NULL,
-		NULL, NULL);
+	session_validity.shared_generation = veil2_privs_cache_generation();
+	session_validity.invalidations = veil2_privs_cache_invalidations();
+	session_validity.local_generation = accessorPrivsGeneration();
+	session_validity.hierarchy_generation =
+		veil2_scope_hierarchy_generation();
 }
 
+/**
+ * Predicate identifying whether privileges loaded for our current
+ * session context are still valid.  If shared memory is available
+ * we can determine this precisely, for the session's accessor, using
+ * the shared generations.  Otherwise any change to any accessor's
+ * privileges, as notified through relcache invalidations, makes them
+ * invalid.  For become_user() sessions, whose privileges also depend
+ * on those of their ancestor sessions, any invalidation at all makes
+ * them invalid.
+ *
+ * @param validity The generations recorded when the privileges
+ * began to be loaded.
+ *
+ * @return true if the privileges are still valid.
+ */
+static bool
+privsValid(PrivsValidity *validity)
+{
+	if (validity->hierarchy_generation !=
+		veil2_scope_hierarchy_generation())
+	{
+		return false;
+	}
+	if (!validity->shared_generation) {
+		return validity->local_generation == accessorPrivsGeneration();
+	}
+	if (validity->invalidations == veil2_privs_cache_invalidations()) {
+		return true;
+	}
+	if (session_context.parent_session_id != session_context.session_id) {
+		return false;
+	}
+	return !veil2_privs_cache_stale(session_context.accessor_id,
+									validity->shared_generation);
+}
 
 /**
- * Does the database donkey-work for veil2_reset_session().
+ * Does the donkey-work for veil2_reset_session().  Session privileges
+ * and context are held only in backend memory, so there is nothing
+ * that a user could have tampered with and no catalog check is
+ * needed.  The temporary table that was once used by become_user(),
+ * and which required such a check on every reset, has been replaced
+ * by in-memory filtering.  We record the current privilege
+ * generations, so that we can later tell whether the privileges that
+ * are about to be loaded have become stale.
  * 
- * @param clear_context  Whether veil2_session_context should be
- * cleared as well as the privileges temp tables.
+ * @param clear_context  Whether the session context should be
+ * cleared as well as the session privileges.
  */
 static void
 do_reset_session(bool clear_context)
 {
-	tuple_2ints my_tup;
-	int processed;
-
-	processed = veil2_query(
-		"select count(*)::integer,"
-		"       sum(case when c.relacl is null then 1 else 0 end)"
-		"  from pg_catalog.pg_class c"
-		" where c.relname = 'veil2_ancestor_privileges'"
-		"   and c.relkind = 'r'"
-		"   and c.relpersistence = 't'"
-		"   and pg_catalog.pg_table_is_visible(c.oid)",
-		0, NULL, NULL,
-		false, 	NULL,
-		fetch_2ints, (void *) &my_tup);
-
-	if (processed == 0) {
-		/* Unexpected error in query. */
-		ereport(ERROR,
-				(errcode(ERRCODE_INTERNAL_ERROR),
-				 errmsg("Temp tables query fails in veil2_reset_session()")));
-	}
-	else {
-		if (processed != 1) {
-			/* This should be impossible. */
-			ereport(ERROR,
-					(errcode(ERRCODE_INTERNAL_ERROR),
-					 errmsg("Unexpected processing error in "
-							"veil2_reset_session: %d", processed)));
-		}
-		if (my_tup.f1 == 0) {
-			/* We have no temp table, so let's create it. */
-			create_temp_tables();
-			session_ready = true;
-		}
-		else if (my_tup.f1 == 1) {
-			/* We have the expected temp tables - check that access
-			 * is properly limited. */
-			if (my_tup.f2 != 1) {
-				ereport(ERROR,
-						(errcode(ERRCODE_INTERNAL_ERROR),
-						 errmsg("Unexpected access to temp table in "
-								"veil2_reset_session"),
-						 errdetail("This indicates an attempt to bypass "
-								   "VPD security!")));
-			}
-			/* Access to temp tables looks kosher.  Truncate the
-			 * tables. */
-			if (clear_context) {
-				session_context.loaded = false;
-			}
-			clear_session_roleprivs();
-			session_ready = true;
-		}
-		else {
-			ereport(ERROR,
-					(errcode(ERRCODE_INTERNAL_ERROR),
-					 errmsg("Unexpected count of temp tables in "
-							"veil2_reset_session: %d", my_tup.f1),
-					 errdetail("This indicates an attempt to bypass "
-							   "VPD security!")));
-		}
+	if (clear_context) {
+		session_context.loaded = false;
 	}
+	clear_session_roleprivs();
+	stampPrivsValidity();
+	session_ready = true;
 }
 
 
@@ -538,6 +1489,9 @@ do_reset_session(bool clear_context)
 Datum
 veil2_session_ready(PG_FUNCTION_ARGS)
 {
+	if (!session_ready) {
+		veil2_parallel_restore();
+	}
     PG_RETURN_BOOL(session_ready);
 }
 
@@ -546,9 +1500,9 @@ veil2_session_ready(PG_FUNCTION_ARGS)
  * <code>veil2.reset_session() returns void</code> 
  *
  * Resets a postgres session prior to the recording of session
- * privilege information.  This ensures that the Veil2 temporary
- * tables, on which our security depends, exist and have not been
- * tamperered with.  Unless this function succeeds, the privilege
+ * privilege information.  This clears any existing session context
+ * and privileges.  No queries are performed.  Unless this function
+ * has been called, the privilege
  * testing functions veil2_i_have_global_priv(),
  * veil2_i_have_personal_priv(), veil2_i_have_priv_in_scope() and
  * veil2_i_have_priv_in_superior_scope() will always return false.
@@ -558,31 +1512,22 @@ veil2_session_ready(PG_FUNCTION_ARGS)
 Datum
 veil2_reset_session(PG_FUNCTION_ARGS)
 {
-	bool pushed;
-	
-	session_ready = false;
-	veil2_spi_connect(&pushed, "failed to reset session (1)");
 	do_reset_session(true);
-	veil2_spi_finish(pushed, "failed to reset session (2)");
  	PG_RETURN_VOID();
 }
 
 /** 
  * <code>veil2.reset_session_privs() returns void</code> 
  *
- * Clears the temp table and cached privileges for a postgres
- * session and reloads them.
+ * Clears the cached privileges for a postgres session, retaining
+ * its session context.
  *
  * @return void
  */
 Datum
 veil2_reset_session_privs(PG_FUNCTION_ARGS)
 {
-	bool pushed;
-
-	veil2_spi_connect(&pushed, "failed to reset session privs (1)");
 	do_reset_session(false);
-	veil2_spi_finish(pushed, "failed to reset session privs (2)");
  	PG_RETURN_VOID();
 }
 
@@ -630,6 +1575,8 @@ veil2_session_context(PG_FUNCTION_ARGS)
 			session_context.parent_session_id = PG_GETARG_INT64(8);
 		}
 		session_context.loaded = true;
+		/* Any session state shipped to parallel workers is stale. */
+		session_privs_generation++;
 	}
 	if (session_context.loaded) {
 		results[0] = Int32GetDatum(session_context.accessor_id);
@@ -702,11 +1649,9 @@ veil2_session_privileges(PG_FUNCTION_ARGS)
 		HeapTuple tuple;
 		Datum datum;
 		Bitmap *bitmap;
-		results[0] = Int32GetDatum(session_roleprivs->
-								   context_roleprivs[idx].scope_type);
-		results[1] = Int32GetDatum(session_roleprivs->
-								   context_roleprivs[idx].scope);
-		bitmap = session_roleprivs->context_roleprivs[idx].roles;
+		results[0] = Int32GetDatum(session_roleprivs->keys[idx].scope_type);
+		results[1] = Int32GetDatum(session_roleprivs->keys[idx].scope);
+		bitmap = contextRoles(idx);
         oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
 		if (bitmap) {
 			results[2] = (Datum) bitmapCopy(bitmap);
@@ -714,7 +1659,7 @@ veil2_session_privileges(PG_FUNCTION_ARGS)
 		else {
 			nulls[2] = true;
 		}
-		bitmap = session_roleprivs->context_roleprivs[idx].privileges;
+		bitmap = contextPrivileges(idx);
 		if (bitmap) {
 			results[3] = (Datum) bitmapCopy(bitmap);
 		}
@@ -738,10 +1683,10 @@ veil2_session_privileges(PG_FUNCTION_ARGS)
  * <code>veil2.add_session_privileges(scope_type_id, scope_id,
  *                              roles, privileges)</code> 
  *
- * Create a new in-memory session_privileges record.  Note that this
- * *must* be called with records ordered by scope_type_id, and
- * scope_id.  This is because we use a binary search to match the
- * relevant scope when "querying" this structure internally.
+ * Create a new in-memory session_privileges record.  Records may be
+ * added in any order, as the per-scope-type index used to match the
+ * relevant scope when "querying" this structure internally is
+ * rebuilt on the next privilege test.
  * @param integer scope_type_id The type of scope
  * @param integer scope_id The id of the actual scope
  * @param Bitmap roles The roles assigned in the context for this scope
@@ -783,350 +1728,3197 @@ Datum veil2_update_session_privileges(PG_FUNCTION_ARGS)
 	PG_RETURN_VOID();
 }
 
+/**
+ * Used by veil2_compute_session_privileges() to record the computed
+ * privileges between calls.
+ */
+typedef struct {
+	int count;
+	int idx;
+	ContextRolePrivs *roleprivs;
+} ComputedPrivs;
+
 /** 
- * <code>veil2.true(params) returns bool</code> 
+ * <code>veil2.compute_session_privileges(load bool) returns setof
+ * veil2.session_privileges_t</code>
  *
- * Always return true, regardless of parameters.  This is used to
- * determine the minimum possible overhead for a privilege testing
- * predicate, for performance measurements.
+ * Compute the roles and privileges for the current session, giving
+ * the same results as veil2.session_privileges_v, but without the
+ * overhead of that view.  If load is true, the in-memory
+ * session_privileges are replaced with the results, which saves the
+ * caller from having to call veil2_add_session_privileges() for each
+ * one.
  *
- * @return boolean true
+ * @param boolean load Whether to load the results as our session
+ * privileges.
+ * @return setof record
  */
 Datum
-veil2_true(PG_FUNCTION_ARGS)
+veil2_compute_session_privileges(PG_FUNCTION_ARGS)
 {
-	return true;
-}
+    FuncCallContext *funcctx;
+	MemoryContext oldcontext;
+	ComputedPrivs *computed;
+	PrivsCacheKey key;
+	bool nulls[4] = {false, false, false, false};
+	
+    if (SRF_IS_FIRSTCALL()) {
+		funcctx = SRF_FIRSTCALL_INIT();
+        oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+        funcctx->tuple_desc = BlessTupleDesc(
+			RelationNameGetTupleDesc("veil2.session_privileges_t"));
+		computed = (ComputedPrivs *) palloc0(sizeof(ComputedPrivs));
+		if (session_context.loaded) {
+			sessionPrivsCacheKey(&key);
+			computed->count = veil2_compute_session_privs(
+				&key, &computed->roleprivs);
+		}
+		funcctx->user_fctx = (void *) computed;
+        MemoryContextSwitchTo(oldcontext);
+
+		if (PG_GETARG_BOOL(0)) {
+			loadSessionRolePrivs(computed->roleprivs, computed->count);
+		}
+	}
+	
+	funcctx = SRF_PERCALL_SETUP();
+	computed = (ComputedPrivs *) funcctx->user_fctx;
+
+	if (computed->idx < computed->count) {
+		Datum results[4];
+		HeapTuple tuple;
+		ContextRolePrivs *cp = &(computed->roleprivs[computed->idx]);
+
+		results[0] = Int32GetDatum(cp->scope_type);
+		results[1] = Int32GetDatum(cp->scope);
+		results[2] = PointerGetDatum(cp->roles);
+		results[3] = PointerGetDatum(cp->privileges);
+		tuple = heap_form_tuple(funcctx->tuple_desc, results, nulls);
+		computed->idx++;
+        SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+	else {
+		SRF_RETURN_DONE(funcctx);
+	}
+}
+
+/** 
+ * <code>veil2.load_shared_privs() returns bool</code>
+ *
+ * Load our session's privileges from the shared accessor privileges
+ * cache, if they can be found there.  If they cannot, we record the
+ * current shared cache generation, so that veil2_save_shared_privs()
+ * can later save our privileges once they have been loaded by other
+ * means.
+ *
+ * @return boolean true if the privileges were loaded.
+ */
+Datum
+veil2_load_shared_privs(PG_FUNCTION_ARGS)
+{
+	PrivsCacheKey key;
+	bool found = false;
+
+	shared_privs_generation = 0;
+	if (session_context.loaded) {
+		sessionPrivsCacheKey(&key);
+		found = veil2_privs_cache_lookup(&key, unpackSessionPrivs, NULL);
+		if (!found) {
+			shared_privs_generation = veil2_privs_cache_generation();
+		}
+	}
+	PG_RETURN_BOOL(found);
+}
+
+
+/** 
+ * <code>veil2.load_cached_session_privs() returns integer</code>
+ *
+ * Load our session's privileges from
+ * veil2.accessor_privileges_cache in a single query.  This replaces
+ * calling veil2.add_session_privileges() for each row, avoiding the
+ * per-row function call overhead and the incremental growth of our
+ * session privileges arrays.  Duplicate rows are ignored.
+ *
+ * @return integer The number of scopes loaded.
+ */
+Datum
+veil2_load_cached_session_privs(PG_FUNCTION_ARGS)
+{
+	PrivsCacheKey key;
+	ContextRolePrivs *roleprivs;
+	int count = 0;
+
+	clear_session_roleprivs();
+	if (session_context.loaded) {
+		sessionPrivsCacheKey(&key);
+		count = veil2_fetch_cached_session_privs(&key, &roleprivs);
+		if (count) {
+			loadSessionRolePrivs(roleprivs, count);
+			pfree(roleprivs);
+		}
+	}
+	PG_RETURN_INT32(count);
+}
+
+
+/** 
+ * <code>veil2.save_shared_privs() returns void</code>
+ *
+ * Save our session's privileges into the shared accessor privileges
+ * cache.  This does nothing unless there has been a preceding call to
+ * veil2_load_shared_privs() which failed to find them.
+ *
+ * @return void
+ */
+Datum
+veil2_save_shared_privs(PG_FUNCTION_ARGS)
+{
+	PrivsCacheKey key;
+
+	if (shared_privs_generation && session_context.loaded &&
+		session_roleprivs && session_roleprivs->active_contexts)
+	{
+		sessionPrivsCacheKey(&key);
+		veil2_privs_cache_store(&key, shared_privs_generation,
+								packedSessionPrivsSize(),
+								packSessionPrivs, NULL);
+	}
+	shared_privs_generation = 0;
+	PG_RETURN_VOID();
+}
+
+
+/** 
+ * <code>veil2.clear_shared_privs(accessor_id) returns void</code>
+ *
+ * Invalidate shared accessor privileges cache entries for the given
+ * accessor, or for all accessors if accessor_id is null.
+ *
+ * @param integer accessor_id The accessor whose cached privileges are
+ * to be invalidated, or null.
+ * @return void
+ */
+Datum
+veil2_clear_shared_privs(PG_FUNCTION_ARGS)
+{
+	Oid relid;
+
+	if (PG_ARGISNULL(0)) {
+		veil2_privs_cache_invalidate(0, true);
+	}
+	else {
+		veil2_privs_cache_invalidate(PG_GETARG_INT32(0), false);
+	}
+	/* Ordinary DML on accessor_privileges_cache causes no relcache
+	 * invalidation, so we request one.  This is what causes each
+	 * backend to discard its cached ancestor privileges. */
+	relid = get_relname_relid("accessor_privileges_cache",
+							  get_namespace_oid("veil2", false));
+	if (OidIsValid(relid)) {
+		CacheInvalidateRelcacheByRelid(relid);
+	}
+	PG_RETURN_VOID();
+}
+
+
+/**
+ * The maximum number of parent sessions for which we cache ancestor
+ * privileges.
+ */
+#define ANCESTOR_CACHE_SIZE 8
+
+/**
+ * The combined privileges of a chain of ancestor sessions, as
+ * computed by veil2_compute_ancestor_privs(), for a become_user()
+ * parent session.
+ */
+typedef struct {
+	/** The parent session, the first in the chain */
+	int64 session_id;
+	/** Memory context for the roleprivs array and its bitmaps */
+	MemoryContext context;
+	/** When this entry was last used, for LRU replacement */
+	uint64 last_used;
+	/** The number of entries in roleprivs */
+	int count;
+	/** The ancestor privileges, sorted by scope_type and scope */
+	ContextRolePrivs *roleprivs;
+} AncestorPrivs;
+
+/**
+ * A small per-backend cache of ::AncestorPrivs.  Ancestor privileges
+ * depend on the role and privilege assignments of each ancestor
+ * accessor, and on the scope hierarchy.  The cache is discarded
+ * whenever the accessor privileges generation or the scope hierarchy
+ * generation changes.
+ */
+typedef struct {
+	/** Memory context under which each entry's context is created.
+	 * This is visible in pg_backend_memory_contexts as "veil2
+	 * ancestor privileges". */
+	MemoryContext context;
+	/** The accessor privileges generation for which the entries
+	 * were computed. */
+	uint64 privs_generation;
+	/** The scope hierarchy generation for which the entries were
+	 * computed. */
+	uint64 hierarchy_generation;
+	/** Incremented on each lookup, to record last_used */
+	uint64 clock;
+	/** The number of entries in use */
+	int nentries;
+	AncestorPrivs entries[ANCESTOR_CACHE_SIZE];
+} AncestorPrivsCache;
+
+static AncestorPrivsCache ancestor_cache = {NULL, 0, 0, 0, 0};
+
+/**
+ * Ensure that ::ancestor_cache may be used, discarding its entries if
+ * they have been invalidated.
+ */
+static void
+checkAncestorCache()
+{
+	uint64 privs_generation = accessorPrivsGeneration();
+
+	if (!ancestor_cache.context) {
+		ancestor_cache.context = AllocSetContextCreate(
+			TopMemoryContext, "veil2 ancestor privileges",
+			ALLOCSET_SMALL_SIZES);
+	}
+	if ((ancestor_cache.privs_generation == privs_generation) &&
+		(ancestor_cache.hierarchy_generation ==
+		 veil2_scope_hierarchy_generation()))
+	{
+		return;
+	}
+	/* This deletes each entry's context. */
+	MemoryContextReset(ancestor_cache.context);
+	ancestor_cache.nentries = 0;
+	ancestor_cache.privs_generation = privs_generation;
+	ancestor_cache.hierarchy_generation = veil2_scope_hierarchy_generation();
+}
+
+/**
+ * Find the cached ancestor privileges for a parent session.
+ * checkAncestorCache() must have been called first.
+ *
+ * @param session_id The parent session.
+ *
+ * @return The ::AncestorPrivs entry, or NULL if there is none.
+ */
+static AncestorPrivs *
+findAncestorPrivs(int64 session_id)
+{
+	int i;
+
+	for (i = 0; i < ancestor_cache.nentries; i++) {
+		if (ancestor_cache.entries[i].session_id == session_id) {
+			ancestor_cache.entries[i].last_used = ++ancestor_cache.clock;
+			return &(ancestor_cache.entries[i]);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Add a copy of newly computed ancestor privileges to
+ * ::ancestor_cache, replacing the least recently used entry if the
+ * cache is full.
+ *
+ * @param session_id The parent session.
+ * @param roleprivs The ancestor privileges.
+ * @param count The number of entries in roleprivs.
+ *
+ * @return The new ::AncestorPrivs entry.
+ */
+static AncestorPrivs *
+storeAncestorPrivs(int64 session_id, ContextRolePrivs *roleprivs, int count)
+{
+	AncestorPrivs *entry;
+	MemoryContext old_context;
+	int i;
+
+	if (ancestor_cache.nentries < ANCESTOR_CACHE_SIZE) {
+		entry = &(ancestor_cache.entries[ancestor_cache.nentries]);
+		ancestor_cache.nentries++;
+	}
+	else {
+		entry = &(ancestor_cache.entries[0]);
+		for (i = 1; i < ANCESTOR_CACHE_SIZE; i++) {
+			if (ancestor_cache.entries[i].last_used < entry->last_used) {
+				entry = &(ancestor_cache.entries[i]);
+			}
+		}
+		MemoryContextDelete(entry->context);
+	}
+
+	entry->session_id = session_id;
+	entry->last_used = ++ancestor_cache.clock;
+	entry->count = count;
+	entry->context = AllocSetContextCreate(
+		ancestor_cache.context, "veil2 ancestor session privileges",
+		ALLOCSET_SMALL_SIZES);
+	old_context = MemoryContextSwitchTo(entry->context);
+	entry->roleprivs = (ContextRolePrivs *) palloc(
+		sizeof(ContextRolePrivs) * (count + 1));
+	for (i = 0; i < count; i++) {
+		entry->roleprivs[i].scope_type = roleprivs[i].scope_type;
+		entry->roleprivs[i].scope = roleprivs[i].scope;
+		entry->roleprivs[i].roles = bitmapCopy(roleprivs[i].roles);
+		entry->roleprivs[i].privileges = bitmapCopy(roleprivs[i].privileges);
+	}
+	MemoryContextSwitchTo(old_context);
+	return entry;
+}
+
+/**
+ * Used by fetch_ancestor() to record the chain of ancestor sessions.
+ */
+typedef struct {
+	int count;
+	int64 *session_ids;
+	PrivsCacheKey *keys;
+} AncestorChain;
+
+/**
+ * Fetch_fn() for recording the chain of ancestor sessions for a
+ * become_user() session.  Rows must be provided in order, starting
+ * with the parent session.
+ *
+ * @param tuple  The ::HeapTuple returned from a Postgres SPI query.
+ * This contains a bigint and 5 integers.
+ * @param tupdesc The ::TupleDesc returned from the same Postgres SPI query
+ * @param p_result Pointer to our ::AncestorChain.
+ *
+ * @return <code>bool</code> true, indicating to veil2_query() that
+ * more rows are expected.
+ */
+static bool
+fetch_ancestor(HeapTuple tuple, TupleDesc tupdesc, void *p_result)
+{
+	AncestorChain *chain = (AncestorChain *) p_result;
+	PrivsCacheKey *key;
+	bool isnull;
+
+	if (!chain->session_ids) {
+		/* The query has already been executed, so SPI_processed
+		 * tells us how many rows we need.  These must survive
+		 * SPI_finish(). */
+		chain->session_ids = (int64 *) SPI_palloc(
+			sizeof(int64) * SPI_processed);
+		chain->keys = (PrivsCacheKey *) SPI_palloc(
+			sizeof(PrivsCacheKey) * SPI_processed);
+	}
+	key = &(chain->keys[chain->count]);
+	memset((void *) key, 0, sizeof(PrivsCacheKey));
+	chain->session_ids[chain->count] = DatumGetInt64(
+		SPI_getbinval(tuple, tupdesc, 1, &isnull));
+	key->accessor_id = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 2, &isnull));
+	key->session_context_type_id = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 3, &isnull));
+	key->session_context_id = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 4, &isnull));
+	key->mapping_context_type_id = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 5, &isnull));
+	key->mapping_context_id = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 6, &isnull));
+	chain->count++;
+	return true;
+}
+
+/**
+ * Return the combined privileges of a parent session and all of its
+ * ancestors, from ::ancestor_cache if possible.  Otherwise, we fetch
+ * the chain of ancestor sessions and compute privileges for those
+ * sessions up to the first one that is cached, combining them with
+ * that session's cached privileges.  This means that nested
+ * become_user() sessions do not recompute the privileges of their
+ * more distant ancestors.
+ *
+ * @param parent_session_id The parent session.
+ *
+ * @return The ::AncestorPrivs entry, from ::ancestor_cache.
+ */
+static AncestorPrivs *
+ancestorPrivs(int64 parent_session_id)
+{
+	static void *chain_plan = NULL;
+	Oid argtypes[] = {INT8OID};
+	Datum args[1];
+	AncestorChain chain = {0, NULL, NULL};
+	AncestorPrivs *inherited = NULL;
+	ContextRolePrivs *roleprivs;
+	int count;
+	int i;
+	bool pushed;
+
+	checkAncestorCache();
+	if ((inherited = findAncestorPrivs(parent_session_id))) {
+		return inherited;
+	}
+
+	args[0] = Int64GetDatum(parent_session_id);
+	veil2_spi_connect(&pushed, "failed to fetch ancestor sessions (1)");
+	(void) veil2_query(
+		"with recursive ancestors as"
+		"  ("
+		"    select session_id, parent_session_id, accessor_id,"
+		"           session_context_type_id, session_context_id,"
+		"           mapping_context_type_id, mapping_context_id,"
+		"           1 as depth"
+		"      from veil2.sessions"
+		"     where session_id = $1"
+		"     union all"
+		"    select s.session_id, s.parent_session_id, s.accessor_id,"
+		"           s.session_context_type_id, s.session_context_id,"
+		"           s.mapping_context_type_id, s.mapping_context_id,"
+		"           a.depth + 1"
+		"      from ancestors a"
+		"     inner join veil2.sessions s"
+		"        on s.session_id = a.parent_session_id"
+		"  )"
+		"select session_id, accessor_id,"
+		"       session_context_type_id, session_context_id,"
+		"       mapping_context_type_id, mapping_context_id"
+		"  from ancestors"
+		" order by depth",
+		1, argtypes, args,
+		true, &chain_plan,
+		fetch_ancestor, (void *) &chain);
+	veil2_spi_finish(pushed, "failed to fetch ancestor sessions (2)");
+
+	/* Our query may have caused invalidations to be processed. */
+	checkAncestorCache();
+	for (i = 0; i < chain.count; i++) {
+		if ((inherited = findAncestorPrivs(chain.session_ids[i]))) {
+			break;
+		}
+	}
+	count = veil2_compute_ancestor_privs(
+		chain.keys, i,
+		inherited ? inherited->roleprivs : NULL,
+		inherited ? inherited->count : 0,
+		&roleprivs);
+	return storeAncestorPrivs(parent_session_id, roleprivs, count);
+}
+
+/**
+ * Filter our session privileges, for a become_user() session, so
+ * that we have no roles or privileges that our ancestor sessions did
+ * not.
+ *
+ * @param parent_session_id The parent session.
+ */
+static void
+filterSessionPrivs(int64 parent_session_id)
+{
+	AncestorPrivs *ancestors;
+	ContextRolePrivs *session;
+	ContextRolePrivs *filtered;
+	int count;
+	int i;
+
+	if (!(session_roleprivs && session_roleprivs->active_contexts)) {
+		return;
+	}
+	ancestors = ancestorPrivs(parent_session_id);
+
+	/* Our session privileges will be cleared when the filtered
+	 * privileges are loaded, so we must work from a copy. */
+	count = session_roleprivs->active_contexts;
+	session = (ContextRolePrivs *) palloc(sizeof(ContextRolePrivs) * count);
+	for (i = 0; i < count; i++) {
+		session[i].scope_type = session_roleprivs->keys[i].scope_type;
+		session[i].scope = session_roleprivs->keys[i].scope;
+		session[i].roles = bitmapCopy(contextRoles(i));
+		session[i].privileges = bitmapCopy(contextPrivileges(i));
+	}
+	veil2_filter_privs(session, count, ancestors->roleprivs,
+					   ancestors->count, &filtered);
+	loadSessionRolePrivs(filtered, count);
+}
+
+
+/** 
+ * <code>veil2.filter_session_privs(parent_session_id bigint) returns
+ * void</code>
+ *
+ * Remove from our session privileges any roles and privileges that
+ * are not held by our ancestor sessions.  This is part of the
+ * become_user() process, to ensure that become user cannot lead to
+ * privilege escalation.  It replaces the earlier approach of loading
+ * ancestor privileges into a temporary table and updating session
+ * privileges row by row.
+ *
+ * @param bigint parent_session_id The parent session.
+ * @return void
+ */
+Datum
+veil2_filter_session_privs(PG_FUNCTION_ARGS)
+{
+	if (!PG_ARGISNULL(0)) {
+		filterSessionPrivs(PG_GETARG_INT64(0));
+	}
+	PG_RETURN_VOID();
+}
+
+
+/**
+ * Used to record the veil2.sessions record, and related data, for a
+ * session being (re)opened by veil2_open_connection().
+ */
+typedef struct {
+	/** Memory context into which token is copied */
+	MemoryContext context;
+	bool  found;
+	int   accessor_id;
+	bool  expired;
+	/** Whether the login context is valid for the accessor */
+	bool  valid_context;
+	/** Whether nonces is null */
+	bool  no_nonces;
+	/** Whether the nonce has already been used */
+	bool  nonce_used;
+	bool  nonces_min_null;
+	int   nonces_min;
+	bool  nonces_max_null;
+	int   nonces_max;
+	bool  has_authenticated;
+	char *token;
+	int   login_context_type_id;
+	int   login_context_id;
+	int   session_context_type_id;
+	int   session_context_id;
+	int   mapping_context_type_id;
+	int   mapping_context_id;
+	bool  parent_null;
+	int64 parent_session_id;
+} ConnectionSession;
+
+/**
+ * Used to record the result of veil2_open_connection().
+ */
+typedef struct {
+	/** Memory context into which errmsg is copied */
+	MemoryContext context;
+	bool success;
+	/** The error message, or NULL */
+	char *errmsg;
+} ConnectionResult;
+
+/** 
+ * Fetch_fn() for the veil2.sessions record used by
+ * veil2_open_connection().
+ *
+ * @param tuple  The ::HeapTuple returned from a Postgres SPI query.
+ * @param tupdesc The ::TupleDesc returned from the same Postgres SPI query
+ * @param p_result Pointer to a ::ConnectionSession to be populated.
+ *
+ * @return <code>bool</code> false, indicating to veil2_query() that
+ * no more rows are expected.
+ */
+static bool
+fetch_connection_session(HeapTuple tuple, TupleDesc tupdesc, void *p_result)
+{
+	ConnectionSession *cs = (ConnectionSession *) p_result;
+	MemoryContext old_context;
+	bool isnull;
+
+	cs->found = true;
+	cs->accessor_id = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 1, &isnull));
+	/* A null expiry compares as null, which is not treated as
+	 * expired. */
+	cs->expired = DatumGetBool(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+	cs->expired = cs->expired && !isnull;
+	cs->valid_context = DatumGetBool(
+		SPI_getbinval(tuple, tupdesc, 3, &isnull));
+	cs->no_nonces = DatumGetBool(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+	cs->nonce_used = DatumGetBool(SPI_getbinval(tuple, tupdesc, 5, &isnull));
+	cs->nonces_min = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 6, &cs->nonces_min_null));
+	cs->nonces_max = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 7, &cs->nonces_max_null));
+	cs->has_authenticated = DatumGetBool(
+		SPI_getbinval(tuple, tupdesc, 8, &isnull));
+	old_context = MemoryContextSwitchTo(cs->context);
+	cs->token = SPI_getvalue(tuple, tupdesc, 9);
+	MemoryContextSwitchTo(old_context);
+	cs->login_context_type_id = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 10, &isnull));
+	cs->login_context_id = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 11, &isnull));
+	cs->session_context_type_id = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 12, &isnull));
+	cs->session_context_id = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 13, &isnull));
+	cs->mapping_context_type_id = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 14, &isnull));
+	cs->mapping_context_id = DatumGetInt32(
+		SPI_getbinval(tuple, tupdesc, 15, &isnull));
+	cs->parent_session_id = DatumGetInt64(
+		SPI_getbinval(tuple, tupdesc, 16, &cs->parent_null));
+	return false;
+}
+
+/** 
+ * Fetch_fn() for the result of veil2.open_new_connection().
+ *
+ * @param tuple  The ::HeapTuple returned from a Postgres SPI query.
+ * This contains a boolean and a text value.
+ * @param tupdesc The ::TupleDesc returned from the same Postgres SPI query
+ * @param p_result Pointer to a ::ConnectionResult to be populated.
+ *
+ * @return <code>bool</code> false, indicating to veil2_query() that
+ * no more rows are expected.
+ */
+static bool
+fetch_connection_result(HeapTuple tuple, TupleDesc tupdesc, void *p_result)
+{
+	ConnectionResult *result = (ConnectionResult *) p_result;
+	MemoryContext old_context;
+	bool isnull;
+
+	result->success = DatumGetBool(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+	result->success = result->success && !isnull;
+	old_context = MemoryContextSwitchTo(result->context);
+	result->errmsg = SPI_getvalue(tuple, tupdesc, 2);
+	MemoryContextSwitchTo(old_context);
+	return false;
+}
+
+/**
+ * Check that nonce has not already been used and is within the range
+ * of acceptable values.  This is the equivalent of
+ * veil2.check_nonce().
+ *
+ * @param cs The ::ConnectionSession giving the session's nonces.
+ * @param nonce The nonce to be checked.
+ *
+ * @return true if the nonce is acceptable.
+ */
+static bool
+checkNonce(ConnectionSession *cs, int nonce)
+{
+	if (cs->no_nonces) {
+		return true;
+	}
+	if (cs->nonce_used) {
+		return false;
+	}
+	if (!cs->nonces_min_null && (nonce < cs->nonces_min)) {
+		return false;
+	}
+	if (!cs->nonces_max_null && ((int64) nonce > (int64) cs->nonces_max + 64)) {
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Check whether the combination of nonce, session_token and
+ * authent_token is valid for continuing an authenticated session.
+ * This is the equivalent of veil2.check_continuation(): the
+ * authent_token must be the base64 encoded sha1 digest of the session
+ * token concatenated with the nonce in hex.  For versions of Postgres
+ * without sha1 support in core, we call veil2.check_continuation()
+ * itself.  We must already be connected to SPI.
+ *
+ * @param nonce The nonce for this connection.
+ * @param session_token The session's token.
+ * @param authent_token The token provided by the caller.
+ *
+ * @return true if authent_token is valid.
+ */
+static bool
+checkContinuation(int nonce, char *session_token, text *authent_token)
+{
+#if PG_VERSION_NUM >= 140000
+	pg_cryptohash_ctx *ctx;
+	uint8 digest[SHA1_DIGEST_LENGTH];
+	char hex[9];
+	bytea *digest_bytea;
+	text *expected;
+	bool ok;
+
+	if (!session_token) {
+		return false;
+	}
+	snprintf(hex, sizeof(hex), "%x", (uint32) nonce);
+	ctx = pg_cryptohash_create(PG_SHA1);
+	ok = (pg_cryptohash_init(ctx) == 0) &&
+		(pg_cryptohash_update(ctx, (uint8 *) session_token,
+							  strlen(session_token)) == 0) &&
+		(pg_cryptohash_update(ctx, (uint8 *) hex, strlen(hex)) == 0) &&
+		(pg_cryptohash_final(ctx, digest, sizeof(digest)) == 0);
+	pg_cryptohash_free(ctx);
+	if (!ok) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("Unable to compute sha1 digest in "
+						"checkContinuation()")));
+	}
+
+	digest_bytea = (bytea *) palloc(VARHDRSZ + SHA1_DIGEST_LENGTH);
+	SET_VARSIZE(digest_bytea, VARHDRSZ + SHA1_DIGEST_LENGTH);
+	memcpy(VARDATA(digest_bytea), digest, SHA1_DIGEST_LENGTH);
+	expected = DatumGetTextPP(
+		DirectFunctionCall2(binary_encode, PointerGetDatum(digest_bytea),
+							CStringGetTextDatum("base64")));
+	return (VARSIZE_ANY_EXHDR(expected) ==
+			VARSIZE_ANY_EXHDR(authent_token)) &&
+		(memcmp(VARDATA_ANY(expected), VARDATA_ANY(authent_token),
+				VARSIZE_ANY_EXHDR(expected)) == 0);
+#else
+	static void *saved_plan = NULL;
+	Oid argtypes[] = {INT4OID, TEXTOID, TEXTOID};
+	Datum args[3];
+	bool result = false;
+
+	if (!session_token) {
+		return false;
+	}
+	args[0] = Int32GetDatum(nonce);
+	args[1] = CStringGetTextDatum(session_token);
+	args[2] = PointerGetDatum(authent_token);
+	(void) veil2_bool_from_query(
+		"select veil2.check_continuation($1, $2, $3)",
+		3, argtypes, args, &saved_plan, &result);
+	return result;
+#endif
+}
+
+/**
+ * Load session_context from a ::RegisteredSession.  This is the
+ * equivalent of veil2.reload_session_context().
+ *
+ * @param rs The ::RegisteredSession describing the session.
+ */
+static void
+loadSessionContext(RegisteredSession *rs)
+{
+	session_context.accessor_id = rs->accessor_id;
+	session_context.session_id = rs->session_id;
+	session_context.login_context_type_id = rs->login_context_type_id;
+	session_context.login_context_id = rs->login_context_id;
+	session_context.session_context_type_id = rs->session_context_type_id;
+	session_context.session_context_id = rs->session_context_id;
+	session_context.mapping_context_type_id = rs->mapping_context_type_id;
+	session_context.mapping_context_id = rs->mapping_context_id;
+	session_context.parent_session_id =
+		rs->parent_null? rs->session_id: rs->parent_session_id;
+	session_context.loaded = true;
+	/* Any session state shipped to parallel workers is stale. */
+	session_privs_generation++;
+}
+
+/**
+ * Find a session in ::recent_sessions.
+ *
+ * @param session_id The session to be found.
+ *
+ * @return The ::RecentSession entry, or NULL if there is none.
+ */
+static RecentSession *
+findRecentSession(int64 session_id)
+{
+	int i;
+
+	for (i = 0; i < nrecent_sessions; i++) {
+		if (recent_sessions[i].session_id == session_id) {
+			return &(recent_sessions[i]);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Make the retained privileges of a recently opened session our
+ * session privileges, if they are still valid.  This just replaces
+ * the ::session_roleprivs pointer.  Our session context must already
+ * have been loaded, and the session authenticated.
+ *
+ * @param session_id The session being opened.
+ *
+ * @return true if the session's privileges were restored.
+ */
+static bool
+restoreRecentSession(int64 session_id)
+{
+	RecentSession *recent = findRecentSession(session_id);
+
+	if (!recent) {
+		return false;
+	}
+	if (!privsValid(&(recent->validity))) {
+		forgetRecentSession(recent);
+		return false;
+	}
+
+	if (session_roleprivs != recent->roleprivs) {
+		if (session_roleprivs && !session_roleprivs->retained) {
+			discardSessionRolePrivs(session_roleprivs);
+		}
+		session_roleprivs = recent->roleprivs;
+		invalidateSessionIndex();
+		session_privs_generation++;
+	}
+	session_validity = recent->validity;
+	recent->last_used = ++recent_sessions_clock;
+	return true;
+}
+
+/**
+ * Retain our current session privileges in ::recent_sessions, so
+ * that they may be restored by restoreRecentSession() when the
+ * session is next opened by this backend.  If ::recent_sessions is
+ * full, the least recently used entry is replaced.
+ *
+ * The privileges are retained with ::session_validity, which records
+ * the generations from before they were loaded.
+ *
+ * @param session_id The session whose privileges have just been
+ * loaded.
+ */
+static void
+retainRecentSession(int64 session_id)
+{
+	RecentSession *recent;
+	int i;
+
+	if (!session_roleprivs || session_roleprivs->retained) {
+		return;
+	}
+	if ((recent = findRecentSession(session_id))) {
+		forgetRecentSession(recent);
+	}
+	if (nrecent_sessions >= RECENT_SESSIONS) {
+		recent = &(recent_sessions[0]);
+		for (i = 1; i < nrecent_sessions; i++) {
+			if (recent_sessions[i].last_used < recent->last_used) {
+				recent = &(recent_sessions[i]);
+			}
+		}
+		forgetRecentSession(recent);
+	}
+
+	recent = &(recent_sessions[nrecent_sessions]);
+	nrecent_sessions++;
+	recent->session_id = session_id;
+	recent->validity = session_validity;
+	recent->last_used = ++recent_sessions_clock;
+	recent->roleprivs = session_roleprivs;
+	session_roleprivs->retained = true;
+}
+
+/**
+ * Load the privileges for a newly reopened connection.  This is the
+ * equivalent of veil2.load_connection_privs() but, if this backend
+ * has recently opened the same session, and its privileges are still
+ * valid, they are simply re-used.  Otherwise, if the privileges can
+ * be found in the shared cache, we avoid any queries at all (except
+ * for become_user() sessions, which must filter them).  Failing
+ * that, we call veil2.load_connection_privs() itself.  Successfully
+ * loaded privileges are retained for re-use.  We must already be
+ * connected to SPI.
+ *
+ * @param parent_null Whether the session has no parent session.
+ * @param parent_session_id The parent session, for become_user()
+ * sessions.
+ *
+ * @return true if privileges were loaded.
+ */
+static bool
+loadConnectionPrivs(bool parent_null, int64 parent_session_id)
+{
+	static void *load_plan = NULL;
+	Oid argtypes[] = {INT8OID};
+	Datum args[1];
+	bool result = false;
+	PrivsCacheKey key;
+
+	if (restoreRecentSession(session_context.session_id)) {
+		return true;
+	}
+	args[0] = Int64GetDatum(parent_session_id);
+	sessionPrivsCacheKey(&key);
+	shared_privs_generation = 0;
+	if (veil2_privs_cache_lookup(&key, unpackSessionPrivs, NULL)) {
+		if (!parent_null) {
+			filterSessionPrivs(parent_session_id);
+		}
+		result = true;
+	}
+	else {
+		(void) veil2_query_wn(
+			"select veil2.load_connection_privs($1)",
+			1, argtypes, args, parent_null ? "n" : " ",
+			false, &load_plan,
+			fetch_one_bool, (void *) &result);
+	}
+	if (result) {
+		retainRecentSession(session_context.session_id);
+	}
+	return result;
+}
+
+/**
+ * The number of nonces that may be recorded in a ::RegisteredSession.
+ */
+#define NONCE_WINDOW_BITS (NONCE_WINDOW_WORDS * 64)
+
+/**
+ * Return the used nonces from a ::RegisteredSession, in ascending
+ * order.
+ *
+ * @param rs The ::RegisteredSession.
+ * @param nonces Array, of at least NONCE_WINDOW_BITS entries, into
+ * which the nonces will be placed.
+ *
+ * @return The number of nonces.
+ */
+static int
+nonceWindowElems(RegisteredSession *rs, int32 *nonces)
+{
+	int count = 0;
+	int i;
+
+	for (i = 0; i < NONCE_WINDOW_BITS; i++) {
+		if (rs->nonces[i / 64] & (UINT64CONST(1) << (i % 64))) {
+			nonces[count++] = rs->nonce_base + i;
+		}
+	}
+	return count;
+}
+
+/**
+ * Record the used nonces for a ::RegisteredSession.
+ *
+ * @param rs The ::RegisteredSession.
+ * @param nonces Array of used nonces, in ascending order.
+ * @param count The number of nonces.
+ *
+ * @return false if the nonces span too great a range to be recorded.
+ */
+static bool
+nonceWindowStore(RegisteredSession *rs, int32 *nonces, int count)
+{
+	int64 base;
+	int64 bit;
+	int i;
+
+	memset(rs->nonces, 0, sizeof(rs->nonces));
+	rs->nonce_base = 0;
+	if (count == 0) {
+		return true;
+	}
+	base = (int64) nonces[0] & ~INT64CONST(63);
+	if (((int64) nonces[count - 1] - base) >= NONCE_WINDOW_BITS) {
+		return false;
+	}
+	rs->nonce_base = (int32) base;
+	for (i = 0; i < count; i++) {
+		bit = (int64) nonces[i] - base;
+		rs->nonces[bit / 64] |= UINT64CONST(1) << (bit % 64);
+	}
+	return true;
+}
+
+/**
+ * Add a nonce to an ascending array of used nonces, dropping the
+ * lowest 64-bit group of nonces if they span too great a range.
+ * This is the equivalent of veil2.update_nonces().
+ *
+ * @param nonces Array of used nonces, in ascending order.  This must
+ * have space for one more entry.
+ * @param count The number of nonces.
+ * @param nonce The nonce to be added.
+ *
+ * @return The new number of nonces.
+ */
+static int
+updateNonces(int32 *nonces, int count, int32 nonce)
+{
+	int64 target;
+	int i;
+
+	for (i = 0; (i < count) && (nonces[i] < nonce); i++) {
+	}
+	if ((i == count) || (nonces[i] != nonce)) {
+		memmove(&nonces[i + 1], &nonces[i], (count - i) * sizeof(int32));
+		nonces[i] = nonce;
+		count++;
+	}
+	if (((int64) nonces[count - 1] - nonces[0]) > 192) {
+		target = ((int64) nonces[0] + 64) & ~INT64CONST(63);
+		for (i = 0; (i < count) && (nonces[i] < target); i++) {
+		}
+		memmove(nonces, &nonces[i], (count - i) * sizeof(int32));
+		count -= i;
+	}
+	return count;
+}
+
+/**
+ * Write back the expiry time and used nonces for a session to
+ * veil2.sessions.  We must already be connected to SPI.
+ *
+ * @param rs The ::RegisteredSession, giving the expiry time.
+ * @param nonces Array of used nonces, in ascending order.
+ * @param count The number of nonces.
+ */
+static void
+writeBackSession(RegisteredSession *rs, int32 *nonces, int count)
+{
+	static void *saved_plan = NULL;
+	Oid argtypes[] = {INT8OID, TIMESTAMPTZOID, INT4ARRAYOID};
+	Datum args[3];
+	Datum *elems;
+	int i;
+
+	elems = (Datum *) palloc(sizeof(Datum) * (count + 1));
+	for (i = 0; i < count; i++) {
+		elems[i] = Int32GetDatum(nonces[i]);
+	}
+	args[0] = Int64GetDatum(rs->session_id);
+	args[1] = TimestampTzGetDatum(rs->expires);
+	args[2] = PointerGetDatum(
+		construct_array(elems, count, INT4OID, sizeof(int32), true, 'i'));
+	(void) veil2_query(
+		"select veil2.write_back_session($1, $2, $3)",
+		3, argtypes, args,
+		false, &saved_plan,
+		NULL, NULL);
+	pfree(elems);
+}
+
+/**
+ * Used to build a ::RegisteredSession from veil2.sessions.
+ */
+typedef struct {
+	RegisteredSession session;
+	/** Whether the session may be registered */
+	bool valid;
+} Registration;
+
+/** 
+ * Fetch_fn() for the expiry time, used nonces and timeout for a
+ * session being registered.
+ *
+ * @param tuple  The ::HeapTuple returned from a Postgres SPI query.
+ * @param tupdesc The ::TupleDesc returned from the same Postgres SPI query
+ * @param p_result Pointer to a ::Registration to be populated.
+ *
+ * @return <code>bool</code> false, indicating to veil2_query() that
+ * no more rows are expected.
+ */
+static bool
+fetch_registration(HeapTuple tuple, TupleDesc tupdesc, void *p_result)
+{
+	Registration *reg = (Registration *) p_result;
+	RegisteredSession *rs = &reg->session;
+	ArrayType *array;
+	Datum datum;
+	bool isnull;
+	double timeout;
+	int count = 0;
+	int32 *nonces = NULL;
+
+	rs->expires = DatumGetTimestampTz(
+		SPI_getbinval(tuple, tupdesc, 1, &isnull));
+	if (isnull) {
+		return false;
+	}
+	rs->stored_expires = rs->expires;
+	timeout = DatumGetFloat8(SPI_getbinval(tuple, tupdesc, 3, &isnull));
+	if (isnull) {
+		return false;
+	}
+	rs->timeout = (int64) (timeout * USECS_PER_SEC);
+	datum = SPI_getbinval(tuple, tupdesc, 2, &isnull);
+	if (!isnull) {
+		array = DatumGetArrayTypeP(datum);
+		if (ARR_HASNULL(array)) {
+			return false;
+		}
+		count = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+		nonces = (int32 *) ARR_DATA_PTR(array);
+	}
+	reg->valid = nonceWindowStore(rs, nonces, count);
+	rs->dirty = false;
+	rs->written_at = GetCurrentTransactionStartTimestamp();
+	return false;
+}
+
+/**
+ * Add a session that has just been successfully re-opened from
+ * veil2.sessions to the shared session registry, so that subsequent
+ * re-opens need not read or update veil2.sessions.  We must already
+ * be connected to SPI, and veil2.sessions must have been updated.
+ *
+ * @param cs The ::ConnectionSession read from veil2.sessions.
+ * @param session_id The session.
+ */
+static void
+registerSession(ConnectionSession *cs, int64 session_id)
+{
+	static void *saved_plan = NULL;
+	Oid argtypes[] = {INT8OID};
+	Datum args[1];
+	Registration reg;
+
+	if (!veil2_shmem_available() || !cs->token ||
+		(strlen(cs->token) > REGISTRY_TOKEN_LEN))
+	{
+		return;
+	}
+	memset((void *) &reg, 0, sizeof(reg));
+	args[0] = Int64GetDatum(session_id);
+	(void) veil2_query(
+		"select s.expires, to_array(s.nonces),"
+		"       extract(epoch from p.parameter_value::interval)::float8"
+		"  from veil2.sessions s"
+		" cross join veil2.system_parameters p"
+		" where s.session_id = $1"
+		"   and p.parameter_name = 'shared session timeout'",
+		1, argtypes, args,
+		true, &saved_plan,
+		fetch_registration, (void *) &reg);
+	if (reg.valid) {
+		reg.session.session_id = session_id;
+		reg.session.accessor_id = cs->accessor_id;
+		reg.session.login_context_type_id = cs->login_context_type_id;
+		reg.session.login_context_id = cs->login_context_id;
+		reg.session.session_context_type_id = cs->session_context_type_id;
+		reg.session.session_context_id = cs->session_context_id;
+		reg.session.mapping_context_type_id = cs->mapping_context_type_id;
+		reg.session.mapping_context_id = cs->mapping_context_id;
+		reg.session.parent_null = cs->parent_null;
+		reg.session.parent_session_id = cs->parent_session_id;
+		strlcpy(reg.session.token, cs->token, sizeof(reg.session.token));
+		veil2_session_registry_store(&reg.session);
+	}
+}
+
+/**
+ * Used to record the state of a session being re-opened from the
+ * shared session registry by reopenFromRegistry().
+ */
+typedef struct {
+	int nonce;
+	text *authent_token;
+	/** Whether the registered session has expired */
+	bool expired;
+	/** Whether the accessor may no longer use the login context */
+	bool invalid_context;
+	bool success;
+	char *errmsg;
+	int nonces_min;
+	int nonces_max;
+	/** The session's expiry time before it was re-opened */
+	TimestampTz prev_expires;
+	/** Whether we must write the session back to veil2.sessions */
+	bool write_back;
+	int nonce_count;
+	int32 nonces[NONCE_WINDOW_BITS + 1];
+	/** Copy of the registry entry, after updates */
+	RegisteredSession session;
+} ReopenState;
+
+/**
+ * Predicate identifying whether an accessor may use the given login
+ * context.  This is the check that openConnection() makes, through
+ * its join with veil2.accessor_contexts, for sessions read from
+ * veil2.sessions.  We must already be connected to SPI.
+ *
+ * @param accessor_id The accessor.
+ * @param context_type_id The login context_type_id.
+ * @param context_id The login context_id.
+ *
+ * @return true if the context is valid for the accessor.
+ */
+static bool
+haveAccessorContext(int accessor_id, int context_type_id, int context_id)
+{
+	static void *saved_plan = NULL;
+	Oid argtypes[] = {INT4OID, INT4OID, INT4OID};
+	Datum args[3];
+	bool result = false;
+
+	args[0] = Int32GetDatum(accessor_id);
+	args[1] = Int32GetDatum(context_type_id);
+	args[2] = Int32GetDatum(context_id);
+	(void) veil2_bool_from_query(
+		"select exists ("
+		"    select null"
+		"      from veil2.accessor_contexts ac"
+		"     where ac.accessor_id = $1"
+		"       and ac.context_type_id = $2"
+		"       and ac.context_id = $3)",
+		3, argtypes, args, &saved_plan, &result);
+	return result;
+}
+
+/**
+ * Check a nonce against the used nonces of a ::RegisteredSession,
+ * as checkNonce() does for sessions read from veil2.sessions.  The
+ * used nonces are left in state->nonces.
+ *
+ * @param rs The ::RegisteredSession.
+ * @param state The ::ReopenState, giving the nonce.
+ *
+ * @return true if the nonce may be used.
+ */
+static bool
+checkRegisteredNonce(RegisteredSession *rs, ReopenState *state)
+{
+	int32 *nonces = state->nonces;
+	int count;
+	int i;
+
+	count = nonceWindowElems(rs, nonces);
+	state->nonce_count = count;
+	for (i = 0; (i < count) && (nonces[i] != state->nonce); i++) {
+	}
+	if ((count > 0) &&
+		((i < count) || (state->nonce < nonces[0]) ||
+		 ((int64) state->nonce > (int64) nonces[count - 1] + 64)))
+	{
+		state->nonces_min = nonces[0];
+		state->nonces_max = nonces[count - 1];
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Perform, on a copy of a session's registry entry, the same login
+ * context, expiry, nonce and continuation token checks, in the same
+ * order, as openConnection() does for sessions read from
+ * veil2.sessions, so that both report the same errors.  As this
+ * computes a digest and runs a query, it is done without holding the
+ * registry entry's lock.  We must already be connected to SPI.
+ *
+ * @param state The ::ReopenState, containing the copied entry.
+ */
+static void
+checkRegisteredSession(ReopenState *state)
+{
+	RegisteredSession *rs = &state->session;
+
+	if (!haveAccessorContext(rs->accessor_id,
+							 rs->login_context_type_id,
+							 rs->login_context_id))
+	{
+		state->invalid_context = true;
+		state->errmsg = "AUTHFAIL";
+	}
+	else if (rs->expires < GetCurrentTransactionStartTimestamp()) {
+		/* As for "s.expires < now()" in openConnection(). */
+		state->expired = true;
+	}
+	else if (!checkRegisteredNonce(rs, state)) {
+		state->errmsg = "NONCEFAIL";
+	}
+	else if (!checkContinuation(state->nonce, rs->token,
+								state->authent_token))
+	{
+		state->errmsg = "AUTHFAIL";
+	}
+	else {
+		state->success = true;
+	}
+}
+
+/**
+ * SessionRegistryFn() to record the outcome of
+ * checkRegisteredSession() in a session's registry entry.  This
+ * records the nonce and, on success, extends the session's expiry
+ * time.  The nonce is checked again, as it may have been used
+ * concurrently since the entry was copied.  If the session's expiry
+ * time in veil2.sessions is approaching, the session has not been
+ * written back for veil2.session_write_back_interval, or the used
+ * nonces can no longer be recorded in the registry, the session is
+ * removed from the registry and must be written back by our caller.
+ *
+ * @param rs The ::RegisteredSession, which is exclusively locked.
+ * @param arg Pointer to the ::ReopenState.
+ *
+ * @return false if the entry should be removed from the registry.
+ */
+static bool
+updateRegisteredSession(RegisteredSession *rs, void *arg)
+{
+	ReopenState *state = (ReopenState *) arg;
+	TimestampTz now = GetCurrentTransactionStartTimestamp();
+
+	if (rs->expires < now) {
+		/* Leave it to veil2.sessions to tell us why. */
+		state->expired = true;
+		return false;
+	}
+	if (!checkRegisteredNonce(rs, state) && state->success) {
+		state->success = false;
+		state->errmsg = "NONCEFAIL";
+	}
+	state->prev_expires = rs->expires;
+	if (state->success) {
+		rs->expires = now + rs->timeout;
+	}
+
+	state->nonce_count = updateNonces(state->nonces, state->nonce_count,
+									  state->nonce);
+	if (!nonceWindowStore(rs, state->nonces, state->nonce_count)) {
+		state->write_back = true;
+	}
+	else if (state->success &&
+			 ((rs->stored_expires - now) < (rs->timeout / 2)))
+	{
+		state->write_back = true;
+	}
+	else if ((veil2_session_write_back_interval > 0) &&
+			 ((now - rs->written_at) >=
+			  (int64) veil2_session_write_back_interval * USECS_PER_SEC))
+	{
+		state->write_back = true;
+	}
+	rs->dirty = !state->write_back;
+	memcpy(&state->session, rs, sizeof(RegisteredSession));
+	return !state->write_back;
+}
+
+/**
+ * Attempt to re-open a session from the shared session registry.
+ * The session's entry is copied and checked by
+ * checkRegisteredSession(), and then locked again only briefly, by
+ * updateRegisteredSession(), to record the outcome.  We must already
+ * be connected to SPI.
+ *
+ * @param session_id The session to be re-opened.
+ * @param state The ::ReopenState, giving the nonce and
+ * authentication token, and into which the outcome is recorded.
+ *
+ * @return true if the session was found, unexpired, in the registry,
+ * in which case reopenConnection() must complete the re-open.
+ * Otherwise the session must be opened from veil2.sessions.
+ */
+static bool
+reopenFromRegistry(int64 session_id, ReopenState *state)
+{
+	if (!veil2_session_registry_fetch(session_id, &state->session)) {
+		return false;
+	}
+	checkRegisteredSession(state);
+	if (state->expired) {
+		/* Leave it to veil2.sessions to tell us why. */
+		veil2_session_registry_remove(session_id, false);
+		return false;
+	}
+	return veil2_session_registry_lookup(session_id,
+										 updateRegisteredSession,
+										 (void *) state) &&
+		!state->expired;
+}
+
+/**
+ * Complete the re-opening of a session from the shared session
+ * registry, following reopenFromRegistry().  We must already be
+ * connected to SPI.
+ *
+ * @param state The ::ReopenState from reopenFromRegistry().
+ * @param result The ::ConnectionResult to be returned.
+ */
+static void
+reopenConnection(ReopenState *state, ConnectionResult *result)
+{
+	RegisteredSession *rs = &state->session;
+
+	if (state->success) {
+		loadSessionContext(rs);
+		if (loadConnectionPrivs(rs->parent_null, rs->parent_session_id)) {
+			result->success = true;
+		}
+		else {
+			ereport(WARNING,
+					(errmsg("SECURITY: Accessor %d has no connect "
+							"privilege.", rs->accessor_id)));
+			result->errmsg = "AUTHFAIL";
+			/* Don't extend the session, and make the next attempt
+			 * go through veil2.sessions. */
+			rs->expires = state->prev_expires;
+			if (!state->write_back) {
+				veil2_session_registry_remove(rs->session_id, false);
+				state->write_back = true;
+			}
+		}
+	}
+	else if (strcmp(state->errmsg, "NONCEFAIL") == 0) {
+		ereport(WARNING,
+				(errmsg("SECURITY: Nonce failure.  Nonce %d, "
+						"Nonces %d..%d", state->nonce,
+						state->nonces_min, state->nonces_max)));
+		result->errmsg = state->errmsg;
+	}
+	else if (state->invalid_context) {
+		ereport(WARNING,
+				(errmsg("SECURITY: Connection attempt for "
+						"invalid context")));
+		result->errmsg = state->errmsg;
+	}
+	else {
+		ereport(WARNING,
+				(errmsg("SECURITY: incorrect continuation token "
+						"for %d, " INT64_FORMAT,
+						rs->accessor_id, rs->session_id)));
+		result->errmsg = state->errmsg;
+	}
+
+	if (state->write_back) {
+		writeBackSession(rs, state->nonces, state->nonce_count);
+	}
+}
+
+/**
+ * Open, or re-open, a session from its veil2.sessions record.  Only
+ * the re-opening of authenticated sessions is handled here; all
+ * other cases are delegated to veil2.open_new_connection().  We must
+ * already be connected to SPI.
+ *
+ * @param session_id The session to be opened.
+ * @param nonce A number that may only be used once.
+ * @param authent_token The authentication or continuation token.
+ * @param result The ::ConnectionResult to be returned.
+ */
+static void
+openConnection(int64 session_id, int nonce, text *authent_token,
+			   ConnectionResult *result)
+{
+	static void *session_plan = NULL;
+	static void *update_plan = NULL;
+	static void *new_plan = NULL;
+	Oid argtypes[] = {INT8OID, INT4OID, TEXTOID};
+	Datum args[3];
+	ConnectionSession cs;
+
+	memset((void *) &cs, 0, sizeof(cs));
+	cs.context = CurrentMemoryContext;
+	args[0] = Int64GetDatum(session_id);
+	args[1] = Int32GetDatum(nonce);
+	args[2] = PointerGetDatum(authent_token);
+
+	(void) veil2_query(
+		"select s.accessor_id, s.expires < now(),"
+		"       ac.context_type_id is not null,"
+		"       s.nonces is null, coalesce(s.nonces ? $2, false),"
+		"       bitmin(s.nonces), bitmax(s.nonces),"
+		"       s.has_authenticated, s.token,"
+		"       s.login_context_type_id, s.login_context_id,"
+		"       s.session_context_type_id, s.session_context_id,"
+		"       s.mapping_context_type_id, s.mapping_context_id,"
+		"       s.parent_session_id"
+		"  from veil2.sessions s"
+		"  left outer join veil2.accessor_contexts ac"
+		"    on ac.accessor_id = s.accessor_id"
+		"   and ac.context_type_id = s.login_context_type_id"
+		"   and ac.context_id = s.login_context_id"
+		" where s.session_id = $1",
+		2, argtypes, args,
+		true, &session_plan,
+		fetch_connection_session, (void *) &cs);
+
+	if (!(cs.found && cs.has_authenticated)) {
+		/* Not a continuation of an authenticated session. */
+		(void) veil2_query(
+			"select success, errmsg"
+			"  from veil2.open_new_connection($1, $2, $3)",
+			3, argtypes, args,
+			false, &new_plan,
+			fetch_connection_result, (void *) result);
+		return;
+	}
+
+	if (!cs.valid_context) {
+		ereport(WARNING,
+				(errmsg("SECURITY: Connection attempt for "
+						"invalid context")));
+		result->errmsg = "AUTHFAIL";
+	}
+	else if (cs.expired) {
+		result->errmsg = "EXPIRED";
+	}
+	else if (!checkNonce(&cs, nonce)) {
+		/* Since this could be the result of an attempt to replay a
+		 * past authentication token, we log this failure. */
+		ereport(WARNING,
+				(errmsg("SECURITY: Nonce failure.  Nonce %d, "
+						"Nonces %d..%d", nonce,
+						cs.nonces_min, cs.nonces_max)));
+		result->errmsg = "NONCEFAIL";
+	}
+	else if (!checkContinuation(nonce, cs.token, authent_token)) {
+		ereport(WARNING,
+				(errmsg("SECURITY: incorrect continuation token "
+						"for %d, " INT64_FORMAT,
+						cs.accessor_id, session_id)));
+		result->errmsg = "AUTHFAIL";
+	}
+	else {
+		/* Reload session context. */
+		session_context.accessor_id = cs.accessor_id;
+		session_context.session_id = session_id;
+		session_context.login_context_type_id = cs.login_context_type_id;
+		session_context.login_context_id = cs.login_context_id;
+		session_context.session_context_type_id =
+			cs.session_context_type_id;
+		session_context.session_context_id = cs.session_context_id;
+		session_context.mapping_context_type_id =
+			cs.mapping_context_type_id;
+		session_context.mapping_context_id = cs.mapping_context_id;
+		session_context.parent_session_id =
+			cs.parent_null? session_id: cs.parent_session_id;
+		session_context.loaded = true;
+
+		if (loadConnectionPrivs(cs.parent_null, cs.parent_session_id)) {
+			result->success = true;
+		}
+		else {
+			ereport(WARNING,
+					(errmsg("SECURITY: Accessor %d has no connect "
+							"privilege.", cs.accessor_id)));
+			result->errmsg = "AUTHFAIL";
+		}
+	}
+
+	/* Regardless of the success of the preceding checks we record
+	 * the use of the latest nonce.  If all validations succeeded, we
+	 * extend the expiry time of the session. */
+	args[2] = BoolGetDatum(result->success);
+	argtypes[2] = BOOLOID;
+	(void) veil2_query(
+		"select veil2.update_session($1,"
+		"           veil2.update_nonces($2, s.nonces), $3)"
+		"  from veil2.sessions s"
+		" where s.session_id = $1",
+		3, argtypes, args,
+		false, &update_plan,
+		NULL, NULL);
+
+	if (result->success) {
+		registerSession(&cs, session_id);
+	}
+}
+
+/** 
+ * <code>veil2.open_connection(session_id bigint, nonce integer,
+ *   authent_token text, success out bool, errmsg out text)
+ *   returns record</code>
+ *
+ * Attempt to open or re-open a session.  Re-opening an already
+ * authenticated session is the common case, as it happens on each
+ * request from an application server, so we handle it here,
+ * natively.  If shared memory is available, such sessions are
+ * recorded in the shared session registry, from which they can be
+ * re-opened without reading or updating their veil2.sessions
+ * records at all: changes to expiry times and used nonces are
+ * written back only as a session's recorded expiry time approaches,
+ * or by veil2.flush_sessions().  All other cases, including the
+ * initial authentication of a session, are handled by
+ * veil2.open_new_connection().  The semantics and error codes
+ * (AUTHFAIL, EXPIRED and NONCEFAIL) are the same for each.
+ *
+ * @param bigint session_id The session to be opened.
+ * @param integer nonce A number that may only be used once.
+ * @param text authent_token The authentication or continuation token.
+ * @return record (success, errmsg)
+ */
+Datum
+veil2_open_connection(PG_FUNCTION_ARGS)
+{
+	int64 session_id = PG_GETARG_INT64(0);
+	int nonce = PG_GETARG_INT32(1);
+	text *authent_token = PG_GETARG_TEXT_PP(2);
+	Datum results[2];
+	bool nulls[2] = {false, true};
+	ConnectionResult result;
+	ReopenState *state;
+	TupleDesc tuple_desc;
+	bool pushed;
+	instr_time start;
+
+	if (veil2_track_timing) {
+		INSTR_TIME_SET_CURRENT(start);
+	}
+	SESSION_STAT(SESSTAT_OPENS)++;
+	if (get_call_result_type(fcinfo, NULL,
+							 &tuple_desc) != TYPEFUNC_COMPOSITE) {
+		ereport(ERROR,
+                    (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                     errmsg("function returning record called in context "
+                            "that cannot accept type record")));
+	}
+	tuple_desc = BlessTupleDesc(tuple_desc);
+
+	result.context = CurrentMemoryContext;
+	result.success = false;
+	result.errmsg = NULL;
+	state = (ReopenState *) palloc0(sizeof(ReopenState));
+	state->nonce = nonce;
+	state->authent_token = authent_token;
+
+	do_reset_session(true);
+	veil2_spi_connect(&pushed, "failed to open connection (1)");
+	if (reopenFromRegistry(session_id, state)) {
+		SESSION_STAT(SESSTAT_REGISTRY_HITS)++;
+		reopenConnection(state, &result);
+	}
+	else {
+		openConnection(session_id, nonce, authent_token, &result);
+	}
+	veil2_spi_finish(pushed, "failed to open connection (2)");
+	if (veil2_track_timing) {
+		SESSION_STAT(SESSTAT_OPEN_TIME) += veil2_stat_elapsed(&start);
+	}
+
+	results[0] = BoolGetDatum(result.success);
+	if (result.errmsg) {
+		results[1] = CStringGetTextDatum(result.errmsg);
+		nulls[1] = false;
+	}
+	return HeapTupleGetDatum(heap_form_tuple(tuple_desc, results, nulls));
+}
+
+
+/** 
+ * <code>veil2.forget_sessions(session_ids bigint[]) returns void</code>
+ *
+ * Remove sessions from the shared session registry.  This is called
+ * from triggers on veil2.sessions when sessions are deleted.
+ *
+ * @param bigint[] session_ids The sessions to be removed.  If this
+ * is null, all sessions are removed.
+ * @return void
+ */
+Datum
+veil2_forget_sessions(PG_FUNCTION_ARGS)
+{
+	ArrayType *array;
+	int64 *session_ids;
+	int count;
+	int i;
+
+	if (PG_ARGISNULL(0)) {
+		veil2_session_registry_remove(0, true);
+	}
+	else {
+		array = PG_GETARG_ARRAYTYPE_P(0);
+		count = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+		if (ARR_HASNULL(array)) {
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("session_ids may not contain nulls")));
+		}
+		session_ids = (int64 *) ARR_DATA_PTR(array);
+		for (i = 0; i < count; i++) {
+			veil2_session_registry_remove(session_ids[i], false);
+		}
+	}
+	PG_RETURN_VOID();
+}
+
+
+/** 
+ * <code>veil2.flush_sessions(expired_only boolean) returns integer</code>
+ *
+ * Write back to veil2.sessions the expiry times and used nonces of
+ * all sessions in the shared session registry that have changed
+ * since they were last written.  If expired_only is true, only those
+ * sessions whose recorded expiry time has passed are written back,
+ * so that sessions that are still active will not be deleted as
+ * expired.
+ *
+ * @return integer The number of sessions written back.
+ */
+Datum
+veil2_flush_sessions(PG_FUNCTION_ARGS)
+{
+	bool expired_only = !PG_ARGISNULL(0) && PG_GETARG_BOOL(0);
+	RegisteredSession *sessions;
+	int32 nonces[NONCE_WINDOW_BITS];
+	int count;
+	int i;
+	bool pushed;
+
+	count = veil2_session_registry_dirty(&sessions, expired_only);
+	if (count) {
+		veil2_spi_connect(&pushed, "failed to flush sessions (1)");
+		for (i = 0; i < count; i++) {
+			writeBackSession(&sessions[i], nonces,
+							 nonceWindowElems(&sessions[i], nonces));
+		}
+		veil2_spi_finish(pushed, "failed to flush sessions (2)");
+		pfree(sessions);
+	}
+	PG_RETURN_INT32(count);
+}
+
+
+/** 
+ * <code>veil2.true(params) returns bool</code> 
+ *
+ * Always return true, regardless of parameters.  This is used to
+ * determine the minimum possible overhead for a privilege testing
+ * predicate, for performance measurements.
+ *
+ * @return boolean true
+ */
+Datum
+veil2_true(PG_FUNCTION_ARGS)
+{
+	return true;
+}
+
+/**
+ * Find the memoized result of a privilege test for the calling
+ * function's call site.  The memo is created on first use, and
+ * emptied if session privileges or the scope hierarchy have changed
+ * since its results were recorded.
+ *
+ * @param fcinfo The calling function's FunctionCallInfo.
+ * @param priv The privilege being tested.
+ * @param scope_type The scope_type_id being tested.
+ * @param scope The scope_id being tested.
+ * @param p_entry The memo slot for this test is returned through
+ * this.  If no result is found, the caller should record its result
+ * here using privsMemoSave().
+ *
+ * @return true if a memoized result was found, in which case it can
+ * be read from (*p_entry)->result.
+ */
+static bool
+privsMemoLookup(FunctionCallInfo fcinfo, int priv, int scope_type,
+				int scope, PrivsMemoEntry **p_entry)
+{
+	PrivsMemo *memo = (PrivsMemo *) fcinfo->flinfo->fn_extra;
+	uint64 hierarchy_generation = veil2_scope_hierarchy_generation();
+	PrivsMemoEntry *entry;
+	uint32 hash;
+
+	if (!memo) {
+		memo = (PrivsMemo *) MemoryContextAllocZero(
+			fcinfo->flinfo->fn_mcxt, sizeof(PrivsMemo));
+		fcinfo->flinfo->fn_extra = (void *) memo;
+	}
+	else if ((memo->session_generation != session_privs_generation) ||
+			 (memo->hierarchy_generation != hierarchy_generation))
+	{
+		memset(memo->entries, 0, sizeof(memo->entries));
+	}
+	memo->session_generation = session_privs_generation;
+	memo->hierarchy_generation = hierarchy_generation;
+
+	hash = ((uint32) priv * 0x9E3779B1U) ^
+		((uint32) scope_type * 0x85EBCA77U) ^
+		((uint32) scope * 0xC2B2AE3DU);
+	entry = &(memo->entries[(hash * 0x9E3779B1U) >>
+							(32 - PRIVS_MEMO_BITS)]);
+	*p_entry = entry;
+	if (entry->valid && (entry->priv == priv) &&
+		(entry->scope_type == scope_type) && (entry->scope == scope))
+	{
+		FN_STAT(FNSTAT_MEMO_HITS)++;
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Record the result of a privilege test in the memo slot returned
+ * from privsMemoLookup().
+ *
+ * @param entry The memo slot.
+ * @param priv The privilege tested.
+ * @param scope_type The scope_type_id tested.
+ * @param scope The scope_id tested.
+ * @param result The result of the test.
+ */
+static void
+privsMemoSave(PrivsMemoEntry *entry, int priv, int scope_type,
+			  int scope, bool result)
+{
+	entry->valid = true;
+	entry->result = result;
+	entry->priv = priv;
+	entry->scope_type = scope_type;
+	entry->scope = scope;
+}
+
+/**
+ * Does the work of reloadSessionPrivs().  This is the equivalent of
+ * veil2.load_connection_privs() except that, as it may be called
+ * from within a query, it performs no updates: privileges that
+ * cannot be found in the shared cache are computed, but are saved
+ * neither to veil2.accessor_privileges_cache nor to the shared cache.
+ * They are computed using the calling query's snapshot, which may
+ * predate the commit of the change that made them stale, so must not
+ * be offered to other sessions.
+ */
+static void
+doReloadSessionPrivs()
+{
+	PrivsCacheKey key;
+	ContextRolePrivs *roleprivs;
+	int count;
+
+	stampPrivsValidity();
+	sessionPrivsCacheKey(&key);
+	if (!veil2_privs_cache_lookup(&key, unpackSessionPrivs, NULL)) {
+		count = veil2_compute_session_privs(&key, &roleprivs);
+		loadSessionRolePrivs(roleprivs, count);
+	}
+	if (session_context.parent_session_id != session_context.session_id) {
+		filterSessionPrivs(session_context.parent_session_id);
+	}
+	retainRecentSession(session_context.session_id);
+}
+
+/**
+ * Reload our session privileges, which have been found to be stale.
+ * This is called only from the privilege testing functions which, as
+ * security definer functions, run as the owner of the veil2 schema,
+ * so already have access to everything needed to compute session
+ * privileges.  Any temporary allocations are made in a short-lived
+ * memory context.
+ */
+static void
+reloadSessionPrivs()
+{
+	MemoryContext reload_context;
+	MemoryContext old_context;
+
+	reload_context = AllocSetContextCreate(CurrentMemoryContext,
+										   "veil2 privileges reload",
+										   ALLOCSET_DEFAULT_SIZES);
+	old_context = MemoryContextSwitchTo(reload_context);
+	reloading_privs = true;
+	PG_TRY();
+	{
+		doReloadSessionPrivs();
+	}
+	PG_CATCH();
+	{
+		reloading_privs = false;
+		MemoryContextSwitchTo(old_context);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	reloading_privs = false;
+	MemoryContextSwitchTo(old_context);
+	MemoryContextDelete(reload_context);
+}
+
+/**
+ * Check whether our session privileges may have been invalidated
+ * since they were loaded, and if so whether they actually have been,
+ * reloading them if necessary.  The first check is a comparison of
+ * counters, so that this may be called on every privilege test.
+ *
+ * The check is made only once per command, identified by its
+ * statement start time and command id.  The privilege testing
+ * functions are declared stable, so every row of a scan, and the
+ * result of my_scopes(), must be judged against the same privileges.
+ * A change made by an earlier command, even one in the same
+ * statement, is seen by the next.
+ *
+ * Privileges are reloaded only for a session that has successfully
+ * loaded them, so an accessor that had no connect privilege when
+ * their session was opened cannot acquire privileges without opening
+ * it again.  They are not reloaded in parallel mode, as the leader
+ * and its workers must agree on them, or while they are already being
+ * reloaded.
+ */
+static inline void
+checkSessionPrivs()
+{
+	TimestampTz statement_start = GetCurrentStatementStartTimestamp();
+	CommandId command_id = GetCurrentCommandId(false);
+
+	if ((checked_statement_start == statement_start) &&
+		(checked_command_id == command_id))
+	{
+		return;
+	}
+	checked_statement_start = statement_start;
+	checked_command_id = command_id;
+	if (session_validity.shared_generation) {
+		if (session_validity.invalidations ==
+			veil2_privs_cache_invalidations())
+		{
+			return;
+		}
+	}
+	else if (session_validity.local_generation ==
+			 accessor_privs_generation)
+	{
+		return;
+	}
+	if (!(session_context.loaded && session_roleprivs &&
+		  session_roleprivs->active_contexts) ||
+		reloading_privs || IsInParallelMode())
+	{
+		return;
+	}
+	if (privsValid(&session_validity)) {
+		/* The invalidations were for other accessors. */
+		session_validity.invalidations = veil2_privs_cache_invalidations();
+		session_validity.local_generation = accessor_privs_generation;
+		return;
+	}
+	reloadSessionPrivs();
+}
+
+/**
+ * Check whether a session has been properly initialized.  If not, and
+ * we are supposed to fail in such a situation, fail with an appropriate
+ * error message.  Otherwise return true if the session is ready to
+ * go.  If our session privileges have been invalidated, by a change
+ * in this or another backend, they are reloaded.
+ *
+ * @result boolean True if our session has been properly initialized.
+ */
+static bool
+checkSessionReady()
+{
+	if (session_ready) {
+		checkSessionPrivs();
+		return true;
+	}
+	veil2_parallel_restore();
+	if (session_ready) {
+		return true;
+	}
+	if (error_if_no_session()) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("Attempt to check privileges before call to "
+						"veil2_reset_session.")));
+	}
+	return false;
+}
+
+/**
+ * Start recording statistics for a privilege testing function.
+ *
+ * @param fn The function being called.
+ * @param start The start time is returned through this, if timings
+ * are being recorded.
+ */
+static inline void
+statBegin(StatFunction fn, instr_time *start)
+{
+	veil2_stat_fn = fn;
+	FN_STAT(FNSTAT_CALLS)++;
+	if (veil2_track_timing) {
+		INSTR_TIME_SET_CURRENT(*start);
+	}
+	else {
+		INSTR_TIME_SET_ZERO(*start);
+	}
+}
+
+/**
+ * Finish recording statistics for a privilege testing function,
+ * started by statBegin().
+ *
+ * @param start The start time recorded by statBegin().
+ */
+static inline void
+statFinish(instr_time *start)
+{
+	if (veil2_track_timing && !INSTR_TIME_IS_ZERO(*start)) {
+		FN_STAT(FNSTAT_TIME) += veil2_stat_elapsed(start);
+	}
+	veil2_stat_fn = STATFN_INTERNAL;
+}
+
+/**
+ * Finish recording statistics for a privilege testing predicate,
+ * started by statBegin(), recording its result.
+ *
+ * @param start The start time recorded by statBegin().
+ * @param result The result of the predicate.
+ *
+ * @return result
+ */
+static inline bool
+statResult(instr_time *start, bool result)
+{
+	FN_STAT(result? FNSTAT_TRUE: FNSTAT_FALSE)++;
+	statFinish(start);
+	return result;
+}
+
+/** 
+ * <code>veil2.i_have_global_priv(priv) returns bool</code> 
+ *
+ * Predicate to determine whether the current session user has a given
+ * privilege, <code>priv</code>, with global scope.
+ *
+ * @param privilege_id Integer giving privilege to test for
+ *
+ * @return boolean true if the session has the given privilege
+ */
+Datum
+veil2_i_have_global_priv(PG_FUNCTION_ARGS)
+{
+	static int context_idx = -1;
+	int priv = PG_GETARG_INT32(0);
+	bool result;
+	PrivsMemoEntry *memo;
+	instr_time start;
+	
+	statBegin(STATFN_GLOBAL, &start);
+	if ((result = checkSessionReady())) {
+		if (privsMemoLookup(fcinfo, priv, 1, 0, &memo)) {
+			result = memo->result;
+		}
+		else {
+			result = checkContext(&context_idx, 1, 0, priv);
+			privsMemoSave(memo, priv, 1, 0, result);
+		}
+	}
+	result_counts[result]++;
+	return statResult(&start, result);
+}
+
+
+/** 
+ * <code>veil2.i_have_personal_priv(priv, accessor_id) returns bool</code> 
+ *
+ * Predicate to determine whether the current session user has a given
+ * privilege, <code>priv</code>, in their personal scope (ie for data
+ * pertaining to themselves).
+ *
+ * @param privilege_id Integer giving privilege to test for
+ * @param accessor_id Integer id for a party from the record being
+ * checked.
+ *
+ * @return boolean true if the session has the given privilege in the
+ * personal scope of the given accessor_id
+ */
+Datum
+veil2_i_have_personal_priv(PG_FUNCTION_ARGS)
+{
+	static int context_idx = -1;
+	bool result;
+	PrivsMemoEntry *memo;
+	instr_time start;
+	int priv = PG_GETARG_INT32(0);
+	int accessor_id = PG_GETARG_INT32(1);
+	
+	statBegin(STATFN_PERSONAL, &start);
+	if ((result = checkSessionReady())) {
+		if (privsMemoLookup(fcinfo, priv, 2, accessor_id, &memo)) {
+			result = memo->result;
+		}
+		else {
+			result = checkContext(&context_idx, 2, accessor_id, priv);
+			privsMemoSave(memo, priv, 2, accessor_id, result);
+		}
+	}
+	result_counts[result]++;
+	return statResult(&start, result);
+}
+
+
+/** 
+ * <code>veil2.i_have_priv_in_scope(priv, scope_type_id, scope_id) 
+ *     returns bool</code> 
+ *
+ * Predicate to determine whether the current session user has a given
+ * privilege, <code>priv</code>, in a specific scope
+ * (<code>scope_type_id</code>, <code>scope_id</code>).
+ *
+ * @param privilege_id Integer giving privilege to test for
+ * @param scope_type_id Integer id of the scope type to be checked
+ * @param scope_id Integer id of the scop to be checked
+ *
+ * @return boolean true if the session has the given privilege for the
+ * given scope_type_id and scope_id
+ */
+Datum
+veil2_i_have_priv_in_scope(PG_FUNCTION_ARGS)
+{
+	static int context_idx = -1;
+	bool result;
+	PrivsMemoEntry *memo;
+	instr_time start;
+	int priv = PG_GETARG_INT32(0);
+	int scope_type_id = PG_GETARG_INT32(1);
+	int scope_id = PG_GETARG_INT32(2);
+	
+	statBegin(STATFN_SCOPE, &start);
+	if ((result = checkSessionReady())) {
+		if (privsMemoLookup(fcinfo, priv, scope_type_id, scope_id, &memo)) {
+			result = memo->result;
+		}
+		else {
+			result = checkContext(&context_idx, scope_type_id,
+								  scope_id, priv);
+			privsMemoSave(memo, priv, scope_type_id, scope_id, result);
+		}
+	}
+	result_counts[result]++;
+	return statResult(&start, result);
+}
+
+
+/** 
+ * <code>veil2.i_have_priv_in_scope_or_global(priv, scope_type_id, scope_id) 
+ *     returns bool</code> 
+ *
+ * Predicate to determine whether the current session user has a given
+ * privilege, <code>priv</code>, in a specific scope
+ * (<code>scope_type_id</code>, <code>scope_id</code>), or in global scope.
+ *
+ * @param privilege_id Integer giving privilege to test for
+ * @param scope_type_id Integer id of the scope type to be checked
+ * @param scope_id Integer id of the scop to be checked
+ *
+ * @return boolean true if the session has the given privilege for the
+ * given scope_type_id and scope_id
+ */
+Datum
+veil2_i_have_priv_in_scope_or_global(PG_FUNCTION_ARGS)
+{
+	static int global_context_idx = -1;
+	static int given_context_idx = -1;
+	bool result;
+	PrivsMemoEntry *memo;
+	instr_time start;
+	int priv = PG_GETARG_INT32(0);
+	int scope_type_id = PG_GETARG_INT32(1);
+	int scope_id = PG_GETARG_INT32(2);
+	
+	statBegin(STATFN_SCOPE_OR_GLOBAL, &start);
+	if ((result = checkSessionReady())) {
+		if (privsMemoLookup(fcinfo, priv, scope_type_id, scope_id, &memo)) {
+			result = memo->result;
+		}
+		else {
+			result =
+				(checkContext(&global_context_idx, 1, 0, priv) ||
+				 checkContext(&given_context_idx, scope_type_id,
+							  scope_id, priv));
+			privsMemoSave(memo, priv, scope_type_id, scope_id, result);
+		}
+	}
+	result_counts[result]++;
+	return statResult(&start, result);
+}
+
+
+/** 
+ * <code>veil2.i_have_priv_in_superior_scope(priv, scope_type_id, scope_id) 
+ *     returns bool</code> 
+ *
+ * Predicate to determine whether the current session user has a given
+ * privilege, <code>priv</code>, in a superior scope to that supplied: 
+ * <code>scope_type_id</code>, <code>scope_id</code>.
+ *
+ * @param privilege_id Integer giving privilege to test for
+ * @param scope_type_id Integer id of the scope type to be checked
+ * @param scope_id Integer id of the scop to be checked
+ *
+ * @return boolean true if the session has the given privilege in a
+ * scope superior to that given by scope_type_id and scope_id
+ */
+Datum
+veil2_i_have_priv_in_superior_scope(PG_FUNCTION_ARGS)
+{
+	bool result;
+	PrivsMemoEntry *memo;
+	instr_time start;
+	int priv = PG_GETARG_INT32(0);
+	int scope_type_id = PG_GETARG_INT32(1);
+	int scope_id = PG_GETARG_INT32(2);
+	
+	statBegin(STATFN_SUPERIOR, &start);
+	if ((result = checkSessionReady())) {
+		if (privsMemoLookup(fcinfo, priv, scope_type_id, scope_id, &memo)) {
+			result = memo->result;
+		}
+		else {
+			result = checkSuperiorContexts(scope_type_id, scope_id, priv);
+			privsMemoSave(memo, priv, scope_type_id, scope_id, result);
+		}
+	}
+	result_counts[result]++;
+	return statResult(&start, result);
+}
+
+
+/** 
+ * <code>veil2.i_have_priv_in_scope_or_superior(priv, scope_type_id, scope_id) 
+ *     returns bool</code> 
+ *
+ * Predicate to determine whether the current session user has a given
+ * privilege, <code>priv</code>, in the supplied scope or a superior one: 
+ * <code>scope_type_id</code>, <code>scope_id</code>.
+ *
+ * @param privilege_id Integer giving privilege to test for
+ * @param scope_type_id Integer id of the scope type to be checked
+ * @param scope_id Integer id of the scop to be checked
+ *
+ * @return boolean true if the session has the given privilege in the
+ * scope given by scope_type_id and scope_id or a supeior one.
+ */
+Datum
+veil2_i_have_priv_in_scope_or_superior(PG_FUNCTION_ARGS)
+{
+	static int context_idx = -1;
+	bool result;
+	PrivsMemoEntry *memo;
+	instr_time start;
+	int priv = PG_GETARG_INT32(0);
+	int scope_type_id = PG_GETARG_INT32(1);
+	int scope_id = PG_GETARG_INT32(2);
+
+	statBegin(STATFN_SCOPE_OR_SUPERIOR, &start);
+	if ((result = checkSessionReady())) {
+		if (privsMemoLookup(fcinfo, priv, scope_type_id, scope_id, &memo)) {
+			result = memo->result;
+		}
+		else {
+			result =
+				(checkContext(&context_idx, scope_type_id,
+							  scope_id, priv) ||
+				 checkSuperiorContexts(scope_type_id, scope_id, priv));
+			privsMemoSave(memo, priv, scope_type_id, scope_id, result);
+		}
+	}
+	result_counts[result]++;
+	return statResult(&start, result);
+}
+
+
+/** 
+ * <code>veil2.i_have_priv_in_scope_or_superior_or_global(priv, scope_type_id, scope_id) 
+ *     returns bool</code> 
+ *
+ * Predicate to determine whether the current session user has a given
+ * privilege, <code>priv</code>, in global_scope, or the supplied
+ * scope, or a superior one: 
+ * <code>scope_type_id</code>, <code>scope_id</code>.
+ *
+ * @param privilege_id Integer giving privilege to test for
+ * @param scope_type_id Integer id of the scope type to be checked
+ * @param scope_id Integer id of the scop to be checked
+ *
+ * @return boolean true if the session has the given privilege in the
+ * scope given by scope_type_id and scope_id or a supeior one or
+ * global scope.
+ */
+Datum
+veil2_i_have_priv_in_scope_or_superior_or_global(PG_FUNCTION_ARGS)
+{
+	static int global_context_idx = -1;
+	static int given_context_idx = -1;
+	bool result;
+	PrivsMemoEntry *memo;
+	instr_time start;
+	int priv = PG_GETARG_INT32(0);
+	int scope_type_id = PG_GETARG_INT32(1);
+	int scope_id = PG_GETARG_INT32(2);
+	
+	statBegin(STATFN_SCOPE_OR_SUPERIOR_OR_GLOBAL, &start);
+	if ((result = checkSessionReady())) {
+		if (privsMemoLookup(fcinfo, priv, scope_type_id, scope_id, &memo)) {
+			result = memo->result;
+		}
+		else {
+			result =
+				(checkContext(&global_context_idx, 1, 0, priv) ||
+				 checkContext(&given_context_idx, scope_type_id,
+							  scope_id, priv) ||
+				 checkSuperiorContexts(scope_type_id, scope_id, priv));
+			privsMemoSave(memo, priv, scope_type_id, scope_id, result);
+		}
+	}
+	result_counts[result]++;
+	return statResult(&start, result);
+}
+
 
 /**
- * Check whether a session has been properly initialized.  If not, and
- * we are supposed to fail in such a situation, fail with an appropriate
- * error message.  Otherwise return true if the session is ready to
- * go.
+ * Deconstruct an integer array of scope_ids.
  *
- * @result boolean True if our session has been properly initialized.
+ * @param array The array.
+ * @param p_scopes The deconstructed scope_id Datums are returned
+ * through this.
+ * @param p_nulls The null flags for each element are returned
+ * through this.
+ *
+ * @return The number of elements.
+ */
+static int
+deconstructScopesArray(ArrayType *array, Datum **p_scopes, bool **p_nulls)
+{
+	int nelems;
+
+	if (ARR_ELEMTYPE(array) != INT4OID) {
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("scope_ids must be an array of integer")));
+	}
+	deconstruct_array(array, INT4OID, sizeof(int32), true, 'i',
+					  p_scopes, p_nulls, &nelems);
+	return nelems;
+}
+
+/** 
+ * <code>veil2.i_have_priv_in_scopes(priv, scope_type_id, scope_ids) 
+ *     returns bool[]</code> 
+ *
+ * Test whether the current session user has a given privilege,
+ * <code>priv</code>, in each of an array of scopes of a given scope
+ * type.  This is equivalent to calling veil2_i_have_priv_in_scope()
+ * for each element of <code>scope_ids</code>, but without the
+ * per-call overhead.
+ *
+ * @param privilege_id Integer giving privilege to test for
+ * @param scope_type_id Integer id of the scope type to be checked
+ * @param scope_ids Array of integer ids of the scopes to be checked
+ *
+ * @return boolean array, with the same dimensions as
+ * <code>scope_ids</code>, each element of which is true if the
+ * session has the given privilege for the corresponding scope, or
+ * null if the scope_id is null.
+ */
+Datum
+veil2_i_have_priv_in_scopes(PG_FUNCTION_ARGS)
+{
+	int context_idx = -1;
+	int priv;
+	int scope_type_id;
+	ArrayType *scope_ids;
+	Datum *scopes;
+	bool *nulls;
+	int nelems;
+	bool ready;
+	bool result;
+	instr_time start;
+	int i;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2)) {
+		PG_RETURN_NULL();
+	}
+	priv = PG_GETARG_INT32(0);
+	scope_type_id = PG_GETARG_INT32(1);
+	scope_ids = PG_GETARG_ARRAYTYPE_P(2);
+	if (ARR_NDIM(scope_ids) == 0) {
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(BOOLOID));
+	}
+
+	statBegin(STATFN_IN_SCOPES, &start);
+	nelems = deconstructScopesArray(scope_ids, &scopes, &nulls);
+	ready = checkSessionReady();
+	for (i = 0; i < nelems; i++) {
+		if (nulls[i]) {
+			continue;
+		}
+		result = ready && checkContext(&context_idx, scope_type_id,
+									   DatumGetInt32(scopes[i]), priv);
+		result_counts[result]++;
+		FN_STAT(result? FNSTAT_TRUE: FNSTAT_FALSE)++;
+		/* Re-use the scopes array for our results. */
+		scopes[i] = BoolGetDatum(result);
+	}
+	statFinish(&start);
+	PG_RETURN_ARRAYTYPE_P(
+		construct_md_array(scopes, nulls, ARR_NDIM(scope_ids),
+						   ARR_DIMS(scope_ids), ARR_LBOUND(scope_ids),
+						   BOOLOID, sizeof(bool), true, 'c'));
+}
+
+
+/** 
+ * <code>veil2.filter_scopes_with_priv(priv, scope_type_id, scope_ids) 
+ *     returns int[]</code> 
+ *
+ * Return those elements of an array of scope_ids, for which the
+ * current session user has a given privilege, <code>priv</code>, in
+ * the scope given by the scope_type and scope_id.
+ *
+ * @param privilege_id Integer giving privilege to test for
+ * @param scope_type_id Integer id of the scope type to be checked
+ * @param scope_ids Array of integer ids of the scopes to be checked
+ *
+ * @return integer array containing, in their original order, the
+ * non-null elements of <code>scope_ids</code> for which the session
+ * has the given privilege.
+ */
+Datum
+veil2_filter_scopes_with_priv(PG_FUNCTION_ARGS)
+{
+	int context_idx = -1;
+	int priv;
+	int scope_type_id;
+	ArrayType *scope_ids;
+	Datum *scopes;
+	bool *nulls;
+	int nelems;
+	int nfound = 0;
+	bool result;
+	instr_time start;
+	int i;
+
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1) || PG_ARGISNULL(2)) {
+		PG_RETURN_NULL();
+	}
+	priv = PG_GETARG_INT32(0);
+	scope_type_id = PG_GETARG_INT32(1);
+	scope_ids = PG_GETARG_ARRAYTYPE_P(2);
+	statBegin(STATFN_FILTER_SCOPES, &start);
+	if ((ARR_NDIM(scope_ids) == 0) || !checkSessionReady()) {
+		statFinish(&start);
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(INT4OID));
+	}
+
+	nelems = deconstructScopesArray(scope_ids, &scopes, &nulls);
+	for (i = 0; i < nelems; i++) {
+		if (nulls[i]) {
+			continue;
+		}
+		result = checkContext(&context_idx, scope_type_id,
+							  DatumGetInt32(scopes[i]), priv);
+		result_counts[result]++;
+		FN_STAT(result? FNSTAT_TRUE: FNSTAT_FALSE)++;
+		if (result) {
+			/* Compact the matching scopes into the start of the
+			 * array. */
+			scopes[nfound++] = scopes[i];
+		}
+	}
+	statFinish(&start);
+	if (nfound == 0) {
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(INT4OID));
+	}
+	PG_RETURN_ARRAYTYPE_P(
+		construct_array(scopes, nfound, INT4OID, sizeof(int32), true, 'i'));
+}
+
+
+/**
+ * The names by which each ::PolicyMode is identified in a policy.
+ * These are the names of the equivalent i_have_xxx() functions,
+ * without their common prefixes.
+ */
+static const char *policy_mode_names[] = {
+	"global",
+	"personal",
+	"scope",
+	"scope_or_global",
+	"superior",
+	"scope_or_superior",
+	"scope_or_superior_or_global"
+};
+
+/**
+ * Report an error in a policy for veil2_i_have_any_priv().
+ *
+ * @param spec The policy.
+ * @param detail Description of the problem.
+ */
+static void
+policyError(const char *spec, const char *detail)
+{
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid veil2 policy: \"%s\"", spec),
+			 errdetail("%s", detail)));
+}
+
+/**
+ * Skip whitespace in a policy.
+ *
+ * @param p Pointer into the policy.
+ *
+ * @return Pointer to the next non-whitespace character.
+ */
+static char *
+skipPolicySpace(char *p)
+{
+	while (isspace((unsigned char) *p)) {
+		p++;
+	}
+	return p;
+}
+
+/**
+ * Read an integer from a policy.
+ *
+ * @param spec The policy, for error reporting.
+ * @param p_pos Pointer to our position in the policy, which is
+ * advanced past the integer and any following whitespace.
+ *
+ * @return The integer.
+ */
+static int
+parsePolicyInt(const char *spec, char **p_pos)
+{
+	char *end;
+	long value;
+
+	errno = 0;
+	value = strtol(*p_pos, &end, 10);
+	if ((end == *p_pos) || (errno != 0) ||
+		(value < PG_INT32_MIN) || (value > PG_INT32_MAX))
+	{
+		policyError(spec, "An integer was expected.");
+	}
+	*p_pos = skipPolicySpace(end);
+	return (int) value;
+}
+
+/**
+ * Parse a policy for veil2_i_have_any_priv().  A policy is a
+ * comma-separated list of terms, each of the form
+ * <code>mode(priv)</code> for global and personal terms, or
+ * <code>mode(priv, scope_type_id)</code> for the rest.
+ *
+ * @param spec The policy, as a null-terminated string.
+ * @param mcxt The memory context in which to allocate the result.
+ *
+ * @return The parsed ::PolicySpec.
+ */
+static PolicySpec *
+parsePolicy(char *spec, MemoryContext mcxt)
+{
+	PolicySpec *policy;
+	PolicyTerm *term;
+	char *pos;
+	char *name;
+	int len;
+	int maxterms = 1;
+	int mode;
+
+	for (pos = spec; *pos; pos++) {
+		if (*pos == '(') {
+			maxterms++;
+		}
+	}
+	policy = (PolicySpec *) MemoryContextAllocZero(mcxt, sizeof(PolicySpec));
+	policy->text = MemoryContextStrdup(mcxt, spec);
+	policy->terms = (PolicyTerm *) MemoryContextAlloc(
+		mcxt, sizeof(PolicyTerm) * maxterms);
+	policy->global_idx = -1;
+
+	pos = skipPolicySpace(spec);
+	while (true) {
+		name = pos;
+		while (isalnum((unsigned char) *pos) || (*pos == '_')) {
+			pos++;
+		}
+		len = pos - name;
+		for (mode = 0; mode < lengthof(policy_mode_names); mode++) {
+			if ((strlen(policy_mode_names[mode]) == len) &&
+				(pg_strncasecmp(policy_mode_names[mode], name, len) == 0))
+			{
+				break;
+			}
+		}
+		if (mode == lengthof(policy_mode_names)) {
+			policyError(spec, "Unknown privilege test.");
+		}
+		pos = skipPolicySpace(pos);
+		if (*pos != '(') {
+			policyError(spec, "\"(\" was expected.");
+		}
+		pos = skipPolicySpace(pos + 1);
+
+		term = &(policy->terms[policy->nterms++]);
+		term->mode = (PolicyMode) mode;
+		term->priv = parsePolicyInt(spec, &pos);
+		term->context_idx = -1;
+		if (term->mode == POLICY_GLOBAL) {
+			term->scope_type = 1;
+			term->arg = -1;
+		}
+		else {
+			if (term->mode == POLICY_PERSONAL) {
+				term->scope_type = 2;
+			}
+			else {
+				if (*pos != ',') {
+					policyError(spec, "A scope_type_id was expected.");
+				}
+				pos = skipPolicySpace(pos + 1);
+				term->scope_type = parsePolicyInt(spec, &pos);
+			}
+			term->arg = policy->nscopes++;
+		}
+		if (*pos != ')') {
+			policyError(spec, "\")\" was expected.");
+		}
+		pos = skipPolicySpace(pos + 1);
+		if (*pos == '\0') {
+			break;
+		}
+		if (*pos != ',') {
+			policyError(spec, "\",\" was expected.");
+		}
+		pos = skipPolicySpace(pos + 1);
+	}
+
+	policy->scopes = (int *) MemoryContextAlloc(
+		mcxt, sizeof(int) * (policy->nscopes + 1));
+	policy->nulls = (bool *) MemoryContextAlloc(
+		mcxt, sizeof(bool) * (policy->nscopes + 1));
+	return policy;
+}
+
+/**
+ * Return the parsed policy for a call to veil2_i_have_any_priv(),
+ * parsing it only if it differs from the policy for the previous
+ * call from the same call site.  Each parsed policy is held in its
+ * own child of fn_mcxt, which is deleted when the policy is replaced,
+ * so that a policy that varies from row to row does not accumulate
+ * memory for the rest of the query.
+ *
+ * @param fcinfo The function call info, whose fn_extra records the
+ * parsed policy.
+ * @param policy_text The policy.
+ *
+ * @return The parsed ::PolicySpec.
+ */
+static PolicySpec *
+getPolicy(FunctionCallInfo fcinfo, text *policy_text)
+{
+	PolicySpec *policy = (PolicySpec *) fcinfo->flinfo->fn_extra;
+	PolicySpec *new_policy;
+	MemoryContext context;
+	int len = VARSIZE_ANY_EXHDR(policy_text);
+
+	if (policy && (strlen(policy->text) == len) &&
+		(memcmp(policy->text, VARDATA_ANY(policy_text), len) == 0))
+	{
+		return policy;
+	}
+	context = AllocSetContextCreate(fcinfo->flinfo->fn_mcxt,
+									"veil2 policy",
+									ALLOCSET_SMALL_SIZES);
+	new_policy = parsePolicy(text_to_cstring(policy_text), context);
+	new_policy->context = context;
+	if (policy) {
+		MemoryContextDelete(policy->context);
+	}
+	fcinfo->flinfo->fn_extra = (void *) new_policy;
+	return new_policy;
+}
+
+/**
+ * Check that the number of scope_ids supplied in a call to
+ * veil2_i_have_any_priv() matches its ::PolicySpec.
+ *
+ * @param policy The ::PolicySpec.
+ * @param nelems The number of scope_ids supplied.
+ */
+static void
+checkPolicyScopeCount(PolicySpec *policy, int nelems)
+{
+	if (nelems != policy->nscopes) {
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("veil2 policy \"%s\" requires %d scope_ids, "
+						"but %d were supplied",
+						policy->text, policy->nscopes, nelems)));
+	}
+}
+
+/**
+ * Copy the scope_ids for a call to veil2_i_have_any_priv() into its
+ * ::PolicySpec.  This reads the array directly, rather than
+ * deconstructing it, as it is done for every row, so the array must
+ * first be checked to be a one-dimensional integer array.
+ *
+ * @param policy The ::PolicySpec.
+ * @param array The scope_ids array.
  */
-static bool
-checkSessionReady()
+static void
+fetchPolicyScopes(PolicySpec *policy, ArrayType *array)
 {
-	if (session_ready) {
-		return true;
+	int nelems;
+	int32 *data;
+	bits8 *nullmap;
+	int i;
+
+	if (ARR_ELEMTYPE(array) != INT4OID) {
+		ereport(ERROR,
+				(errcode(ERRCODE_DATATYPE_MISMATCH),
+				 errmsg("scope_ids must be an array of integer")));
 	}
-	if (error_if_no_session()) {
+	if (ARR_NDIM(array) > 1) {
 		ereport(ERROR,
-				(errcode(ERRCODE_INTERNAL_ERROR),
-				 errmsg("Attempt to check privileges before call to "
-						"veil2_reset_session.")));
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("scope_ids must be a one-dimensional array")));
+	}
+	nelems = ArrayGetNItems(ARR_NDIM(array), ARR_DIMS(array));
+	data = (int32 *) ARR_DATA_PTR(array);
+	nullmap = ARR_NULLBITMAP(array);
+	checkPolicyScopeCount(policy, nelems);
+	for (i = 0; i < nelems; i++) {
+		if (nullmap && !(nullmap[i / 8] & (1 << (i % 8)))) {
+			policy->nulls[i] = true;
+		}
+		else {
+			policy->nulls[i] = false;
+			policy->scopes[i] = *data++;
+		}
 	}
-	return false;
 }
 
-/** 
- * <code>veil2.i_have_global_priv(priv) returns bool</code> 
- *
- * Predicate to determine whether the current session user has a given
- * privilege, <code>priv</code>, with global scope.
+/**
+ * Find the context for a term of a policy, re-using the result of
+ * any earlier term in the same call that tested the same scope.
  *
- * @param privilege_id Integer giving privilege to test for
+ * @param policy The ::PolicySpec.
+ * @param t The index of the term.
  *
- * @return boolean true if the session has the given privilege
+ * @return The index of the context, or -1 if there is none.
  */
-Datum
-veil2_i_have_global_priv(PG_FUNCTION_ARGS)
+static int
+findTermContext(PolicySpec *policy, int t)
 {
-	static int context_idx = -1;
-	int priv = PG_GETARG_INT32(0);
-	bool result;
-	
-	if ((result = checkSessionReady())) {
-		result = checkContext(&context_idx, 1, 0, priv);
+	PolicyTerm *term = &(policy->terms[t]);
+	int scope = policy->scopes[term->arg];
+	PolicyTerm *prev;
+	int i;
+
+	for (i = 0; i < t; i++) {
+		prev = &(policy->terms[i]);
+		if ((prev->mode != POLICY_GLOBAL) && (prev->mode != POLICY_SUPERIOR) &&
+			!policy->nulls[prev->arg] &&
+			(prev->scope_type == term->scope_type) &&
+			(policy->scopes[prev->arg] == scope))
+		{
+			term->context_idx = prev->context_idx;
+			return term->context_idx;
+		}
 	}
-	result_counts[result]++;
-	return result;
+	findContext(&(term->context_idx), term->scope_type, scope);
+	return term->context_idx;
 }
 
-
-/** 
- * <code>veil2.i_have_personal_priv(priv, accessor_id) returns bool</code> 
- *
- * Predicate to determine whether the current session user has a given
- * privilege, <code>priv</code>, in their personal scope (ie for data
- * pertaining to themselves).
+/**
+ * Evaluate a policy for veil2_i_have_any_priv().  This is done in 2
+ * passes.  The first tests each term in the global context and the
+ * given scope, as appropriate, finding each distinct context only
+ * once.  Only if no term is satisfied is the second, more expensive,
+ * pass made, which searches superior scopes.  Terms whose scope_id
+ * is null are tested only in the global context, as are the
+ * equivalent i_have_xxx() functions.
  *
- * @param privilege_id Integer giving privilege to test for
- * @param accessor_id Integer id for a party from the record being
- * checked.
+ * @param policy The ::PolicySpec, with the scope_ids for this call.
  *
- * @return boolean true if the session has the given privilege in the
- * personal scope of the given accessor_id
+ * @return true if any term of the policy is satisfied.
  */
-Datum
-veil2_i_have_personal_priv(PG_FUNCTION_ARGS)
+static bool
+evaluatePolicy(PolicySpec *policy)
 {
-	static int context_idx = -1;
-	bool result;
-	int priv = PG_GETARG_INT32(0);
-	int accessor_id = PG_GETARG_INT32(1);
-	
-	if ((result = checkSessionReady())) {
-		result = checkContext(&context_idx, 2, accessor_id, priv);
+	PolicyTerm *term;
+	int idx;
+	int t;
+
+	for (t = 0; t < policy->nterms; t++) {
+		term = &(policy->terms[t]);
+		switch (term->mode) {
+		case POLICY_GLOBAL:
+		case POLICY_SCOPE_OR_GLOBAL:
+		case POLICY_SCOPE_OR_SUPERIOR_OR_GLOBAL:
+			findContext(&(policy->global_idx), 1, 0);
+			if ((policy->global_idx != -1) &&
+				bitmapTestbit(contextPrivileges(policy->global_idx),
+							  term->priv))
+			{
+				return true;
+			}
+			break;
+		default:
+			break;
+		}
+		if ((term->mode == POLICY_GLOBAL) ||
+			(term->mode == POLICY_SUPERIOR) || policy->nulls[term->arg])
+		{
+			continue;
+		}
+		idx = findTermContext(policy, t);
+		if ((idx != -1) &&
+			bitmapTestbit(contextPrivileges(idx), term->priv))
+		{
+			return true;
+		}
 	}
-	result_counts[result]++;
-	return result;
-}
 
+	for (t = 0; t < policy->nterms; t++) {
+		term = &(policy->terms[t]);
+		switch (term->mode) {
+		case POLICY_SUPERIOR:
+		case POLICY_SCOPE_OR_SUPERIOR:
+		case POLICY_SCOPE_OR_SUPERIOR_OR_GLOBAL:
+			if (!policy->nulls[term->arg] &&
+				checkSuperiorContexts(term->scope_type,
+									  policy->scopes[term->arg],
+									  term->priv))
+			{
+				return true;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	return false;
+}
 
 /** 
- * <code>veil2.i_have_priv_in_scope(priv, scope_type_id, scope_id) 
+ * <code>veil2.i_have_any_priv(policy, variadic scope_ids) 
  *     returns bool</code> 
  *
- * Predicate to determine whether the current session user has a given
- * privilege, <code>priv</code>, in a specific scope
- * (<code>scope_type_id</code>, <code>scope_id</code>).
+ * Predicate to determine whether the current session user satisfies
+ * any of the terms of a policy.  This replaces a security policy
+ * that ORs together several calls to the other privilege testing
+ * functions with a single call, so that the overheads of each
+ * function call, and of checking the session, are incurred only
+ * once, and so that the context for a scope that is tested more than
+ * once need be found only once.  For instance:
+ * <code>
+ *   veil2.i_have_priv_in_scope_or_global(21, 3, corp_id)
+ *   or veil2.i_have_priv_in_scope(21, 4, org_id)
+ *   or veil2.i_have_personal_priv(21, party_id)
+ * </code>
+ * may be written as:
+ * <code>
+ *   veil2.i_have_any_priv(
+ *       'scope_or_global(21, 3), scope(21, 4), personal(21)',
+ *       corp_id, org_id, party_id)
+ * </code>
  *
- * @param privilege_id Integer giving privilege to test for
- * @param scope_type_id Integer id of the scope type to be checked
- * @param scope_id Integer id of the scop to be checked
+ * The policy is a comma-separated list of terms, each naming the
+ * privilege testing function to be used, without its
+ * <code>i_have_</code> and <code>priv_in_</code> prefixes, with the
+ * privilege and, except for global and personal tests, the
+ * scope_type_id as parameters.  Each term other than a global one
+ * takes the next of the scope_ids.  The scope and superior scope
+ * tests of a term with a null scope_id are not satisfied, so
+ * conditional terms may be written using case expressions, but the
+ * global tests of scope_or_global and scope_or_superior_or_global
+ * terms are still made, as they are by
+ * veil2_i_have_priv_in_scope_or_global() and
+ * veil2_i_have_priv_in_scope_or_superior_or_global().  A policy
+ * consisting only of global terms may be given without scope_ids.
+ * The policy is parsed only once for each call site.
  *
- * @return boolean true if the session has the given privilege for the
- * given scope_type_id and scope_id
+ * @param policy Text giving the terms of the policy
+ * @param scope_ids The scope_ids, or for personal terms the
+ * accessor_ids, for each non-global term, if any
+ *
+ * @return boolean true if any term of the policy is satisfied
  */
 Datum
-veil2_i_have_priv_in_scope(PG_FUNCTION_ARGS)
+veil2_i_have_any_priv(PG_FUNCTION_ARGS)
 {
-	static int context_idx = -1;
+	PolicySpec *policy;
 	bool result;
-	int priv = PG_GETARG_INT32(0);
-	int scope_type_id = PG_GETARG_INT32(1);
-	int scope_id = PG_GETARG_INT32(2);
-	
+	instr_time start;
+
+	if (PG_ARGISNULL(0)) {
+		PG_RETURN_NULL();
+	}
+	statBegin(STATFN_ANY_PRIV, &start);
+	policy = getPolicy(fcinfo, PG_GETARG_TEXT_PP(0));
+	if (PG_NARGS() < 2) {
+		checkPolicyScopeCount(policy, 0);
+	}
+	else if (PG_ARGISNULL(1)) {
+		memset(policy->nulls, true, sizeof(bool) * policy->nscopes);
+	}
+	else {
+		fetchPolicyScopes(policy, PG_GETARG_ARRAYTYPE_P(1));
+	}
 	if ((result = checkSessionReady())) {
-		result = checkContext(&context_idx, scope_type_id, scope_id, priv);
+		result = evaluatePolicy(policy);
 	}
 	result_counts[result]++;
-	return result;
+	return statResult(&start, result);
 }
 
 
-/** 
- * <code>veil2.i_have_priv_in_scope_or_global(priv, scope_type_id, scope_id) 
- *     returns bool</code> 
- *
- * Predicate to determine whether the current session user has a given
- * privilege, <code>priv</code>, in a specific scope
- * (<code>scope_type_id</code>, <code>scope_id</code>), or in global scope.
+/**
+ * qsort comparator for ints.
+ */
+static int
+cmp_ints(const void *a, const void *b)
+{
+	int x = *((const int *) a);
+	int y = *((const int *) b);
+
+	return (x > y) - (x < y);
+}
+
+/**
+ * Build the array of scope_ids for veil2_my_scopes().
  *
- * @param privilege_id Integer giving privilege to test for
- * @param scope_type_id Integer id of the scope type to be checked
- * @param scope_id Integer id of the scop to be checked
+ * @param priv The privilege.
+ * @param scope_type The scope_type_id of the scopes to be returned.
  *
- * @return boolean true if the session has the given privilege for the
- * given scope_type_id and scope_id
+ * @return A new array, in scope_id order, of scope_ids in which the
+ * session has priv, either directly or through a superior scope.
  */
-Datum
-veil2_i_have_priv_in_scope_or_global(PG_FUNCTION_ARGS)
+static ArrayType *
+buildMyScopes(int priv, int scope_type)
 {
-	static int global_context_idx = -1;
-	static int given_context_idx = -1;
-	bool result;
-	int priv = PG_GETARG_INT32(0);
-	int scope_type_id = PG_GETARG_INT32(1);
-	int scope_id = PG_GETARG_INT32(2);
-	
-	if ((result = checkSessionReady())) {
-		result =
-			(checkContext(&global_context_idx, 1, 0, priv) ||
-			 checkContext(&given_context_idx, scope_type_id,
-						  scope_id, priv));
+	int *scopes;
+	int nscopes;
+	int *candidates;
+	int ncandidates;
+	int nfound = 0;
+	Datum *datums;
+	ScopeKey *key;
+	int i;
+
+	ncandidates = veil2_scopes_with_superiors(scope_type, &candidates);
+	scopes = (int *) palloc(sizeof(int) *
+							(session_roleprivs->active_contexts +
+							 ncandidates + 1));
+
+	/* Scopes in which priv has been directly assigned, or promoted. */
+	for (i = 0; i < session_roleprivs->active_contexts; i++) {
+		key = &(session_roleprivs->keys[i]);
+		if ((key->scope_type == scope_type) &&
+			bitmapTestbit(contextPrivileges(i), priv))
+		{
+			scopes[nfound++] = key->scope;
+		}
 	}
-	result_counts[result]++;
-	return result;
-}
 
+	/* Scopes in which priv is derived from a superior scope. */
+	for (i = 0; i < ncandidates; i++) {
+		if (checkSuperiorContexts(scope_type, candidates[i], priv)) {
+			scopes[nfound++] = candidates[i];
+		}
+	}
+
+	/* Sort and remove duplicates. */
+	qsort(scopes, nfound, sizeof(int), cmp_ints);
+	nscopes = 0;
+	datums = (Datum *) palloc(sizeof(Datum) * (nfound + 1));
+	for (i = 0; i < nfound; i++) {
+		if ((i == 0) || (scopes[i] != scopes[i - 1])) {
+			datums[nscopes++] = Int32GetDatum(scopes[i]);
+		}
+	}
+	if (nscopes == 0) {
+		return construct_empty_array(INT4OID);
+	}
+	return construct_array(datums, nscopes, INT4OID,
+						   sizeof(int32), true, 'i');
+}
 
 /** 
- * <code>veil2.i_have_priv_in_superior_scope(priv, scope_type_id, scope_id) 
- *     returns bool</code> 
+ * <code>veil2.my_scopes(priv, scope_type_id) returns int[]</code> 
  *
- * Predicate to determine whether the current session user has a given
- * privilege, <code>priv</code>, in a superior scope to that supplied: 
- * <code>scope_type_id</code>, <code>scope_id</code>.
+ * Return the set of scope_ids, for scopes of the given scope type,
+ * in which the current session user has a given privilege,
+ * <code>priv</code>.  This includes scopes in which the privilege
+ * has been assigned or promoted, and scopes which have a superior
+ * scope in which the privilege has been assigned.  Global privileges
+ * are not considered: this is intended to be used in conjunction
+ * with veil2_i_have_global_priv().
+ *
+ * This allows security policies to be written as:
+ * <code>project_id = any(veil2.my_scopes(25, 5))</code>, which the
+ * planner can use in index scans.  The result is memoized for each
+ * call site, and rebuilt only when session privileges or the scope
+ * hierarchy change, so it is cheap to call for every row.
  *
  * @param privilege_id Integer giving privilege to test for
- * @param scope_type_id Integer id of the scope type to be checked
- * @param scope_id Integer id of the scop to be checked
+ * @param scope_type_id Integer id of the scope type for which scopes
+ * are to be returned
  *
- * @return boolean true if the session has the given privilege in a
- * scope superior to that given by scope_type_id and scope_id
+ * @return integer array of scope_ids, in ascending order.
  */
 Datum
-veil2_i_have_priv_in_superior_scope(PG_FUNCTION_ARGS)
+veil2_my_scopes(PG_FUNCTION_ARGS)
 {
-	static void *saved_plan = NULL;
-	bool result;
-	bool found;
-	bool pushed;
-	int priv = PG_GETARG_INT32(0);
-	int scope_type_id = PG_GETARG_INT32(1);
-	int scope_id = PG_GETARG_INT32(2);
-	Oid argtypes[] = {INT4OID, INT4OID, INT4OID};
-	Datum args[] = {Int32GetDatum(priv),
-					Int32GetDatum(scope_type_id),
-					Int32GetDatum(scope_id)};
-	
-	if ((result = checkSessionReady())) {
-		veil2_spi_connect(&pushed,
-						  "SPI connect failed in "
-						  "veil2_i_have_priv_in_superior_scope()");
-		found = veil2_bool_from_query(
-			"select true"
-			"  from veil2.all_superior_scopes asp"
-			" inner join veil2.session_privileges() sp"
-			"    on sp.scope_type_id = asp.superior_scope_type_id"
-			"   and sp.scope_id = asp.superior_scope_id"
-			" where asp.scope_type_id = $2"
-			"   and asp.scope_id = $3"
-			"   and sp.privs ? $1",
-			3, argtypes, args,
-			&saved_plan, &result);
+	MyScopesMemo *memo = (MyScopesMemo *) fcinfo->flinfo->fn_extra;
+	uint64 hierarchy_generation;
+	int priv;
+	int scope_type_id;
+	ArrayType *result;
+	MemoryContext old_context;
+	instr_time start;
 
-		veil2_spi_finish(pushed,
-						 "SPI finish failed in "
-						 "veil2_i_have_priv_in_superior_scope()");
-		result = found && result;
+	if (PG_ARGISNULL(0) || PG_ARGISNULL(1)) {
+		PG_RETURN_NULL();
 	}
-	result_counts[result]++;
-	return result;
+	priv = PG_GETARG_INT32(0);
+	scope_type_id = PG_GETARG_INT32(1);
+	statBegin(STATFN_MY_SCOPES, &start);
+	if (!checkSessionReady() || !session_roleprivs) {
+		statFinish(&start);
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(INT4OID));
+	}
+
+	hierarchy_generation = veil2_scope_hierarchy_generation();
+	if (memo && memo->result &&
+		(memo->session_generation == session_privs_generation) &&
+		(memo->hierarchy_generation == hierarchy_generation) &&
+		(memo->priv == priv) && (memo->scope_type == scope_type_id))
+	{
+		FN_STAT(FNSTAT_MEMO_HITS)++;
+		/* Our caller may modify or free the result, so we must not
+		 * return the memo's own copy. */
+		result = (ArrayType *) palloc(VARSIZE(memo->result));
+		memcpy(result, memo->result, VARSIZE(memo->result));
+		statFinish(&start);
+		PG_RETURN_ARRAYTYPE_P(result);
+	}
+
+	result = buildMyScopes(priv, scope_type_id);
+	if (!memo) {
+		memo = (MyScopesMemo *) MemoryContextAllocZero(
+			fcinfo->flinfo->fn_mcxt, sizeof(MyScopesMemo));
+		fcinfo->flinfo->fn_extra = (void *) memo;
+	}
+	if (memo->result) {
+		pfree(memo->result);
+	}
+	old_context = MemoryContextSwitchTo(fcinfo->flinfo->fn_mcxt);
+	memo->result = (ArrayType *) palloc(VARSIZE(result));
+	memcpy(memo->result, result, VARSIZE(result));
+	MemoryContextSwitchTo(old_context);
+
+	memo->session_generation = session_privs_generation;
+	memo->hierarchy_generation = hierarchy_generation;
+	memo->priv = priv;
+	memo->scope_type = scope_type_id;
+	statFinish(&start);
+	PG_RETURN_ARRAYTYPE_P(result);
 }
 
 
-/** 
- * <code>veil2.i_have_priv_in_scope_or_superior(priv, scope_type_id, scope_id) 
- *     returns bool</code> 
- *
- * Predicate to determine whether the current session user has a given
- * privilege, <code>priv</code>, in the supplied scope or a superior one: 
- * <code>scope_type_id</code>, <code>scope_id</code>.
+/**
+ * Determine whether the session has a given privilege in global
+ * scope, without affecting ::result_counts.  This is for use by the
+ * planner support functions.
  *
- * @param privilege_id Integer giving privilege to test for
- * @param scope_type_id Integer id of the scope type to be checked
- * @param scope_id Integer id of the scop to be checked
+ * @param priv The privilege to test for.
  *
- * @return boolean true if the session has the given privilege in the
- * scope given by scope_type_id and scope_id or a supeior one.
+ * @return true if the session is ready and has priv in global scope.
  */
-Datum
-veil2_i_have_priv_in_scope_or_superior(PG_FUNCTION_ARGS)
+bool
+veil2_session_has_global_priv(int priv)
 {
-	static int context_idx = -1;
-	static void *saved_plan = NULL;
-	bool result;
-	bool found;
-	bool pushed;
-	int priv = PG_GETARG_INT32(0);
-	int scope_type_id = PG_GETARG_INT32(1);
-	int scope_id = PG_GETARG_INT32(2);
-	Oid argtypes[] = {INT4OID, INT4OID, INT4OID};
-	Datum args[] = {Int32GetDatum(priv),
-					Int32GetDatum(scope_type_id),
-					Int32GetDatum(scope_id)};
+	int idx = -1;
 
-	if ((result = checkSessionReady())) {
-		/* Start by checking priv in scope - this can maybe save us a
-		 * query. */
-
-		result = checkContext(&context_idx, scope_type_id, scope_id, priv);
-
-		if (!result) {
-			veil2_spi_connect(&pushed,
-							  "SPI connect failed in "
-							  "veil2_i_have_priv_in_scope_or_superior()");
-			found = veil2_bool_from_query(
-				"select true"
-				"  from veil2.all_superior_scopes asp"
-				" inner join veil2.session_privileges() sp"
-				"    on sp.scope_type_id = asp.superior_scope_type_id"
-				"   and sp.scope_id = asp.superior_scope_id"
-				" where asp.scope_type_id = $2"
-				"   and asp.scope_id = $3"
-				"   and sp.privs ? $1",
-				3, argtypes, args,
-				&saved_plan, &result);
-			
-			veil2_spi_finish(pushed,
-							 "SPI finish failed in "
-							 "veil2_i_have_priv_in_scope_or_superior()");
-			result = found && result;
-		}
-	}
-	result_counts[result]++;
-	return result;
+	return session_ready && checkContext(&idx, 1, 0, priv);
 }
 
+/**
+ * The number of superior scope counts remembered by
+ * veil2_count_scopes_with_priv().
+ */
+#define SCOPE_COUNT_SLOTS 8
 
-/** 
- * <code>veil2.i_have_priv_in_scope_or_superior_or_global(priv, scope_type_id, scope_id) 
- *     returns bool</code> 
- *
- * Predicate to determine whether the current session user has a given
- * privilege, <code>priv</code>, in global_scope, or the supplied
- * scope, or a superior one: 
- * <code>scope_type_id</code>, <code>scope_id</code>.
+/**
+ * A remembered count of the scopes in which the session has a
+ * privilege, including those derived from superior scopes.
+ */
+typedef struct {
+	/** The session privileges generation for which count is valid */
+	uint64 session_generation;
+	/** The scope hierarchy generation for which count is valid */
+	uint64 hierarchy_generation;
+	int priv;
+	int scope_type;
+	int count;
+} ScopeCount;
+
+/**
+ * Superior scope counts for veil2_count_scopes_with_priv().  Building
+ * these requires a search of the scope hierarchy, which is too
+ * expensive to repeat each time a query is planned.
+ */
+static ScopeCount scope_counts[SCOPE_COUNT_SLOTS];
+
+/**
+ * The next slot in ::scope_counts to be replaced.
+ */
+static int next_scope_count = 0;
+
+/**
+ * Count the scopes of a given scope type in which the session has a
+ * given privilege.  This is for use by the planner support functions
+ * in estimating the selectivity of privilege tests.  Counts that
+ * include superior scopes are remembered until our session
+ * privileges or the scope hierarchy change.
  *
- * @param privilege_id Integer giving privilege to test for
- * @param scope_type_id Integer id of the scope type to be checked
- * @param scope_id Integer id of the scop to be checked
+ * @param priv The privilege to test for.
+ * @param scope_type The scope_type_id of the scopes to be counted.
+ * @param superior Whether scopes for which the privilege is derived
+ * from a superior scope should be counted.
  *
- * @return boolean true if the session has the given privilege in the
- * scope given by scope_type_id and scope_id or a supeior one or
- * global scope.
+ * @return The number of scopes, or -1 if session privileges have not
+ * been loaded.
  */
-Datum
-veil2_i_have_priv_in_scope_or_superior_or_global(PG_FUNCTION_ARGS)
+int
+veil2_count_scopes_with_priv(int priv, int scope_type, bool superior)
 {
-	static int global_context_idx = -1;
-	static int given_context_idx = -1;
-	static void *saved_plan = NULL;
-	bool result;
-	bool found;
-	bool pushed;
-	int priv = PG_GETARG_INT32(0);
-	int scope_type_id = PG_GETARG_INT32(1);
-	int scope_id = PG_GETARG_INT32(2);
-	Oid argtypes[] = {INT4OID, INT4OID, INT4OID};
-	Datum args[] = {Int32GetDatum(priv),
-					Int32GetDatum(scope_type_id),
-					Int32GetDatum(scope_id)};
-	
-	if ((result = checkSessionReady())) {
-		result =
-			(checkContext(&global_context_idx, 1, 0, priv) ||
-			 checkContext(&given_context_idx, scope_type_id,
-						  scope_id, priv));
-		if (!result) {
-			veil2_spi_connect(&pushed,
-							  "SPI connect failed in "
-							  "veil2_i_have_priv_in_scope_or_superior()");
-			found = veil2_bool_from_query(
-				"select true"
-				"  from veil2.all_superior_scopes asp"
-				" inner join veil2.session_privileges() sp"
-				"    on sp.scope_type_id = asp.superior_scope_type_id"
-				"   and sp.scope_id = asp.superior_scope_id"
-				" where asp.scope_type_id = $2"
-				"   and asp.scope_id = $3"
-				"   and sp.privs ? $1",
-				3, argtypes, args,
-				&saved_plan, &result);
-
-			veil2_spi_finish(pushed,
-							 "SPI finish failed in "
-							 "veil2_i_have_priv_in_scope_or_superior()");
-			result = found && result;
+	ArrayType *scopes;
+	ScopeCount *slot;
+	uint64 hierarchy_generation;
+	int count = 0;
+	int i;
+
+	if (!session_ready || !session_roleprivs) {
+		return -1;
+	}
+	if (superior) {
+		hierarchy_generation = veil2_scope_hierarchy_generation();
+		for (i = 0; i < SCOPE_COUNT_SLOTS; i++) {
+			slot = &scope_counts[i];
+			if ((slot->session_generation == session_privs_generation) &&
+				(slot->hierarchy_generation == hierarchy_generation) &&
+				(slot->priv == priv) && (slot->scope_type == scope_type))
+			{
+				return slot->count;
+			}
 		}
+		scopes = buildMyScopes(priv, scope_type);
+		count = ArrayGetNItems(ARR_NDIM(scopes), ARR_DIMS(scopes));
+		pfree(scopes);
+
+		slot = &scope_counts[next_scope_count];
+		next_scope_count = (next_scope_count + 1) % SCOPE_COUNT_SLOTS;
+		slot->session_generation = session_privs_generation;
+		slot->hierarchy_generation = hierarchy_generation;
+		slot->priv = priv;
+		slot->scope_type = scope_type;
+		slot->count = count;
+		return count;
 	}
-	result_counts[result]++;
-	return result;
+	for (i = 0; i < session_roleprivs->active_contexts; i++) {
+		if ((session_roleprivs->keys[i].scope_type == scope_type) &&
+			bitmapTestbit(contextPrivileges(i), priv))
+		{
+			count++;
+		}
+	}
+	return count;
 }
 
 
@@ -11,6 +11,8 @@
  * 
  */
 
+#include "datatype/timestamp.h"
+#include "portability/instr_time.h"
 #include "extension/pgbitmap/pgbitmap.h"
 #include "veil2_version.h"
 
@@ -22,16 +24,27 @@ typedef bool (Fetch_fn)(HeapTuple, TupleDesc, void *);
 
 
 /**
- * This is for queries that return tuples containing a pair of
- * integers.  It is passed as a fn_param value to veil2_query() and
- * processed by a Fetch_fn().
+ * Identifies a scope (security context) by its scope_type_id and
+ * scope_id.
  */
 typedef struct {
-	/** Unnamed integer field */
-	int f1;   
-    /** Unnamed, integer field */
-	int f2;   
-} tuple_2ints;
+	/** The scope_type_id of the scope */
+	int scope_type;
+	/** The scope_id of the scope */
+	int scope;
+} ScopeKey;
+
+
+/**
+ * Used to record an in-memory set of privileges associated with a
+ * specfic scope (security context).
+ */
+typedef struct {
+	int scope_type;
+	int scope;
+	Bitmap *roles;
+	Bitmap *privileges;
+} ContextRolePrivs;
 
 
 
@@ -56,6 +69,8 @@ extern int veil2_query(const char *qry,
 					   Fetch_fn process_row,
 					   void *fn_param);
 
+extern bool fetch_one_bool(HeapTuple tuple, TupleDesc tupdesc,
+						   void *p_result);
 extern bool veil2_bool_from_query(const char *qry,
 								  int nargs,
 								  Oid *argtypes,
@@ -64,7 +79,276 @@ extern bool veil2_bool_from_query(const char *qry,
 								  bool *result);
 
 
+/**
+ * Key for the shared accessor privileges cache.  This identifies an
+ * accessor and the contexts of their session.  As this is hashed
+ * and compared bytewise, it must contain no padding.
+ */
+typedef struct {
+	int accessor_id;
+	int login_context_type_id;
+	int login_context_id;
+	int session_context_type_id;
+	int session_context_id;
+	int mapping_context_type_id;
+	int mapping_context_id;
+} PrivsCacheKey;
+
+/**
+ * A single scope's entry in a ::PackedSessionPrivs.  The roles and
+ * privileges bitmaps are stored after the entries array, and are
+ * identified by their byte offsets from the start of the
+ * PackedSessionPrivs struct.
+ */
+typedef struct {
+	int scope_type;
+	int scope;
+	uint32 roles_offset;
+	uint32 privs_offset;
+} PackedRolePrivs;
+
+/**
+ * A session's privileges packed into a single contiguous chunk of
+ * memory, so that they may be copied to and from shared memory.
+ */
+typedef struct {
+	/** The total size of this struct, including its bitmaps */
+	uint32 size;
+	/** The number of entries */
+	int32 nentries;
+	PackedRolePrivs entries[FLEXIBLE_ARRAY_MEMBER];
+} PackedSessionPrivs;
+
+/**
+ * A function that reads a ::PackedSessionPrivs.
+ */
+typedef void (PrivsCacheReader)(PackedSessionPrivs *, void *);
+
+/**
+ * A function that writes a ::PackedSessionPrivs into space of the
+ * given size.
+ */
+typedef void (PrivsCacheWriter)(PackedSessionPrivs *, Size, void *);
+
+
+/**
+ * The maximum length of a session token that may be recorded in the
+ * shared session registry.  Sessions with longer tokens are not
+ * registered.
+ */
+#define REGISTRY_TOKEN_LEN 64
+
+/**
+ * The number of 64-bit words used to record a registered session's
+ * used nonces.
+ */
+#define NONCE_WINDOW_WORDS 4
+
+/**
+ * An entry in the shared session registry.  This records the state
+ * of an authenticated session so that it may be re-opened without
+ * reading or updating its veil2.sessions record.  Changes to expires
+ * and nonces are written back to veil2.sessions lazily.
+ */
+typedef struct {
+	/** The session_id.  This must be the first field. */
+	int64 session_id;
+	int accessor_id;
+	int login_context_type_id;
+	int login_context_id;
+	int session_context_type_id;
+	int session_context_id;
+	int mapping_context_type_id;
+	int mapping_context_id;
+	bool parent_null;
+	int64 parent_session_id;
+	/** The session's current expiry time */
+	TimestampTz expires;
+	/** The expiry time last recorded in veil2.sessions */
+	TimestampTz stored_expires;
+	/** When the session was last written back to veil2.sessions */
+	TimestampTz written_at;
+	/** The session timeout, in microseconds */
+	int64 timeout;
+	/** Whether expires or nonces have changed since they were last
+	 * written back to veil2.sessions */
+	bool dirty;
+	/** The nonce represented by the lowest bit of nonces.  This is
+	 * always a multiple of 64. */
+	int32 nonce_base;
+	/** Bitmap of used nonces */
+	uint64 nonces[NONCE_WINDOW_WORDS];
+	char token[REGISTRY_TOKEN_LEN + 1];
+} RegisteredSession;
+
+/**
+ * A function that examines, and may update, a ::RegisteredSession.
+ * It returns false if the entry should be removed from the registry.
+ */
+typedef bool (SessionRegistryFn)(RegisteredSession *, void *);
+
+
+/**
+ * The functions for which statistics are separately recorded.
+ * STATFN_INTERNAL is used for privilege tests made other than by one
+ * of the privilege testing functions, eg by the planner support
+ * functions.
+ */
+typedef enum {
+	STATFN_INTERNAL = 0,
+	STATFN_GLOBAL,
+	STATFN_PERSONAL,
+	STATFN_SCOPE,
+	STATFN_SCOPE_OR_GLOBAL,
+	STATFN_SUPERIOR,
+	STATFN_SCOPE_OR_SUPERIOR,
+	STATFN_SCOPE_OR_SUPERIOR_OR_GLOBAL,
+	STATFN_IN_SCOPES,
+	STATFN_FILTER_SCOPES,
+	STATFN_MY_SCOPES,
+	STATFN_ANY_PRIV,
+	STATFN_COUNT
+} StatFunction;
+
+/**
+ * The statistics counters recorded for each ::StatFunction.
+ */
+typedef enum {
+	FNSTAT_CALLS = 0,
+	FNSTAT_TRUE,
+	FNSTAT_FALSE,
+	FNSTAT_MEMO_HITS,
+	FNSTAT_CONTEXT_LOOKUPS,
+	FNSTAT_CONTEXT_CACHE_HITS,
+	FNSTAT_INDEX_PROBES,
+	FNSTAT_SUPERIOR_LOOKUPS,
+	FNSTAT_BSEARCH_PROBES,
+	FNSTAT_HIERARCHY_LOADS,
+	/** Nanoseconds, recorded only if veil2.track_timing is on */
+	FNSTAT_TIME,
+	FNSTAT_COUNT
+} FunctionStat;
+
+/**
+ * The statistics counters recorded for session handling.
+ */
+typedef enum {
+	SESSTAT_OPENS = 0,
+	SESSTAT_REGISTRY_HITS,
+	SESSTAT_SHARED_HITS,
+	SESSTAT_SHARED_MISSES,
+	SESSTAT_COMPUTES,
+	SESSTAT_COMPUTED_CONTEXTS,
+	SESSTAT_CONTEXTS_LOADED,
+	/** Nanoseconds, recorded only if veil2.track_timing is on */
+	SESSTAT_COMPUTE_TIME,
+	/** Nanoseconds, recorded only if veil2.track_timing is on */
+	SESSTAT_OPEN_TIME,
+	SESSTAT_COUNT
+} SessionStat;
+
+/**
+ * The total number of statistics counters.
+ */
+#define STAT_COUNTERS (STATFN_COUNT * FNSTAT_COUNT + SESSTAT_COUNT)
+
+/**
+ * The counter, in ::veil2_stats, for a ::FunctionStat of the current
+ * ::StatFunction.
+ */
+#define FN_STAT(counter)									\
+	(veil2_stats[veil2_stat_fn * FNSTAT_COUNT + (counter)])
+
+/**
+ * The counter, in ::veil2_stats, for a ::SessionStat.
+ */
+#define SESSION_STAT(counter)								\
+	(veil2_stats[STATFN_COUNT * FNSTAT_COUNT + (counter)])
+
+
+/* privs.c */
+extern int veil2_compute_session_privs(PrivsCacheKey *key,
+									   ContextRolePrivs **p_result);
+extern int veil2_fetch_cached_session_privs(PrivsCacheKey *key,
+											ContextRolePrivs **p_result);
+extern int veil2_compute_ancestor_privs(PrivsCacheKey *keys, int nkeys,
+										ContextRolePrivs *inherited,
+										int ninherited,
+										ContextRolePrivs **p_result);
+extern void veil2_filter_privs(ContextRolePrivs *session, int nsession,
+							   ContextRolePrivs *ancestors, int nancestors,
+							   ContextRolePrivs **p_result);
+
+
+/* scopes.c */
+extern int veil2_superior_scopes(int scope_type, int scope,
+								 ScopeKey **p_superiors,
+								 bool **p_promotions);
+extern int veil2_scopes_with_superiors(int scope_type, int **p_scopes);
+extern uint64 veil2_scope_hierarchy_generation(void);
+Datum veil2_scope_hierarchy_changed(PG_FUNCTION_ARGS);
+
+
+/* shmem.c */
+extern void veil2_shmem_init(void);
+extern bool veil2_shmem_available(void);
+extern uint64 veil2_privs_cache_generation(void);
+extern uint64 veil2_privs_cache_invalidations(void);
+extern bool veil2_privs_cache_stale(int accessor_id, uint64 generation);
+extern bool veil2_privs_cache_lookup(PrivsCacheKey *key,
+									 PrivsCacheReader reader, void *arg);
+extern void veil2_privs_cache_store(PrivsCacheKey *key, uint64 generation,
+									Size size, PrivsCacheWriter writer,
+									void *arg);
+extern void veil2_privs_cache_invalidate(int accessor_id, bool all);
+extern int veil2_session_write_back_interval;
+extern bool veil2_session_registry_fetch(int64 session_id,
+										 RegisteredSession *session);
+extern bool veil2_session_registry_lookup(int64 session_id,
+										  SessionRegistryFn fn, void *arg);
+extern void veil2_session_registry_store(RegisteredSession *session);
+extern void veil2_session_registry_remove(int64 session_id, bool all);
+extern int veil2_session_registry_dirty(RegisteredSession **p_sessions,
+										bool expired_only);
+extern bool veil2_shared_stats_add(uint64 *counters);
+extern bool veil2_shared_stats_read(uint64 *counters, TimestampTz *p_reset);
+extern void veil2_shared_stats_reset(TimestampTz reset);
+
+
+/* stats.c */
+extern uint64 veil2_stats[STAT_COUNTERS];
+extern StatFunction veil2_stat_fn;
+extern bool veil2_track_timing;
+extern void veil2_stats_init(void);
+extern void veil2_stats_flush(void);
+extern uint64 veil2_stat_elapsed(instr_time *start);
+Datum veil2_function_stats(PG_FUNCTION_ARGS);
+Datum veil2_session_stats(PG_FUNCTION_ARGS);
+Datum veil2_reset_stats(PG_FUNCTION_ARGS);
+
+
+/* parallel.c */
+extern void veil2_parallel_init(void);
+extern void veil2_parallel_restore(void);
+
+
+/* support.c */
+Datum veil2_privilege_support(PG_FUNCTION_ARGS);
+
+
+/* worker.c */
+extern void veil2_worker_init(void);
+
+
 /* veil2.c */
+extern void _PG_init(void);
+extern bool veil2_session_has_global_priv(int priv);
+extern int veil2_count_scopes_with_priv(int priv, int scope_type,
+										bool superior);
+extern uint64 veil2_session_state_generation(void);
+extern Size veil2_session_state_size(void);
+extern void veil2_session_state_pack(void *dest, Size size);
+extern void veil2_session_state_unpack(void *src);
 Datum veil2_session_ready(PG_FUNCTION_ARGS);
 Datum veil2_reset_session(PG_FUNCTION_ARGS);
 Datum veil2_reset_session_privs(PG_FUNCTION_ARGS);
@@ -72,6 +356,15 @@ Datum veil2_session_context(PG_FUNCTION_ARGS);
 Datum veil2_session_privileges(PG_FUNCTION_ARGS);
 Datum veil2_add_session_privileges(PG_FUNCTION_ARGS);
 Datum veil2_update_session_privileges(PG_FUNCTION_ARGS);
+Datum veil2_compute_session_privileges(PG_FUNCTION_ARGS);
+Datum veil2_load_shared_privs(PG_FUNCTION_ARGS);
+Datum veil2_load_cached_session_privs(PG_FUNCTION_ARGS);
+Datum veil2_save_shared_privs(PG_FUNCTION_ARGS);
+Datum veil2_clear_shared_privs(PG_FUNCTION_ARGS);
+Datum veil2_filter_session_privs(PG_FUNCTION_ARGS);
+Datum veil2_open_connection(PG_FUNCTION_ARGS);
+Datum veil2_forget_sessions(PG_FUNCTION_ARGS);
+Datum veil2_flush_sessions(PG_FUNCTION_ARGS);
 Datum veil2_true(PG_FUNCTION_ARGS);
 Datum veil2_i_have_global_priv(PG_FUNCTION_ARGS);
 Datum veil2_i_have_personal_priv(PG_FUNCTION_ARGS);
@@ -80,6 +373,10 @@ Datum veil2_i_have_priv_in_scope_or_global(PG_FUNCTION_ARGS);
 Datum veil2_i_have_priv_in_superior_scope(PG_FUNCTION_ARGS);
 Datum veil2_i_have_priv_in_scope_or_superior(PG_FUNCTION_ARGS);
 Datum veil2_i_have_priv_in_scope_or_superior_or_global(PG_FUNCTION_ARGS);
+Datum veil2_i_have_priv_in_scopes(PG_FUNCTION_ARGS);
+Datum veil2_filter_scopes_with_priv(PG_FUNCTION_ARGS);
+Datum veil2_my_scopes(PG_FUNCTION_ARGS);
+Datum veil2_i_have_any_priv(PG_FUNCTION_ARGS);
 Datum veil2_result_counts(PG_FUNCTION_ARGS);
 Datum veil2_docpath(PG_FUNCTION_ARGS);
 Datum veil2_datapath(PG_FUNCTION_ARGS);
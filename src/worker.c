@@ -0,0 +1,264 @@
+/**
+ * @file   worker.c
+ * \code
+ *     Author:       Marc Munro
+ *     Copyright (c) 2021 Marc Munro
+ *     License:      GPL V3
+ *
+ * \endcode
+ * @brief
+ * Optional background worker for veil2 housekeeping.
+ *
+ * If veil2 is loaded using shared_preload_libraries, and the
+ * veil2.worker_database GUC names a database, a background worker is
+ * started which periodically:
+ *
+ * - deletes expired sessions from veil2.sessions, in small batches so
+ *   that each transaction, and the locks it holds, is short;
+ *
+ * - pre-warms the accessor privileges caches, by loading privileges
+ *   for recently active combinations of accessor and session contexts
+ *   that are no longer cached (eg following an invalidation).  This
+ *   means that users re-opening sessions remain on the fast path.
+ *
+ * The work itself is done by the SQL functions
+ * veil2.sweep_expired_sessions() and veil2.prewarm_privs_cache(),
+ * which do nothing unless the veil2 extension is installed in the
+ * database.  The background worker requires Postgres 13 or later.
+ */
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "commands/extension.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#if PG_VERSION_NUM >= 130000
+#include "postmaster/interrupt.h"
+#endif
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "tcop/tcopprot.h"
+#include "utils/guc.h"
+#include "utils/snapmgr.h"
+
+#include "veil2.h"
+
+
+/**
+ * The database in which the background worker runs.  If this is not
+ * set, no worker is started.  This is set from the
+ * veil2.worker_database GUC.
+ */
+static char *worker_database = NULL;
+
+/**
+ * The number of seconds between each round of background work.  This
+ * is set from the veil2.worker_naptime GUC.
+ */
+static int worker_naptime = 60;
+
+/**
+ * The maximum number of expired sessions to be deleted in each
+ * transaction.  This is set from the veil2.worker_sweep_batch GUC.
+ */
+static int worker_sweep_batch = 1000;
+
+/**
+ * The maximum number of accessor privileges cache entries to be
+ * loaded in each round.  A value of 0 disables pre-warming.  This is
+ * set from the veil2.worker_prewarm_limit GUC.
+ */
+static int worker_prewarm_limit = 100;
+
+
+#if PG_VERSION_NUM >= 130000
+
+PGDLLEXPORT void veil2_worker_main(Datum main_arg);
+
+/**
+ * Fetch_fn() for the integer result of a worker query.
+ *
+ * @param tuple  The ::HeapTuple returned from a Postgres SPI query.
+ * @param tupdesc The ::TupleDesc returned from the same Postgres SPI query
+ * @param p_result Pointer to an integer into which the result is
+ * placed.
+ *
+ * @return <code>bool</code> false, indicating to veil2_query() that
+ * no more rows are expected.
+ */
+static bool
+fetch_worker_count(HeapTuple tuple, TupleDesc tupdesc, void *p_result)
+{
+	bool isnull;
+
+	*((int *) p_result) =
+		DatumGetInt32(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+	if (isnull) {
+		*((int *) p_result) = 0;
+	}
+	return false;
+}
+
+/**
+ * Run a veil2 housekeeping function, with a single integer argument,
+ * in its own transaction.
+ *
+ * @param qry The query to be run.  This must return a single
+ * integer.
+ * @param arg The integer argument for the query.
+ *
+ * @return The integer result of the query, or 0 if the veil2
+ * extension is not installed.
+ */
+static int
+runWorkerQuery(const char *qry, int arg)
+{
+	Oid argtypes[] = {INT4OID};
+	Datum args[1];
+	int result = 0;
+	bool pushed;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, qry);
+	if (OidIsValid(get_extension_oid("veil2", true))) {
+		args[0] = Int32GetDatum(arg);
+		veil2_spi_connect(&pushed, "veil2 worker failed to connect to SPI");
+		(void) veil2_query(qry, 1, argtypes, args,
+						   false, NULL,
+						   fetch_worker_count, (void *) &result);
+		veil2_spi_finish(pushed, "veil2 worker failed to finish SPI");
+	}
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_stat(false);
+	pgstat_report_activity(STATE_IDLE, NULL);
+	return result;
+}
+
+/**
+ * Main function for the veil2 background worker.
+ *
+ * @param main_arg Unused.
+ */
+void
+veil2_worker_main(Datum main_arg)
+{
+	int count;
+
+	pqsignal(SIGHUP, SignalHandlerForConfigReload);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+	BackgroundWorkerInitializeConnection(worker_database, NULL, 0);
+
+	for (;;) {
+		(void) WaitLatch(MyLatch,
+						 WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 worker_naptime * 1000L, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+
+		if (ConfigReloadPending) {
+			ConfigReloadPending = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		/* Delete expired sessions until there are none left. */
+		do {
+			CHECK_FOR_INTERRUPTS();
+			count = runWorkerQuery(
+				"select veil2.sweep_expired_sessions($1)",
+				worker_sweep_batch);
+		} while (count >= worker_sweep_batch);
+
+		if (worker_prewarm_limit > 0) {
+			(void) runWorkerQuery(
+				"select veil2.prewarm_privs_cache($1)",
+				worker_prewarm_limit);
+		}
+	}
+}
+
+/**
+ * Register the veil2 background worker.
+ */
+static void
+register_worker(void)
+{
+	BackgroundWorker worker;
+
+	memset(&worker, 0, sizeof(worker));
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS |
+		BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = 60;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "veil2");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "veil2_worker_main");
+	snprintf(worker.bgw_name, BGW_MAXLEN, "veil2 worker");
+	snprintf(worker.bgw_type, BGW_MAXLEN, "veil2 worker");
+	RegisterBackgroundWorker(&worker);
+}
+
+#endif
+
+
+/**
+ * Define the GUCs for the veil2 background worker and, if we are
+ * being loaded by shared_preload_libraries and a database has been
+ * given, register it.  This must be called from _PG_init(), before
+ * veil2_shmem_init() reserves the veil2 GUC prefix.
+ */
+void
+veil2_worker_init(void)
+{
+	DefineCustomStringVariable("veil2.worker_database",
+							   "Database in which the veil2 background "
+							   "worker runs.",
+							   "If not set, no background worker is "
+							   "started.",
+							   &worker_database,
+							   NULL,
+							   PGC_POSTMASTER,
+							   0,
+							   NULL, NULL, NULL);
+	DefineCustomIntVariable("veil2.worker_naptime",
+							"Time between rounds of veil2 background "
+							"work.",
+							NULL,
+							&worker_naptime,
+							60, 1, INT_MAX / 1000,
+							PGC_SIGHUP,
+							GUC_UNIT_S,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("veil2.worker_sweep_batch",
+							"Maximum number of expired sessions deleted "
+							"per transaction.",
+							NULL,
+							&worker_sweep_batch,
+							1000, 1, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+	DefineCustomIntVariable("veil2.worker_prewarm_limit",
+							"Maximum number of privileges cache entries "
+							"loaded per round.",
+							"Set to 0 to disable cache pre-warming.",
+							&worker_prewarm_limit,
+							100, 0, INT_MAX,
+							PGC_SIGHUP,
+							0,
+							NULL, NULL, NULL);
+
+#if PG_VERSION_NUM >= 130000
+	if (process_shared_preload_libraries_in_progress &&
+		worker_database && worker_database[0])
+	{
+		register_worker();
+	}
+#endif
+}
@@ -26,7 +26,8 @@ insert into veil2.scope_types
 values (-3, 'corp', 'corporate context'),
        (-4, 'div', 'divisional context'),
        (-5, 'dept', 'department context'),
-       (-6, 'proj', 'project context');
+       (-6, 'proj', 'project context'),
+       (-7, 'sparse', 'context with widely spaced scope ids');
 
 -- and a test corp
 --\echo ......creating test corp...
@@ -62,6 +63,14 @@ values (-6, -61),
        (-6, -63),
        (-6, -64);
 
+-- and some widely spaced scopes, so that privilege lookups in this
+-- scope type must use a hashed, rather than direct-indexed, index.
+insert into veil2.scopes
+       (scope_type_id, scope_id)
+values (-7, 1),
+       (-7, 8),
+       (-7, 1000000);
+
 -- And some mappings of depts to divs to corps
 -- This is a non-veil2 table, ie the sort of data that veil2 is
 -- protecting. 
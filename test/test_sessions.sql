@@ -26,10 +26,9 @@ select * from veil2.session_context()
 
 grant select on session_context to public;
 
-select plan(107);
+select plan(176);
 
--- Perform a reset session without returning a row.  This ensures the
--- temporary table is created.
+-- Perform a reset session without returning a row.
 with reset_session as
   (
     select 1 as result from veil2.reset_session()
@@ -302,6 +301,19 @@ select is(errmsg is null, true,
        	  'There should be no error message (7)')
   from session;
 
+-- Again with a valid nonce but an incorrect continuation token
+with session as
+  (
+    select o.*, ms.session_id1 as session_id
+      from mytest_session ms
+     inner join veil2.sessions s on s.session_id = ms.session_id1 
+     cross join veil2.open_connection(ms.session_id1, 6,
+        encode(digest(s.token || to_hex(7), 'sha1'), 'base64')) o
+  )
+select is(errmsg, 'AUTHFAIL',
+       	  'There should be an AUTHFAIL message (7a)')
+  from session;
+
 -- Again with a valid nonce but significantly larger
 with session as
   (
@@ -378,6 +390,80 @@ select is(veil2.i_have_priv_in_scope_or_global(0, 9, 9), true,
 select is(veil2.i_have_priv_in_scope_or_superior_or_global(0, 9, 9), true,
        	  'Session should have connect privilege(3)');
 
+-- Switching back to a session that this backend has recently opened
+-- should re-use its retained privileges rather than loading them
+-- again, unless they have been invalidated in the meantime.
+with session as
+  (
+    select o.*, ms.session_id2 as session_id
+      from mytest_session ms
+     inner join veil2.sessions s on s.session_id = ms.session_id2 
+     cross join veil2.open_connection(ms.session_id2, 3,
+        encode(digest(s.token || to_hex(3), 'sha1'), 'base64')) o
+  )
+select is(success, true,
+          'Switch to the second session should succeed (14)')
+  from session;
+
+select contexts_loaded as contexts_loaded_before
+  from veil2.stat_sessions \gset
+
+with session as
+  (
+    select o.*, ms.session_id1 as session_id
+      from mytest_session ms
+     inner join veil2.sessions s on s.session_id = ms.session_id1 
+     cross join veil2.open_connection(ms.session_id1, 481,
+        encode(digest(s.token || to_hex(481), 'sha1'), 'base64')) o
+  )
+select is(success, true,
+          'Switch back to the original session should succeed (15)')
+  from session;
+
+select is((select contexts_loaded from veil2.stat_sessions),
+          :contexts_loaded_before::bigint,
+          'Original session should re-use its retained privileges');
+
+select is(veil2.i_have_global_priv(0), true,
+          'Retained privileges should include connect privilege');
+
+with session as
+  (
+    select o.*, ms.session_id2 as session_id
+      from mytest_session ms
+     inner join veil2.sessions s on s.session_id = ms.session_id2 
+     cross join veil2.open_connection(ms.session_id2, 4,
+        encode(digest(s.token || to_hex(4), 'sha1'), 'base64')) o
+  )
+select is(success, true,
+          'Switch to the second session should succeed (16)')
+  from session;
+
+select lives_ok('select veil2.clear_shared_privs(-2)',
+                'Invalidate the original session''s privileges');
+
+select contexts_loaded as contexts_loaded_before
+  from veil2.stat_sessions \gset
+
+with session as
+  (
+    select o.*, ms.session_id1 as session_id
+      from mytest_session ms
+     inner join veil2.sessions s on s.session_id = ms.session_id1 
+     cross join veil2.open_connection(ms.session_id1, 482,
+        encode(digest(s.token || to_hex(482), 'sha1'), 'base64')) o
+  )
+select is(success, true,
+          'Switch back to the original session should succeed (17)')
+  from session;
+
+select ok((select contexts_loaded from veil2.stat_sessions) >
+          :contexts_loaded_before::bigint,
+          'Invalidated retained privileges should be reloaded');
+
+select is(veil2.i_have_global_priv(0), true,
+          'Reloaded privileges should include connect privilege');
+
 -- Last time - should be forgetting those early nonces by now
 with session as
   (
@@ -410,6 +496,89 @@ select is(errmsg, 'NONCEFAIL',
        	  'There should be a NONCEFAIL message (13)')
   from session;
 
+-- Re-opening a session from the shared session registry should fail
+-- with the same errors as re-opening it from veil2.sessions.  Each
+-- failure is tried first with the session registered, and then again
+-- after the session has been written back and forgotten.  This must
+-- work whether or not the registry is available.
+with session as
+  (
+    select o.*, ms.session_id1 as session_id
+      from mytest_session ms
+     inner join veil2.sessions s on s.session_id = ms.session_id1 
+     cross join veil2.open_connection(ms.session_id1, 541,
+        encode(digest(s.token || to_hex(541), 'sha1'), 'base64')) o
+  )
+select is(success, true,
+          'Authentication should have succeeded (13a)')
+  from session;
+
+select o.errmsg as registry_errmsg
+  from mytest_session ms
+ cross join veil2.open_connection(ms.session_id1, 541, 'password2') o \gset
+
+select lives_ok('select veil2.flush_sessions()',
+                'Write back the registered session (13b)');
+
+select lives_ok(format('select veil2.forget_sessions(array[%s]::bigint[])',
+                       session_id1),
+                'Forget the registered session (13b)')
+  from mytest_session;
+
+with session as
+  (
+    select o.*, ms.session_id1 as session_id
+      from mytest_session ms
+     cross join veil2.open_connection(ms.session_id1, 541, 'password2') o
+  )
+select is(:'registry_errmsg', 'NONCEFAIL',
+       	  'There should be a NONCEFAIL message (13b)')
+union all
+select is(errmsg, :'registry_errmsg',
+       	  'Registered and unregistered nonce failures should match (13b)')
+  from session;
+
+with session as
+  (
+    select o.*, ms.session_id1 as session_id
+      from mytest_session ms
+     inner join veil2.sessions s on s.session_id = ms.session_id1 
+     cross join veil2.open_connection(ms.session_id1, 542,
+        encode(digest(s.token || to_hex(542), 'sha1'), 'base64')) o
+  )
+select is(success, true,
+          'Authentication should have succeeded (13c)')
+  from session;
+
+select o.errmsg as registry_errmsg
+  from mytest_session ms
+ inner join veil2.sessions s on s.session_id = ms.session_id1 
+ cross join veil2.open_connection(ms.session_id1, 543,
+        encode(digest(s.token || to_hex(544), 'sha1'), 'base64')) o \gset
+
+select lives_ok('select veil2.flush_sessions()',
+                'Write back the registered session (13d)');
+
+select lives_ok(format('select veil2.forget_sessions(array[%s]::bigint[])',
+                       session_id1),
+                'Forget the registered session (13d)')
+  from mytest_session;
+
+with session as
+  (
+    select o.*, ms.session_id1 as session_id
+      from mytest_session ms
+     inner join veil2.sessions s on s.session_id = ms.session_id1 
+     cross join veil2.open_connection(ms.session_id1, 544,
+        encode(digest(s.token || to_hex(545), 'sha1'), 'base64')) o
+  )
+select is(:'registry_errmsg', 'AUTHFAIL',
+       	  'There should be an AUTHFAIL message (13d)')
+union all
+select is(errmsg, :'registry_errmsg',
+       	  'Registered and unregistered token failures should match (13d)')
+  from session;
+
 -- ...while we are here, let's ensure that we no longer have privileges.
 select is(veil2.i_have_global_priv(0), false,
        	  'Session should not have connect privilege');
@@ -423,6 +592,29 @@ select null
 select is(veil2.i_have_global_priv(0), true,
        	  'Open session should have connect privilege');
 
+select is(cnt > 0, true, 'Native session privileges should not be empty')
+  from (select count(*)::integer as cnt
+          from veil2.compute_session_privileges()) x;
+
+select is(cnt, 0,
+          'Native session privileges should match session_privileges_v (alice)')
+  from (select count(*)::integer as cnt
+          from ((select scope_type_id, scope_id,
+                        to_array(roles), to_array(privs)
+                   from veil2.compute_session_privileges()
+                 except
+                 select scope_type_id, scope_id,
+                        to_array(roles), to_array(privileges)
+                   from veil2.session_privileges_v)
+                union all
+                (select scope_type_id, scope_id,
+                        to_array(roles), to_array(privileges)
+                   from veil2.session_privileges_v
+                 except
+                 select scope_type_id, scope_id,
+                        to_array(roles), to_array(privs)
+                   from veil2.compute_session_privileges())) x) y;
+
 select null
   from veil2.close_connection()
  where close_connection is null;  -- Ensure no rows returned
@@ -585,6 +777,78 @@ union all
 select is(veil2.i_have_priv_in_scope(25, -4, -41), true,
          'Bob should have priv 25 in context -4,-41');
 
+select is(veil2.i_have_priv_in_scopes(20, -5, array[-51, -9999, null]),
+          array[true, false, null]::boolean[],
+          'Bob should have priv 20 in context -5,-51 only (array)');
+
+select is(veil2.filter_scopes_with_priv(23, -5, array[-9999, -51, null]),
+          array[-51],
+          'Bob should have priv 23 in context -5,-51 only (filter)');
+
+select is(veil2.i_have_any_priv('scope(20, -5), scope_or_global(25, -4)',
+                                -9999, -41),
+          true, 'Bob should satisfy a policy with priv 25 in -4,-41');
+
+select is(veil2.i_have_any_priv('global(20), scope(20, -5)', -9999),
+          false, 'Bob should not satisfy a policy with priv 20 in -5,-9999');
+
+select is(veil2.i_have_any_priv('scope(20, -5)', null::integer),
+          false, 'A policy term with a null scope should not be satisfied');
+
+select is(veil2.i_have_any_priv('scope_or_global(0, -5)', null::integer),
+          veil2.i_have_priv_in_scope_or_global(0, -5, null),
+          'A scope_or_global term with a null scope should match the function');
+
+select is(veil2.i_have_any_priv('scope_or_global(0, -5)', null::integer),
+          true, 'A scope_or_global term with a null scope tests global scope');
+
+select is(veil2.i_have_any_priv('global(20), global(0)'), true,
+          'Bob should satisfy a global-only policy without scope_ids');
+
+select throws_ok('select veil2.i_have_any_priv(''scope(20, -5)'')',
+                 '22023', null,
+                 'A policy needing scope_ids should require them');
+
+select throws_ok(
+         'select veil2.i_have_any_priv(''scope(20, -5), scope(20, -5)'','
+         '                             variadic array[[-51], [-51]])',
+         '2202E', null,
+         'Multi-dimensional scope_ids should be rejected');
+
+select is((select count(*)::integer
+             from pg_catalog.pg_proc
+            where pronamespace = 'veil2'::regnamespace
+              and proname = 'i_have_any_priv'
+              and proleakproof),
+          0, 'i_have_any_priv() should not be declared leakproof');
+
+select throws_ok('select veil2.i_have_any_priv(''bogus(20)'', -51)',
+                 '22023', null,
+                 'An invalid policy should be rejected');
+
+-- Privilege changes take effect without a call to
+-- reload_connection_privs().
+delete from veil2.accessor_roles where accessor_id = -5 and role_id = 0;
+
+select is(veil2.i_have_priv_in_scope(23, -5, -51), false,
+          'Bob should lose privileges without an explicit reload');
+
+insert into veil2.accessor_roles
+       (accessor_id, role_id, context_type_id, context_id)
+values (-5, 0, 1, 0);
+
+-- Giving a privilege to a role that Bob holds only indirectly (role
+-- 9, test_role_6, is assigned to test_role_5) must also invalidate
+-- his privileges.
+insert into veil2.role_privileges
+       (role_id, privilege_id)
+values (9, 12);
+
+select is(veil2.i_have_priv_in_scope(12, -5, -51), true,
+          'Bob should gain privileges given to an indirectly held role');
+
+delete from veil2.role_privileges where role_id = 9 and privilege_id = 12;
+
 -- connect as eve
 with session as
   (
@@ -742,6 +1006,58 @@ select is(roles ? 9, false,
 
 
 
+-- Privilege tests in a scope type with widely spaced scope_ids, which
+-- is indexed by hash rather than directly.  With 3 scopes, scope_ids
+-- 1, 8 and 13 all hash to the same slot, so that finding 8, and
+-- failing to find 13, requires probing past the other entries.
+insert
+  into veil2.accessor_roles
+       (accessor_id, role_id, context_type_id, context_id)
+select -6, role_id, -7, s.scope_id
+  from veil2.roles
+ cross join (values (1), (8), (1000000)) s (scope_id)
+ where role_name = 'test_role_5';
+
+select privilege_id as sparse_priv
+  from veil2.privileges
+ where privilege_name = 'test_privilege_5' \gset
+
+with session as
+  (
+    select o.*
+      from veil2.create_session('alice', 'plaintext') c
+     cross join veil2.open_connection(c.session_id, 1, 'password6') o
+  )
+select is(s.success, true, 'Alice should be authenticated (sparse scopes)')
+  from session s;
+
+select is(veil2.i_have_priv_in_scope(:sparse_priv, -7, 1), true,
+          'Alice should have priv in sparse scope 1')
+union all
+select is(veil2.i_have_priv_in_scope(:sparse_priv, -7, 8), true,
+          'Alice should have priv in colliding sparse scope 8')
+union all
+select is(veil2.i_have_priv_in_scope(:sparse_priv, -7, 1000000), true,
+          'Alice should have priv in sparse scope 1000000')
+union all
+select is(veil2.i_have_priv_in_scope(:sparse_priv, -7, 13), false,
+          'Alice should not have priv in colliding sparse scope 13')
+union all
+select is(veil2.i_have_priv_in_scope(:sparse_priv, -7, 2), false,
+          'Alice should not have priv in sparse scope 2')
+union all
+select is(veil2.i_have_priv_in_scope(:sparse_priv, -7, 2000000), false,
+          'Alice should not have priv in sparse scope 2000000')
+union all
+select is(veil2.i_have_priv_in_scope(0, -7, 1000000), false,
+          'Alice should not have connect priv in sparse scope 1000000');
+
+select is(veil2.i_have_priv_in_scopes(:sparse_priv, -7,
+                                      array[1000000, 13, 8, 1, 2]),
+          array[true, false, true, true, false],
+          'Alice should have priv in only the assigned sparse scopes');
+
+
 -- connect as eve for scope -3,-31
 with session as
   (
@@ -763,6 +1079,81 @@ select is(veil2.i_have_priv_in_scope_or_superior_or_global(4, -6, -62), true,
 
 select is(veil2.i_have_priv_in_superior_scope(4, -6, -61), false,
           'Eve should not have priv 4 in a scope superior to -6, -61');
+
+-- Add a new project to dept -54.  This updates all_superior_scopes
+-- which must cause the in-memory scope hierarchy to be reloaded.
+insert
+  into projects
+       (project_id, corp_id, dept_id, project_name)
+values (-63, -31, -54, 'Corp -31, dept -54, div -44 (2)');
+
+select is(veil2.i_have_priv_in_superior_scope(4, -6, -63), true,
+          'Eve should have priv 4 in a scope superior to new scope -6, -63');
+
+select is(cnt, 0,
+          'Incrementally updated all_superior_scopes should match the view')
+  from (select count(*)::integer as cnt
+          from ((select * from veil2.all_superior_scopes
+                 except
+                 select * from veil2.all_superior_scopes_v)
+                union all
+                (select * from veil2.all_superior_scopes_v
+                 except
+                 select * from veil2.all_superior_scopes)) x) y;
+
+select is(veil2.my_scopes(4, -6) @> array[-62, -63], true,
+          'Eve''s scopes for priv 4 should include -6,-62 and -6,-63');
+
+select is(-61 = any(veil2.my_scopes(4, -6)), false,
+          'Eve''s scopes for priv 4 should not include -6,-61');
+
+-- Predicate-filtered scans must give the same results when the
+-- predicates are evaluated by parallel workers as when they are
+-- evaluated serially.
+select array_agg(project_id order by project_id)::text as serial_projects
+  from projects
+ where veil2.i_have_priv_in_scope_or_superior(4, -6, project_id) \gset
+
+select set_config(case when current_setting('server_version_num')::integer
+                            >= 160000
+                       then 'debug_parallel_query'
+                       else 'force_parallel_mode' end,
+                  'on', false) is null as parallel_on \gset
+
+select array_agg(project_id order by project_id)::text as parallel_projects
+  from projects
+ where veil2.i_have_priv_in_scope_or_superior(4, -6, project_id) \gset
+
+select set_config(case when current_setting('server_version_num')::integer
+                            >= 160000
+                       then 'debug_parallel_query'
+                       else 'force_parallel_mode' end,
+                  'off', false) is null as parallel_off \gset
+
+select is(:'serial_projects'::integer[] @> array[-62, -63], true,
+          'Serial scan should find Eve''s projects for priv 4');
+
+select is(:'parallel_projects', :'serial_projects',
+          'Parallel scan should find the same projects as a serial scan');
+
+select is(cnt, 0,
+          'Native session privileges should match session_privileges_v (eve)')
+  from (select count(*)::integer as cnt
+          from ((select scope_type_id, scope_id,
+                        to_array(roles), to_array(privs)
+                   from veil2.compute_session_privileges()
+                 except
+                 select scope_type_id, scope_id,
+                        to_array(roles), to_array(privileges)
+                   from veil2.session_privileges_v)
+                union all
+                (select scope_type_id, scope_id,
+                        to_array(roles), to_array(privileges)
+                   from veil2.session_privileges_v
+                 except
+                 select scope_type_id, scope_id,
+                        to_array(roles), to_array(privs)
+                   from veil2.compute_session_privileges())) x) y;
 /*
 
     \pset tuples_only false
@@ -808,6 +1199,103 @@ select is(roles ? 9, true,
   from sess;
 
 
+-- Shared privileges cache invalidation.  This must work whether or
+-- not the shared cache is available.  Eve's roles are removed without
+-- firing the trigger that would clear her cached privileges, so that
+-- only clear_shared_privs() can make the change visible.
+alter table veil2.accessor_roles disable trigger accessor_roles__aiud;
+delete from veil2.accessor_roles where accessor_id = -2 and role_id != 0;
+alter table veil2.accessor_roles enable trigger accessor_roles__aiud;
+
+select is(veil2.i_have_priv_in_superior_scope(4, -6, -62), true,
+          'Eve should keep her cached privileges until they are cleared');
+
+select lives_ok('select veil2.clear_shared_privs(-2)',
+                'Clear shared privileges for a single accessor');
+
+select is(veil2.i_have_priv_in_superior_scope(4, -6, -62), false,
+          'Eve should lose her privileges once they have been cleared');
+
+select lives_ok('truncate table veil2.accessor_roles',
+                'Truncating accessor_roles clears all cached privileges');
+
+select is((select count(*)::integer from apc), 0,
+          'Truncating accessor_roles should empty accessor_privileges_cache');
+
+
+-- Shared session registry write-back.  This must work whether or not
+-- the registry is available.
+with write_back as
+  (
+    select 1 as result
+      from mytest_session ms
+     cross join veil2.write_back_session(
+                    ms.session_id1, now(), array[1000, 1001])
+  )
+select null
+  from write_back
+ where result != 1;
+
+select is(to_array(s.nonces), array[1000, 1001],
+          'Written back session should have the given nonces')
+  from mytest_session ms
+ inner join veil2.sessions s
+    on s.session_id = ms.session_id1;
+
+select lives_ok('select veil2.delete_expired_sessions()',
+                'Delete expired sessions, flushing the session registry');
+
+-- Background worker housekeeping functions.
+update veil2.sessions
+   set expires = now() - '1 minute'::interval
+ where session_id = (select session_id2 from mytest_session);
+
+select is(veil2.sweep_expired_sessions(1000), 1,
+          'One expired session should have been swept');
+
+select is((select count(*)::integer
+             from veil2.sessions
+            where session_id = (select session_id2 from mytest_session)),
+          0, 'Swept session should no longer exist');
+
+select lives_ok('select veil2.prewarm_privs_cache(10)',
+                'Pre-warm the accessor privileges caches');
+
+-- Statistics.
+select lives_ok('select veil2.reset_stats()', 'Reset veil2 statistics');
+
+select is((select sum(calls)::integer from veil2.stat_functions), 0,
+          'Function statistics should have been reset');
+
+select is((select count(*)::integer from veil2.stat_functions), 12,
+          'There should be statistics for 12 functions');
+
+select ok((select stats_reset is not null from veil2.stat_sessions),
+          'Session statistics should record the reset time');
+
+-- Parallel query.
+select is((select count(*)::integer
+             from pg_catalog.pg_proc
+            where pronamespace = 'veil2'::regnamespace
+              and (proname like 'i\_have\_%'
+                   or proname in ('filter_scopes_with_priv', 'my_scopes'))
+              and proparallel != 's'),
+          0, 'Privilege testing functions should be parallel safe');
+
+-- Planner support.  prosupport does not exist before PostgreSQL 12,
+-- so we look for it through to_jsonb().
+select is((select count(*)::integer
+             from pg_catalog.pg_proc p
+            where pronamespace = 'veil2'::regnamespace
+              and (to_jsonb(p) ->> 'prosupport')::regproc =
+                  'veil2.privilege_support'::regproc),
+          case when current_setting('server_version_num')::integer
+                        >= 120000 then 7 else 0 end,
+          'Privilege testing functions should have planner support');
+
+select throws_ok('set veil2.parallel_state = ''1:1''',
+                 '22023', null,
+                 'veil2.parallel_state may not be set directly');
 
 
 select * from finish();
@@ -13,8 +13,64 @@
 
 begin;
 select '...test Veil2 views...';
-select plan(13);
-refresh materialized view veil2.all_role_privileges;
+select plan(17);
+
+-- all_role_privileges is maintained incrementally as roles and
+-- privileges are created.  Ensure that it matches what a full refresh
+-- would give us.
+select is(cnt, 0,
+          'Expecting all_role_privileges to match all_role_privileges_v')
+  from (select count(*)::integer as cnt
+          from ((select role_id, mapping_context_type_id,
+                        mapping_context_id, to_array(roles),
+                        to_array(privileges)
+                   from veil2.all_role_privileges
+                 except
+                 select *
+                   from veil2.all_role_privileges_info)
+                union all
+                (select *
+                   from veil2.all_role_privileges_info
+                 except
+                 select role_id, mapping_context_type_id,
+                        mapping_context_id, to_array(roles),
+                        to_array(privileges)
+                   from veil2.all_role_privileges)) x) y;
+
+-- In deferred mode, all_role_privileges is not updated until commit,
+-- which we simulate by forcing the deferred trigger to fire.
+update veil2.system_parameters
+   set parameter_value = 'true'
+ where parameter_name = 'deferred matview refresh';
+
+insert into veil2.roles (role_id, role_name)
+values (10000, 'deferred refresh test role');
+insert into veil2.role_privileges (role_id, privilege_id)
+values (10000, 0), (10000, 1);
+
+select is((select count(*)::integer
+             from veil2.all_role_privileges
+            where role_id = 10000), 0,
+          'Deferred refresh should not update all_role_privileges yet');
+
+set constraints veil2.deferred_refreshes__commit immediate;
+
+select is((select to_array(privileges)
+             from veil2.all_role_privileges
+            where role_id = 10000), '{0,1}'::integer[],
+          'Deferred refresh should have updated all_role_privileges');
+
+select is((select count(*)::integer
+             from veil2.deferred_refreshes), 0,
+          'Deferred refreshes should have been consumed');
+
+set constraints veil2.deferred_refreshes__commit deferred;
+delete from veil2.role_privileges where role_id = 10000;
+delete from veil2.roles where role_id = 10000;
+update veil2.system_parameters
+   set parameter_value = 'false'
+ where parameter_name = 'deferred matview refresh';
+set constraints veil2.deferred_refreshes__commit immediate;
 
 select is(array_length(to_array(privileges), 1), 1,
           'Expecting connect role to have only 1 privilege')